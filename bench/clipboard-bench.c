@@ -0,0 +1,624 @@
+/*  clipboard-bench.c spice-vdagent copy and paste latency benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measures copy and paste through spice-vdagent, driving it from both
+   sides (see xbench.h): the stub vdagentd stands in for the SPICE client,
+   and the benchmark's own X connection for the applications in the guest.
+
+   guest-to-client: an X client owns the selection and the stub daemon
+   requests its data from the agent, timed from the request till the data
+   arrives. The owner either sends the data in one property, or with INCR.
+   client-to-guest: the stub daemon grabs the selection and X clients convert
+   it, timed from XConvertSelection till they have read all data. The agent
+   itself decides when to use INCR for this.
+
+   With more than one requestor the requests are made at the same time,
+   for client-to-guest each from its own window. The results are written
+   as JSON lines. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <spice/vd_agent.h>
+
+#include "vdagentd-proto.h"
+#include "xbench.h"
+
+#define INCR_CHUNK_SIZE (256 * 1024)
+#define MAX_REQUESTORS 64
+#define MIN_OPS 5
+#define MAX_OPS 200
+
+struct format {
+    const char *name;
+    const char *target;
+    uint32_t type;
+};
+
+static const struct format formats[] = {
+    { "text", "UTF8_STRING", VD_AGENT_CLIPBOARD_UTF8_TEXT },
+    { "image", "image/png", VD_AGENT_CLIPBOARD_IMAGE_PNG },
+};
+
+static const char * const selection_names[] = { "clipboard", "primary" };
+
+static const uint32_t sizes[] = {
+    16, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024
+};
+static const uint32_t requestor_counts[] = { 1, 8 };
+
+struct run {
+    const char *direction;
+    const struct format *format;
+    uint8_t selection;
+    uint32_t size;
+    int incr;              /* guest-to-client: the owner uses INCR */
+    uint32_t requestors;
+    uint32_t ops;
+    uint32_t done;
+    uint32_t wait_for;
+    uint32_t incr_seen;    /* client-to-guest: the agent used INCR */
+    int grabbed;
+    uint8_t *payload;
+    double *started;
+    double *latency;
+    Atom selection_atom;
+    Atom target_atom;
+    /* guest-to-client: the owner's INCR transfer in progress */
+    Window incr_requestor;
+    Atom incr_property;
+    uint32_t incr_pos;
+    /* client-to-guest: the op and transfer state of each requestor */
+    uint32_t window_op[MAX_REQUESTORS];
+    uint32_t received[MAX_REQUESTORS];
+    int in_incr[MAX_REQUESTORS];
+};
+
+static struct {
+    Atom selections[2];
+    Atom targets;
+    Atom incr;
+    Atom property;
+} atoms;
+
+static Window owner_window;
+static Window requestor_windows[MAX_REQUESTORS];
+static uint32_t max_direct_size;
+
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "clipboard-bench: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+/* ---------- X11 selection owner (guest-to-client) ---------- */
+
+static void owner_handle_request(struct xbench *xb, struct run *run,
+                                 XSelectionRequestEvent *req)
+{
+    Display *display = xb->display;
+    XSelectionEvent notify;
+    Atom property = req->property != None ? req->property : req->target;
+
+    memset(&notify, 0, sizeof(notify));
+    notify.type = SelectionNotify;
+    notify.display = display;
+    notify.requestor = req->requestor;
+    notify.selection = req->selection;
+    notify.target = req->target;
+    notify.time = req->time;
+    notify.property = property;
+
+    if (req->target == atoms.targets) {
+        Atom targets[2] = { atoms.targets, run->target_atom };
+
+        XChangeProperty(display, req->requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)targets, 2);
+    } else if (req->target == run->target_atom && run->incr) {
+        long size = run->size;
+
+        if (run->incr_requestor != None)
+            fail("overlapping INCR requests");
+        XSelectInput(display, req->requestor, PropertyChangeMask);
+        XChangeProperty(display, req->requestor, property, atoms.incr, 32,
+                        PropModeReplace, (unsigned char *)&size, 1);
+        run->incr_requestor = req->requestor;
+        run->incr_property = property;
+        run->incr_pos = 0;
+    } else if (req->target == run->target_atom) {
+        XChangeProperty(display, req->requestor, property, run->target_atom,
+                        8, PropModeReplace, run->payload, run->size);
+    } else {
+        notify.property = None;
+    }
+
+    XSendEvent(display, req->requestor, False, NoEventMask,
+               (XEvent *)&notify);
+    XFlush(display);
+}
+
+/* Each time the requestor deleted the property, it is ready for the next
+   chunk, a zero length chunk ends the transfer */
+static void owner_handle_property(struct xbench *xb, struct run *run,
+                                  XPropertyEvent *event)
+{
+    uint32_t len;
+
+    if (event->window != run->incr_requestor ||
+            event->atom != run->incr_property ||
+            event->state != PropertyDelete)
+        return;
+
+    len = run->size - run->incr_pos;
+    if (len > INCR_CHUNK_SIZE)
+        len = INCR_CHUNK_SIZE;
+    XChangeProperty(xb->display, event->window, event->atom,
+                    run->target_atom, 8, PropModeReplace,
+                    run->payload + run->incr_pos, len);
+    run->incr_pos += len;
+    if (len == 0) {
+        XSelectInput(xb->display, event->window, NoEventMask);
+        run->incr_requestor = None;
+    }
+    XFlush(xb->display);
+}
+
+/* ---------- X11 selection requestors (client-to-guest) ---------- */
+
+static int requestor_index(struct run *run, Window window)
+{
+    uint32_t i;
+
+    for (i = 0; i < run->requestors; i++)
+        if (requestor_windows[i] == window)
+            return i;
+    return -1;
+}
+
+static void requestor_convert(struct xbench *xb, struct run *run,
+                              uint32_t r, uint32_t op)
+{
+    run->window_op[r] = op;
+    run->received[r] = 0;
+    run->in_incr[r] = 0;
+    run->started[op] = xbench_now();
+    XConvertSelection(xb->display, run->selection_atom, run->target_atom,
+                      atoms.property, requestor_windows[r], CurrentTime);
+}
+
+/* Reads and deletes the property, deleting it is what makes INCR owners
+   send the next chunk */
+static unsigned long requestor_read(struct xbench *xb, struct run *run,
+                                    Window window, Atom *type)
+{
+    unsigned char *data = NULL;
+    unsigned long len, remain;
+    int format;
+
+    if (XGetWindowProperty(xb->display, window, atoms.property, 0, LONG_MAX,
+                           True, AnyPropertyType, type, &format, &len,
+                           &remain, &data) != Success)
+        fail("XGetWindowProperty failed");
+    if (data)
+        XFree(data);
+    if (*type != atoms.incr && *type != run->target_atom)
+        fail("got a property of the wrong type");
+
+    return len;
+}
+
+static void requestor_complete(struct run *run, uint32_t r)
+{
+    uint32_t op = run->window_op[r];
+
+    if (run->received[r] != run->size)
+        fail("received %u of %u bytes", run->received[r], run->size);
+    run->latency[op] = xbench_now() - run->started[op];
+    run->done++;
+}
+
+static void requestor_handle_notify(struct xbench *xb, struct run *run,
+                                    XSelectionEvent *event)
+{
+    int r = requestor_index(run, event->requestor);
+    unsigned long len;
+    Atom type;
+
+    if (r == -1)
+        return;
+    if (event->property == None)
+        fail("spice-vdagent refused the conversion");
+
+    len = requestor_read(xb, run, event->requestor, &type);
+    if (type == atoms.incr) {
+        run->in_incr[r] = 1;
+        run->incr_seen++;
+        return;
+    }
+    run->received[r] = len;
+    requestor_complete(run, r);
+}
+
+static void requestor_handle_property(struct xbench *xb, struct run *run,
+                                      XPropertyEvent *event)
+{
+    int r = requestor_index(run, event->window);
+    unsigned long len;
+    Atom type;
+
+    if (r == -1 || !run->in_incr[r] || event->atom != atoms.property ||
+            event->state != PropertyNewValue)
+        return;
+
+    len = requestor_read(xb, run, event->window, &type);
+    if (len == 0) {
+        run->in_incr[r] = 0;
+        requestor_complete(run, r);
+    } else {
+        run->received[r] += len;
+    }
+}
+
+/* ---------- Event handling ---------- */
+
+static void x_event(struct xbench *xb, XEvent *event)
+{
+    struct run *run = xb->priv;
+
+    if (!run)
+        return;
+
+    switch (event->type) {
+    case SelectionRequest:
+        owner_handle_request(xb, run, &event->xselectionrequest);
+        break;
+    case SelectionNotify:
+        requestor_handle_notify(xb, run, &event->xselection);
+        break;
+    case PropertyNotify:
+        if (event->xproperty.window == run->incr_requestor)
+            owner_handle_property(xb, run, &event->xproperty);
+        else
+            requestor_handle_property(xb, run, &event->xproperty);
+        break;
+    }
+}
+
+/* The stub daemon answers the agent's requests the way the client would */
+static void agent_read(struct xbench *xb, struct udscs_message_header *header,
+                       uint8_t *data)
+{
+    struct run *run = xb->priv;
+    uint32_t id;
+
+    if (!run)
+        return;
+
+    switch (header->type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+        if ((uint8_t)header->arg1 == run->selection)
+            run->grabbed = 1;
+        break;
+    case VDAGENTD_CLIPBOARD_REQUEST:
+        udscs_write(xb->agent, VDAGENTD_CLIPBOARD_DATA, header->arg1,
+                    header->arg2, run->payload, run->size);
+        break;
+    case VDAGENTD_CLIPBOARD_DATA:
+        id = VDAGENTD_CLIPBOARD_ID(header->arg1);
+        if (id == 0 || id > run->ops)
+            fail("clipboard data for unknown request %u", id);
+        if (header->size != run->size)
+            fail("received %u of %u bytes", header->size, run->size);
+        run->latency[id - 1] = xbench_now() - run->started[id - 1];
+        run->done++;
+        break;
+    }
+}
+
+static int run_is_grabbed(struct xbench *xb)
+{
+    struct run *run = xb->priv;
+    Window owner;
+
+    if (!strcmp(run->direction, "guest-to-client"))
+        return run->grabbed;
+
+    owner = XGetSelectionOwner(xb->display, run->selection_atom);
+    return owner != None && owner != owner_window;
+}
+
+static int run_is_done(struct xbench *xb)
+{
+    struct run *run = xb->priv;
+
+    return run->done == run->wait_for;
+}
+
+/* ---------- Benchmark runs ---------- */
+
+static void fill_payload(struct run *run)
+{
+    const char *line = "The quick brown fox jumps over the lazy dog.\n";
+    size_t line_len = strlen(line);
+    uint32_t i, x = 1;
+
+    if (run->format->type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+        for (i = 0; i < run->size; i++)
+            run->payload[i] = line[i % line_len];
+    } else {
+        /* Something which does not compress, like the pixel data of a PNG */
+        for (i = 0; i < run->size; i++) {
+            x = x * 1103515245 + 12345;
+            run->payload[i] = x >> 24;
+        }
+    }
+}
+
+static void print_per_op(const char *name, long count, uint32_t ops)
+{
+    if (count < 0)
+        printf("\"%s\": null, ", name);
+    else
+        printf("\"%s\": %.1f, ", name, (double)count / ops);
+}
+
+static void report(struct run *run, double t, struct xbench_usage *usage)
+{
+    uint32_t n = run->ops;
+    double p50 = xbench_percentile(run->latency, n, 50);
+    double p99 = xbench_percentile(run->latency, n, 99);
+
+    printf("{\"bench\": \"clipboard\", \"direction\": \"%s\", "
+           "\"format\": \"%s\", \"selection\": \"%s\", \"size\": %u, "
+           "\"incr\": %s, \"requestors\": %u, \"ops\": %u, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f, "
+           "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, ",
+           run->direction, run->format->name,
+           selection_names[run->selection], run->size,
+           (run->incr || run->incr_seen) ? "true" : "false",
+           run->requestors, n, t, n / t, (double)n * run->size / t / 1e6,
+           p50 * 1e3, p99 * 1e3, run->latency[n - 1] * 1e3);
+    print_per_op("x_requests_per_op", usage->x_requests, n);
+    print_per_op("x_roundtrips_per_op", usage->x_replies, n);
+    printf("\"agent_cpu_ms_per_op\": %.3f, \"agent_rss_kb\": %ld, "
+           "\"agent_hwm_kb\": %ld}\n",
+           usage->cpu * 1e3 / n, usage->rss_kb, usage->hwm_kb);
+    fflush(stdout);
+}
+
+static void run_bench(struct xbench *xb, const char *direction,
+                      const struct format *format, uint8_t selection,
+                      uint32_t size, int incr, uint32_t requestors,
+                      uint64_t run_bytes)
+{
+    struct xbench_usage usage;
+    struct run run;
+    uint32_t op, r, type;
+    double t;
+
+    memset(&run, 0, sizeof(run));
+    run.direction = direction;
+    run.format = format;
+    run.selection = selection;
+    run.size = size;
+    run.incr = incr;
+    run.requestors = requestors;
+    run.selection_atom = atoms.selections[selection];
+    run.target_atom = XInternAtom(xb->display, format->target, False);
+
+    run.ops = run_bytes / size;
+    if (run.ops < MIN_OPS)
+        run.ops = MIN_OPS;
+    if (run.ops > MAX_OPS)
+        run.ops = MAX_OPS;
+    run.ops = (run.ops + requestors - 1) / requestors * requestors;
+
+    run.payload = malloc(size);
+    run.started = calloc(run.ops, sizeof(double));
+    run.latency = calloc(run.ops, sizeof(double));
+    if (!run.payload || !run.started || !run.latency)
+        fail("out of memory");
+    fill_payload(&run);
+
+    xb->priv = &run;
+    xbench_start_agent(xb);
+
+    if (!strcmp(direction, "guest-to-client")) {
+        XSetSelectionOwner(xb->display, run.selection_atom, owner_window,
+                           CurrentTime);
+    } else {
+        type = format->type;
+        udscs_write(xb->agent, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
+                    (uint8_t *)&type, sizeof(type));
+    }
+    xbench_wait(xb, run_is_grabbed, "the clipboard grab");
+
+    xbench_measure_start(xb);
+    t = xbench_now();
+    for (op = 0; op < run.ops; op += requestors) {
+        for (r = 0; r < requestors; r++) {
+            if (!strcmp(direction, "guest-to-client")) {
+                run.started[op + r] = xbench_now();
+                udscs_write(xb->agent, VDAGENTD_CLIPBOARD_REQUEST,
+                            VDAGENTD_CLIPBOARD_ARG1(selection, op + r + 1),
+                            format->type, NULL, 0);
+            } else {
+                requestor_convert(xb, &run, r, op + r);
+            }
+        }
+        run.wait_for = op + requestors;
+        xbench_wait(xb, run_is_done, "clipboard data");
+    }
+    t = xbench_now() - t;
+    xbench_measure_end(xb, &usage);
+    xbench_stop_agent(xb);
+    xb->priv = NULL;
+
+    report(&run, t, &usage);
+
+    free(run.latency);
+    free(run.started);
+    free(run.payload);
+}
+
+static void run_size(struct xbench *xb, const char *direction,
+                     const struct format *format, uint8_t selection,
+                     uint32_t size, const uint32_t *run_requestors,
+                     size_t n_requestors, uint64_t run_bytes)
+{
+    size_t r;
+
+    for (r = 0; r < n_requestors; r++) {
+        if (!strcmp(direction, "client-to-guest")) {
+            run_bench(xb, direction, format, selection, size, 0,
+                      run_requestors[r], run_bytes);
+            continue;
+        }
+        /* Owners only send the data at once if it fits in a request, and
+           only bother with INCR for larger data */
+        if (size <= max_direct_size)
+            run_bench(xb, direction, format, selection, size, 0,
+                      run_requestors[r], run_bytes);
+        if (size > INCR_CHUNK_SIZE)
+            run_bench(xb, direction, format, selection, size, 1,
+                      run_requestors[r], run_bytes);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *directions[] = { "guest-to-client", "client-to-guest" };
+    const char *agent = "src/spice-vdagent", *only_direction = NULL;
+    const uint32_t *run_sizes = sizes, *run_requestors = requestor_counts;
+    size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t n_requestors =
+        sizeof(requestor_counts) / sizeof(requestor_counts[0]);
+    uint64_t run_bytes = 64 * 1024 * 1024;
+    uint32_t size, requestors, max_requestors = 0;
+    int c, verbose = 0, record = 1;
+    struct xbench *xb;
+    size_t d, f, s, i;
+    uint8_t sel;
+
+    while ((c = getopt(argc, argv, "a:D:s:r:b:nvh")) != -1) {
+        switch (c) {
+        case 'a':
+            agent = optarg;
+            break;
+        case 'D':
+            only_direction = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            run_sizes = &size;
+            n_sizes = 1;
+            break;
+        case 'r':
+            requestors = strtoul(optarg, NULL, 0);
+            run_requestors = &requestors;
+            n_requestors = 1;
+            break;
+        case 'b':
+            run_bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            record = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a spice-vdagent] "
+                    "[-D guest-to-client|client-to-guest] [-s size] "
+                    "[-r requestors] [-b bytes-per-run] [-n] [-v]\n"
+                    "  -n  don't count the agent's X requests\n"
+                    "  -v  show the agent's and Xvfb's output\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if ((run_sizes == &size && !size) ||
+            (run_requestors == &requestors &&
+             (!requestors || requestors > MAX_REQUESTORS))) {
+        fprintf(stderr, "size must be at least 1 and requestors "
+                "between 1 and %d\n", MAX_REQUESTORS);
+        return 1;
+    }
+
+    xb = xbench_create(XBENCH_XVFB, agent, verbose, record);
+    if (!xb) {
+        xbench_print_skipped("clipboard", "Xvfb not found");
+        return 0;
+    }
+    xb->agent_read = agent_read;
+    xb->x_event = x_event;
+
+    atoms.selections[VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD] =
+        XInternAtom(xb->display, "CLIPBOARD", False);
+    atoms.selections[VD_AGENT_CLIPBOARD_SELECTION_PRIMARY] = XA_PRIMARY;
+    atoms.targets = XInternAtom(xb->display, "TARGETS", False);
+    atoms.incr = XInternAtom(xb->display, "INCR", False);
+    atoms.property = XInternAtom(xb->display, "XBENCH_SELECTION", False);
+
+    /* Bytes, leaving room for the request header */
+    max_direct_size = XExtendedMaxRequestSize(xb->display);
+    if (!max_direct_size)
+        max_direct_size = XMaxRequestSize(xb->display);
+    max_direct_size = max_direct_size * 4 - 100;
+
+    owner_window = XCreateSimpleWindow(xb->display, xb->root,
+                                       0, 0, 1, 1, 0, 0, 0);
+    for (i = 0; i < n_requestors; i++)
+        if (run_requestors[i] > max_requestors)
+            max_requestors = run_requestors[i];
+    for (i = 0; i < max_requestors; i++) {
+        requestor_windows[i] = XCreateSimpleWindow(xb->display, xb->root,
+                                                   0, 0, 1, 1, 0, 0, 0);
+        XSelectInput(xb->display, requestor_windows[i], PropertyChangeMask);
+    }
+
+    for (d = 0; d < sizeof(directions) / sizeof(directions[0]); d++) {
+        if (only_direction && strcmp(only_direction, directions[d]))
+            continue;
+        for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+            /* Only text is commonly copied to the primary selection */
+            for (sel = 0; sel <= (formats[f].type ==
+                                  VD_AGENT_CLIPBOARD_UTF8_TEXT); sel++)
+                for (s = 0; s < n_sizes; s++)
+                    run_size(xb, directions[d], &formats[f], sel,
+                             run_sizes[s], run_requestors, n_requestors,
+                             run_bytes);
+    }
+
+    xbench_destroy(xb);
+    return 0;
+}
@@ -0,0 +1,668 @@
+/*  compress-bench.c virtio payload compression benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sends payloads of several classes through virtio-port, as is and with
+   vdagentd's compression (see compress.h), to a mock client at the other
+   end of the port's unix socket. The mock client speaks the chunked port
+   protocol itself and uses libzstd directly, so this also checks that
+   what vdagentd sends and accepts is plain zstd.
+
+   Clipboard classes go to the client, each message compressed on its own
+   like vdagentd does. File classes come from the client as
+   VD_AGENT_FILE_XFER_DATA, compressed as one stream per file. All data
+   gets checked on arrival. The results, with the compression ratio, are
+   written as JSON lines. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spice/vd_agent.h>
+#include <zstd.h>
+
+#include "compress.h"
+#include "virtio-port.h"
+
+/* What spice-gtk sends file data in */
+#define FILE_CHUNK_SIZE (VD_AGENT_MAX_DATA_SIZE * 32)
+#define FILE_SIZE (8 * 1024 * 1024)
+/* Clipboard messages in flight, like a client pasting repeatedly */
+#define CLIPBOARD_DEPTH 4
+
+struct payload_class {
+    const char *name;
+    int from_client;  /* file xfer data, clipboard data to the client else */
+    uint32_t type;    /* of the clipboard data */
+    void (*fill)(uint8_t *buf, uint32_t size);
+};
+
+struct bench {
+    const struct payload_class *class;
+    int compressed;
+    uint32_t size;         /* of each message's payload */
+    uint32_t messages;
+    uint32_t sent;
+    uint32_t received;     /* protected by lock */
+    uint64_t wire_bytes;   /* message data crossing the port */
+    uint8_t *payload;      /* FILE_SIZE bytes with the file classes */
+    int client_fd;
+    int wake[2];           /* the client thread wakes up the main loop */
+    pthread_mutex_t lock;
+};
+
+static struct bench *bench;
+static struct vdagentd_compress *compress;
+static char socket_path[108];
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "%s: %s\n", bench ? bench->class->name : "compress",
+            msg);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ---------- Payloads ---------- */
+
+static uint32_t rand_state = 1;
+
+/* xorshift, the low bits of a LCG would repeat within a file */
+static uint32_t rand_next(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+/* Lines of words, like source code or logs */
+static void fill_text(uint8_t *buf, uint32_t size)
+{
+    static const char *words[] = {
+        "the", "clipboard", "data", "of", "selection", "int", "return",
+        "static", "void", "if", "else", "for", "while", "struct", "agent",
+        "client", "guest", "message", "size", "error", "{", "}", "=", ";",
+        "0", "1", "NULL", "free", "malloc", "syslog", "LOG_ERR",
+    };
+    uint32_t i = 0, n;
+    const char *w;
+
+    while (i < size) {
+        if (rand_next() % 10 == 0) {
+            buf[i++] = '\n';
+            continue;
+        }
+        w = words[rand_next() % (sizeof(words) / sizeof(words[0]))];
+        for (n = 0; w[n] && i < size; n++)
+            buf[i++] = w[n];
+        if (i < size)
+            buf[i++] = ' ';
+    }
+}
+
+/* A 24 bit BMP of a desktop: flat areas, windows, a gradient and a photo */
+static void fill_bmp(uint8_t *buf, uint32_t size)
+{
+    uint32_t width = 1024, x, y, height, i;
+    uint8_t *p;
+
+    if (size < 54)
+        return fill_text(buf, size);
+    height = (size - 54) / (width * 3);
+    memset(buf, 0, 54);
+    buf[0] = 'B';
+    buf[1] = 'M';
+    memcpy(buf + 2, &size, 4);
+    buf[10] = 54;
+    buf[14] = 40;
+    memcpy(buf + 18, &width, 4);
+    memcpy(buf + 22, &height, 4);
+    buf[26] = 1;
+    buf[28] = 24;
+
+    p = buf + 54;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++, p += 3) {
+            if (x > 600 && y > height / 2) {
+                /* photo */
+                p[0] = rand_next();
+                p[1] = (x + y + (rand_next() & 15)) & 0xff;
+                p[2] = (x * y) >> 8;
+            } else if (x > 100 && x < 500 && y % 200 > 20) {
+                /* window with text lines */
+                i = (y % 16 < 10 && rand_next() % 3 == 0) ? 0 : 0xee;
+                p[0] = p[1] = p[2] = i;
+            } else {
+                /* background gradient */
+                p[0] = 0x40;
+                p[1] = 0x60 + y * 64 / (height ? height : 1);
+                p[2] = 0x90;
+            }
+        }
+    }
+    /* BMP rows are padded to 4 bytes, width * 3 already is */
+    memset(p, 0, buf + size - p);
+}
+
+/* Already compressed data: PNG / JPEG images, archives */
+static void fill_random(uint8_t *buf, uint32_t size)
+{
+    uint32_t i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = rand_next();
+}
+
+static const struct payload_class classes[] = {
+    { "text", 0, VD_AGENT_CLIPBOARD_UTF8_TEXT, fill_text },
+    { "bmp", 0, VD_AGENT_CLIPBOARD_IMAGE_BMP, fill_bmp },
+    { "png", 0, VD_AGENT_CLIPBOARD_IMAGE_PNG, fill_random },
+    { "file-text", 1, 0, fill_text },
+    { "file-binary", 1, 0, fill_random },
+};
+
+/* ---------- Mock client ---------- */
+
+static void read_full(int fd, void *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = read(fd, buf, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fail("mock client: port closed");
+        }
+        buf = (uint8_t *)buf + n;
+        size -= n;
+    }
+}
+
+static void write_full(int fd, const void *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, buf, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fail("mock client: port closed");
+        }
+        buf = (const uint8_t *)buf + n;
+        size -= n;
+    }
+}
+
+/* Read size bytes of message data, skipping the chunk headers */
+static void client_read(uint32_t *chunk_left, void *buf, size_t size)
+{
+    VDIChunkHeader chunk;
+    size_t len;
+
+    while (size) {
+        if (!*chunk_left) {
+            read_full(bench->client_fd, &chunk, sizeof(chunk));
+            *chunk_left = chunk.size;
+            continue;
+        }
+        len = size < *chunk_left ? size : *chunk_left;
+        read_full(bench->client_fd, buf, len);
+        buf = (uint8_t *)buf + len;
+        size -= len;
+        *chunk_left -= len;
+    }
+}
+
+/* Write a message in chunks, the way spice-server does */
+static void client_write(uint32_t type, const uint8_t *data, uint32_t size)
+{
+    VDAgentMessage header = {
+        .protocol = VD_AGENT_PROTOCOL,
+        .type = type,
+        .size = size,
+    };
+    uint8_t chunk_data[VD_AGENT_MAX_DATA_SIZE];
+    VDIChunkHeader chunk = { .port = VDP_CLIENT_PORT };
+    uint32_t pos = 0, len, used;
+
+    memcpy(chunk_data, &header, sizeof(header));
+    used = sizeof(header);
+    do {
+        len = size - pos;
+        if (len > sizeof(chunk_data) - used)
+            len = sizeof(chunk_data) - used;
+        memcpy(chunk_data + used, data + pos, len);
+        chunk.size = used + len;
+        write_full(bench->client_fd, &chunk, sizeof(chunk));
+        write_full(bench->client_fd, chunk_data, chunk.size);
+        pos += len;
+        used = 0;
+    } while (pos < size);
+}
+
+static uint32_t get_received(void)
+{
+    uint32_t received;
+
+    pthread_mutex_lock(&bench->lock);
+    received = bench->received;
+    pthread_mutex_unlock(&bench->lock);
+    return received;
+}
+
+static void message_received(uint32_t wire_size)
+{
+    pthread_mutex_lock(&bench->lock);
+    bench->received++;
+    bench->wire_bytes += wire_size;
+    pthread_mutex_unlock(&bench->lock);
+    if (write(bench->wake[1], "", 1) == -1 &&
+            errno != EAGAIN)
+        fail("waking up the main loop");
+}
+
+/* Check the selection, type and data of a VD_AGENT_CLIPBOARD message */
+static void check_clipboard(const uint8_t *data, uint32_t size)
+{
+    uint32_t type;
+
+    if (size != 8 + bench->size)
+        fail("clipboard data of the wrong size");
+    memcpy(&type, data + 4, 4);
+    if (data[0] != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD ||
+            type != bench->class->type ||
+            memcmp(data + 8, bench->payload, bench->size))
+        fail("clipboard data corrupted");
+}
+
+static void *client_receive_thread(void *priv)
+{
+    struct vdagentd_compress_header *compressed;
+    VDAgentMessage header;
+    uint8_t *data, *buf = NULL;
+    uint32_t chunk_left = 0, i;
+    size_t ret;
+
+    for (i = 0; i < bench->messages; i++) {
+        client_read(&chunk_left, &header, sizeof(header));
+        data = malloc(header.size);
+        if (!data)
+            fail("out of memory");
+        client_read(&chunk_left, data, header.size);
+
+        if (header.type == VDAGENTD_COMPRESS_MESSAGE) {
+            compressed = (struct vdagentd_compress_header *)data;
+            if (header.size < sizeof(*compressed) ||
+                    compressed->type != VD_AGENT_CLIPBOARD ||
+                    compressed->codec != VDAGENTD_COMPRESS_CODEC_ZSTD ||
+                    compressed->flags)
+                fail("bad compressed message");
+            buf = realloc(buf, compressed->size);
+            if (!buf)
+                fail("out of memory");
+            ret = ZSTD_decompress(buf, compressed->size,
+                                  data + sizeof(*compressed),
+                                  header.size - sizeof(*compressed));
+            if (ZSTD_isError(ret) || ret != compressed->size)
+                fail("decompressing failed");
+            check_clipboard(buf, ret);
+        } else if (header.type == VD_AGENT_CLIPBOARD) {
+            check_clipboard(data, header.size);
+        } else {
+            fail("unexpected message type");
+        }
+        free(data);
+        message_received(header.size);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Send the payload as the chunks of files, a zstd stream per file */
+static void *client_send_thread(void *priv)
+{
+    struct vdagentd_compress_header *compressed;
+    VDAgentFileXferDataMessage *msg;
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    uint32_t msg_size, i, id, file_pos;
+    size_t ret, out_size;
+    uint8_t *buf;
+
+    msg_size = sizeof(*msg) + bench->size;
+    out_size = sizeof(*compressed) + ZSTD_compressBound(msg_size);
+    msg = malloc(msg_size);
+    buf = malloc(out_size);
+    if (!cctx || !msg || !buf)
+        fail("out of memory");
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 1);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+                           VDAGENTD_COMPRESS_WINDOW_LOG);
+
+    for (i = 0; i < bench->messages; i++) {
+        id = 1 + (uint64_t)i * bench->size / FILE_SIZE;
+        file_pos = (uint64_t)i * bench->size % FILE_SIZE;
+        if (!file_pos)
+            ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+
+        msg->id = id;
+        msg->size = bench->size;
+        memcpy(msg->data, bench->payload + file_pos, bench->size);
+        if (!bench->compressed) {
+            client_write(VD_AGENT_FILE_XFER_DATA, (uint8_t *)msg, msg_size);
+            continue;
+        }
+
+        compressed = (struct vdagentd_compress_header *)buf;
+        compressed->type = VD_AGENT_FILE_XFER_DATA;
+        compressed->size = msg_size;
+        compressed->codec = VDAGENTD_COMPRESS_CODEC_ZSTD;
+        compressed->flags = VDAGENTD_COMPRESS_FLAG_STREAM;
+        compressed->stream = id;
+        in.src = msg;
+        in.size = msg_size;
+        in.pos = 0;
+        out.dst = buf + sizeof(*compressed);
+        out.size = out_size - sizeof(*compressed);
+        out.pos = 0;
+        do {
+            ret = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_flush);
+            if (ZSTD_isError(ret))
+                fail("compressing failed");
+        } while (ret);
+        client_write(VDAGENTD_COMPRESS_MESSAGE, buf,
+                     sizeof(*compressed) + out.pos);
+    }
+
+    ZSTD_freeCCtx(cctx);
+    free(buf);
+    free(msg);
+    return NULL;
+}
+
+/* ---------- vdagentd side ---------- */
+
+/* Messages arrive in order, from this thread only */
+static void check_file_data(const uint8_t *data, uint32_t size)
+{
+    const VDAgentFileXferDataMessage *msg =
+        (const VDAgentFileXferDataMessage *)data;
+    uint32_t i = get_received();
+
+    if (size != sizeof(*msg) + bench->size || msg->size != bench->size ||
+            msg->id != 1 + (uint64_t)i * bench->size / FILE_SIZE ||
+            memcmp(msg->data,
+                   bench->payload + (uint64_t)i * bench->size % FILE_SIZE,
+                   bench->size))
+        fail("file data corrupted");
+}
+
+static int port_read(struct vdagent_virtio_port *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    uint32_t type, size;
+    uint8_t *buf;
+
+    if (message_header->type == VDAGENTD_COMPRESS_MESSAGE) {
+        buf = vdagentd_compress_decompress(compress, data,
+                                           message_header->size,
+                                           &type, &size);
+        if (!buf || type != VD_AGENT_FILE_XFER_DATA)
+            fail("bad compressed message");
+        check_file_data(buf, size);
+        free(buf);
+    } else if (message_header->type == VD_AGENT_FILE_XFER_DATA) {
+        check_file_data(data, message_header->size);
+    } else {
+        fail("unexpected message type");
+    }
+    message_received(message_header->size);
+    return 0;
+}
+
+/* Queue a clipboard message the way vdagentd's virtio_write_clipboard()
+   does */
+static void write_clipboard(struct vdagent_virtio_port *vport)
+{
+    uint8_t sel[4] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, 0, 0, 0 };
+    uint32_t type = bench->class->type, size;
+    struct vdagentd_compress_iov iov[3] = {
+        { sel, 4 }, { &type, 4 }, { bench->payload, bench->size },
+    };
+    uint8_t *buf = NULL;
+
+    if (bench->compressed && type != VD_AGENT_CLIPBOARD_IMAGE_PNG &&
+            type != VD_AGENT_CLIPBOARD_IMAGE_JPG)
+        buf = vdagentd_compress_message(compress, VD_AGENT_CLIPBOARD, iov, 3,
+                                        &size);
+    if (buf) {
+        vdagent_virtio_port_write(vport, VDP_CLIENT_PORT,
+                                  VDAGENTD_COMPRESS_MESSAGE, 0, buf, size);
+        free(buf);
+        return;
+    }
+    vdagent_virtio_port_write_start(vport, VDP_CLIENT_PORT,
+                                    VD_AGENT_CLIPBOARD, 0, 8 + bench->size);
+    vdagent_virtio_port_write_append(vport, sel, 4);
+    vdagent_virtio_port_write_append(vport, (uint8_t *)&type, 4);
+    vdagent_virtio_port_write_append(vport, bench->payload, bench->size);
+}
+
+static void report(double t)
+{
+    uint64_t bytes = (uint64_t)bench->messages * bench->size;
+
+    printf("{\"bench\": \"compress\", \"class\": \"%s\", "
+           "\"direction\": \"%s\", \"mode\": \"%s\", \"size\": %u, "
+           "\"messages\": %u, \"seconds\": %.6f, \"mb_per_sec\": %.1f, "
+           "\"wire_bytes\": %llu, \"ratio\": %.3f}\n",
+           bench->class->name,
+           bench->class->from_client ? "client-to-guest" : "guest-to-client",
+           bench->compressed ? "zstd" : "none", bench->size,
+           bench->messages, t, bytes / t / 1e6,
+           (unsigned long long)bench->wire_bytes,
+           (double)bytes / bench->wire_bytes);
+    fflush(stdout);
+}
+
+static void run_port(void)
+{
+    struct vdagent_virtio_port *vport;
+    struct sockaddr_un address;
+    fd_set readfds, writefds;
+    pthread_t client;
+    int listen_fd, nfds;
+    char buf[64];
+    double t;
+
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+            bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+            listen(listen_fd, 1)) {
+        perror("creating mock client socket");
+        exit(1);
+    }
+    vport = vdagent_virtio_port_create(socket_path, port_read, NULL);
+    bench->client_fd = accept(listen_fd, NULL, NULL);
+    if (!vport || bench->client_fd == -1)
+        fail("could not set up the port");
+
+    t = now();
+    pthread_create(&client, NULL, bench->class->from_client ?
+                   client_send_thread : client_receive_thread, NULL);
+    while (get_received() < bench->messages) {
+        while (!bench->class->from_client &&
+               bench->sent < bench->messages &&
+               bench->sent - get_received() < CLIPBOARD_DEPTH) {
+            write_clipboard(vport);
+            bench->sent++;
+        }
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        nfds = vdagent_virtio_port_fill_fds(vport, &readfds, &writefds);
+        FD_SET(bench->wake[0], &readfds);
+        if (bench->wake[0] >= nfds)
+            nfds = bench->wake[0] + 1;
+        if (select(nfds, &readfds, &writefds, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(1);
+        }
+        if (FD_ISSET(bench->wake[0], &readfds))
+            while (read(bench->wake[0], buf, sizeof(buf)) > 0)
+                ;
+        vdagent_virtio_port_handle_fds(&vport, &readfds, &writefds);
+        if (!vport)
+            fail("port closed");
+    }
+    pthread_join(client, NULL);
+    t = now() - t;
+
+    report(t);
+
+    vdagent_virtio_port_destroy(&vport);
+    close(bench->client_fd);
+    close(listen_fd);
+    unlink(socket_path);
+}
+
+/* ---------- Main ---------- */
+
+static void run(const struct payload_class *class, int compressed,
+                uint32_t size, uint64_t run_bytes)
+{
+    struct bench b;
+    uint64_t messages;
+    uint32_t payload_size;
+
+    payload_size = size;
+    if (class->from_client) {
+        size = FILE_CHUNK_SIZE;
+        payload_size = FILE_SIZE;
+    }
+    messages = run_bytes / size;
+    if (messages < 2)
+        messages = 2;
+
+    memset(&b, 0, sizeof(b));
+    b.class = class;
+    b.compressed = compressed;
+    b.size = size;
+    b.messages = messages;
+    b.payload = malloc(payload_size);
+    if (!b.payload) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    rand_state = 1;
+    class->fill(b.payload, payload_size);
+    if (pipe2(b.wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    bench = &b;
+
+    run_port();
+
+    bench = NULL;
+    pthread_mutex_destroy(&b.lock);
+    close(b.wake[0]);
+    close(b.wake[1]);
+    free(b.payload);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/compress-bench.XXXXXX";
+    const char *only_class = NULL;
+    uint64_t run_bytes = 64 * 1024 * 1024;
+    uint32_t size = 1024 * 1024;
+    size_t i;
+    int c, compressed;
+
+    while ((c = getopt(argc, argv, "c:s:b:h")) != -1) {
+        switch (c) {
+        case 'c':
+            only_class = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            run_bytes = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c class] [-s clipboard-size] "
+                    "[-b bytes-per-run]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (!size) {
+        fprintf(stderr, "size must be at least 1\n");
+        return 1;
+    }
+
+    compress = vdagentd_compress_create(0);
+    if (!compress) {
+        fprintf(stderr, "could not create the compression state\n");
+        return 1;
+    }
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/sock", dir);
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (only_class && strcmp(only_class, classes[i].name))
+            continue;
+        for (compressed = 0; compressed < 2; compressed++)
+            run(&classes[i], compressed, size, run_bytes);
+        vdagentd_compress_reset(compress);
+    }
+
+    vdagentd_compress_destroy(compress);
+    rmdir(dir);
+    return 0;
+}
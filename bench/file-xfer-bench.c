@@ -0,0 +1,218 @@
+/*  file-xfer-bench.c spice-vdagent file xfer benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Feeds vdagent_file_xfers the same sequence of messages a client sends when
+   a folder of files is dropped onto its window, and reports the amount of
+   files per second the agent manages to write out. Also compares the cost
+   of the CRC32C calculated for each xfer with the raw write throughput. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <spice/vd_agent.h>
+#include <glib.h>
+
+#include "udscs.h"
+#include "file-xfers.h"
+#include "crc32c.h"
+
+#define DATA_CHUNK_SIZE (64 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* file-xfers only ever queues status messages on the connection, so a
+   listening socket nobody accepts on is all the "daemon" we need */
+static struct udscs_connection *bench_connect(const char *dir, int *listen_fd)
+{
+    struct sockaddr_un address;
+    struct udscs_connection *conn;
+
+    *listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s/sock", dir);
+    if (*listen_fd == -1 ||
+            bind(*listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+            listen(*listen_fd, 1)) {
+        perror("creating bench socket");
+        exit(1);
+    }
+
+    conn = udscs_connect(address.sun_path, NULL, NULL, NULL, 0, 0);
+    if (!conn) {
+        fprintf(stderr, "could not connect to bench socket\n");
+        exit(1);
+    }
+    return conn;
+}
+
+static void run(const char *mode, const char *dir, int files, int size,
+                int multi_file)
+{
+    struct udscs_connection *conn;
+    struct vdagent_file_xfers *xfers;
+    VDAgentFileXferStartMessage *start;
+    VDAgentFileXferDataMessage *data;
+    char *save_dir, *keyfile;
+    double t;
+    int i, pos, len, listen_fd;
+
+    save_dir = g_strdup_printf("%s/%s", dir, mode);
+    conn = bench_connect(dir, &listen_fd);
+    xfers = vdagent_file_xfers_create(conn, save_dir, 0, 0);
+
+    data = g_malloc0(sizeof(*data) + DATA_CHUNK_SIZE);
+    memset(data->data, 'x', DATA_CHUNK_SIZE);
+
+    t = now();
+    for (i = 1; i <= files; i++) {
+        if (multi_file)
+            keyfile = g_strdup_printf("[vdagent-file-xfer]\n"
+                                      "name=dir%d/file%d\nsize=%d\n"
+                                      "file-xfer-nr=%d\nfile-xfer-total=%d\n",
+                                      i % 16, i, size, i, files);
+        else
+            keyfile = g_strdup_printf("[vdagent-file-xfer]\n"
+                                      "name=dir%d/file%d\nsize=%d\n",
+                                      i % 16, i, size);
+        len = strlen(keyfile) + 1;
+        start = g_malloc(sizeof(*start) + len);
+        start->id = i;
+        memcpy(start->data, keyfile, len);
+        vdagent_file_xfers_start(xfers, start);
+        g_free(start);
+        g_free(keyfile);
+
+        for (pos = 0; pos < size; pos += data->size) {
+            data->id = i;
+            data->size = MIN(size - pos, DATA_CHUNK_SIZE);
+            vdagent_file_xfers_data(xfers, data);
+        }
+    }
+    t = now() - t;
+
+    printf("{\"bench\": \"file-xfer\", \"mode\": \"%s\", \"files\": %d, "
+           "\"size\": %d, \"seconds\": %.6f, \"files_per_sec\": %.1f}\n",
+           mode, files, size, t, files / t);
+
+    vdagent_file_xfers_destroy(xfers);
+    udscs_destroy_connection(&conn);
+    close(listen_fd);
+    g_free(data);
+    g_free(save_dir);
+}
+
+static void run_crc32c(const char *dir, int total)
+{
+    char *buf, *path;
+    double t_write, t_crc;
+    uint32_t crc = 0;
+    int i, fd;
+
+    buf = g_malloc(DATA_CHUNK_SIZE);
+    memset(buf, 'x', DATA_CHUNK_SIZE);
+    path = g_strdup_printf("%s/crc32c", dir);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    t_write = now();
+    for (i = 0; i < total; i += DATA_CHUNK_SIZE) {
+        if (write(fd, buf, DATA_CHUNK_SIZE) != DATA_CHUNK_SIZE) {
+            perror("write");
+            exit(1);
+        }
+    }
+    t_write = now() - t_write;
+
+    t_crc = now();
+    for (i = 0; i < total; i += DATA_CHUNK_SIZE)
+        crc = crc32c_update(crc, buf, DATA_CHUNK_SIZE);
+    t_crc = now() - t_crc;
+
+    printf("{\"bench\": \"file-xfer-crc32c\", \"bytes\": %d, "
+           "\"crc32c\": \"%08x\", \"write_mb_per_sec\": %.1f, "
+           "\"crc32c_mb_per_sec\": %.1f, \"overhead_pct\": %.2f}\n",
+           total, crc, total / t_write / 1e6, total / t_crc / 1e6,
+           100.0 * t_crc / t_write);
+
+    close(fd);
+    unlink(path);
+    g_free(path);
+    g_free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/file-xfer-bench.XXXXXX";
+    int c, files = 2000, size = 4096;
+
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n files] [-s file-size]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    run("single", dir, files, size, 0);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    mkdir(dir, 0700);
+    run("multi-file", dir, files, size, 1);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    mkdir(dir, 0700);
+    run_crc32c(dir, 256 * 1024 * 1024);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return 0;
+}
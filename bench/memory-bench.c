@@ -0,0 +1,721 @@
+/*  memory-bench.c spice-vdagentd and spice-vdagent peak memory regression
+    test
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Pushes large clipboard and file transfers through the real spice-vdagentd
+   and spice-vdagent (see xbench.h), playing the SPICE client on the
+   daemon's virtio port and the X applications on Xvfb, and reports how
+   many copies of the payload each process held at its peak.
+
+   The copies are measured twice: from the processes' peak resident set
+   size (VmHWM) against their size before the transfer, and from the
+   high-water marks of the buffers each component reports in its metrics.
+   Each transfer gets a fresh daemon and agent, so that these peaks are the
+   transfer's own. The results are written as JSON lines, and the benchmark
+   fails when either measure exceeds the copies the current design needs. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <spice/vd_agent.h>
+
+#include "xbench.h"
+
+#define INCR_CHUNK_SIZE (256 * 1024)
+#define FILE_XFER_CHUNK_SIZE (64 * 1024)
+#define PORT_READ_SIZE (64 * 1024)
+/* Allowed on top of the expected copies: the metrics only miss the message
+   and chunk headers, the resident set size also has the allocator's and
+   Xlib's buffers in it */
+#define TRACKED_SLACK 0.1
+#define RSS_SLACK 1.0
+
+struct workload {
+    const char *name;
+    void (*run)(struct xbench *xb);
+    /* The copies of the payload each process holds with the current
+       design, the benchmark fails when they grow */
+    double daemon_copies;
+    double agent_copies;
+};
+
+/* The buffers reported in the metrics, which hold payload data */
+static const char * const daemon_buffers[] = {
+    "virtio_read_bytes", "virtio_queued_bytes", "udscs_read_bytes",
+    "udscs_queued_bytes", "file_xfer_queued_bytes",
+};
+static const char * const agent_buffers[] = {
+    "udscs_read_bytes", "udscs_queued_bytes",
+    "clipboard_incr_receive_bytes", "clipboard_incr_send_bytes",
+    "clipboard_text_cache_bytes",
+};
+
+static const uint32_t sizes[] = { 16 * 1024 * 1024, 64 * 1024 * 1024 };
+
+/* The state of the transfer in progress */
+static struct {
+    uint32_t size;
+    uint8_t *payload;
+    int caps_done;        /* the daemon has acknowledged our capabilities */
+    int grabbed;          /* the agent has grabbed the client's clipboard */
+    int done;
+    int file_xfer_status; /* of the last VD_AGENT_FILE_XFER_STATUS, or -1 */
+    /* guest-to-client: the owner's INCR transfer in progress */
+    Window incr_requestor;
+    Atom incr_property;
+    uint32_t incr_pos;
+    /* client-to-guest: the requestor's transfer */
+    uint32_t received;
+    int in_incr;
+} run;
+
+/* The virtio port, as seen from the client */
+static struct {
+    uint8_t in[PORT_READ_SIZE];
+    uint32_t in_len;
+    uint8_t *message;
+    uint32_t message_len;
+    uint32_t message_size;
+} port;
+
+static struct {
+    Atom clipboard;
+    Atom targets;
+    Atom utf8_string;
+    Atom incr;
+    Atom property;
+} atoms;
+
+static Window owner_window;
+static Window requestor_window;
+
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "memory-bench: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+/* ---------- The client's end of the virtio port ---------- */
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            fail("writing to the virtio port: %s", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Messages go out in chunks, like spice-server sends them. The clipboard
+   messages start with the selection, as we announce
+   VD_AGENT_CAP_CLIPBOARD_SELECTION. */
+static void port_write(struct xbench *xb, uint32_t type,
+                       const void *data1, uint32_t size1,
+                       const void *data2, uint32_t size2)
+{
+    VDAgentMessage header = {
+        .protocol = VD_AGENT_PROTOCOL,
+        .type = type,
+        .size = size1 + size2,
+    };
+    const uint8_t *src[3] = { (uint8_t *)&header, data1, data2 };
+    uint32_t src_len[3] = { sizeof(header), size1, size2 };
+    uint8_t chunk[sizeof(VDIChunkHeader) + VD_AGENT_MAX_DATA_SIZE];
+    VDIChunkHeader *chunk_header = (VDIChunkHeader *)chunk;
+    uint32_t len, pos = 0;
+    int i = 0;
+
+    chunk_header->port = VDP_CLIENT_PORT;
+    while (i < 3) {
+        chunk_header->size = 0;
+        while (i < 3 && chunk_header->size < VD_AGENT_MAX_DATA_SIZE) {
+            len = src_len[i] - pos;
+            if (len > VD_AGENT_MAX_DATA_SIZE - chunk_header->size)
+                len = VD_AGENT_MAX_DATA_SIZE - chunk_header->size;
+            memcpy(chunk + sizeof(*chunk_header) + chunk_header->size,
+                   src[i] + pos, len);
+            chunk_header->size += len;
+            pos += len;
+            if (pos == src_len[i]) {
+                i++;
+                pos = 0;
+            }
+        }
+        write_all(xb->port, chunk, sizeof(*chunk_header) + chunk_header->size);
+    }
+}
+
+static void send_capabilities(struct xbench *xb)
+{
+    uint32_t caps[1 + VD_AGENT_CAPS_SIZE];
+    VDAgentAnnounceCapabilities *announce =
+        (VDAgentAnnounceCapabilities *)caps;
+
+    memset(caps, 0, sizeof(caps));
+    announce->request = 1;
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    VD_AGENT_SET_CAPABILITY(announce->caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    port_write(xb, VD_AGENT_ANNOUNCE_CAPABILITIES, caps, sizeof(caps),
+               NULL, 0);
+}
+
+static void send_clipboard(struct xbench *xb, uint32_t type,
+                           const void *data, uint32_t size)
+{
+    uint32_t header[2] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+                           VD_AGENT_CLIPBOARD_UTF8_TEXT };
+
+    port_write(xb, type, header, sizeof(header), data, size);
+}
+
+static void handle_message(struct xbench *xb, VDAgentMessage *message)
+{
+    VDAgentAnnounceCapabilities *caps;
+    VDAgentFileXferStatusMessage *status;
+
+    switch (message->type) {
+    case VD_AGENT_ANNOUNCE_CAPABILITIES:
+        /* The daemon's answer to our request, not its own request */
+        caps = (VDAgentAnnounceCapabilities *)message->data;
+        if (!caps->request)
+            run.caps_done = 1;
+        break;
+    case VD_AGENT_CLIPBOARD_GRAB:
+        run.grabbed = 1;
+        break;
+    case VD_AGENT_CLIPBOARD_REQUEST:
+        send_clipboard(xb, VD_AGENT_CLIPBOARD, run.payload, run.size);
+        break;
+    case VD_AGENT_CLIPBOARD:
+        /* The selection and the type come first */
+        if (message->size != 8 + run.size)
+            fail("received %u of %u bytes", message->size - 8, run.size);
+        run.done = 1;
+        break;
+    case VD_AGENT_FILE_XFER_STATUS:
+        status = (VDAgentFileXferStatusMessage *)message->data;
+        run.file_xfer_status = status->result;
+        break;
+    }
+}
+
+static void port_add_message_data(const uint8_t *data, uint32_t len)
+{
+    if (port.message_len + len > port.message_size) {
+        port.message_size = 2 * (port.message_len + len);
+        port.message = realloc(port.message, port.message_size);
+        if (!port.message)
+            fail("out of memory");
+    }
+    memcpy(port.message + port.message_len, data, len);
+    port.message_len += len;
+}
+
+/* All messages come from the daemon's end of the port, so the chunk's
+   port number is of no interest */
+static void port_read(struct xbench *xb)
+{
+    VDIChunkHeader *chunk;
+    VDAgentMessage *message;
+    uint32_t pos = 0, len;
+    ssize_t n;
+
+    n = read(xb->port, port.in + port.in_len, sizeof(port.in) - port.in_len);
+    if (n == -1 && errno == EINTR)
+        return;
+    if (n <= 0)
+        fail("the daemon closed the virtio port");
+    port.in_len += n;
+
+    while (port.in_len - pos >= sizeof(*chunk)) {
+        chunk = (VDIChunkHeader *)(port.in + pos);
+        if (chunk->size > VD_AGENT_MAX_DATA_SIZE)
+            fail("chunk of %u bytes on the virtio port", chunk->size);
+        if (port.in_len - pos < sizeof(*chunk) + chunk->size)
+            break;
+        port_add_message_data(port.in + pos + sizeof(*chunk), chunk->size);
+        pos += sizeof(*chunk) + chunk->size;
+
+        message = (VDAgentMessage *)port.message;
+        while (port.message_len >= sizeof(*message) &&
+               port.message_len >= sizeof(*message) + message->size) {
+            handle_message(xb, message);
+            len = sizeof(*message) + message->size;
+            memmove(port.message, port.message + len,
+                    port.message_len - len);
+            port.message_len -= len;
+        }
+    }
+    memmove(port.in, port.in + pos, port.in_len - pos);
+    port.in_len -= pos;
+}
+
+/* ---------- X11 selection owner (guest-to-client) ---------- */
+
+static void owner_handle_request(struct xbench *xb,
+                                 XSelectionRequestEvent *req)
+{
+    Display *display = xb->display;
+    XSelectionEvent notify;
+    Atom property = req->property != None ? req->property : req->target;
+
+    memset(&notify, 0, sizeof(notify));
+    notify.type = SelectionNotify;
+    notify.display = display;
+    notify.requestor = req->requestor;
+    notify.selection = req->selection;
+    notify.target = req->target;
+    notify.time = req->time;
+    notify.property = property;
+
+    if (req->target == atoms.targets) {
+        Atom targets[2] = { atoms.targets, atoms.utf8_string };
+
+        XChangeProperty(display, req->requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)targets, 2);
+    } else if (req->target == atoms.utf8_string) {
+        /* With the total size, so that the agent can allocate its buffer
+           up front */
+        long size = run.size;
+
+        if (run.incr_requestor != None)
+            fail("overlapping INCR requests");
+        XSelectInput(display, req->requestor, PropertyChangeMask);
+        XChangeProperty(display, req->requestor, property, atoms.incr, 32,
+                        PropModeReplace, (unsigned char *)&size, 1);
+        run.incr_requestor = req->requestor;
+        run.incr_property = property;
+        run.incr_pos = 0;
+    } else {
+        notify.property = None;
+    }
+
+    XSendEvent(display, req->requestor, False, NoEventMask,
+               (XEvent *)&notify);
+    XFlush(display);
+}
+
+static void owner_handle_property(struct xbench *xb, XPropertyEvent *event)
+{
+    uint32_t len;
+
+    if (event->atom != run.incr_property || event->state != PropertyDelete)
+        return;
+
+    len = run.size - run.incr_pos;
+    if (len > INCR_CHUNK_SIZE)
+        len = INCR_CHUNK_SIZE;
+    XChangeProperty(xb->display, event->window, event->atom,
+                    atoms.utf8_string, 8, PropModeReplace,
+                    run.payload + run.incr_pos, len);
+    run.incr_pos += len;
+    if (len == 0) {
+        XSelectInput(xb->display, event->window, NoEventMask);
+        run.incr_requestor = None;
+    }
+    XFlush(xb->display);
+}
+
+/* ---------- X11 selection requestor (client-to-guest) ---------- */
+
+static unsigned long requestor_read(struct xbench *xb, Atom *type)
+{
+    unsigned char *data = NULL;
+    unsigned long len, remain;
+    int format;
+
+    if (XGetWindowProperty(xb->display, requestor_window, atoms.property, 0,
+                           LONG_MAX, True, AnyPropertyType, type, &format,
+                           &len, &remain, &data) != Success)
+        fail("XGetWindowProperty failed");
+    if (data)
+        XFree(data);
+    if (*type != atoms.incr && *type != atoms.utf8_string)
+        fail("got a property of the wrong type");
+
+    return len;
+}
+
+static void requestor_complete(void)
+{
+    if (run.received != run.size)
+        fail("received %u of %u bytes", run.received, run.size);
+    run.done = 1;
+}
+
+static void requestor_handle_notify(struct xbench *xb, XSelectionEvent *event)
+{
+    Atom type;
+
+    if (event->requestor != requestor_window)
+        return;
+    if (event->property == None)
+        fail("spice-vdagent refused the conversion");
+
+    run.received = requestor_read(xb, &type);
+    if (type == atoms.incr) {
+        run.received = 0;
+        run.in_incr = 1;
+        return;
+    }
+    requestor_complete();
+}
+
+static void requestor_handle_property(struct xbench *xb,
+                                      XPropertyEvent *event)
+{
+    unsigned long len;
+    Atom type;
+
+    if (!run.in_incr || event->atom != atoms.property ||
+            event->state != PropertyNewValue)
+        return;
+
+    len = requestor_read(xb, &type);
+    if (len == 0) {
+        run.in_incr = 0;
+        requestor_complete();
+    } else {
+        run.received += len;
+    }
+}
+
+static void x_event(struct xbench *xb, XEvent *event)
+{
+    switch (event->type) {
+    case SelectionRequest:
+        owner_handle_request(xb, &event->xselectionrequest);
+        break;
+    case SelectionNotify:
+        requestor_handle_notify(xb, &event->xselection);
+        break;
+    case PropertyNotify:
+        if (event->xproperty.window == run.incr_requestor)
+            owner_handle_property(xb, &event->xproperty);
+        else if (event->xproperty.window == requestor_window)
+            requestor_handle_property(xb, &event->xproperty);
+        break;
+    }
+}
+
+/* ---------- Workloads ---------- */
+
+static int caps_are_done(struct xbench *xb)
+{
+    return run.caps_done;
+}
+
+static int is_grabbed(struct xbench *xb)
+{
+    return run.grabbed;
+}
+
+static int agent_owns_clipboard(struct xbench *xb)
+{
+    Window owner = XGetSelectionOwner(xb->display, atoms.clipboard);
+
+    return owner != None && owner != owner_window;
+}
+
+static int is_done(struct xbench *xb)
+{
+    return run.done;
+}
+
+static int file_xfer_has_status(struct xbench *xb)
+{
+    return run.file_xfer_status != -1;
+}
+
+/* The client grabs the clipboard and an X client pastes from it: the agent
+   sends the data to the requestor with INCR */
+static void run_client_to_guest(struct xbench *xb)
+{
+    send_clipboard(xb, VD_AGENT_CLIPBOARD_GRAB, NULL, 0);
+    xbench_wait(xb, agent_owns_clipboard, "the clipboard grab");
+
+    xbench_measure_start(xb);
+    XConvertSelection(xb->display, atoms.clipboard, atoms.utf8_string,
+                      atoms.property, requestor_window, CurrentTime);
+    xbench_wait(xb, is_done, "the clipboard data");
+}
+
+/* An X client copies, and the client pastes: the agent reads the data from
+   the owner with INCR */
+static void run_guest_to_client(struct xbench *xb)
+{
+    XSetSelectionOwner(xb->display, atoms.clipboard, owner_window,
+                       CurrentTime);
+    xbench_wait(xb, is_grabbed, "the clipboard grab");
+
+    xbench_measure_start(xb);
+    send_clipboard(xb, VD_AGENT_CLIPBOARD_REQUEST, NULL, 0);
+    xbench_wait(xb, is_done, "the clipboard data");
+}
+
+static void run_file_xfer(struct xbench *xb)
+{
+    VDAgentFileXferDataMessage data = { .id = 1 };
+    VDAgentFileXferStartMessage start = { 1 };
+    char keyfile[128], path[PATH_MAX];
+    uint32_t pos;
+
+    xbench_measure_start(xb);
+    snprintf(keyfile, sizeof(keyfile),
+             "[vdagent-file-xfer]\nname=memory-bench\nsize=%u\n", run.size);
+    run.file_xfer_status = -1;
+    port_write(xb, VD_AGENT_FILE_XFER_START, &start, sizeof(start),
+               keyfile, strlen(keyfile) + 1);
+    xbench_wait(xb, file_xfer_has_status, "the file transfer to start");
+    if (run.file_xfer_status != VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        fail("the agent refused the file transfer");
+
+    run.file_xfer_status = -1;
+    for (pos = 0; pos < run.size; pos += data.size) {
+        data.size = run.size - pos;
+        if (data.size > FILE_XFER_CHUNK_SIZE)
+            data.size = FILE_XFER_CHUNK_SIZE;
+        port_write(xb, VD_AGENT_FILE_XFER_DATA, &data, sizeof(data),
+                   run.payload + pos, data.size);
+    }
+    xbench_wait(xb, file_xfer_has_status, "the file transfer to complete");
+    if (run.file_xfer_status != VD_AGENT_FILE_XFER_STATUS_SUCCESS)
+        fail("the file transfer failed with status %d",
+             run.file_xfer_status);
+
+    snprintf(path, sizeof(path), "%s/memory-bench", xbench_dir(xb));
+    unlink(path);
+}
+
+static const struct workload workloads[] = {
+    /* The daemon reassembles the message from the virtio port and queues
+       a copy for the agent, which reads it in full and keeps a copy for
+       further requests, the INCR send uses that copy */
+    { "clipboard-client-to-guest", run_client_to_guest, 2, 2 },
+    /* The agent collects the INCR data in a buffer and queues a copy for
+       the daemon, which reads it in full and queues it for the port */
+    { "clipboard-guest-to-client", run_guest_to_client, 2, 2 },
+    /* Streamed in small messages, but nothing stops the daemon from
+       queueing all of the file when the client outruns the agent */
+    { "file-xfer", run_file_xfer, 1, 0 },
+};
+
+/* ---------- Measuring ---------- */
+
+static double report_buffers(const char *metrics, const char *process,
+                             const char * const buffers[], size_t n)
+{
+    long long peak, total = 0;
+    char name[64];
+    size_t i;
+
+    printf("{");
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s_peak", buffers[i]);
+        peak = xbench_metric(metrics, name, process);
+        if (peak == -1)
+            fail("%s has no %s metric", process, name);
+        printf("%s\"%s\": %lld", i ? ", " : "", buffers[i], peak);
+        total += peak;
+    }
+    printf("}");
+    return (double)total / run.size;
+}
+
+static int check(const char *what, double copies, double limit)
+{
+    if (copies <= limit)
+        return 0;
+    fprintf(stderr, "memory-bench: %s holds %.2f copies per byte, "
+            "more than %.2f\n", what, copies, limit);
+    return 1;
+}
+
+static int run_workload(struct xbench *xb, const char *daemon,
+                        const struct workload *workload, uint32_t size)
+{
+    struct xbench_usage usage;
+    double t, daemon_rss, agent_rss, daemon_tracked, agent_tracked;
+    char *metrics;
+    int failed = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.size = size;
+    run.file_xfer_status = -1;
+    run.payload = malloc(size);
+    if (!run.payload)
+        fail("out of memory");
+    memset(run.payload, 'x', size);
+    port.in_len = port.message_len = 0;
+
+    xbench_start_daemon(xb, daemon);
+    xbench_start_agent(xb);
+    send_capabilities(xb);
+    xbench_wait(xb, caps_are_done, "the capabilities exchange");
+
+    /* The workloads call xbench_measure_start once they are set up */
+    t = xbench_now();
+    workload->run(xb);
+    t = xbench_now() - t;
+    xbench_measure_end(xb, &usage);
+    metrics = xbench_daemon_metrics(xb);
+
+    printf("{\"bench\": \"memory\", \"workload\": \"%s\", \"size\": %u, "
+           "\"seconds\": %.3f, ", workload->name, size, t);
+    printf("\"daemon_buffer_peaks\": ");
+    daemon_tracked = report_buffers(metrics, "spice-vdagentd",
+                                    daemon_buffers,
+                                    sizeof(daemon_buffers) /
+                                    sizeof(daemon_buffers[0]));
+    printf(", \"agent_buffer_peaks\": ");
+    agent_tracked = report_buffers(metrics, "spice-vdagent", agent_buffers,
+                                   sizeof(agent_buffers) /
+                                   sizeof(agent_buffers[0]));
+    free(metrics);
+
+    daemon_rss = usage.daemon_hwm_growth_kb * 1024.0 / size;
+    agent_rss = usage.hwm_growth_kb * 1024.0 / size;
+    printf(", \"daemon_hwm_kb\": %ld, \"agent_hwm_kb\": %ld, "
+           "\"daemon_copies\": %.2f, \"agent_copies\": %.2f, "
+           "\"daemon_tracked_copies\": %.2f, \"agent_tracked_copies\": %.2f, "
+           "\"expected_daemon_copies\": %.0f, "
+           "\"expected_agent_copies\": %.0f}\n",
+           usage.daemon_hwm_kb, usage.hwm_kb, daemon_rss, agent_rss,
+           daemon_tracked, agent_tracked, workload->daemon_copies,
+           workload->agent_copies);
+    fflush(stdout);
+
+    failed |= check("spice-vdagentd's resident set", daemon_rss,
+                    workload->daemon_copies + RSS_SLACK);
+    failed |= check("spice-vdagent's resident set", agent_rss,
+                    workload->agent_copies + RSS_SLACK);
+    failed |= check("spice-vdagentd's buffers", daemon_tracked,
+                    workload->daemon_copies + TRACKED_SLACK);
+    failed |= check("spice-vdagent's buffers", agent_tracked,
+                    workload->agent_copies + TRACKED_SLACK);
+
+    /* Don't leave the next agent a selection to pick up */
+    if (XGetSelectionOwner(xb->display, atoms.clipboard) == owner_window)
+        XSetSelectionOwner(xb->display, atoms.clipboard, None, CurrentTime);
+    xbench_stop_agent(xb);
+    xbench_stop_daemon(xb);
+    free(run.payload);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *agent = "src/spice-vdagent", *daemon = "src/spice-vdagentd";
+    const char *only_workload = NULL;
+    const uint32_t *run_sizes = sizes;
+    size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    int c, verbose = 0, report_only = 0, failed = 0;
+    struct xbench *xb;
+    uint32_t size;
+    size_t w, s;
+
+    while ((c = getopt(argc, argv, "a:d:w:s:Rvh")) != -1) {
+        switch (c) {
+        case 'a':
+            agent = optarg;
+            break;
+        case 'd':
+            daemon = optarg;
+            break;
+        case 'w':
+            only_workload = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            run_sizes = &size;
+            n_sizes = 1;
+            break;
+        case 'R':
+            report_only = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a spice-vdagent] [-d spice-vdagentd] "
+                    "[-w workload] [-s size] [-R] [-v]\n"
+                    "  -R  only report, don't fail when the copies grow\n"
+                    "  -v  show the daemon's, the agent's and Xvfb's "
+                    "output\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    /* The copies per byte of small payloads are all overhead */
+    if (run_sizes == &size && size < 1024 * 1024) {
+        fprintf(stderr, "size must be at least 1 MiB\n");
+        return 1;
+    }
+
+    xb = xbench_create(XBENCH_XVFB, agent, verbose, 0);
+    if (!xb) {
+        xbench_print_skipped("memory", "Xvfb not found");
+        return 0;
+    }
+    xb->x_event = x_event;
+    xb->port_read = port_read;
+
+    atoms.clipboard = XInternAtom(xb->display, "CLIPBOARD", False);
+    atoms.targets = XInternAtom(xb->display, "TARGETS", False);
+    atoms.utf8_string = XInternAtom(xb->display, "UTF8_STRING", False);
+    atoms.incr = XInternAtom(xb->display, "INCR", False);
+    atoms.property = XInternAtom(xb->display, "XBENCH_SELECTION", False);
+
+    owner_window = XCreateSimpleWindow(xb->display, xb->root,
+                                       0, 0, 1, 1, 0, 0, 0);
+    requestor_window = XCreateSimpleWindow(xb->display, xb->root,
+                                           0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(xb->display, requestor_window, PropertyChangeMask);
+
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if (only_workload && strcmp(only_workload, workloads[w].name))
+            continue;
+        for (s = 0; s < n_sizes; s++)
+            failed |= run_workload(xb, daemon, &workloads[w], run_sizes[s]);
+    }
+
+    xbench_destroy(xb);
+    return failed && !report_only;
+}
@@ -0,0 +1,389 @@
+/*  randr-bench.c spice-vdagent monitor config benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replays sequences of monitor configs, like the client sends them when
+   its windows get resized, enabled or disabled, or moved around, to
+   spice-vdagent running against an X server with RandR (see xbench.h).
+
+   For each config the wall time till the agent reports the resulting guest
+   xorg resolution back is measured. Also reported per config are the X
+   requests and round-trips of the agent, the RandR and ConfigureNotify
+   events which the X server sends to the other clients, and the guest xorg
+   resolution messages the agent sends. The results are written as JSON
+   lines.
+
+   Xvfb only has a single RandR output, to benchmark more monitors use Xorg
+   with the dummy driver instead (-X dummy). */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+#include <spice/vd_agent.h>
+
+#include "vdagentd-proto.h"
+#include "xbench.h"
+
+#define BASE_WIDTH 1024
+#define BASE_HEIGHT 768
+#define MAX_MONITORS 16
+
+enum sequence {
+    RESIZE_STORM,
+    ENABLE_DISABLE,
+    REPOSITION,
+};
+
+static const char * const sequence_names[] = {
+    "resize-storm", "enable-disable", "reposition"
+};
+
+static const uint32_t monitor_counts[] = { 1, 2, 4, 8, 16 };
+
+struct run {
+    uint32_t configs;
+    uint32_t applied;
+    int got_resolution;
+    int got_metrics;
+    double started;
+    double *latency;
+    unsigned long resolutions;
+    unsigned long screen_events;
+    unsigned long crtc_events;
+    unsigned long output_events;
+    unsigned long configure_events;
+};
+
+static int randr_event_base;
+static int outputs;
+
+/* Config i of a sequence, consecutive configs always differ:
+   resize-storm: all monitors shrink a bit with each config, like while the
+   client's windows are being resized, and then jump back to full size.
+   enable-disable: every other config only has the first monitor enabled.
+   reposition: the monitors swap places, their order rotates by one. */
+static size_t build_config(VDAgentMonitorsConfig *conf, enum sequence sequence,
+                           uint32_t monitors, uint32_t i)
+{
+    uint32_t m, enabled = monitors;
+    uint32_t width = BASE_WIDTH, height = BASE_HEIGHT;
+
+    switch (sequence) {
+    case RESIZE_STORM:
+        width -= 8 * (i % 32);
+        height -= 6 * (i % 32);
+        break;
+    case ENABLE_DISABLE:
+        if (i % 2)
+            enabled = 1;
+        break;
+    case REPOSITION:
+        break;
+    }
+
+    conf->num_of_monitors = monitors;
+    conf->flags = 0;
+    for (m = 0; m < monitors; m++) {
+        VDAgentMonConfig *mon = &conf->monitors[m];
+        uint32_t pos = m;
+
+        if (sequence == REPOSITION)
+            pos = (m + i) % monitors;
+        mon->width = m < enabled ? width : 0;
+        mon->height = m < enabled ? height : 0;
+        mon->depth = 32;
+        mon->x = pos * width;
+        mon->y = 0;
+    }
+
+    return sizeof(*conf) + monitors * sizeof(VDAgentMonConfig);
+}
+
+static void x_event(struct xbench *xb, XEvent *event)
+{
+    struct run *run = xb->priv;
+
+    if (!run)
+        return;
+
+    if (event->type == ConfigureNotify) {
+        if (event->xconfigure.window == xb->root)
+            run->configure_events++;
+    } else if (event->type == randr_event_base + RRScreenChangeNotify) {
+        run->screen_events++;
+    } else if (event->type == randr_event_base + RRNotify) {
+        switch (((XRRNotifyEvent *)event)->subtype) {
+        case RRNotify_CrtcChange:
+            run->crtc_events++;
+            break;
+        case RRNotify_OutputChange:
+            run->output_events++;
+            break;
+        }
+    }
+}
+
+static void agent_read(struct xbench *xb, struct udscs_message_header *header,
+                       uint8_t *data)
+{
+    struct run *run = xb->priv;
+
+    if (!run)
+        return;
+
+    switch (header->type) {
+    case VDAGENTD_GUEST_XORG_RESOLUTION:
+        /* Sent once the config has been applied, it may get sent again
+           for the RandR events caused by applying it */
+        if (!run->got_resolution && run->applied < run->configs)
+            run->latency[run->applied] = xbench_now() - run->started;
+        run->got_resolution = 1;
+        run->resolutions++;
+        break;
+    case VDAGENTD_METRICS:
+        run->got_metrics = 1;
+        break;
+    }
+}
+
+static int config_is_done(struct xbench *xb)
+{
+    struct run *run = xb->priv;
+
+    return run->got_resolution && run->got_metrics;
+}
+
+/* The agent handles the metrics request after it is done with the config,
+   including the events caused by it, so all messages about the config have
+   been received once the reply is in. A round-trip of our own then gets
+   all the events the X server sent us for it. */
+static void apply_config(struct xbench *xb, struct run *run,
+                         VDAgentMonitorsConfig *conf, size_t size)
+{
+    XEvent event;
+
+    run->got_resolution = 0;
+    run->got_metrics = 0;
+    run->started = xbench_now();
+    udscs_write(xb->agent, VDAGENTD_MONITORS_CONFIG, 0, 0,
+                (uint8_t *)conf, size);
+    udscs_write(xb->agent, VDAGENTD_METRICS, 0, 0, NULL, 0);
+    xbench_wait(xb, config_is_done, "the monitor config to be applied");
+
+    XSync(xb->display, False);
+    while (XPending(xb->display)) {
+        XNextEvent(xb->display, &event);
+        x_event(xb, &event);
+    }
+}
+
+static void per_config(const char *name, double count, uint32_t configs)
+{
+    if (count < 0)
+        printf("\"%s\": null, ", name);
+    else
+        printf("\"%s\": %.2f, ", name, count / configs);
+}
+
+static void report(const char *server, enum sequence sequence,
+                   uint32_t monitors, struct run *run, double t,
+                   struct xbench_usage *usage)
+{
+    uint32_t n = run->configs;
+    double p50 = xbench_percentile(run->latency, n, 50);
+    double p99 = xbench_percentile(run->latency, n, 99);
+
+    printf("{\"bench\": \"randr\", \"server\": \"%s\", \"sequence\": \"%s\", "
+           "\"monitors\": %u, \"configs\": %u, \"seconds\": %.6f, "
+           "\"configs_per_sec\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+           "\"max_ms\": %.3f, ",
+           server, sequence_names[sequence], monitors, n, t, n / t,
+           p50 * 1e3, p99 * 1e3, run->latency[n - 1] * 1e3);
+    per_config("x_requests_per_config", usage->x_requests, n);
+    per_config("x_roundtrips_per_config", usage->x_replies, n);
+    per_config("screen_change_events_per_config", run->screen_events, n);
+    per_config("crtc_change_events_per_config", run->crtc_events, n);
+    per_config("output_change_events_per_config", run->output_events, n);
+    per_config("configure_events_per_config", run->configure_events, n);
+    per_config("xorg_resolutions_per_config", run->resolutions, n);
+    printf("\"agent_cpu_ms_per_config\": %.3f, \"agent_rss_kb\": %ld, "
+           "\"agent_hwm_kb\": %ld}\n",
+           usage->cpu * 1e3 / n, usage->rss_kb, usage->hwm_kb);
+    fflush(stdout);
+}
+
+static void run_bench(struct xbench *xb, const char *server,
+                      enum sequence sequence, uint32_t monitors,
+                      uint32_t configs)
+{
+    uint8_t buf[sizeof(VDAgentMonitorsConfig) +
+                MAX_MONITORS * sizeof(VDAgentMonConfig)];
+    VDAgentMonitorsConfig *conf = (VDAgentMonitorsConfig *)buf;
+    struct xbench_usage usage;
+    struct run run;
+    char reason[128];
+    uint32_t i;
+    size_t size;
+    double t;
+
+    if (monitors > (uint32_t)outputs) {
+        snprintf(reason, sizeof(reason), "%s with %u monitors, the X server "
+                 "only has %d RandR outputs", sequence_names[sequence],
+                 monitors, outputs);
+        xbench_print_skipped("randr", reason);
+        return;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.configs = configs;
+    run.latency = calloc(configs, sizeof(double));
+    if (!run.latency) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    xb->priv = &run;
+    xbench_start_agent(xb);
+
+    /* Start from the second config of the sequence, so that the first one
+       measured is a change like all others */
+    size = build_config(conf, sequence, monitors, 1);
+    apply_config(xb, &run, conf, size);
+    run.resolutions = 0;
+    run.screen_events = run.crtc_events = run.output_events = 0;
+    run.configure_events = 0;
+
+    xbench_measure_start(xb);
+    t = xbench_now();
+    for (i = 0; i < configs; i++) {
+        size = build_config(conf, sequence, monitors, i);
+        apply_config(xb, &run, conf, size);
+        run.applied++;
+    }
+    t = xbench_now() - t;
+    xbench_measure_end(xb, &usage);
+    xbench_stop_agent(xb);
+    xb->priv = NULL;
+
+    report(server, sequence, monitors, &run, t, &usage);
+    free(run.latency);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *agent = "src/spice-vdagent", *server = "xvfb";
+    const char *only_sequence = NULL;
+    const uint32_t *run_monitors = monitor_counts;
+    size_t n_monitors = sizeof(monitor_counts) / sizeof(monitor_counts[0]);
+    uint32_t monitors, configs = 64;
+    int c, i, major, minor, verbose = 0, record = 1;
+    XRRScreenResources *res;
+    struct xbench *xb;
+    size_t s, m;
+
+    while ((c = getopt(argc, argv, "a:X:s:m:c:nvh")) != -1) {
+        switch (c) {
+        case 'a':
+            agent = optarg;
+            break;
+        case 'X':
+            server = optarg;
+            break;
+        case 's':
+            only_sequence = optarg;
+            break;
+        case 'm':
+            monitors = strtoul(optarg, NULL, 0);
+            run_monitors = &monitors;
+            n_monitors = 1;
+            break;
+        case 'c':
+            configs = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            record = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a spice-vdagent] [-X xvfb|dummy] "
+                    "[-s resize-storm|enable-disable|reposition] "
+                    "[-m monitors] [-c configs] [-n] [-v]\n"
+                    "  -X  X server to use, dummy is Xorg with the dummy "
+                    "driver, which usually\n"
+                    "      needs root\n"
+                    "  -n  don't count the agent's X requests\n"
+                    "  -v  show the agent's and the X server's output\n",
+                    argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if ((run_monitors == &monitors &&
+         (!monitors || monitors > MAX_MONITORS)) || !configs ||
+            (strcmp(server, "xvfb") && strcmp(server, "dummy"))) {
+        fprintf(stderr, "monitors must be between 1 and %d, configs at "
+                "least 1 and the X server xvfb or dummy\n", MAX_MONITORS);
+        return 1;
+    }
+
+    xb = xbench_create(strcmp(server, "dummy") ? XBENCH_XVFB : XBENCH_DUMMY,
+                       agent, verbose, record);
+    if (!xb) {
+        xbench_print_skipped("randr", strcmp(server, "dummy") ?
+                             "Xvfb not found" : "Xorg not found");
+        return 0;
+    }
+    xb->agent_read = agent_read;
+    xb->x_event = x_event;
+
+    if (!XRRQueryExtension(xb->display, &randr_event_base, &i) ||
+            !XRRQueryVersion(xb->display, &major, &minor) ||
+            major < 1 || (major == 1 && minor < 3)) {
+        xbench_print_skipped("randr", "the X server has no RandR 1.3");
+        xbench_destroy(xb);
+        return 0;
+    }
+    XRRSelectInput(xb->display, xb->root, RRScreenChangeNotifyMask |
+                   RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+    XSelectInput(xb->display, xb->root, StructureNotifyMask);
+    res = XRRGetScreenResources(xb->display, xb->root);
+    outputs = res ? res->noutput : 0;
+    if (res)
+        XRRFreeScreenResources(res);
+
+    for (s = 0; s < sizeof(sequence_names) / sizeof(sequence_names[0]); s++) {
+        if (only_sequence && strcmp(only_sequence, sequence_names[s]))
+            continue;
+        for (m = 0; m < n_monitors; m++) {
+            /* With a single monitor there is nothing to disable or move */
+            if (s != RESIZE_STORM && run_monitors[m] == 1)
+                continue;
+            run_bench(xb, server, s, run_monitors[m], configs);
+        }
+    }
+
+    xbench_destroy(xb);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*  reconnect-bench.c agent to vdagentd reconnect latency benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Restarts a stand-in for vdagentd over and over, with a random downtime,
+   while an agent thread reconnects to it the way spice-vdagent does, and
+   measures the time from the daemon listening again until the agent is
+   connected. The agent either polls once per second, as spice-vdagent
+   used to, or waits with vdagent_reconnect_wait().
+
+   In the "restart" scenario the daemon removes its socket when it goes,
+   in the "stale" one it leaves it behind (it crashed), so that connecting
+   gets refused until the new daemon replaces it. The results are written
+   as JSON lines. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "udscs.h"
+#include "reconnect.h"
+
+struct bench {
+    const char *mode;
+    const char *scenario;
+    uint32_t iterations;
+    uint32_t go;           /* iterations the agent may start, under lock */
+    double *latency;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct bench *bench;
+static char socket_path[108];
+static int max_downtime_ms = 500;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What a crashed daemon leaves behind: a socket nobody listens on */
+static void stale_socket(void)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 ||
+            bind(fd, (struct sockaddr *)&address, sizeof(address))) {
+        perror("creating stale socket");
+        exit(1);
+    }
+    close(fd);
+}
+
+/* ---------- Agent ---------- */
+
+static void *agent_thread(void *priv)
+{
+    struct udscs_connection *conn;
+    unsigned int failures;
+    uint32_t i;
+
+    for (i = 0; i < bench->iterations; i++) {
+        pthread_mutex_lock(&bench->lock);
+        while (bench->go <= i)
+            pthread_cond_wait(&bench->cond, &bench->lock);
+        pthread_mutex_unlock(&bench->lock);
+
+        /* Like client_setup() */
+        failures = 0;
+        while (!(conn = udscs_connect(socket_path, NULL, NULL, NULL, 0, 0))) {
+            if (!strcmp(bench->mode, "poll"))
+                sleep(1);
+            else
+                vdagent_reconnect_wait(socket_path, ++failures);
+        }
+        udscs_destroy_connection(&conn);
+    }
+    return NULL;
+}
+
+/* ---------- Daemon ---------- */
+
+static int connected;
+
+static void daemon_connect(struct udscs_connection *conn)
+{
+    connected = 1;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+static void report(void)
+{
+    uint32_t n = bench->iterations;
+    double total = 0;
+    uint32_t i;
+
+    qsort(bench->latency, n, sizeof(double), compare_doubles);
+    for (i = 0; i < n; i++)
+        total += bench->latency[i];
+    printf("{\"bench\": \"reconnect\", \"mode\": \"%s\", "
+           "\"scenario\": \"%s\", \"iterations\": %u, "
+           "\"max_downtime_ms\": %d, \"mean_ms\": %.2f, \"p50_ms\": %.2f, "
+           "\"max_ms\": %.2f}\n",
+           bench->mode, bench->scenario, n, max_downtime_ms,
+           total / n * 1e3, bench->latency[n / 2] * 1e3,
+           bench->latency[n - 1] * 1e3);
+    fflush(stdout);
+}
+
+static void run(const char *mode, const char *scenario, uint32_t iterations)
+{
+    struct bench b;
+    pthread_t agent;
+    struct udscs_server *server;
+    int stale = !strcmp(scenario, "stale");
+    fd_set readfds, writefds;
+    double t;
+    uint32_t i;
+
+    memset(&b, 0, sizeof(b));
+    b.mode = mode;
+    b.scenario = scenario;
+    b.iterations = iterations;
+    b.latency = calloc(iterations, sizeof(double));
+    if (!b.latency) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    bench = &b;
+    srandom(1);
+
+    pthread_create(&agent, NULL, agent_thread, NULL);
+    for (i = 0; i < iterations; i++) {
+        /* The daemon is gone, the agent notices and starts reconnecting */
+        if (stale)
+            stale_socket();
+        pthread_mutex_lock(&b.lock);
+        b.go++;
+        pthread_cond_signal(&b.cond);
+        pthread_mutex_unlock(&b.lock);
+
+        usleep((random() % (max_downtime_ms + 1)) * 1000);
+
+        /* The new daemon is up, its init script removes a stale socket */
+        unlink(socket_path);
+        connected = 0;
+        server = udscs_create_server(socket_path, daemon_connect, NULL, NULL,
+                                     NULL, 0, 0);
+        if (!server) {
+            fprintf(stderr, "could not create %s\n", socket_path);
+            exit(1);
+        }
+        t = now();
+        while (!connected) {
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+            select(udscs_server_fill_fds(server, &readfds, &writefds),
+                   &readfds, &writefds, NULL, NULL);
+            udscs_server_handle_fds(server, &readfds, &writefds);
+        }
+        b.latency[i] = now() - t;
+        udscs_destroy_server(server);
+        unlink(socket_path);
+    }
+    pthread_join(agent, NULL);
+
+    report();
+
+    bench = NULL;
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    free(b.latency);
+}
+
+/* ---------- Main ---------- */
+
+int main(int argc, char *argv[])
+{
+    static const char *modes[] = { "poll", "inotify" };
+    static const char *scenarios[] = { "restart", "stale" };
+    char dir[] = "/tmp/reconnect-bench.XXXXXX";
+    const char *only_mode = NULL;
+    uint32_t iterations = 10;
+    size_t m, s;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:n:d:h")) != -1) {
+        switch (c) {
+        case 'm':
+            only_mode = optarg;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            max_downtime_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m poll|inotify] [-n iterations] "
+                    "[-d max-downtime-ms]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (!iterations || max_downtime_ms < 0) {
+        fprintf(stderr, "need at least 1 iteration, and a downtime >= 0\n");
+        return 1;
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/sock", dir);
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (only_mode && strcmp(only_mode, modes[m]))
+            continue;
+        for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+            run(modes[m], scenarios[s], iterations);
+    }
+
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,640 @@
+/*  transport-bench.c udscs and virtio-port framing benchmark
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Pushes messages through udscs (client -> server over a unix socket) and
+   through virtio-port (looped back by a stand-in for spice-server, which
+   re-chunks the data the way the server does towards the guest), for a
+   matrix of payload sizes, queue depths and reader/writer speeds.
+
+   Both transports use blocking sockets, so like in the real daemons the
+   two ends run concurrently: the udscs server runs in a thread of its own,
+   and so does the spice-server stand-in.
+
+   The transport code is linked with --wrap for its I/O and allocation
+   functions (see Makefile.am), so the syscalls and allocations it makes
+   per message can be reported. The results are written as JSON lines. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spice/vd_agent.h>
+
+#include "udscs.h"
+#include "virtio-port.h"
+
+/* ---------- Counting wrappers for the transport code ---------- */
+
+/* Per thread, only the threads running transport code get added up */
+static __thread unsigned long io_calls, alloc_calls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+    io_calls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    io_calls++;
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags)
+{
+    io_calls++;
+    return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+    io_calls++;
+    return __real_send(fd, buf, len, flags);
+}
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_calls++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_calls++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_calls++;
+    return __real_realloc(ptr, size);
+}
+
+/* ---------- Benchmark state ---------- */
+
+struct speed {
+    const char *name;
+    int reader_us; /* time the reader spends on each message */
+    int writer_us; /* time the writer spends before each message */
+};
+
+struct bench {
+    const char *transport;
+    uint32_t size;
+    uint32_t depth;
+    const struct speed *speed;
+    uint32_t messages;
+    uint32_t sent;
+    uint32_t received;     /* protected by lock */
+    uint8_t *payload;
+    double *sent_at;
+    double *latency;
+    unsigned long io_calls;
+    unsigned long alloc_calls;
+    unsigned long wakeups;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct bench *bench;
+static char socket_path[108];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Emulate a slow reader / writer, busy, so that this also holds the CPU */
+static void spend(int us)
+{
+    double end;
+
+    if (!us)
+        return;
+    end = now() + us / 1e6;
+    while (now() < end)
+        ;
+}
+
+static void count_thread(void)
+{
+    pthread_mutex_lock(&bench->lock);
+    bench->io_calls += io_calls;
+    bench->alloc_calls += alloc_calls;
+    pthread_mutex_unlock(&bench->lock);
+}
+
+static uint32_t get_received(void)
+{
+    uint32_t received;
+
+    pthread_mutex_lock(&bench->lock);
+    received = bench->received;
+    pthread_mutex_unlock(&bench->lock);
+    return received;
+}
+
+static void message_received(uint32_t seq)
+{
+    double t = now();
+
+    if (seq >= bench->messages) {
+        fprintf(stderr, "%s: received bogus message %u\n",
+                bench->transport, seq);
+        exit(1);
+    }
+    spend(bench->speed->reader_us);
+
+    pthread_mutex_lock(&bench->lock);
+    bench->latency[bench->received++] = t - bench->sent_at[seq];
+    pthread_cond_signal(&bench->cond);
+    pthread_mutex_unlock(&bench->lock);
+}
+
+/* Queue messages as long as there are less than depth in flight */
+static void queue_messages(void (*write_message)(void *priv, uint32_t seq),
+                           void *priv)
+{
+    uint32_t received = get_received();
+
+    while (bench->sent < bench->messages &&
+           bench->sent - received < bench->depth) {
+        spend(bench->speed->writer_us);
+        bench->sent_at[bench->sent] = now();
+        write_message(priv, bench->sent);
+        bench->sent++;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+static void report(double t)
+{
+    uint32_t n = bench->messages;
+
+    qsort(bench->latency, n, sizeof(double), compare_doubles);
+    printf("{\"bench\": \"transport\", \"transport\": \"%s\", "
+           "\"size\": %u, \"depth\": %u, \"speed\": \"%s\", "
+           "\"messages\": %u, \"seconds\": %.6f, \"msgs_per_sec\": %.1f, "
+           "\"mb_per_sec\": %.1f, \"syscalls_per_msg\": %.2f, "
+           "\"wakeups_per_msg\": %.2f, \"allocs_per_msg\": %.2f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f}\n",
+           bench->transport, bench->size, bench->depth, bench->speed->name,
+           n, t, n / t, (double)n * bench->size / t / 1e6,
+           (double)bench->io_calls / n, (double)bench->wakeups / n,
+           (double)bench->alloc_calls / n, bench->latency[n / 2] * 1e6,
+           bench->latency[n - 1 - n / 100] * 1e6);
+    fflush(stdout);
+}
+
+/* ---------- udscs ---------- */
+
+static void udscs_received(struct udscs_connection **connp,
+    struct udscs_message_header *header, uint8_t *data)
+{
+    message_received(header->arg1);
+}
+
+static void *udscs_reader(void *priv)
+{
+    struct udscs_server *server = priv;
+    fd_set readfds, writefds;
+    unsigned long wakeups = 0;
+    int nfds;
+
+    io_calls = alloc_calls = 0;
+    while (get_received() < bench->messages) {
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        nfds = udscs_server_fill_fds(server, &readfds, &writefds);
+        if (select(nfds, &readfds, &writefds, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(1);
+        }
+        wakeups++;
+        udscs_server_handle_fds(server, &readfds, &writefds);
+    }
+
+    count_thread();
+    pthread_mutex_lock(&bench->lock);
+    bench->wakeups += wakeups;
+    pthread_mutex_unlock(&bench->lock);
+    return NULL;
+}
+
+static void udscs_write_message(void *priv, uint32_t seq)
+{
+    udscs_write(priv, 0, seq, 0, bench->payload, bench->size);
+}
+
+static void run_udscs(void)
+{
+    struct udscs_server *server;
+    struct udscs_connection *client;
+    fd_set readfds, writefds;
+    pthread_t reader;
+    int nfds;
+    double t;
+
+    server = udscs_create_server(socket_path, NULL, udscs_received,
+                                 NULL, NULL, 0, 0);
+    client = udscs_connect(socket_path, NULL, NULL, NULL, 0, 0);
+    if (!server || !client) {
+        fprintf(stderr, "udscs: could not set up %s\n", socket_path);
+        exit(1);
+    }
+
+    io_calls = alloc_calls = 0;
+    t = now();
+    pthread_create(&reader, NULL, udscs_reader, server);
+    for (;;) {
+        queue_messages(udscs_write_message, client);
+
+        if (!udscs_get_queued_bytes(client)) {
+            if (bench->sent == bench->messages)
+                break;
+            /* Nothing to write until the reader catches up */
+            pthread_mutex_lock(&bench->lock);
+            while (bench->sent - bench->received >= bench->depth)
+                pthread_cond_wait(&bench->cond, &bench->lock);
+            pthread_mutex_unlock(&bench->lock);
+            continue;
+        }
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        nfds = udscs_client_fill_fds(client, &readfds, &writefds);
+        if (select(nfds, &readfds, &writefds, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(1);
+        }
+        bench->wakeups++;
+        udscs_client_handle_fds(&client, &readfds, &writefds);
+        if (!client) {
+            fprintf(stderr, "udscs: connection lost\n");
+            exit(1);
+        }
+    }
+    count_thread();
+    pthread_join(reader, NULL);
+    t = now() - t;
+
+    report(t);
+
+    udscs_destroy_connection(&client);
+    udscs_destroy_server(server);
+    unlink(socket_path);
+}
+
+/* ---------- virtio-port ---------- */
+
+/* Stand-in for spice-server: echoes what vdagentd writes to it back, split
+   into chunks of at most VD_AGENT_MAX_DATA_SIZE like the server does. Like
+   the server it never blocks, so it buffers whatever the port does not
+   read yet. */
+struct echo {
+    int fd;
+    VDIChunkHeader in;
+    uint32_t in_header_read;
+    uint32_t in_data_left;
+    uint8_t *out;
+    size_t out_size;
+    size_t out_pos;
+    size_t out_alloc;
+};
+
+static void echo_append(struct echo *echo, const uint8_t *data, size_t size)
+{
+    if (echo->out_size + size > echo->out_alloc) {
+        echo->out_alloc = (echo->out_size + size) * 2;
+        echo->out = realloc(echo->out, echo->out_alloc);
+        if (!echo->out) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(echo->out + echo->out_size, data, size);
+    echo->out_size += size;
+}
+
+static void echo_input(struct echo *echo, const uint8_t *data, size_t size)
+{
+    VDIChunkHeader out_header;
+    size_t len;
+
+    while (size) {
+        if (echo->in_header_read < sizeof(echo->in)) {
+            len = sizeof(echo->in) - echo->in_header_read;
+            if (len > size)
+                len = size;
+            memcpy((uint8_t *)&echo->in + echo->in_header_read, data, len);
+            echo->in_header_read += len;
+            if (echo->in_header_read == sizeof(echo->in))
+                echo->in_data_left = echo->in.size;
+        } else {
+            len = echo->in_data_left;
+            if (len > size)
+                len = size;
+            if (len > VD_AGENT_MAX_DATA_SIZE)
+                len = VD_AGENT_MAX_DATA_SIZE;
+            out_header.port = echo->in.port;
+            out_header.size = len;
+            echo_append(echo, (uint8_t *)&out_header, sizeof(out_header));
+            echo_append(echo, data, len);
+            echo->in_data_left -= len;
+        }
+        if (echo->in_header_read == sizeof(echo->in) && !echo->in_data_left)
+            echo->in_header_read = 0;
+        data += len;
+        size -= len;
+    }
+}
+
+static void *echo_thread(void *priv)
+{
+    struct echo *echo = priv;
+    uint8_t buf[65536];
+    fd_set readfds, writefds;
+    ssize_t n;
+
+    fcntl(echo->fd, F_SETFL, fcntl(echo->fd, F_GETFL) | O_NONBLOCK);
+    for (;;) {
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(echo->fd, &readfds);
+        if (echo->out_pos < echo->out_size)
+            FD_SET(echo->fd, &writefds);
+        if (select(echo->fd + 1, &readfds, &writefds, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(1);
+        }
+
+        if (FD_ISSET(echo->fd, &readfds)) {
+            n = read(echo->fd, buf, sizeof(buf));
+            if (n == 0)
+                break; /* the port got closed, done */
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("echo read");
+                exit(1);
+            }
+            if (n > 0)
+                echo_input(echo, buf, n);
+        }
+
+        if (FD_ISSET(echo->fd, &writefds)) {
+            n = write(echo->fd, echo->out + echo->out_pos,
+                      echo->out_size - echo->out_pos);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("echo write");
+                exit(1);
+            }
+            if (n > 0)
+                echo->out_pos += n;
+            if (echo->out_pos == echo->out_size)
+                echo->out_pos = echo->out_size = 0;
+        }
+    }
+
+    free(echo->out);
+    close(echo->fd);
+    return NULL;
+}
+
+static int virtio_received(struct vdagent_virtio_port *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    message_received(message_header->opaque);
+    return 0;
+}
+
+static void virtio_write_message(void *priv, uint32_t seq)
+{
+    vdagent_virtio_port_write(priv, VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, seq,
+                              bench->payload, bench->size);
+}
+
+static void run_virtio(void)
+{
+    struct vdagent_virtio_port *vport;
+    struct sockaddr_un address;
+    struct echo echo;
+    fd_set readfds, writefds;
+    pthread_t echoer;
+    int listen_fd, nfds;
+    double t;
+
+    memset(&echo, 0, sizeof(echo));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+            bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+            listen(listen_fd, 1)) {
+        perror("creating virtio stand-in socket");
+        exit(1);
+    }
+    vport = vdagent_virtio_port_create(socket_path, virtio_received, NULL);
+    echo.fd = accept(listen_fd, NULL, NULL);
+    if (!vport || echo.fd == -1) {
+        fprintf(stderr, "virtio: could not set up %s\n", socket_path);
+        exit(1);
+    }
+    pthread_create(&echoer, NULL, echo_thread, &echo);
+
+    /* Reading and writing both happen in this thread, like in vdagentd */
+    io_calls = alloc_calls = 0;
+    t = now();
+    while (get_received() < bench->messages) {
+        queue_messages(virtio_write_message, vport);
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        nfds = vdagent_virtio_port_fill_fds(vport, &readfds, &writefds);
+        if (select(nfds, &readfds, &writefds, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(1);
+        }
+        bench->wakeups++;
+        vdagent_virtio_port_handle_fds(&vport, &readfds, &writefds);
+        if (!vport) {
+            fprintf(stderr, "virtio: port closed\n");
+            exit(1);
+        }
+    }
+    count_thread();
+    t = now() - t;
+
+    report(t);
+
+    vdagent_virtio_port_destroy(&vport);
+    pthread_join(echoer, NULL);
+    close(listen_fd);
+    unlink(socket_path);
+}
+
+/* ---------- Main ---------- */
+
+static const uint32_t sizes[] = {
+    16, 256, 4096, 64 * 1024, 1024 * 1024, 64 * 1024 * 1024
+};
+static const uint32_t depths[] = { 1, 16, 256 };
+static const struct speed speeds[] = {
+    { "equal", 0, 0 },
+    { "slow-reader", 20, 0 },
+    { "slow-writer", 0, 20 },
+};
+
+static void run(const char *transport, uint32_t size, uint32_t depth,
+                const struct speed *speed, uint64_t run_bytes)
+{
+    struct bench b;
+    uint64_t messages = run_bytes / size;
+
+    if (messages < 2)
+        messages = 2;
+    if (messages > 100000)
+        messages = 100000;
+
+    memset(&b, 0, sizeof(b));
+    b.transport = transport;
+    b.size = size;
+    b.depth = depth;
+    b.speed = speed;
+    b.messages = messages;
+    b.payload = malloc(size);
+    b.sent_at = calloc(messages, sizeof(double));
+    b.latency = calloc(messages, sizeof(double));
+    if (!b.payload || !b.sent_at || !b.latency) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(b.payload, 'x', size);
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    bench = &b;
+
+    if (!strcmp(transport, "udscs"))
+        run_udscs();
+    else
+        run_virtio();
+
+    bench = NULL;
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    free(b.latency);
+    free(b.sent_at);
+    free(b.payload);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/transport-bench.XXXXXX";
+    const char *transports[] = { "udscs", "virtio" };
+    const char *only_transport = NULL;
+    const uint32_t *run_sizes = sizes, *run_depths = depths;
+    size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t n_depths = sizeof(depths) / sizeof(depths[0]);
+    uint64_t run_bytes = 64 * 1024 * 1024;
+    uint32_t size, depth;
+    size_t t, s, d, r;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:s:d:b:h")) != -1) {
+        switch (c) {
+        case 't':
+            only_transport = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            run_sizes = &size;
+            n_sizes = 1;
+            break;
+        case 'd':
+            depth = strtoul(optarg, NULL, 0);
+            run_depths = &depth;
+            n_depths = 1;
+            break;
+        case 'b':
+            run_bytes = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t udscs|virtio] [-s size] "
+                    "[-d depth] [-b bytes-per-run]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if ((run_sizes == &size && !size) || (run_depths == &depth && !depth)) {
+        fprintf(stderr, "size and depth must be at least 1\n");
+        return 1;
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s/sock", dir);
+
+    for (t = 0; t < sizeof(transports) / sizeof(transports[0]); t++) {
+        if (only_transport && strcmp(only_transport, transports[t]))
+            continue;
+        for (s = 0; s < n_sizes; s++)
+            for (d = 0; d < n_depths; d++)
+                for (r = 0; r < sizeof(speeds) / sizeof(speeds[0]); r++)
+                    run(transports[t], run_sizes[s], run_depths[d],
+                        &speeds[r], run_bytes);
+    }
+
+    unlink(socket_path);
+    rmdir(dir);
+    return 0;
+}
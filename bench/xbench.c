@@ -0,0 +1,859 @@
+/*  xbench.c spice-vdagent X11 benchmark helpers
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <X11/Xatom.h>
+#include <X11/Xproto.h>
+#include <X11/extensions/record.h>
+
+#include "vdagentd-proto.h"
+#include "vdagentd-proto-strings.h"
+#include "xbench.h"
+
+#define WAIT_TIMEOUT 60
+
+struct xbench_priv {
+    struct xbench pub;
+    const char *agent_path;
+    int verbose;
+    pid_t x_server_pid;
+    pid_t agent_pid;
+    pid_t daemon_pid;
+    char display_name[40];
+    char dir[32];
+    char socket_path[64];
+    struct udscs_server *server;
+    /* The real daemon, its sockets and its virtio port */
+    char daemon_socket_path[64];
+    char metrics_path[64];
+    char port_path[64];
+    int port_listen;
+    /* Counting the agent's requests, through the RECORD extension */
+    Display *record_display;
+    XRecordContext record_context;
+    long x_requests;
+    long x_replies;
+    struct xbench_usage start;
+};
+
+/* udscs has no user data for the server callbacks, there is only one */
+static struct xbench_priv *xbench;
+
+double xbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+double xbench_percentile(double *latency, uint32_t n, int percentile)
+{
+    qsort(latency, n, sizeof(double), compare_doubles);
+    return latency[(n - 1) * percentile / 100];
+}
+
+void xbench_print_skipped(const char *bench, const char *reason)
+{
+    printf("{\"bench\": \"%s\", \"skipped\": \"%s\"}\n", bench, reason);
+    fflush(stdout);
+}
+
+/* ---------- Child processes ---------- */
+
+static void kill_child(pid_t *pid)
+{
+    int i, status;
+
+    if (*pid <= 0)
+        return;
+
+    kill(*pid, SIGTERM);
+    for (i = 0; i < 100; i++) {
+        if (waitpid(*pid, &status, WNOHANG) != 0)
+            break;
+        usleep(20000);
+    }
+    if (i == 100) {
+        kill(*pid, SIGKILL);
+        waitpid(*pid, &status, 0);
+    }
+    *pid = 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* Also called on exit, so that failing benchmarks don't leave an X server
+   behind */
+static void cleanup(void)
+{
+    if (!xbench)
+        return;
+
+    kill_child(&xbench->agent_pid);
+    kill_child(&xbench->daemon_pid);
+    kill_child(&xbench->x_server_pid);
+    /* Also the files saved by file transfers */
+    if (xbench->dir[0])
+        nftw(xbench->dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void quiet_stderr(void)
+{
+    int fd = open("/dev/null", O_WRONLY);
+
+    if (fd != -1) {
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+}
+
+static void write_dummy_config(struct xbench_priv *xb, const char *path)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    /* Room for 16 monitors of 1024x768 side by side */
+    fprintf(f,
+            "Section \"ServerFlags\"\n"
+            "    Option \"AutoAddDevices\" \"false\"\n"
+            "    Option \"DontVTSwitch\" \"true\"\n"
+            "EndSection\n"
+            "Section \"Device\"\n"
+            "    Identifier \"dummy\"\n"
+            "    Driver \"dummy\"\n"
+            "    VideoRam 262144\n"
+            "EndSection\n"
+            "Section \"Screen\"\n"
+            "    Identifier \"screen\"\n"
+            "    Device \"dummy\"\n"
+            "    DefaultDepth 24\n"
+            "    SubSection \"Display\"\n"
+            "        Depth 24\n"
+            "        Virtual 16384 4096\n"
+            "    EndSubSection\n"
+            "EndSection\n");
+    fclose(f);
+}
+
+/* The X server picks a free display itself and writes its number to
+   displayfd */
+static int start_server(struct xbench_priv *xb, enum xbench_server server)
+{
+    char fd_str[16], buf[32], config[64] = "", log[64] = "";
+    int fds[2], status;
+    ssize_t n, len = 0;
+
+    if (server == XBENCH_DUMMY) {
+        snprintf(config, sizeof(config), "%s/xorg.conf", xb->dir);
+        snprintf(log, sizeof(log), "%s/Xorg.log", xb->dir);
+        write_dummy_config(xb, config);
+    }
+
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+
+    xb->x_server_pid = fork();
+    if (xb->x_server_pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (xb->x_server_pid == 0) {
+        close(fds[0]);
+        snprintf(fd_str, sizeof(fd_str), "%d", fds[1]);
+        if (!xb->verbose)
+            quiet_stderr();
+        if (server == XBENCH_DUMMY)
+            execlp("Xorg", "Xorg", "-displayfd", fd_str, "-nolisten", "tcp",
+                   "-noreset", "-novtswitch", "-sharevts", "-config", config,
+                   "-logfile", log, NULL);
+        else
+            execlp("Xvfb", "Xvfb", "-displayfd", fd_str, "-nolisten", "tcp",
+                   "-noreset", "-screen", "0", "1920x1080x24", NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    while (len < (ssize_t)sizeof(buf) - 1 &&
+           (n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        len += n;
+        if (buf[len - 1] == '\n')
+            break;
+    }
+    close(fds[0]);
+
+    if (len == 0 || buf[len - 1] != '\n') {
+        waitpid(xb->x_server_pid, &status, 0);
+        xb->x_server_pid = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+            return -1;
+        fprintf(stderr, "the X server failed to start, "
+                "use -v to see its output\n");
+        exit(1);
+    }
+    buf[len - 1] = 0;
+    snprintf(xb->display_name, sizeof(xb->display_name), ":%s", buf);
+    return 0;
+}
+
+/* Without a window manager the agent waits a second for one to show up
+   each time it starts, so pretend to be one */
+static void fake_wm(struct xbench_priv *xb)
+{
+    Display *display = xb->pub.display;
+    Atom check = XInternAtom(display, "_NET_SUPPORTING_WM_CHECK", False);
+    Window window;
+
+    window = XCreateSimpleWindow(display, xb->pub.root, 0, 0, 1, 1, 0, 0, 0);
+    XChangeProperty(display, xb->pub.root, check, XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&window, 1);
+    XChangeProperty(display, window, check, XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&window, 1);
+    XChangeProperty(display, window,
+                    XInternAtom(display, "_NET_WM_NAME", False),
+                    XInternAtom(display, "UTF8_STRING", False), 8,
+                    PropModeReplace, (unsigned char *)"xbench", 6);
+}
+
+/* ---------- Stub vdagentd ---------- */
+
+static void agent_connect(struct udscs_connection *conn)
+{
+    if (xbench->pub.agent) {
+        fprintf(stderr, "a second agent connected\n");
+        exit(1);
+    }
+    xbench->pub.agent = conn;
+}
+
+static void agent_read_complete(struct udscs_connection **connp,
+    struct udscs_message_header *header, uint8_t *data)
+{
+    if (header->type == VDAGENTD_GUEST_XORG_RESOLUTION)
+        xbench->pub.agent_ready = 1;
+    if (xbench->pub.agent_read)
+        xbench->pub.agent_read(&xbench->pub, header, data);
+}
+
+static void agent_disconnect(struct udscs_connection *conn)
+{
+    xbench->pub.agent = NULL;
+    xbench->pub.agent_ready = 0;
+}
+
+/* ---------- X request counting ---------- */
+
+static void record_intercept(XPointer closure, XRecordInterceptData *data)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)closure;
+
+    /* Without delivered events in the range, only replies and errors
+       come from the server */
+    if (data->category == XRecordFromClient)
+        xb->x_requests++;
+    else if (data->category == XRecordFromServer && data->data_len &&
+             data->data[0] == X_Reply)
+        xb->x_replies++;
+    XRecordFreeData(data);
+}
+
+/* The context only records the clients connecting after its creation,
+   so the agents, not the benchmark's own connections */
+static void start_recording(struct xbench_priv *xb)
+{
+    XRecordClientSpec clients = XRecordFutureClients;
+    XRecordRange *range;
+    int major, minor;
+
+    if (!XRecordQueryVersion(xb->pub.display, &major, &minor)) {
+        fprintf(stderr, "the X server has no RECORD extension, "
+                "not counting X requests\n");
+        return;
+    }
+
+    xb->record_display = XOpenDisplay(xb->display_name);
+    range = XRecordAllocRange();
+    if (!xb->record_display || !range) {
+        fprintf(stderr, "could not set up X request recording\n");
+        exit(1);
+    }
+    range->core_requests.first = 1;
+    range->core_requests.last = 127;
+    range->core_replies.first = 1;
+    range->core_replies.last = 127;
+    range->ext_requests.ext_major.first = 128;
+    range->ext_requests.ext_major.last = 255;
+    range->ext_requests.ext_minor.first = 0;
+    range->ext_requests.ext_minor.last = 65535;
+    range->ext_replies = range->ext_requests;
+
+    xb->record_context = XRecordCreateContext(xb->pub.display, 0, &clients, 1,
+                                              &range, 1);
+    XFree(range);
+    if (!xb->record_context ||
+            !XRecordEnableContextAsync(xb->record_display,
+                                       xb->record_context, record_intercept,
+                                       (XPointer)xb)) {
+        fprintf(stderr, "could not enable X request recording\n");
+        exit(1);
+    }
+    XSync(xb->pub.display, False);
+}
+
+/* The server flushes the recorded data before it replies to other
+   clients, so after a round-trip all of it is on its way to us */
+static void flush_recording(struct xbench_priv *xb)
+{
+    struct pollfd pfd;
+
+    if (!xb->record_display)
+        return;
+
+    XSync(xb->pub.display, False);
+    pfd.fd = ConnectionNumber(xb->record_display);
+    pfd.events = POLLIN;
+    do {
+        XRecordProcessReplies(xb->record_display);
+    } while (poll(&pfd, 1, 0) == 1);
+}
+
+/* ---------- Public API ---------- */
+
+struct xbench *xbench_create(enum xbench_server server, const char *agent,
+                             int verbose, int record)
+{
+    struct xbench_priv *xb;
+
+    xb = calloc(1, sizeof(*xb));
+    if (!xb) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    xb->agent_path = agent;
+    xb->verbose = verbose;
+    xb->pub.port = -1;
+    xb->port_listen = -1;
+    xbench = xb;
+    atexit(cleanup);
+    /* Don't die on writing to an agent which went away, report it */
+    signal(SIGPIPE, SIG_IGN);
+
+    strcpy(xb->dir, "/tmp/xbench.XXXXXX");
+    if (!mkdtemp(xb->dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    if (start_server(xb, server)) {
+        cleanup();
+        xbench = NULL;
+        free(xb);
+        return NULL;
+    }
+
+    xb->pub.display = XOpenDisplay(xb->display_name);
+    if (!xb->pub.display) {
+        fprintf(stderr, "could not open display %s\n", xb->display_name);
+        exit(1);
+    }
+    xb->pub.root = DefaultRootWindow(xb->pub.display);
+    fake_wm(xb);
+    if (record)
+        start_recording(xb);
+
+    snprintf(xb->socket_path, sizeof(xb->socket_path), "%s/sock", xb->dir);
+    xb->server = udscs_create_server(xb->socket_path, agent_connect,
+                                     agent_read_complete, agent_disconnect,
+                                     vdagentd_messages, VDAGENTD_NO_MESSAGES,
+                                     0);
+    if (!xb->server) {
+        fprintf(stderr, "could not create stub vdagentd socket\n");
+        exit(1);
+    }
+
+    return &xb->pub;
+}
+
+void xbench_destroy(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+
+    xbench_stop_agent(pub);
+    xbench_stop_daemon(pub);
+    udscs_destroy_server(xb->server);
+    if (xb->record_display) {
+        XRecordDisableContext(xb->pub.display, xb->record_context);
+        XRecordFreeContext(xb->pub.display, xb->record_context);
+        XCloseDisplay(xb->record_display);
+    }
+    XCloseDisplay(xb->pub.display);
+    cleanup();
+    xbench = NULL;
+    free(xb);
+}
+
+static void dispatch(struct xbench_priv *xb, double timeout)
+{
+    fd_set readfds, writefds;
+    struct timeval tv;
+    XEvent event;
+    int nfds, fd;
+
+    while (XPending(xb->pub.display)) {
+        XNextEvent(xb->pub.display, &event);
+        if (xb->pub.x_event)
+            xb->pub.x_event(&xb->pub, &event);
+    }
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    nfds = udscs_server_fill_fds(xb->server, &readfds, &writefds);
+    fd = ConnectionNumber(xb->pub.display);
+    FD_SET(fd, &readfds);
+    if (fd >= nfds)
+        nfds = fd + 1;
+    if (xb->record_display) {
+        fd = ConnectionNumber(xb->record_display);
+        FD_SET(fd, &readfds);
+        if (fd >= nfds)
+            nfds = fd + 1;
+    }
+    /* The daemon connects to the port once, while an agent starts */
+    fd = xb->pub.port != -1 ? xb->pub.port : xb->port_listen;
+    if (fd != -1) {
+        FD_SET(fd, &readfds);
+        if (fd >= nfds)
+            nfds = fd + 1;
+    }
+
+    tv.tv_sec = timeout;
+    tv.tv_usec = (timeout - tv.tv_sec) * 1e6;
+    if (select(nfds, &readfds, &writefds, NULL, &tv) == -1) {
+        if (errno == EINTR)
+            return;
+        perror("select");
+        exit(1);
+    }
+
+    udscs_server_handle_fds(xb->server, &readfds, &writefds);
+    if (xb->record_display &&
+            FD_ISSET(ConnectionNumber(xb->record_display), &readfds))
+        XRecordProcessReplies(xb->record_display);
+
+    if (xb->pub.port != -1) {
+        if (FD_ISSET(xb->pub.port, &readfds) && xb->pub.port_read)
+            xb->pub.port_read(&xb->pub);
+    } else if (xb->port_listen != -1 &&
+               FD_ISSET(xb->port_listen, &readfds)) {
+        xb->pub.port = accept(xb->port_listen, NULL, NULL);
+        if (xb->pub.port == -1) {
+            perror("accept");
+            exit(1);
+        }
+        close(xb->port_listen);
+        xb->port_listen = -1;
+        xb->pub.agent_ready = 1;
+    }
+}
+
+static void check_child(pid_t *pid, const char *name, const char *what)
+{
+    int status;
+
+    if (*pid && waitpid(*pid, &status, WNOHANG) > 0) {
+        *pid = 0;
+        fprintf(stderr, "%s died while waiting for %s\n", name, what);
+        exit(1);
+    }
+}
+
+void xbench_wait(struct xbench *pub, int (*done)(struct xbench *xb),
+                 const char *what)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+    double deadline = xbench_now() + WAIT_TIMEOUT;
+
+    while (!done(pub)) {
+        check_child(&xb->agent_pid, "spice-vdagent", what);
+        check_child(&xb->daemon_pid, "spice-vdagentd", what);
+        if (xbench_now() > deadline) {
+            fprintf(stderr, "timeout waiting for %s\n", what);
+            exit(1);
+        }
+        dispatch(xb, 0.1);
+    }
+}
+
+static int agent_is_ready(struct xbench *xb)
+{
+    return xb->agent_ready;
+}
+
+/* In daemon mode the agent is ready when the daemon opens the virtio port,
+   which it does once the agent has sent its guest xorg resolution */
+static void listen_port(struct xbench_priv *xb)
+{
+    struct sockaddr_un address;
+
+    xb->port_listen = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (xb->port_listen == -1) {
+        perror("socket");
+        exit(1);
+    }
+    unlink(xb->port_path);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s",
+             xb->port_path);
+    if (bind(xb->port_listen, (struct sockaddr *)&address,
+             sizeof(address)) || listen(xb->port_listen, 1)) {
+        perror(xb->port_path);
+        exit(1);
+    }
+}
+
+/* The daemon closes the port itself when its agent goes away, closing our
+   end first would make it reconnect. Anything still unread gets dropped. */
+static void close_port(struct xbench_priv *xb, int wait_for_daemon)
+{
+    struct pollfd pfd;
+    char buf[4096];
+
+    if (xb->port_listen != -1) {
+        close(xb->port_listen);
+        xb->port_listen = -1;
+    }
+    if (xb->pub.port == -1)
+        return;
+
+    pfd.fd = xb->pub.port;
+    pfd.events = POLLIN;
+    while (wait_for_daemon && poll(&pfd, 1, WAIT_TIMEOUT * 1000) == 1 &&
+           read(xb->pub.port, buf, sizeof(buf)) > 0)
+        ;
+    close(xb->pub.port);
+    xb->pub.port = -1;
+}
+
+void xbench_start_agent(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+    const char *socket_path = xb->socket_path, *port_path = xb->socket_path;
+
+    if (xb->daemon_pid) {
+        listen_port(xb);
+        socket_path = xb->daemon_socket_path;
+        port_path = xb->port_path;
+    }
+
+    xb->agent_pid = fork();
+    if (xb->agent_pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (xb->agent_pid == 0) {
+        setenv("DISPLAY", xb->display_name, 1);
+        /* Applying a monitor config removes the user's monitors.xml */
+        setenv("XDG_CONFIG_HOME", xb->dir, 1);
+        /* Where the file transfer journal goes */
+        setenv("XDG_CACHE_HOME", xb->dir, 1);
+        if (!xb->verbose)
+            quiet_stderr();
+        /* The port device only gets checked for existence */
+        execl(xb->agent_path, xb->agent_path, "-x", "-S", socket_path,
+              "-s", port_path, "-f", xb->dir, "-o", "0",
+              xb->verbose ? "-d" : NULL, NULL);
+        fprintf(stderr, "exec %s: %s\n", xb->agent_path, strerror(errno));
+        _exit(127);
+    }
+
+    xbench_wait(pub, agent_is_ready, "spice-vdagent to start");
+}
+
+void xbench_stop_agent(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+
+    if (xb->pub.agent)
+        udscs_destroy_connection(&xb->pub.agent);
+    kill_child(&xb->agent_pid);
+    close_port(xb, xb->daemon_pid != 0);
+    xb->pub.agent_ready = 0;
+}
+
+void xbench_start_daemon(struct xbench *pub, const char *daemon)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+    char uinput_path[64];
+    double deadline;
+    struct stat st;
+    int fd;
+
+    snprintf(xb->daemon_socket_path, sizeof(xb->daemon_socket_path),
+             "%s/vdagentd.sock", xb->dir);
+    snprintf(xb->metrics_path, sizeof(xb->metrics_path),
+             "%s/metrics.sock", xb->dir);
+    snprintf(xb->port_path, sizeof(xb->port_path), "%s/port", xb->dir);
+    /* A fake uinput device is a file the events get written to */
+    snprintf(uinput_path, sizeof(uinput_path), "%s/uinput", xb->dir);
+    fd = open(uinput_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror(uinput_path);
+        exit(1);
+    }
+    close(fd);
+    /* Left behind when a previous daemon got killed */
+    unlink(xb->daemon_socket_path);
+
+    xb->daemon_pid = fork();
+    if (xb->daemon_pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (xb->daemon_pid == 0) {
+        if (!xb->verbose)
+            quiet_stderr();
+        execl(daemon, daemon, "-x", "-X", "-f", "-u", uinput_path,
+              "-s", xb->port_path, "-S", xb->daemon_socket_path,
+              "-M", xb->metrics_path, xb->verbose ? "-d" : NULL, NULL);
+        fprintf(stderr, "exec %s: %s\n", daemon, strerror(errno));
+        _exit(127);
+    }
+
+    /* The agent can only connect once the daemon listens */
+    deadline = xbench_now() + WAIT_TIMEOUT;
+    while (stat(xb->daemon_socket_path, &st)) {
+        check_child(&xb->daemon_pid, "spice-vdagentd", "its socket");
+        if (xbench_now() > deadline) {
+            fprintf(stderr, "timeout waiting for spice-vdagentd's socket\n");
+            exit(1);
+        }
+        usleep(10000);
+    }
+}
+
+void xbench_stop_daemon(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+
+    kill_child(&xb->daemon_pid);
+    close_port(xb, 0);
+}
+
+static char *read_metrics(struct xbench_priv *xb)
+{
+    struct sockaddr_un address;
+    size_t len = 0, size = 65536;
+    char *text = malloc(size);
+    ssize_t n;
+    int fd;
+
+    fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!text || fd == -1) {
+        perror("metrics");
+        exit(1);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s",
+             xb->metrics_path);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+        perror(xb->metrics_path);
+        exit(1);
+    }
+
+    /* The daemon only gets to send once we are back in dispatch */
+    for (;;) {
+        if (len + 1 == size) {
+            size *= 2;
+            text = realloc(text, size);
+            if (!text) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        n = recv(fd, text + len, size - len - 1, MSG_DONTWAIT);
+        if (n == 0)
+            break;
+        if (n > 0) {
+            len += n;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("reading metrics");
+            exit(1);
+        }
+        check_child(&xb->daemon_pid, "spice-vdagentd", "metrics");
+        dispatch(xb, 0.01);
+    }
+    close(fd);
+    text[len] = 0;
+    return text;
+}
+
+long long xbench_metric(const char *metrics, const char *name,
+                        const char *process)
+{
+    char sample[128];
+    const char *p;
+
+    snprintf(sample, sizeof(sample), "\nspice_vdagent_%s{process=\"%s\"} ",
+             name, process);
+    p = strstr(metrics, sample);
+    return p ? strtoll(p + strlen(sample), NULL, 10) : -1;
+}
+
+/* Each scrape asks the agent for a fresh snapshot for the next one, so
+   scrape until the agent has answered a request made after our call */
+char *xbench_daemon_metrics(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+    double deadline = xbench_now() + WAIT_TIMEOUT;
+    long long received;
+    char *text;
+
+    text = read_metrics(xb);
+    received = xbench_metric(text, "udscs_messages_received_total",
+                             "spice-vdagent");
+    while (xb->agent_pid) {
+        free(text);
+        dispatch(xb, 0.01);
+        text = read_metrics(xb);
+        if (xbench_metric(text, "udscs_messages_received_total",
+                          "spice-vdagent") > received)
+            break;
+        if (xbench_now() > deadline) {
+            fprintf(stderr, "timeout waiting for the agent's metrics\n");
+            exit(1);
+        }
+    }
+    return text;
+}
+
+const char *xbench_dir(struct xbench *pub)
+{
+    return ((struct xbench_priv *)pub)->dir;
+}
+
+/* utime and stime are the 14th and 15th field, the 2nd field is the
+   command name, which may contain spaces */
+static void get_process_usage(pid_t pid, double *cpu, long *rss_kb,
+                              long *hwm_kb)
+{
+    unsigned long utime = 0, stime = 0;
+    char path[64], line[1024], *p;
+    FILE *f;
+
+    *cpu = 0;
+    *rss_kb = *hwm_kb = 0;
+    if (!pid)
+        return;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (f) {
+        if (fgets(line, sizeof(line), f) && (p = strrchr(line, ')')) &&
+                sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                       "%lu %lu", &utime, &stime) == 2)
+            *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    f = fopen(path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            sscanf(line, "VmRSS: %ld", rss_kb);
+            sscanf(line, "VmHWM: %ld", hwm_kb);
+        }
+        fclose(f);
+    }
+}
+
+static void get_usage(struct xbench_priv *xb, struct xbench_usage *usage)
+{
+    flush_recording(xb);
+    usage->x_requests = xb->record_display ? xb->x_requests : -1;
+    usage->x_replies = xb->record_display ? xb->x_replies : -1;
+    get_process_usage(xb->agent_pid, &usage->cpu, &usage->rss_kb,
+                      &usage->hwm_kb);
+    get_process_usage(xb->daemon_pid, &usage->daemon_cpu,
+                      &usage->daemon_rss_kb, &usage->daemon_hwm_kb);
+}
+
+void xbench_measure_start(struct xbench *pub)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+
+    get_usage(xb, &xb->start);
+}
+
+void xbench_measure_end(struct xbench *pub, struct xbench_usage *usage)
+{
+    struct xbench_priv *xb = (struct xbench_priv *)pub;
+
+    get_usage(xb, usage);
+    if (xb->record_display) {
+        usage->x_requests -= xb->start.x_requests;
+        usage->x_replies -= xb->start.x_replies;
+    }
+    usage->cpu -= xb->start.cpu;
+    usage->hwm_growth_kb = usage->hwm_kb - xb->start.rss_kb;
+    usage->daemon_cpu -= xb->start.daemon_cpu;
+    usage->daemon_hwm_growth_kb = usage->daemon_hwm_kb -
+                                  xb->start.daemon_rss_kb;
+}
@@ -0,0 +1,137 @@
+/*  xbench.h spice-vdagent X11 benchmark helpers header
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __XBENCH_H
+#define __XBENCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <X11/Xlib.h>
+
+#include "udscs.h"
+
+/* Runs spice-vdagent against a private X server, with a stub vdagentd on the
+   other end of its udscs connection, so that benchmarks can drive the agent
+   from both sides: as the daemon through the udscs messages and as other X
+   clients through their own connection to the X server.
+   With xbench_start_daemon the real spice-vdagentd runs in between instead
+   of the stub, and the benchmark plays the SPICE client on the other end of
+   the daemon's virtio port, a unix socket. */
+
+struct xbench;
+
+enum xbench_server {
+    XBENCH_XVFB,
+    /* Xorg with the xf86-video-dummy driver, which unlike Xvfb has multiple
+       RandR outputs. Xorg only accepts a config file of ours as root. */
+    XBENCH_DUMMY,
+};
+
+/* Called for every message the agent sends to the stub daemon */
+typedef void (*xbench_agent_read_callback)(struct xbench *xb,
+    struct udscs_message_header *header, uint8_t *data);
+
+/* Called for every event on the benchmark's own X connection */
+typedef void (*xbench_x_event_callback)(struct xbench *xb, XEvent *event);
+
+/* Called when the daemon's virtio port is readable */
+typedef void (*xbench_port_read_callback)(struct xbench *xb);
+
+struct xbench {
+    Display *display;  /* the benchmark's own connection */
+    Window root;
+    struct udscs_connection *agent;  /* NULL while no agent is connected */
+    int agent_ready;   /* the agent has sent its guest xorg resolution */
+    int port;          /* the daemon's virtio port connection, or -1 */
+    xbench_agent_read_callback agent_read;
+    xbench_x_event_callback x_event;
+    xbench_port_read_callback port_read;
+    void *priv;
+};
+
+/* Resources used by the agent between xbench_measure_start and _end.
+   x_replies are the requests the agent had to wait for the X server on,
+   so its round-trips. Both are -1 when the X server has no RECORD. */
+struct xbench_usage {
+    long x_requests;
+    long x_replies;
+    double cpu;        /* user + system, seconds */
+    long rss_kb;       /* resident set size at the end of the measurement */
+    long hwm_kb;       /* peak resident set size since the agent started */
+    long hwm_growth_kb; /* hwm_kb minus rss_kb at xbench_measure_start */
+    /* The same for spice-vdagentd, all 0 without xbench_start_daemon */
+    double daemon_cpu;
+    long daemon_rss_kb;
+    long daemon_hwm_kb;
+    long daemon_hwm_growth_kb;
+};
+
+/* Start a private X server and the stub daemon. The benchmark's usage
+   message documents the options which get passed through: agent is the
+   spice-vdagent binary to run, verbose lets the agent and the X server log
+   to stderr and record enables counting the agent's X requests, which
+   costs the X server a copy of all the agent's traffic.
+   Returns NULL when the X server is not installed, other errors are
+   fatal. */
+struct xbench *xbench_create(enum xbench_server server, const char *agent,
+                             int verbose, int record);
+void xbench_destroy(struct xbench *xb);
+
+/* Start a fresh spice-vdagent and wait till it is ready for use, with
+   the real daemon that is when the daemon has connected to the virtio port.
+   The agent saves transferred files in xbench_dir(). */
+void xbench_start_agent(struct xbench *xb);
+void xbench_stop_agent(struct xbench *xb);
+
+/* Start spice-vdagentd, the agents started after this connect to it
+   instead of the stub daemon. Stopping the daemon also closes the port. */
+void xbench_start_daemon(struct xbench *xb, const char *daemon);
+void xbench_stop_daemon(struct xbench *xb);
+
+/* Return value: the daemon's metrics in the Prometheus text format, for
+   both itself and the agent, as a malloc-ed string. The agent's part is
+   from after the call was made. */
+char *xbench_daemon_metrics(struct xbench *xb);
+
+/* Return value: the value of a sample in the output of
+   xbench_daemon_metrics, name without the spice_vdagent_ prefix and
+   process either "spice-vdagentd" or "spice-vdagent", -1 if not found */
+long long xbench_metric(const char *metrics, const char *name,
+                        const char *process);
+
+/* The private directory of this xbench, removed by xbench_destroy */
+const char *xbench_dir(struct xbench *xb);
+
+/* Handle X events and agent messages until done returns true, exits
+   the benchmark when this takes longer than 60 seconds. what is used in the
+   error message for this. */
+void xbench_wait(struct xbench *xb, int (*done)(struct xbench *xb),
+                 const char *what);
+
+void xbench_measure_start(struct xbench *xb);
+void xbench_measure_end(struct xbench *xb, struct xbench_usage *usage);
+
+/* Print the JSON line which benchmarks print instead of their results when
+   they cannot run */
+void xbench_print_skipped(const char *bench, const char *reason);
+
+double xbench_now(void);
+/* Sort latencies and return the given percentile of them */
+double xbench_percentile(double *latency, uint32_t n, int percentile);
+
+#endif
@@ -0,0 +1,145 @@
+/*  budget.c memory budget for message buffers, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include "budget.h"
+#include "metrics.h"
+
+static const struct {
+    const char *name;
+    enum metrics_counter gauge;
+} pools[BUDGET_NO_POOLS] = {
+    [BUDGET_VIRTIO_READ] = { "virtio-read", METRICS_VIRTIO_READ_BYTES },
+    [BUDGET_VIRTIO_WRITE] = { "virtio-write", METRICS_VIRTIO_QUEUED_BYTES },
+    [BUDGET_UDSCS_READ] = { "udscs-read", METRICS_UDSCS_READ_BYTES },
+    [BUDGET_UDSCS_WRITE] = { "udscs-write", METRICS_UDSCS_QUEUED_BYTES },
+    [BUDGET_XFER_QUEUE] = { "xfer-queue", METRICS_FILE_XFER_QUEUED_BYTES },
+};
+
+static uint64_t limits[BUDGET_NO_POOLS];
+static uint64_t global_limit;
+static int deferred;
+
+void budget_set_limit(enum budget_pool pool, uint64_t limit)
+{
+    limits[pool] = limit;
+}
+
+void budget_set_global_limit(uint64_t limit)
+{
+    global_limit = limit;
+}
+
+int budget_pool_from_name(const char *name)
+{
+    int i;
+
+    /* The pools from BUDGET_XFER_QUEUE on have no cap of their own */
+    for (i = 0; i < BUDGET_XFER_QUEUE; i++) {
+        if (!strcmp(pools[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+static enum budget_verdict budget_check(int64_t usage, uint64_t limit,
+    uint64_t size, int bulk)
+{
+    uint64_t reserve = bulk ? limit / 4 : 0;
+
+    if (!limit)
+        return BUDGET_ADMIT;
+    if (size > limit)
+        return BUDGET_REFUSE;
+    if (usage < 0)
+        usage = 0;
+    /* Without any usage a bulk message eats into the reserve, as nothing
+       would ever make room for it */
+    if ((uint64_t)usage + size + reserve <= limit ||
+            (bulk && usage == 0))
+        return BUDGET_ADMIT;
+    return bulk ? BUDGET_DEFER : BUDGET_REFUSE;
+}
+
+static enum budget_verdict budget_verdict(enum budget_pool pool,
+    uint64_t size)
+{
+    int bulk = size >= BUDGET_BULK_SIZE;
+    enum budget_verdict verdict, global_verdict;
+
+    verdict = budget_check(metrics_data.counters[pools[pool].gauge],
+                           limits[pool], size, bulk);
+    global_verdict = budget_check(metrics_data.counters[METRICS_BUDGET_BYTES],
+                                  global_limit, size, bulk);
+    return global_verdict > verdict ? global_verdict : verdict;
+}
+
+enum budget_verdict budget_admit(enum budget_pool pool, uint64_t size)
+{
+    enum budget_verdict verdict = budget_verdict(pool, size);
+
+    if (verdict == BUDGET_DEFER)
+        deferred = 1;
+    else if (verdict == BUDGET_REFUSE)
+        metrics_inc(METRICS_BUDGET_REFUSED);
+    return verdict;
+}
+
+int budget_admit_now(enum budget_pool pool, uint64_t size)
+{
+    if (budget_verdict(pool, size) == BUDGET_ADMIT)
+        return 1;
+
+    metrics_inc(METRICS_BUDGET_REFUSED);
+    return 0;
+}
+
+int budget_fits(enum budget_pool pool, uint64_t size)
+{
+    if (budget_check(metrics_data.counters[pools[pool].gauge],
+                     limits[pool], size, 0) == BUDGET_ADMIT &&
+            budget_check(metrics_data.counters[METRICS_BUDGET_BYTES],
+                         global_limit, size, 0) == BUDGET_ADMIT)
+        return 1;
+
+    metrics_inc(METRICS_BUDGET_REFUSED);
+    return 0;
+}
+
+void budget_charge(enum budget_pool pool, uint64_t size)
+{
+    metrics_add(pools[pool].gauge, size);
+    metrics_add(METRICS_BUDGET_BYTES, size);
+}
+
+void budget_release(enum budget_pool pool, uint64_t size)
+{
+    metrics_add(pools[pool].gauge, -(int64_t)size);
+    metrics_add(METRICS_BUDGET_BYTES, -(int64_t)size);
+}
+
+int budget_take_deferred(void)
+{
+    int r = deferred;
+
+    deferred = 0;
+    return r;
+}
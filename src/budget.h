@@ -0,0 +1,102 @@
+/*  budget.h memory budget for message buffers, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BUDGET_H
+#define __BUDGET_H
+
+#include <stdint.h>
+
+/* Every buffer holding message data is charged to one of the pools below.
+ * Each pool can have a cap of its own, and all pools together a global
+ * one. The usage of a pool is its metrics gauge, so that current and peak
+ * usage get exported with the other metrics, the global usage is
+ * METRICS_BUDGET_BYTES.
+ *
+ * Reading a message gets admitted before its buffer is allocated. Bulk
+ * messages (of at least BUDGET_BULK_SIZE bytes: clipboard and file xfer
+ * data) are only admitted while they leave a quarter of the caps free, that
+ * part is kept for the small control messages. A bulk message which does
+ * not fit gets deferred: its reader stops until the usage has dropped.
+ * Readers which carry control messages behind the bulk ones on the same
+ * stream (the virtio port) can not stop, they refuse such a message
+ * instead. A message which does not fit at all (larger than a cap, or a
+ * control message when the budget is used up) gets refused.
+ *
+ * Like the metrics this is process global, and not thread safe.
+ */
+enum budget_pool {
+    BUDGET_VIRTIO_READ,   /* messages being reassembled from virtio chunks */
+    BUDGET_VIRTIO_WRITE,  /* the virtio port write queue */
+    BUDGET_UDSCS_READ,    /* messages being read from udscs connections */
+    BUDGET_UDSCS_WRITE,   /* the udscs write queues */
+    BUDGET_XFER_QUEUE,    /* file xfer data in vdagentd's scheduler, this
+                             is fed by admitted virtio messages, so only
+                             the global cap applies to it */
+    BUDGET_NO_POOLS /* Must always be last */
+};
+
+enum budget_verdict {
+    BUDGET_ADMIT,
+    BUDGET_DEFER,
+    BUDGET_REFUSE,
+};
+
+#define BUDGET_BULK_SIZE 4096
+
+/* Set the cap of pool, resp. the global cap, in bytes. 0 (the default)
+ * means no cap.
+ */
+void budget_set_limit(enum budget_pool pool, uint64_t limit);
+void budget_set_global_limit(uint64_t limit);
+
+/* Return value: the pool called name ("virtio-read", "virtio-write",
+ * "udscs-read" or "udscs-write"), -1 if there is no such pool with a cap.
+ */
+int budget_pool_from_name(const char *name);
+
+/* Admission control for reading a message of size bytes into pool.
+ * Return value: see above, refusals get counted in METRICS_BUDGET_REFUSED.
+ */
+enum budget_verdict budget_admit(enum budget_pool pool, uint64_t size);
+
+/* For readers which can not wait: like budget_admit(), but a message which
+ * would get deferred is refused as well.
+ * Return value: 1 if the message is admitted, 0 (counted as a refusal) if
+ * not.
+ */
+int budget_admit_now(enum budget_pool pool, uint64_t size);
+
+/* For buffers which can not be deferred, like those of the write queues.
+ * Writers only check bulk messages, control messages always get queued
+ * (and charged), as there is no way to make their receiver retry.
+ * Return value: 1 if size bytes fit in pool and globally, 0 (counted as
+ * a refusal) if not.
+ */
+int budget_fits(enum budget_pool pool, uint64_t size);
+
+void budget_charge(enum budget_pool pool, uint64_t size);
+void budget_release(enum budget_pool pool, uint64_t size);
+
+/* Return value: 1 if budget_admit() deferred a message since the last
+ * call. Deferred readers retry from their handle_fds function, the main
+ * loop should not sleep for long then, as the usage may drop without any
+ * fd becoming ready.
+ */
+int budget_take_deferred(void);
+
+#endif
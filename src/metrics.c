@@ -0,0 +1,322 @@
+/*  metrics.c runtime counters and histograms, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "metrics.h"
+
+#define METRICS_PREFIX "spice_vdagent_"
+
+struct metrics_desc {
+    const char *name;
+    const char *type;
+    const char *help;
+};
+
+static const struct metrics_desc counter_descs[METRICS_NO_COUNTERS] = {
+    [METRICS_UDSCS_MESSAGES_SENT] = { "udscs_messages_sent_total", "counter",
+        "Messages queued on unix domain socket connections" },
+    [METRICS_UDSCS_BYTES_SENT] = { "udscs_bytes_sent_total", "counter",
+        "Bytes written to unix domain socket connections" },
+    [METRICS_UDSCS_MESSAGES_RECEIVED] = {
+        "udscs_messages_received_total", "counter",
+        "Messages received on unix domain socket connections" },
+    [METRICS_UDSCS_BYTES_RECEIVED] = { "udscs_bytes_received_total", "counter",
+        "Bytes read from unix domain socket connections" },
+    [METRICS_UDSCS_MESSAGES_PURGED] = {
+        "udscs_messages_purged_total", "counter",
+        "Stale messages dropped from unix domain socket queues" },
+    [METRICS_UDSCS_QUEUED_BYTES] = { "udscs_queued_bytes", "gauge",
+        "Bytes waiting to be written to unix domain socket connections" },
+    [METRICS_UDSCS_ERRORS] = { "udscs_errors_total", "counter",
+        "Unix domain socket connections dropped because of an error" },
+    [METRICS_VIRTIO_MESSAGES_SENT] = {
+        "virtio_messages_sent_total", "counter",
+        "Messages queued on the virtio port" },
+    [METRICS_VIRTIO_BYTES_SENT] = { "virtio_bytes_sent_total", "counter",
+        "Bytes written to the virtio port" },
+    [METRICS_VIRTIO_MESSAGES_RECEIVED] = {
+        "virtio_messages_received_total", "counter",
+        "Messages received on the virtio port" },
+    [METRICS_VIRTIO_BYTES_RECEIVED] = {
+        "virtio_bytes_received_total", "counter",
+        "Bytes read from the virtio port" },
+    [METRICS_VIRTIO_MESSAGES_PURGED] = {
+        "virtio_messages_purged_total", "counter",
+        "Stale messages dropped from the virtio port queue" },
+    [METRICS_VIRTIO_QUEUED_BYTES] = { "virtio_queued_bytes", "gauge",
+        "Bytes waiting to be written to the virtio port" },
+    [METRICS_VIRTIO_ERRORS] = { "virtio_errors_total", "counter",
+        "Virtio port read / write errors" },
+    [METRICS_UINPUT_EVENTS] = { "uinput_events_total", "counter",
+        "Input events written to the uinput device" },
+    [METRICS_CLIPBOARD_GRABS] = { "clipboard_grabs_total", "counter",
+        "Clipboard grabs handled" },
+    [METRICS_CLIPBOARD_REQUESTS] = { "clipboard_requests_total", "counter",
+        "Clipboard data requests handled" },
+    [METRICS_CLIPBOARD_BYTES] = { "clipboard_bytes_total", "counter",
+        "Clipboard data bytes transferred" },
+    [METRICS_FILE_XFER_STARTED] = { "file_xfer_started_total", "counter",
+        "File transfers started" },
+    [METRICS_FILE_XFER_COMPLETED] = { "file_xfer_completed_total", "counter",
+        "File transfers completed successfully" },
+    [METRICS_FILE_XFER_FAILED] = { "file_xfer_failed_total", "counter",
+        "File transfers which failed or were cancelled" },
+    [METRICS_FILE_XFER_BYTES] = { "file_xfer_bytes_total", "counter",
+        "File transfer data bytes handled" },
+    [METRICS_UDSCS_READ_BYTES] = { "udscs_read_bytes", "gauge",
+        "Bytes of partially read messages on unix domain socket connections" },
+    [METRICS_VIRTIO_READ_BYTES] = { "virtio_read_bytes", "gauge",
+        "Bytes of messages being reassembled from virtio port chunks" },
+    [METRICS_FILE_XFER_QUEUED_BYTES] = { "file_xfer_queued_bytes", "gauge",
+        "File transfer data bytes waiting in the scheduler queue" },
+    [METRICS_CLIPBOARD_INCR_RECEIVE_BYTES] = {
+        "clipboard_incr_receive_bytes", "gauge",
+        "Size of the buffer for clipboard data received with INCR" },
+    [METRICS_CLIPBOARD_INCR_SEND_BYTES] = {
+        "clipboard_incr_send_bytes", "gauge",
+        "Clipboard data bytes held for sending with INCR" },
+    [METRICS_CLIPBOARD_TEXT_CACHE_BYTES] = {
+        "clipboard_text_cache_bytes", "gauge",
+        "Client clipboard text kept for answering further requests" },
+    [METRICS_CLIPBOARD_IMAGE_CACHE_BYTES] = {
+        "clipboard_image_cache_bytes", "gauge",
+        "Converted clipboard images kept for answering further requests" },
+    [METRICS_CLIPBOARD_GRABS_SUPPRESSED] = {
+        "clipboard_grabs_suppressed_total", "counter",
+        "Guest clipboard grabs not sent because nothing had changed" },
+    [METRICS_CLIPBOARD_VERIFY_BYTES] = {
+        "clipboard_verify_bytes_total", "counter",
+        "Guest clipboard data read back to check for changed content" },
+    [METRICS_COMPRESS_SENT_BYTES] = {
+        "compress_sent_bytes_total", "counter",
+        "Compressed messages written to the virtio port" },
+    [METRICS_COMPRESS_SENT_ORIGINAL_BYTES] = {
+        "compress_sent_original_bytes_total", "counter",
+        "Size before compression of the messages written compressed" },
+    [METRICS_COMPRESS_RECEIVED_BYTES] = {
+        "compress_received_bytes_total", "counter",
+        "Compressed messages read from the virtio port" },
+    [METRICS_COMPRESS_RECEIVED_ORIGINAL_BYTES] = {
+        "compress_received_original_bytes_total", "counter",
+        "Size after decompression of the messages read compressed" },
+    [METRICS_VIRTIO_RECONNECTS] = {
+        "virtio_reconnects_total", "counter",
+        "Times the virtio port dropped and got reopened" },
+    [METRICS_VIRTIO_CLIENT_RESUMES] = {
+        "virtio_client_resumes_total", "counter",
+        "Reconnects after which the client kept its negotiated state" },
+    [METRICS_BUDGET_BYTES] = { "budget_bytes", "gauge",
+        "Bytes of message buffers charged to the memory budget" },
+    [METRICS_BUDGET_DEFERRED] = { "budget_deferred_total", "counter",
+        "Bulk messages whose reading waited for the memory budget" },
+    [METRICS_BUDGET_REFUSED] = { "budget_refused_total", "counter",
+        "Messages dropped or refused for not fitting the memory budget" },
+    [METRICS_X11_BATCHES_LIMITED] = {
+        "x11_batches_limited_total", "counter",
+        "Times handling X events yielded to vdagentd's messages, "
+        "with events left" },
+};
+
+static const struct metrics_desc histogram_descs[METRICS_NO_HISTOGRAMS] = {
+    [METRICS_UDSCS_MESSAGE_SIZE] = { "udscs_message_size_bytes", "histogram",
+        "Size of messages queued on unix domain socket connections" },
+    [METRICS_VIRTIO_MESSAGE_SIZE] = { "virtio_message_size_bytes", "histogram",
+        "Size of messages queued on the virtio port" },
+    [METRICS_CLIPBOARD_LATENCY] = {
+        "clipboard_latency_microseconds", "histogram",
+        "Time between a clipboard data request and its answer" },
+    [METRICS_FILE_XFER_QUEUE_DELAY] = {
+        "file_xfer_queue_delay_microseconds", "histogram",
+        "Time file transfer data spends in the scheduler queue" },
+};
+
+struct metrics_snapshot metrics_data = {
+    .no_counters = METRICS_NO_COUNTERS,
+    .no_histograms = METRICS_NO_HISTOGRAMS,
+};
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t value)
+{
+    struct metrics_histogram_data *h = &metrics_data.histograms[histogram];
+    int bucket;
+
+    /* Index of the smallest power of 2 >= value */
+    if (value <= 1)
+        bucket = 0;
+    else
+        bucket = 64 - __builtin_clzll(value - 1);
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS)
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+
+    h->buckets[bucket]++;
+    h->sum += value;
+}
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const struct metrics_snapshot *metrics_get(void)
+{
+    return &metrics_data;
+}
+
+int metrics_snapshot_valid(const void *snapshot, uint32_t size)
+{
+    const struct metrics_snapshot *s = snapshot;
+
+    return size == sizeof(*s) &&
+           s->no_counters == METRICS_NO_COUNTERS &&
+           s->no_histograms == METRICS_NO_HISTOGRAMS;
+}
+
+struct metrics_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+    int oom;
+};
+
+static void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+    va_list args;
+    char *new_buf;
+    int n;
+
+    while (!b->oom) {
+        va_start(args, fmt);
+        n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            b->oom = 1;
+            break;
+        }
+        if ((size_t)n < b->size - b->len) {
+            b->len += n;
+            break;
+        }
+
+        new_buf = realloc(b->buf, 2 * b->size + n);
+        if (!new_buf) {
+            b->oom = 1;
+            break;
+        }
+        b->buf = new_buf;
+        b->size = 2 * b->size + n;
+    }
+}
+
+static void metrics_render_histogram(struct metrics_buf *b, const char *name,
+    const char *label, const struct metrics_histogram_data *h)
+{
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        count += h->buckets[i];
+        metrics_printf(b, METRICS_PREFIX "%s_bucket{process=\"%s\",le=\"%"
+                       PRIu64 "\"} %" PRIu64 "\n",
+                       name, label, UINT64_C(1) << i, count);
+    }
+    count += h->buckets[METRICS_HISTOGRAM_BUCKETS - 1];
+    metrics_printf(b, METRICS_PREFIX "%s_bucket{process=\"%s\",le=\"+Inf\"} %"
+                   PRIu64 "\n", name, label, count);
+    metrics_printf(b, METRICS_PREFIX "%s_sum{process=\"%s\"} %" PRIu64 "\n",
+                   name, label, h->sum);
+    metrics_printf(b, METRICS_PREFIX "%s_count{process=\"%s\"} %" PRIu64 "\n",
+                   name, label, count);
+}
+
+char *metrics_render(const struct metrics_snapshot * const snapshots[],
+    const char * const labels[], int no_snapshots)
+{
+    struct metrics_buf b = { NULL, 0, 0, 0 };
+    int i, j;
+
+    b.size = 16384;
+    b.buf = malloc(b.size);
+    if (!b.buf)
+        return NULL;
+    b.buf[0] = '\0';
+
+    /* All samples of a metric family must be grouped together */
+    for (i = 0; i < METRICS_NO_COUNTERS; i++) {
+        metrics_printf(&b, "# HELP " METRICS_PREFIX "%s %s\n",
+                       counter_descs[i].name, counter_descs[i].help);
+        metrics_printf(&b, "# TYPE " METRICS_PREFIX "%s %s\n",
+                       counter_descs[i].name, counter_descs[i].type);
+        for (j = 0; j < no_snapshots; j++) {
+            if (!snapshots[j])
+                continue;
+            metrics_printf(&b, METRICS_PREFIX "%s{process=\"%s\"} %" PRId64
+                           "\n", counter_descs[i].name, labels[j],
+                           snapshots[j]->counters[i]);
+        }
+    }
+
+    /* The high-water marks of the gauges, as gauges of their own */
+    for (i = 0; i < METRICS_NO_COUNTERS; i++) {
+        if (strcmp(counter_descs[i].type, "gauge"))
+            continue;
+        metrics_printf(&b, "# HELP " METRICS_PREFIX "%s_peak Peak of: %s\n",
+                       counter_descs[i].name, counter_descs[i].help);
+        metrics_printf(&b, "# TYPE " METRICS_PREFIX "%s_peak gauge\n",
+                       counter_descs[i].name);
+        for (j = 0; j < no_snapshots; j++) {
+            if (!snapshots[j])
+                continue;
+            metrics_printf(&b, METRICS_PREFIX "%s_peak{process=\"%s\"} %"
+                           PRId64 "\n", counter_descs[i].name, labels[j],
+                           snapshots[j]->peaks[i]);
+        }
+    }
+
+    for (i = 0; i < METRICS_NO_HISTOGRAMS; i++) {
+        metrics_printf(&b, "# HELP " METRICS_PREFIX "%s %s\n",
+                       histogram_descs[i].name, histogram_descs[i].help);
+        metrics_printf(&b, "# TYPE " METRICS_PREFIX "%s %s\n",
+                       histogram_descs[i].name, histogram_descs[i].type);
+        for (j = 0; j < no_snapshots; j++) {
+            if (!snapshots[j])
+                continue;
+            metrics_render_histogram(&b, histogram_descs[i].name, labels[j],
+                                     &snapshots[j]->histograms[i]);
+        }
+    }
+
+    if (b.oom) {
+        free(b.buf);
+        return NULL;
+    }
+    return b.buf;
+}
@@ -0,0 +1,143 @@
+/*  metrics.h runtime counters and histograms, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+
+/* Metrics are only ever updated from the main thread of either process
+ * (spice-vdagent's image conversion thread must leave that to the main
+ * thread), so all updates are plain (non atomic) increments of a process
+ * global table, no locking is involved anywhere.
+ * The enums below are part of the vdagent <-> vdagentd protocol (see
+ * VDAGENTD_METRICS), only append to them and keep metrics.c in sync.
+ */
+enum metrics_counter {
+    METRICS_UDSCS_MESSAGES_SENT,
+    METRICS_UDSCS_BYTES_SENT,
+    METRICS_UDSCS_MESSAGES_RECEIVED,
+    METRICS_UDSCS_BYTES_RECEIVED,
+    METRICS_UDSCS_MESSAGES_PURGED,
+    METRICS_UDSCS_QUEUED_BYTES,          /* gauge */
+    METRICS_UDSCS_ERRORS,
+    METRICS_VIRTIO_MESSAGES_SENT,
+    METRICS_VIRTIO_BYTES_SENT,
+    METRICS_VIRTIO_MESSAGES_RECEIVED,
+    METRICS_VIRTIO_BYTES_RECEIVED,
+    METRICS_VIRTIO_MESSAGES_PURGED,
+    METRICS_VIRTIO_QUEUED_BYTES,         /* gauge */
+    METRICS_VIRTIO_ERRORS,
+    METRICS_UINPUT_EVENTS,
+    METRICS_CLIPBOARD_GRABS,
+    METRICS_CLIPBOARD_REQUESTS,
+    METRICS_CLIPBOARD_BYTES,
+    METRICS_FILE_XFER_STARTED,
+    METRICS_FILE_XFER_COMPLETED,
+    METRICS_FILE_XFER_FAILED,
+    METRICS_FILE_XFER_BYTES,
+    METRICS_UDSCS_READ_BYTES,            /* gauge */
+    METRICS_VIRTIO_READ_BYTES,           /* gauge */
+    METRICS_FILE_XFER_QUEUED_BYTES,      /* gauge */
+    METRICS_CLIPBOARD_INCR_RECEIVE_BYTES, /* gauge */
+    METRICS_CLIPBOARD_INCR_SEND_BYTES,   /* gauge */
+    METRICS_CLIPBOARD_TEXT_CACHE_BYTES,  /* gauge */
+    METRICS_CLIPBOARD_IMAGE_CACHE_BYTES, /* gauge */
+    METRICS_CLIPBOARD_GRABS_SUPPRESSED,
+    METRICS_CLIPBOARD_VERIFY_BYTES,
+    METRICS_COMPRESS_SENT_BYTES,
+    METRICS_COMPRESS_SENT_ORIGINAL_BYTES,
+    METRICS_COMPRESS_RECEIVED_BYTES,
+    METRICS_COMPRESS_RECEIVED_ORIGINAL_BYTES,
+    METRICS_VIRTIO_RECONNECTS,
+    METRICS_VIRTIO_CLIENT_RESUMES,
+    METRICS_BUDGET_BYTES,                /* gauge */
+    METRICS_BUDGET_DEFERRED,
+    METRICS_BUDGET_REFUSED,
+    METRICS_X11_BATCHES_LIMITED,
+    METRICS_NO_COUNTERS /* Must always be last */
+};
+
+enum metrics_histogram {
+    METRICS_UDSCS_MESSAGE_SIZE,          /* bytes */
+    METRICS_VIRTIO_MESSAGE_SIZE,         /* bytes */
+    METRICS_CLIPBOARD_LATENCY,           /* microseconds */
+    METRICS_FILE_XFER_QUEUE_DELAY,       /* microseconds */
+    METRICS_NO_HISTOGRAMS /* Must always be last */
+};
+
+/* Histograms use power of 2 buckets, bucket i counts the observations with
+ * a value <= 2^i, the last bucket counts everything larger. */
+#define METRICS_HISTOGRAM_BUCKETS 33
+
+struct metrics_histogram_data {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t sum;
+};
+
+struct metrics_snapshot {
+    uint32_t no_counters;
+    uint32_t no_histograms;
+    int64_t counters[METRICS_NO_COUNTERS];
+    /* The highest value each gauge has had, maintained by metrics_add(),
+       for the gauges of buffered bytes these are the buffers' high-water
+       marks */
+    int64_t peaks[METRICS_NO_COUNTERS];
+    struct metrics_histogram_data histograms[METRICS_NO_HISTOGRAMS];
+};
+
+extern struct metrics_snapshot metrics_data;
+
+static inline void metrics_add(enum metrics_counter counter, int64_t value)
+{
+    int64_t v = metrics_data.counters[counter] += value;
+
+    if (v > metrics_data.peaks[counter])
+        metrics_data.peaks[counter] = v;
+}
+
+static inline void metrics_inc(enum metrics_counter counter)
+{
+    metrics_data.counters[counter]++;
+}
+
+/* Add value to histogram */
+void metrics_observe(enum metrics_histogram histogram, uint64_t value);
+
+/* Return value: a monotonic timestamp in microseconds, for use with the
+ * latency histograms.
+ */
+uint64_t metrics_now_us(void);
+
+/* Return value: the live metrics of the calling process */
+const struct metrics_snapshot *metrics_get(void);
+
+/* Check a snapshot received from another process.
+ * Return value: 1 if snapshot matches this build's layout, 0 otherwise.
+ */
+int metrics_snapshot_valid(const void *snapshot, uint32_t size);
+
+/* Render the given snapshots in the Prometheus text exposition format,
+ * labelling the samples of snapshots[i] with process="labels[i]".
+ * NULL entries in snapshots are skipped.
+ * Return value: a malloc-ed NUL terminated string, NULL on out of memory.
+ */
+char *metrics_render(const struct metrics_snapshot * const snapshots[],
+    const char * const labels[], int no_snapshots);
+
+#endif
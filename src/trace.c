@@ -0,0 +1,161 @@
+/*  trace.c in-memory binary event trace ring, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "trace.h"
+
+struct trace_desc {
+    const char *name;
+    const char *args;
+};
+
+static const struct trace_desc trace_descs[TRACE_NO_EVENTS] = {
+    [TRACE_UDSCS_WRITE] = { "udscs-write",
+        "conn:x type:m arg1:u arg2:u size:u" },
+    [TRACE_UDSCS_READ] = { "udscs-read",
+        "conn:x type:m arg1:u arg2:u size:u" },
+    [TRACE_UDSCS_PURGE] = { "udscs-purge",
+        "conn:x stream-hi:x stream-lo:x purged:u" },
+    [TRACE_UDSCS_DISCONNECT] = { "udscs-disconnect", "conn:x" },
+    [TRACE_VIRTIO_WRITE] = { "virtio-write",
+        "port:u type:u opaque:u size:u" },
+    [TRACE_VIRTIO_READ] = { "virtio-read",
+        "port:u type:u opaque:u size:u" },
+    [TRACE_VIRTIO_PURGE] = { "virtio-purge",
+        "stream-hi:x stream-lo:x purged:u" },
+    [TRACE_UINPUT_EVENT] = { "uinput-event", "type:u code:u value:d" },
+    [TRACE_X11_OWNER_CHANGE] = { "x11-owner-change", "selection:u owner:u" },
+    [TRACE_CLIPBOARD] = { "clipboard",
+        "id:x hop:h selection:u type:u size:d" },
+};
+
+static const char * const trace_clipboard_hops[TRACE_CLIPBOARD_NO_HOPS] = {
+    [TRACE_CLIPBOARD_CLIENT_REQUEST] = "client-request",
+    [TRACE_CLIPBOARD_AGENT_REQUEST] = "agent-request",
+    [TRACE_CLIPBOARD_CONVERSION_START] = "conversion-start",
+    [TRACE_CLIPBOARD_CONVERSION_DONE] = "conversion-done",
+    [TRACE_CLIPBOARD_AGENT_DATA] = "agent-data",
+    [TRACE_CLIPBOARD_X11_REQUEST] = "x11-request",
+    [TRACE_CLIPBOARD_DAEMON_REQUEST] = "daemon-request",
+    [TRACE_CLIPBOARD_CLIENT_DATA] = "client-data",
+    [TRACE_CLIPBOARD_X11_DATA] = "x11-data",
+    [TRACE_CLIPBOARD_X11_DATA_DONE] = "x11-data-done",
+};
+
+struct trace_ring trace_ring;
+
+const char *trace_event_name(uint32_t event)
+{
+    if (event >= TRACE_NO_EVENTS)
+        return NULL;
+    return trace_descs[event].name;
+}
+
+const char *trace_event_args(uint32_t event)
+{
+    if (event >= TRACE_NO_EVENTS)
+        return NULL;
+    return trace_descs[event].args;
+}
+
+const char *trace_clipboard_hop_name(uint32_t hop)
+{
+    if (hop >= TRACE_CLIPBOARD_NO_HOPS)
+        return NULL;
+    return trace_clipboard_hops[hop];
+}
+
+static int trace_write_all(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int trace_dump(const char *filename, const char *program)
+{
+    struct trace_file_header header;
+    uint64_t first, count;
+    size_t start, len;
+    char tmp[4096];
+    int fd, saved_errno;
+
+    count = trace_ring.pos < TRACE_RING_SIZE ? trace_ring.pos : TRACE_RING_SIZE;
+    first = trace_ring.pos - count;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+    header.version = TRACE_FILE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    header.count = count;
+    header.time = trace_now();
+    header.pid = getpid();
+    snprintf(header.program, sizeof(header.program), "%s", program);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+
+    /* The ring wraps, write it as 2 parts, oldest first */
+    start = first & (TRACE_RING_SIZE - 1);
+    len = TRACE_RING_SIZE - start < count ? TRACE_RING_SIZE - start : count;
+    if (trace_write_all(fd, &header, sizeof(header)) ||
+            trace_write_all(fd, &trace_ring.records[start],
+                            len * sizeof(struct trace_record)) ||
+            trace_write_all(fd, &trace_ring.records[0],
+                            (count - len) * sizeof(struct trace_record)))
+        goto error;
+
+    if (close(fd) != 0) {
+        fd = -1;
+        goto error;
+    }
+    if (rename(tmp, filename) != 0) {
+        fd = -1;
+        goto error;
+    }
+    return 0;
+
+error:
+    saved_errno = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmp);
+    errno = saved_errno;
+    return -1;
+}
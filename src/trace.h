@@ -0,0 +1,153 @@
+/*  trace.h in-memory binary event trace ring, shared by vdagent and vdagentd
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Tracing is always on: recording an event stores a timestamp, the event id
+ * and up to 5 integer arguments in a fixed size ring, without any
+ * formatting, so it is cheap enough for the per-message hot paths.
+ * The ring gets written to a file with trace_dump() (on SIGUSR1), and such
+ * files are decoded with the spice-vdagent-trace tool.
+ *
+ * The event ids are stored in the dump files, only append to this enum and
+ * keep the descriptions in trace.c in sync.
+ */
+enum trace_event {
+    TRACE_UDSCS_WRITE,
+    TRACE_UDSCS_READ,
+    TRACE_UDSCS_PURGE,
+    TRACE_UDSCS_DISCONNECT,
+    TRACE_VIRTIO_WRITE,
+    TRACE_VIRTIO_READ,
+    TRACE_VIRTIO_PURGE,
+    TRACE_UINPUT_EVENT,
+    TRACE_X11_OWNER_CHANGE,
+    TRACE_CLIPBOARD,
+    TRACE_NO_EVENTS /* Must always be last */
+};
+
+/* The hops of a clipboard request, recorded as TRACE_CLIPBOARD events
+ * together with the request id (see VDAGENTD_CLIPBOARD_ARG1). Requests
+ * from the client (paste in the client):
+ *   CLIENT_REQUEST > AGENT_REQUEST > CONVERSION_START > CONVERSION_DONE >
+ *   AGENT_DATA
+ * and requests from a guest app (paste in the guest):
+ *   X11_REQUEST > DAEMON_REQUEST > CLIENT_DATA > X11_DATA > X11_DATA_DONE
+ */
+enum trace_clipboard_hop {
+    TRACE_CLIPBOARD_CLIENT_REQUEST,   /* vdagentd: request from the client */
+    TRACE_CLIPBOARD_AGENT_REQUEST,    /* vdagent: request from vdagentd */
+    TRACE_CLIPBOARD_CONVERSION_START, /* vdagent: asking the X owner */
+    TRACE_CLIPBOARD_CONVERSION_DONE,  /* vdagent: data from the X owner */
+    TRACE_CLIPBOARD_AGENT_DATA,       /* vdagentd: data from the agent */
+    TRACE_CLIPBOARD_X11_REQUEST,      /* vdagent: request from an X app */
+    TRACE_CLIPBOARD_DAEMON_REQUEST,   /* vdagentd: request from the agent */
+    TRACE_CLIPBOARD_CLIENT_DATA,      /* vdagentd: data from the client */
+    TRACE_CLIPBOARD_X11_DATA,         /* vdagent: data from vdagentd */
+    TRACE_CLIPBOARD_X11_DATA_DONE,    /* vdagent: data handed to the X app */
+    TRACE_CLIPBOARD_NO_HOPS /* Must always be last */
+};
+
+#define TRACE_MAX_ARGS 5
+/* Must be a power of 2 */
+#define TRACE_RING_SIZE 16384
+
+struct trace_record {
+    uint64_t time;      /* CLOCK_MONOTONIC, in ns */
+    uint32_t event;
+    uint32_t args[TRACE_MAX_ARGS];
+};
+
+#define TRACE_FILE_MAGIC "VDTRACE"
+#define TRACE_FILE_VERSION 2
+
+/* A dump file is this header followed by count records, oldest first */
+struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t time;      /* of the dump, same clock as the records */
+    int32_t pid;
+    char program[20];
+};
+
+struct trace_ring {
+    uint64_t pos;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+extern struct trace_ring trace_ring;
+
+static inline uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    /* This is a vdso call, no syscall gets made */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void trace_event(enum trace_event event, uint32_t a0,
+    uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+    struct trace_record *r =
+        &trace_ring.records[trace_ring.pos++ & (TRACE_RING_SIZE - 1)];
+
+    r->time = trace_now();
+    r->event = event;
+    r->args[0] = a0;
+    r->args[1] = a1;
+    r->args[2] = a2;
+    r->args[3] = a3;
+    r->args[4] = a4;
+}
+
+/* Shorthand for identifying objects like connections in the trace */
+#define TRACE_PTR(p) ((uint32_t)(uintptr_t)(p))
+
+static inline void trace_clipboard(uint32_t id, enum trace_clipboard_hop hop,
+    uint8_t selection, uint32_t type, int32_t size)
+{
+    trace_event(TRACE_CLIPBOARD, id, hop, selection, type, size);
+}
+
+/* Write the ring to filename (replacing it atomically), program is stored
+ * in the file to identify the process.
+ * Return value: 0 on success, -1 on error (errno is set).
+ */
+int trace_dump(const char *filename, const char *program);
+
+/* Return value: the name of event, NULL for unknown events. */
+const char *trace_event_name(uint32_t event);
+
+/* Return value: a space separated list with a name:format pair for each
+ * argument of event, format is one of: 'u' unsigned, 'd' signed,
+ * 'x' hex, 'm' vdagentd message type, 'h' clipboard hop.
+ * NULL for unknown events.
+ */
+const char *trace_event_args(uint32_t event);
+
+/* Return value: the name of hop, NULL for unknown hops. */
+const char *trace_clipboard_hop_name(uint32_t hop);
+
+#endif
@@ -26,19 +26,35 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "udscs.h"
+#include "budget.h"
+#include "metrics.h"
+#include "trace.h"
 
 struct udscs_buf {
     uint8_t *buf;
     size_t pos;
     size_t size;
+    uint64_t stream;
 
     struct udscs_buf *next;
+    struct udscs_buf *prev;
+    struct udscs_buf *stream_next;
+};
+
+/* The buffers queued for a single stream, in queue order */
+struct udscs_stream {
+    uint64_t id;
+    struct udscs_buf *head;
+    struct udscs_buf *tail;
+
+    struct udscs_stream *next;
 };
 
 struct udscs_connection {
@@ -52,6 +68,8 @@ struct udscs_connection {
 #endif
 
     /* Read stuff, single buffer, separate header and data buffer */
+    int quiesce;
+    int deferred;         /* the data does not fit in the memory budget yet */
     int header_read;
     struct udscs_message_header header;
     struct udscs_buf data;
@@ -59,6 +77,11 @@ struct udscs_connection {
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
     struct udscs_buf *write_buf;
+    struct udscs_buf *write_buf_tail;
+    size_t write_buf_bytes;
+    /* Buffers which are part of a stream are also linked per stream, so
+       that they can be purged without walking the entire write_buf list */
+    struct udscs_stream *streams;
 
     /* Callbacks */
     udscs_read_callback read_callback;
@@ -99,6 +122,7 @@ struct udscs_connection *udscs_connect(const char *socketname,
         if (conn->debug) {
             syslog(LOG_DEBUG, "connect %s: %m", socketname);
         }
+        close(conn->fd);
         free(conn);
         return NULL;
     }
@@ -120,9 +144,13 @@ void udscs_destroy_connection(struct udscs_connection **connp)
     if (!conn)
         return;
 
+    trace_event(TRACE_UDSCS_DISCONNECT, TRACE_PTR(conn), 0, 0, 0, 0);
+
     if (conn->disconnect_callback)
         conn->disconnect_callback(conn);
 
+    budget_release(BUDGET_UDSCS_WRITE, conn->write_buf_bytes);
+
     wbuf = conn->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
@@ -131,6 +159,14 @@ void udscs_destroy_connection(struct udscs_connection **connp)
         wbuf = next_wbuf;
     }
 
+    while (conn->streams) {
+        struct udscs_stream *next_stream = conn->streams->next;
+        free(conn->streams);
+        conn->streams = next_stream;
+    }
+
+    if (conn->data.buf)
+        budget_release(BUDGET_UDSCS_READ, conn->data.size);
     free(conn->data.buf);
     conn->data.buf = NULL;
 
@@ -161,23 +197,70 @@ void *udscs_get_user_data(struct udscs_connection *conn)
     return conn->user_data;
 }
 
-int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
-    uint32_t arg2, const uint8_t *data, uint32_t size)
+int udscs_get_fd(struct udscs_connection *conn)
+{
+    return conn->fd;
+}
+
+size_t udscs_get_queued_bytes(struct udscs_connection *conn)
+{
+    if (!conn)
+        return 0;
+
+    return conn->write_buf_bytes;
+}
+
+static struct udscs_stream **udscs_find_stream(struct udscs_connection *conn,
+    uint64_t id)
+{
+    struct udscs_stream **streamp = &conn->streams;
+
+    while (*streamp && (*streamp)->id != id)
+        streamp = &(*streamp)->next;
+
+    return streamp;
+}
+
+int udscs_write_stream(struct udscs_connection *conn, uint64_t stream,
+    uint32_t type, uint32_t arg1, uint32_t arg2,
+    const uint8_t *data, uint32_t size)
 {
-    struct udscs_buf *wbuf, *new_wbuf;
+    struct udscs_buf *new_wbuf;
+    struct udscs_stream **streamp = NULL;
     struct udscs_message_header header;
 
+    if (stream) {
+        streamp = udscs_find_stream(conn, stream);
+        if (!*streamp) {
+            *streamp = calloc(1, sizeof(**streamp));
+            if (!*streamp)
+                return -1;
+            (*streamp)->id = stream;
+        }
+    }
+
+    /* Control messages always get queued, dropping one would leave the
+       peer waiting for it, the budget only refuses bulk data */
+    if (size >= BUDGET_BULK_SIZE &&
+            !budget_fits(BUDGET_UDSCS_WRITE, sizeof(header) + size)) {
+        syslog(LOG_ERR, "%p message of %u bytes exceeds the memory budget",
+               conn, size);
+        goto error;
+    }
+
     new_wbuf = malloc(sizeof(*new_wbuf));
     if (!new_wbuf)
-        return -1;
+        goto error;
 
     new_wbuf->pos = 0;
     new_wbuf->size = sizeof(header) + size;
+    new_wbuf->stream = stream;
     new_wbuf->next = NULL;
+    new_wbuf->stream_next = NULL;
     new_wbuf->buf = malloc(new_wbuf->size);
     if (!new_wbuf->buf) {
         free(new_wbuf);
-        return -1;
+        goto error;
     }
 
     header.type = type;
@@ -188,7 +271,10 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     memcpy(new_wbuf->buf, &header, sizeof(header));
     memcpy(new_wbuf->buf + sizeof(header), data, size);
 
-    if (conn->debug) {
+    /* Logging each message slows things down too much, so messages only
+       get traced, unless extra debugging is asked for */
+    trace_event(TRACE_UDSCS_WRITE, TRACE_PTR(conn), type, arg1, arg2, size);
+    if (conn->debug > 1) {
         if (type < conn->no_types)
             syslog(LOG_DEBUG, "%p sent %s, arg1: %u, arg2: %u, size %u",
                    conn, conn->type_to_string[type], arg1, arg2, size);
@@ -198,19 +284,120 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
                    conn, type, arg1, arg2, size);
     }
 
-    if (!conn->write_buf) {
-        conn->write_buf = new_wbuf;
-        return 0;
-    }
+    conn->write_buf_bytes += new_wbuf->size;
+    metrics_inc(METRICS_UDSCS_MESSAGES_SENT);
+    budget_charge(BUDGET_UDSCS_WRITE, new_wbuf->size);
+    metrics_observe(METRICS_UDSCS_MESSAGE_SIZE, new_wbuf->size);
 
     /* maybe we should limit the write_buf stack depth ? */
-    wbuf = conn->write_buf;
-    while (wbuf->next)
-        wbuf = wbuf->next;
+    new_wbuf->prev = conn->write_buf_tail;
+    if (conn->write_buf_tail)
+        conn->write_buf_tail->next = new_wbuf;
+    else
+        conn->write_buf = new_wbuf;
+    conn->write_buf_tail = new_wbuf;
 
-    wbuf->next = new_wbuf;
+    if (streamp) {
+        if ((*streamp)->tail)
+            (*streamp)->tail->stream_next = new_wbuf;
+        else
+            (*streamp)->head = new_wbuf;
+        (*streamp)->tail = new_wbuf;
+    }
 
     return 0;
+
+error:
+    if (streamp && !(*streamp)->head) {
+        struct udscs_stream *empty = *streamp;
+        *streamp = empty->next;
+        free(empty);
+    }
+    return -1;
+}
+
+int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    return udscs_write_stream(conn, 0, type, arg1, arg2, data, size);
+}
+
+/* Remove wbuf from the write_buf list, and from its stream if it is
+   the first buffer of it. */
+static void udscs_unlink_wbuf(struct udscs_connection *conn,
+    struct udscs_buf *wbuf)
+{
+    struct udscs_stream **streamp, *stream;
+
+    if (wbuf->prev)
+        wbuf->prev->next = wbuf->next;
+    else
+        conn->write_buf = wbuf->next;
+    if (wbuf->next)
+        wbuf->next->prev = wbuf->prev;
+    else
+        conn->write_buf_tail = wbuf->prev;
+
+    if (!wbuf->stream)
+        return;
+
+    streamp = udscs_find_stream(conn, wbuf->stream);
+    stream = *streamp;
+    if (!stream || stream->head != wbuf)
+        return;
+
+    stream->head = wbuf->stream_next;
+    if (!stream->head) {
+        *streamp = stream->next;
+        free(stream);
+    }
+}
+
+int udscs_purge_stream(struct udscs_connection *conn, uint64_t stream,
+    udscs_purge_callback purge_callback, void *priv)
+{
+    struct udscs_stream **streamp, *s;
+    struct udscs_buf *wbuf, *next_wbuf;
+    struct udscs_message_header header;
+    int purged = 0;
+
+    if (!conn || !stream)
+        return 0;
+
+    streamp = udscs_find_stream(conn, stream);
+    s = *streamp;
+    if (!s)
+        return 0;
+    *streamp = s->next;
+
+    for (wbuf = s->head; wbuf; wbuf = next_wbuf) {
+        next_wbuf = wbuf->stream_next;
+        wbuf->stream = 0;
+        /* Dropping a partially written message would corrupt the stream */
+        if (wbuf->pos)
+            continue;
+
+        udscs_unlink_wbuf(conn, wbuf);
+        conn->write_buf_bytes -= wbuf->size;
+        budget_release(BUDGET_UDSCS_WRITE, wbuf->size);
+        if (purge_callback) {
+            memcpy(&header, wbuf->buf, sizeof(header));
+            purge_callback(conn, &header, priv);
+        }
+        free(wbuf->buf);
+        free(wbuf);
+        purged++;
+    }
+    free(s);
+    metrics_add(METRICS_UDSCS_MESSAGES_PURGED, purged);
+    trace_event(TRACE_UDSCS_PURGE, TRACE_PTR(conn), stream >> 32, stream,
+                purged, 0);
+
+    if (conn->debug && purged)
+        syslog(LOG_DEBUG, "%p purged %d messages of stream %"PRIx64,
+               conn, purged, stream);
+
+    return purged;
 }
 
 /* A helper for udscs_do_read() */
@@ -218,7 +405,13 @@ static void udscs_read_complete(struct udscs_connection **connp)
 {
     struct udscs_connection *conn = *connp;
 
-    if (conn->debug) {
+    metrics_inc(METRICS_UDSCS_MESSAGES_RECEIVED);
+    metrics_add(METRICS_UDSCS_BYTES_RECEIVED,
+                sizeof(conn->header) + conn->header.size);
+
+    trace_event(TRACE_UDSCS_READ, TRACE_PTR(conn), conn->header.type,
+                conn->header.arg1, conn->header.arg2, conn->header.size);
+    if (conn->debug > 1) {
         if (conn->header.type < conn->no_types)
             syslog(LOG_DEBUG,
                    "%p received %s, arg1: %u, arg2: %u, size %u",
@@ -237,11 +430,46 @@ static void udscs_read_complete(struct udscs_connection **connp)
             return;
     }
 
+    if (conn->data.buf)
+        budget_release(BUDGET_UDSCS_READ, conn->data.size);
     free(conn->data.buf);
     memset(&conn->data, 0, sizeof(conn->data)); /* data.buf = NULL */
     conn->header_read = 0;
 }
 
+/* Allocate the buffer for the data of the message whose header got read,
+   once the memory budget admits it. A helper for udscs_do_read() */
+static void udscs_alloc_data(struct udscs_connection **connp)
+{
+    struct udscs_connection *conn = *connp;
+
+    switch (budget_admit(BUDGET_UDSCS_READ, conn->header.size)) {
+    case BUDGET_ADMIT:
+        break;
+    case BUDGET_DEFER:
+        if (!conn->deferred)
+            metrics_inc(METRICS_BUDGET_DEFERRED);
+        conn->deferred = 1;
+        return;
+    case BUDGET_REFUSE:
+        syslog(LOG_ERR, "message of %u bytes exceeds the memory budget, "
+               "disconnecting %p", conn->header.size, conn);
+        udscs_destroy_connection(connp);
+        return;
+    }
+
+    conn->deferred = 0;
+    conn->data.pos = 0;
+    conn->data.size = conn->header.size;
+    conn->data.buf = malloc(conn->data.size);
+    if (!conn->data.buf) {
+        syslog(LOG_ERR, "out of memory, disconnecting %p", conn);
+        udscs_destroy_connection(connp);
+        return;
+    }
+    budget_charge(BUDGET_UDSCS_READ, conn->data.size);
+}
+
 /* A helper for udscs_client_handle_fds() */
 static void udscs_do_read(struct udscs_connection **connp)
 {
@@ -264,6 +492,7 @@ static void udscs_do_read(struct udscs_connection **connp)
             return;
         syslog(LOG_ERR, "reading unix domain socket: %m, disconnecting %p",
                conn);
+        metrics_inc(METRICS_UDSCS_ERRORS);
     }
     if (n <= 0) {
         udscs_destroy_connection(connp);
@@ -277,14 +506,7 @@ static void udscs_do_read(struct udscs_connection **connp)
                 udscs_read_complete(connp);
                 return;
             }
-            conn->data.pos = 0;
-            conn->data.size = conn->header.size;
-            conn->data.buf = malloc(conn->data.size);
-            if (!conn->data.buf) {
-                syslog(LOG_ERR, "out of memory, disconnecting %p", conn);
-                udscs_destroy_connection(connp);
-                return;
-            }
+            udscs_alloc_data(connp);
         }
     } else {
         conn->data.pos += n;
@@ -315,13 +537,17 @@ static void udscs_do_write(struct udscs_connection **connp)
             return;
         syslog(LOG_ERR, "writing to unix domain socket: %m, disconnecting %p",
                conn);
+        metrics_inc(METRICS_UDSCS_ERRORS);
         udscs_destroy_connection(connp);
         return;
     }
 
     wbuf->pos += n;
+    conn->write_buf_bytes -= n;
+    metrics_add(METRICS_UDSCS_BYTES_SENT, n);
+    budget_release(BUDGET_UDSCS_WRITE, n);
     if (wbuf->pos == wbuf->size) {
-        conn->write_buf = wbuf->next;
+        udscs_unlink_wbuf(conn, wbuf);
         free(wbuf->buf);
         free(wbuf);
     }
@@ -333,7 +559,9 @@ void udscs_client_handle_fds(struct udscs_connection **connp, fd_set *readfds,
     if (!*connp)
         return;
 
-    if (FD_ISSET((*connp)->fd, readfds))
+    if ((*connp)->deferred)
+        udscs_alloc_data(connp);
+    else if (FD_ISSET((*connp)->fd, readfds))
         udscs_do_read(connp);
 
     if (*connp && FD_ISSET((*connp)->fd, writefds))
@@ -346,7 +574,10 @@ int udscs_client_fill_fds(struct udscs_connection *conn, fd_set *readfds,
     if (!conn)
         return -1;
 
-    FD_SET(conn->fd, readfds);
+    /* A quiesced connection only gets read to finish the current message,
+       a deferred one not until its data fits in the memory budget */
+    if (!conn->deferred && (!conn->quiesce || conn->header_read))
+        FD_SET(conn->fd, readfds);
     if (conn->write_buf)
         FD_SET(conn->fd, writefds);
 
@@ -363,20 +594,19 @@ struct udscs_server {
     const char * const *type_to_string;
     int no_types;
     int debug;
+    int quiesce;
     struct udscs_connection connections_head;
     udscs_connect_callback connect_callback;
     udscs_read_callback read_callback;
     udscs_disconnect_callback disconnect_callback;
 };
 
-struct udscs_server *udscs_create_server(const char *socketname,
+struct udscs_server *udscs_create_server_for_fd(int fd,
     udscs_connect_callback connect_callback,
     udscs_read_callback read_callback,
     udscs_disconnect_callback disconnect_callback,
     const char * const type_to_string[], int no_types, int debug)
 {
-    int c;
-    struct sockaddr_un address;
     struct udscs_server *server;
 
     server = calloc(1, sizeof(*server));
@@ -386,35 +616,84 @@ struct udscs_server *udscs_create_server(const char *socketname,
     server->type_to_string = type_to_string;
     server->no_types = no_types;
     server->debug = debug;
+    server->fd = fd;
+    server->connect_callback = connect_callback;
+    server->read_callback = read_callback;
+    server->disconnect_callback = disconnect_callback;
+
+    return server;
+}
+
+struct udscs_server *udscs_create_server(const char *socketname,
+    udscs_connect_callback connect_callback,
+    udscs_read_callback read_callback,
+    udscs_disconnect_callback disconnect_callback,
+    const char * const type_to_string[], int no_types, int debug)
+{
+    int c, fd;
+    struct sockaddr_un address;
+    struct udscs_server *server;
 
-    server->fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (server->fd == -1) {
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
         syslog(LOG_ERR, "creating unix domain socket: %m");
-        free(server);
         return NULL;
     }
 
+    /* The socket only appears under socketname once it is listening, so
+       that clients waiting for it (see vdagent_reconnect_wait) can connect
+       right away */
     address.sun_family = AF_UNIX;
-    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketname);
-    c = bind(server->fd, (struct sockaddr *)&address, sizeof(address));
-    if (c != 0) {
+    c = snprintf(address.sun_path, sizeof(address.sun_path), "%s.new",
+                 socketname);
+    if (c >= (int)sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
         syslog(LOG_ERR, "bind %s: %m", socketname);
-        free(server);
-        return NULL;
+        goto error;
+    }
+    unlink(address.sun_path); /* left behind by a crash */
+    c = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    if (c != 0) {
+        syslog(LOG_ERR, "bind %s: %m", address.sun_path);
+        goto error;
     }
 
-    c = listen(server->fd, 5);
+    c = listen(fd, 5);
     if (c != 0) {
         syslog(LOG_ERR, "listen: %m");
-        free(server);
-        return NULL;
+        goto unlink;
     }
 
-    server->connect_callback = connect_callback;
-    server->read_callback = read_callback;
-    server->disconnect_callback = disconnect_callback;
+    server = udscs_create_server_for_fd(fd, connect_callback, read_callback,
+                                        disconnect_callback, type_to_string,
+                                        no_types, debug);
+    if (!server)
+        goto unlink;
 
+    /* Unlike rename, this fails when the socket exists already */
+    c = link(address.sun_path, socketname);
+    if (c != 0) {
+        c = (errno == EEXIST) ? EADDRINUSE : errno;
+        errno = c;
+        syslog(LOG_ERR, "bind %s: %m", socketname);
+        unlink(address.sun_path);
+        udscs_destroy_server(server);
+        errno = c;
+        return NULL;
+    }
+    unlink(address.sun_path);
     return server;
+
+unlink:
+    /* Keep errno for the caller, it reports EADDRINUSE specially */
+    c = errno;
+    unlink(address.sun_path);
+    errno = c;
+error:
+    c = errno;
+    close(fd);
+    errno = c;
+    return NULL;
 }
 
 void udscs_destroy_server(struct udscs_server *server)
@@ -439,25 +718,23 @@ struct ucred udscs_get_peer_cred(struct udscs_connection *conn)
     return conn->peer_cred;
 }
 
-static void udscs_server_accept(struct udscs_server *server) {
-    struct udscs_connection *new_conn, *conn;
-    struct sockaddr_un address;
-    socklen_t length = sizeof(address);
-    int r, fd;
+int udscs_server_get_fd(struct udscs_server *server)
+{
+    return server->fd;
+}
 
-    fd = accept(server->fd, (struct sockaddr *)&address, &length);
-    if (fd == -1) {
-        if (errno == EINTR)
-            return;
-        syslog(LOG_ERR, "accept: %m");
-        return;
-    }
+struct udscs_connection *udscs_server_adopt_connection(
+    struct udscs_server *server, int fd)
+{
+    struct udscs_connection *new_conn, *conn;
+    socklen_t length;
+    int r;
 
     new_conn = calloc(1, sizeof(*conn));
     if (!new_conn) {
         syslog(LOG_ERR, "out of memory, disconnecting new client");
         close(fd);
-        return;
+        return NULL;
     }
 
     new_conn->fd = fd;
@@ -466,6 +743,7 @@ static void udscs_server_accept(struct udscs_server *server) {
     new_conn->debug = server->debug;
     new_conn->read_callback = server->read_callback;
     new_conn->disconnect_callback = server->disconnect_callback;
+    new_conn->quiesce = server->quiesce;
 
     length = sizeof(new_conn->peer_cred);
     r = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &new_conn->peer_cred, &length);
@@ -473,7 +751,7 @@ static void udscs_server_accept(struct udscs_server *server) {
         syslog(LOG_ERR, "Could not get peercred, disconnecting new client");
         close(fd);
         free(new_conn);
-        return;
+        return NULL;
     }
 
     conn = &server->connections_head;
@@ -487,10 +765,50 @@ static void udscs_server_accept(struct udscs_server *server) {
         syslog(LOG_DEBUG, "new client accepted: %p, pid: %d",
                new_conn, (int)new_conn->peer_cred.pid);
 
-    if (server->connect_callback)
+    return new_conn;
+}
+
+static void udscs_server_accept(struct udscs_server *server) {
+    struct udscs_connection *new_conn;
+    struct sockaddr_un address;
+    socklen_t length = sizeof(address);
+    int fd;
+
+    fd = accept(server->fd, (struct sockaddr *)&address, &length);
+    if (fd == -1) {
+        if (errno == EINTR)
+            return;
+        syslog(LOG_ERR, "accept: %m");
+        return;
+    }
+
+    new_conn = udscs_server_adopt_connection(server, fd);
+    if (new_conn && server->connect_callback)
         server->connect_callback(new_conn);
 }
 
+void udscs_server_quiesce(struct udscs_server *server, int quiesce)
+{
+    struct udscs_connection *conn;
+
+    server->quiesce = quiesce;
+    for (conn = server->connections_head.next; conn; conn = conn->next)
+        conn->quiesce = quiesce;
+}
+
+int udscs_server_is_quiescent(struct udscs_server *server)
+{
+    struct udscs_connection *conn;
+
+    if (!server->quiesce)
+        return 0;
+    for (conn = server->connections_head.next; conn; conn = conn->next) {
+        if (conn->header_read || conn->write_buf)
+            return 0;
+    }
+    return 1;
+}
+
 int udscs_server_fill_fds(struct udscs_server *server, fd_set *readfds,
         fd_set *writefds)
 {
@@ -501,7 +819,8 @@ int udscs_server_fill_fds(struct udscs_server *server, fd_set *readfds,
         return -1;
 
     nfds = server->fd + 1;
-    FD_SET(server->fd, readfds);
+    if (!server->quiesce)
+        FD_SET(server->fd, readfds);
 
     conn = server->connections_head.next;
     while (conn) {
@@ -100,6 +100,40 @@ void udscs_client_handle_fds(struct udscs_connection **connp, fd_set *readfds,
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but tag the message as being part of stream, so that it
+ * can be dropped with udscs_purge_stream() as long as it has not been sent.
+ * Stream 0 is reserved for untagged messages.
+ */
+int udscs_write_stream(struct udscs_connection *conn, uint64_t stream,
+        uint32_t type, uint32_t arg1, uint32_t arg2,
+        const uint8_t *data, uint32_t size);
+
+/* Callbacks with this type get called by udscs_purge_stream() with the
+ * header of each dropped message, e.g. to answer it in another way. They
+ * may queue messages on the connection.
+ */
+typedef void (*udscs_purge_callback)(struct udscs_connection *conn,
+    struct udscs_message_header *header, void *priv);
+
+/* Drop all queued messages of stream, except for a message of which
+ * sending has already started. The cost is linear in the amount of
+ * messages queued for the stream, not in the total queue length.
+ * purge_callback (if not NULL) gets called for each dropped message.
+ * Return value: the number of dropped messages.
+ */
+int udscs_purge_stream(struct udscs_connection *conn, uint64_t stream,
+    udscs_purge_callback purge_callback, void *priv);
+
+/* Return value: the amount of bytes queued for delivery through conn,
+ * 0 if conn is NULL.
+ */
+size_t udscs_get_queued_bytes(struct udscs_connection *conn);
+
+/* Return value: the connection's socket, for handing it over to a new
+ * process (see udscs_server_adopt_connection).
+ */
+int udscs_get_fd(struct udscs_connection *conn);
+
 /* Associates the specified user data with the connection. */
 void udscs_set_user_data(struct udscs_connection *conn, void *data);
 
@@ -137,6 +171,16 @@ struct udscs_server *udscs_create_server(const char *socketname,
     udscs_disconnect_callback disconnect_callback,
     const char * const type_to_string[], int no_types, int debug);
 
+/* Like udscs_create_server, for a unix domain socket which is already
+ * listening, such as one passed in by systemd socket activation. The
+ * server takes ownership of fd.
+ */
+struct udscs_server *udscs_create_server_for_fd(int fd,
+    udscs_connect_callback connect_callback,
+    udscs_read_callback read_callback,
+    udscs_disconnect_callback disconnect_callback,
+    const char * const type_to_string[], int no_types, int debug);
+
 /* Close all the server's connections and releases the corresponding
  * resources.
  * Does nothing if server is NULL.
@@ -179,6 +223,30 @@ void udscs_server_handle_fds(struct udscs_server *server, fd_set *readfds,
 /* Returns the peer's user credentials. */
 struct ucred udscs_get_peer_cred(struct udscs_connection *conn);
 
+/* Return value: the listening socket of the server */
+int udscs_server_get_fd(struct udscs_server *server);
+
+/* Add a connection for fd, which was accepted by another process (or an
+ * earlier incarnation of this one, see udscs_server_quiesce). Unlike with
+ * accepted connections the connect callback does not get called. The
+ * server takes ownership of fd.
+ * Return value: the new connection, NULL on error (fd gets closed then).
+ */
+struct udscs_connection *udscs_server_adopt_connection(
+    struct udscs_server *server, int fd);
+
+/* Stop accepting new connections and stop reading from each connection
+ * once it is between messages, or resume all that if quiesce is 0. What
+ * clients send meanwhile stays in the socket buffers, so that the sockets
+ * can be handed to a new process without any message being cut in half.
+ */
+void udscs_server_quiesce(struct udscs_server *server, int quiesce);
+
+/* Return value: 1 if the server is quiesced, no connection has a partially
+ * read message and all queued messages have been written.
+ */
+int udscs_server_is_quiescent(struct udscs_server *server);
+
 #endif
 
 #endif
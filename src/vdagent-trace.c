@@ -0,0 +1,281 @@
+/*  vdagent-trace.c decoder for spice-vdagent(d) trace dumps
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace.h"
+#include "vdagentd-proto.h"
+#include "vdagentd-proto-strings.h"
+
+struct trace_source {
+    struct trace_file_header header;
+};
+
+struct trace_entry {
+    struct trace_record record;
+    int source;
+    size_t seq;
+};
+
+static struct trace_source *sources = NULL;
+static struct trace_entry *entries = NULL;
+static size_t entry_count = 0;
+
+static int load_file(const char *filename, int source)
+{
+    struct trace_file_header *header = &sources[source].header;
+    struct trace_entry *new_entries;
+    FILE *f;
+    uint64_t i;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+            memcmp(header->magic, TRACE_FILE_MAGIC,
+                   sizeof(TRACE_FILE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", filename);
+        goto error;
+    }
+    if (header->version != TRACE_FILE_VERSION ||
+            header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: unsupported trace file version %u\n", filename,
+                header->version);
+        goto error;
+    }
+    header->program[sizeof(header->program) - 1] = '\0';
+
+    new_entries = realloc(entries,
+                          (entry_count + header->count) * sizeof(*entries));
+    if (!new_entries) {
+        fprintf(stderr, "out of memory\n");
+        goto error;
+    }
+    entries = new_entries;
+
+    for (i = 0; i < header->count; i++) {
+        struct trace_entry *e = &entries[entry_count];
+
+        if (fread(&e->record, sizeof(e->record), 1, f) != 1) {
+            fprintf(stderr, "%s: truncated, %" PRIu64 " of %" PRIu64
+                    " records read\n", filename, i, header->count);
+            break;
+        }
+        e->source = source;
+        e->seq = entry_count;
+        entry_count++;
+    }
+
+    fclose(f);
+    return 0;
+
+error:
+    fclose(f);
+    return -1;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct trace_entry *ea = a, *eb = b;
+
+    if (ea->record.time != eb->record.time)
+        return ea->record.time < eb->record.time ? -1 : 1;
+    /* Keep the order within a file for identical timestamps */
+    return ea->seq < eb->seq ? -1 : 1;
+}
+
+static void print_args(const struct trace_record *r)
+{
+    const char *desc = trace_event_args(r->event);
+    const char *p, *colon;
+    int i;
+
+    for (i = 0, p = desc; p && *p && i < TRACE_MAX_ARGS; i++) {
+        colon = strchr(p, ':');
+        if (!colon)
+            break;
+        printf(" %.*s=", (int)(colon - p), p);
+        switch (colon[1]) {
+        case 'd':
+            printf("%d", (int32_t)r->args[i]);
+            break;
+        case 'x':
+            printf("0x%x", r->args[i]);
+            break;
+        case 'm':
+            if (r->args[i] < VDAGENTD_NO_MESSAGES)
+                printf("\"%s\"", vdagentd_messages[r->args[i]]);
+            else
+                printf("%u", r->args[i]);
+            break;
+        case 'h':
+            if (trace_clipboard_hop_name(r->args[i]))
+                printf("%s", trace_clipboard_hop_name(r->args[i]));
+            else
+                printf("%u", r->args[i]);
+            break;
+        default:
+            printf("%u", r->args[i]);
+        }
+        p = colon + 2;
+        while (*p == ' ')
+            p++;
+    }
+}
+
+static void print_time(uint64_t t)
+{
+    printf("%4" PRIu64 ".%06" PRIu64, t / 1000000000, t % 1000000000 / 1000);
+}
+
+/* Sort the clipboard events on request id, the entries are already sorted on
+   time, and that order is kept for the events of a request */
+static int compare_clipboard_entries(const void *a, const void *b)
+{
+    const struct trace_entry *ea = *(const struct trace_entry **)a;
+    const struct trace_entry *eb = *(const struct trace_entry **)b;
+
+    if (ea->record.args[0] != eb->record.args[0])
+        return ea->record.args[0] < eb->record.args[0] ? -1 : 1;
+    return ea < eb ? -1 : 1;
+}
+
+/* Print each clipboard request with the time spent between its hops */
+static int print_clipboard_requests(uint64_t start)
+{
+    struct trace_entry **clip;
+    size_t i, n = 0, req = 0;
+
+    clip = malloc(entry_count * sizeof(*clip));
+    if (entry_count && !clip) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < entry_count; i++) {
+        /* Requests without an id (older peers) can't be followed */
+        if (entries[i].record.event == TRACE_CLIPBOARD &&
+                entries[i].record.args[0])
+            clip[n++] = &entries[i];
+    }
+    qsort(clip, n, sizeof(*clip), compare_clipboard_entries);
+
+    for (i = 0; i < n; i++) {
+        const struct trace_record *r = &clip[i]->record;
+        const struct trace_source *s = &sources[clip[i]->source];
+        const char *hop = trace_clipboard_hop_name(r->args[1]);
+        int first = i == 0 || clip[i - 1]->record.args[0] != r->args[0];
+        int last = i == n - 1 || clip[i + 1]->record.args[0] != r->args[0];
+
+        if (first) {
+            req = i;
+            printf("request 0x%x selection=%u type=%u\n", r->args[0],
+                   r->args[2], r->args[3]);
+            printf("   ");
+            print_time(r->time - start);
+        } else {
+            printf("  +");
+            print_time(r->time - clip[i - 1]->record.time);
+        }
+        printf(" %s[%d] ", s->header.program, s->header.pid);
+        if (hop)
+            printf("%s", hop);
+        else
+            printf("unknown-hop-%u", r->args[1]);
+        printf(" type=%u size=%d\n", r->args[3], (int32_t)r->args[4]);
+        if (last && !first) {
+            printf("  total ");
+            print_time(r->time - clip[req]->record.time);
+            printf("\n");
+        }
+    }
+
+    free(clip);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t start;
+    size_t i;
+    int j, clipboard = 0, ret = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-c")) {
+        clipboard = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2 || !strcmp(argv[1], "-h")) {
+        fprintf(argc < 2 ? stderr : stdout,
+                "Usage: spice-vdagent-trace [-c] <trace-file>...\n\n"
+                "Decode trace dumps written by spice-vdagentd and "
+                "spice-vdagent\non SIGUSR1, the events of multiple files "
+                "are merged on time.\n\n"
+                "  -c  show the clipboard requests with the time spent "
+                "in each hop\n");
+        return argc < 2;
+    }
+
+    sources = calloc(argc - 1, sizeof(*sources));
+    if (!sources) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (j = 0; j < argc - 1; j++) {
+        if (load_file(argv[j + 1], j))
+            return 1;
+    }
+
+    qsort(entries, entry_count, sizeof(*entries), compare_entries);
+
+    start = entry_count ? entries[0].record.time : 0;
+    if (clipboard) {
+        ret = print_clipboard_requests(start);
+        goto done;
+    }
+
+    for (i = 0; i < entry_count; i++) {
+        const struct trace_record *r = &entries[i].record;
+        const struct trace_source *s = &sources[entries[i].source];
+        const char *name = trace_event_name(r->event);
+        uint64_t t = r->time - start;
+
+        print_time(t);
+        printf(" %s[%d] ", s->header.program, s->header.pid);
+        if (name) {
+            printf("%s", name);
+            print_args(r);
+        } else {
+            printf("unknown-event-%u", r->event);
+        }
+        printf("\n");
+    }
+
+done:
+    free(entries);
+    free(sources);
+    return ret;
+}
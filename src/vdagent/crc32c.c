@@ -0,0 +1,149 @@
+/*  crc32c.c CRC32C (Castagnoli) checksum
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define CRC32C_HAVE_SSE42
+# include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+# define CRC32C_HAVE_ARMV8
+# include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reversed */
+
+/* Slicing-by-8 tables for the generic implementation */
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint32_t lo, hi;
+
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    for (; len >= 8; len -= 8, p += 8) {
+        /* Little endian loads, done byte wise to stay endian neutral */
+        lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^
+              crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^
+              crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^
+              crc32c_table[0][hi >> 24];
+    }
+
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64, v;
+
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_HAVE_ARMV8
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = __crc32cb(crc, *p++);
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len);
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+    if (!crc32c_impl) {
+#if defined(CRC32C_HAVE_SSE42)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+            crc32c_impl = crc32c_hw;
+#elif defined(CRC32C_HAVE_ARMV8)
+        crc32c_impl = crc32c_hw;
+#endif
+        if (!crc32c_impl) {
+            crc32c_init_table();
+            crc32c_impl = crc32c_sw;
+        }
+    }
+
+    return ~crc32c_impl(~crc, buf, len);
+}
@@ -0,0 +1,30 @@
+/*  crc32c.h CRC32C (Castagnoli) checksum
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_CRC32C_H
+#define __VDAGENT_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Update crc with len bytes from buf and return the new crc. Start with a
+   crc of 0, the result is the standard CRC32C of all data fed so far.
+   Uses the SSE 4.2 / ARMv8 crc32c instructions when available. */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -35,19 +35,45 @@
 #include <sys/types.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include "vdagentd-proto.h"
+#include "metrics.h"
 #include "file-xfers.h"
+#include "crc32c.h"
+
+/* Limit the amount of directory fds we keep open for multi-file xfers */
+#define MAX_CACHED_DIR_FDS 64
+
+/* Resumable xfers get their progress written to the journal this often, so
+   that they can also be resumed after the agent crashed (on a clean exit
+   and when vdagentd goes away they get suspended with their exact
+   progress) */
+#define JOURNAL_INTERVAL (64 * 1024 * 1024)
+/* Partial files of xfers which are not resumed within this time get removed */
+#define JOURNAL_MAX_AGE (7 * 24 * 60 * 60)
 
 struct vdagent_file_xfers {
     GHashTable *xfers;
     struct udscs_connection *vdagentd;
     char *save_dir;
+    /* save_dir_fd gets opened on the first xfer, dir_fds caches the fds of
+       the sub-dirs of save_dir used by the current multi-file xfer */
+    int save_dir_fd;
+    GHashTable *dir_fds;
+    /* The files done with per multi-file xfer (keyed on its file count), and
+       the completed files which still need to be synced */
+    GHashTable *sets;
+    int unsynced;
+    /* Progress of suspended (and checkpoints of running) resumable xfers */
+    GKeyFile *journal;
+    char *journal_path;
     int open_save_dir;
     int debug;
 };
 
 typedef struct AgentFileXferTask {
+    struct vdagent_file_xfers      *xfers;
     uint32_t                       id;
     int                            file_fd;
     uint64_t                       read_bytes;
@@ -55,15 +81,33 @@ typedef struct AgentFileXferTask {
     uint64_t                       file_size;
     int                            file_xfer_nr;
     int                            file_xfer_total;
+    /* Running CRC32C of the data received so far */
+    uint32_t                       crc32c;
+    /* Set when the client sent the expected CRC32C in the start msg */
+    int                            check_crc32c;
+    uint32_t                       expected_crc32c;
+    /* Set when the client can resume this xfer after a disconnect */
+    int                            resumable;
+    char                           *client_name;
+    char                           *journal_group;
+    uint64_t                       journal_bytes;
     int                            debug;
 } AgentFileXferTask;
 
+static void vdagent_file_xfers_journal_save(struct vdagent_file_xfers *xfers);
+
 static void vdagent_file_xfer_task_free(gpointer data)
 {
     AgentFileXferTask *task = data;
 
     g_return_if_fail(task != NULL);
 
+    if (task->journal_group) {
+        g_key_file_remove_group(task->xfers->journal, task->journal_group,
+                                NULL);
+        vdagent_file_xfers_journal_save(task->xfers);
+    }
+
     if (task->file_fd > 0) {
         syslog(LOG_ERR, "file-xfer: Removing task %u and file %s due to error",
                task->id, task->file_name);
@@ -74,9 +118,186 @@ static void vdagent_file_xfer_task_free(gpointer data)
                task->id, task->file_name);
 
     g_free(task->file_name);
+    g_free(task->client_name);
+    g_free(task->journal_group);
     g_free(task);
 }
 
+static void vdagent_file_xfers_journal_save(struct vdagent_file_xfers *xfers)
+{
+    GError *error = NULL;
+    gchar **groups, *data, *dir;
+    gsize len;
+
+    groups = g_key_file_get_groups(xfers->journal, NULL);
+    if (groups[0] == NULL) {
+        if (g_unlink(xfers->journal_path) == -1 && errno != ENOENT)
+            syslog(LOG_WARNING, "file-xfer: failed to remove %s: %s",
+                   xfers->journal_path, strerror(errno));
+        g_strfreev(groups);
+        return;
+    }
+    g_strfreev(groups);
+
+    dir = g_path_get_dirname(xfers->journal_path);
+    g_mkdir_with_parents(dir, S_IRWXU);
+    g_free(dir);
+
+    data = g_key_file_to_data(xfers->journal, &len, NULL);
+    if (!g_file_set_contents(xfers->journal_path, data, len, &error)) {
+        syslog(LOG_WARNING, "file-xfer: failed to write journal: %s",
+               error->message);
+        g_clear_error(&error);
+    }
+    g_free(data);
+}
+
+/* Record the progress of task in the journal */
+static void vdagent_file_xfers_journal_update(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    char crc32c[9];
+
+    /* The journal must never claim more data then there is on disk */
+    if (fdatasync(task->file_fd))
+        syslog(LOG_WARNING, "file-xfer: fdatasync %s: %s",
+               task->file_name, strerror(errno));
+
+    if (!task->journal_group)
+        task->journal_group = g_strdup_printf("xfer-%"PRId64"-%u",
+                                              g_get_real_time(), task->id);
+
+    snprintf(crc32c, sizeof(crc32c), "%08x", task->crc32c);
+    g_key_file_set_string(xfers->journal, task->journal_group, "name",
+                          task->client_name);
+    g_key_file_set_string(xfers->journal, task->journal_group, "path",
+                          task->file_name);
+    g_key_file_set_uint64(xfers->journal, task->journal_group, "size",
+                          task->file_size);
+    g_key_file_set_uint64(xfers->journal, task->journal_group,
+                          "bytes-written", task->read_bytes);
+    g_key_file_set_string(xfers->journal, task->journal_group, "crc32c",
+                          crc32c);
+    g_key_file_set_int64(xfers->journal, task->journal_group, "time",
+                         g_get_real_time() / G_USEC_PER_SEC);
+    vdagent_file_xfers_journal_save(xfers);
+
+    task->journal_bytes = task->read_bytes;
+}
+
+/* Load the journal, dropping xfers which have not been resumed in time */
+static void vdagent_file_xfers_journal_load(struct vdagent_file_xfers *xfers)
+{
+    gchar **groups, *path;
+    gint64 time, now = g_get_real_time() / G_USEC_PER_SEC;
+    int i, changed = 0;
+
+    xfers->journal_path = g_build_filename(g_get_user_cache_dir(),
+                                           "spice-vdagent",
+                                           "file-xfers.journal", NULL);
+    xfers->journal = g_key_file_new();
+    if (!g_key_file_load_from_file(xfers->journal, xfers->journal_path,
+                                   G_KEY_FILE_NONE, NULL))
+        return;
+
+    groups = g_key_file_get_groups(xfers->journal, NULL);
+    for (i = 0; groups[i]; i++) {
+        time = g_key_file_get_int64(xfers->journal, groups[i], "time", NULL);
+        if (now - time < JOURNAL_MAX_AGE)
+            continue;
+
+        path = g_key_file_get_string(xfers->journal, groups[i], "path", NULL);
+        if (path) {
+            syslog(LOG_INFO, "file-xfer: removing stale partial file %s",
+                   path);
+            g_unlink(path);
+            g_free(path);
+        }
+        g_key_file_remove_group(xfers->journal, groups[i], NULL);
+        changed = 1;
+    }
+    g_strfreev(groups);
+
+    if (changed)
+        vdagent_file_xfers_journal_save(xfers);
+}
+
+/* Check if a running xfer has checkpointed itself to journal group */
+static int vdagent_file_xfers_group_in_use(struct vdagent_file_xfers *xfers,
+    const char *group)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, xfers->xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        AgentFileXferTask *task = value;
+        if (g_strcmp0(task->journal_group, group) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Look for a suspended xfer of the same file and reattach task to it */
+static int vdagent_file_xfers_journal_resume(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    gchar **groups, *name, *path, *crc32c;
+    uint64_t size, bytes_written;
+    struct stat st;
+    int i, fd;
+
+    groups = g_key_file_get_groups(xfers->journal, NULL);
+    for (i = 0; groups[i]; i++) {
+        name = g_key_file_get_string(xfers->journal, groups[i], "name", NULL);
+        size = g_key_file_get_uint64(xfers->journal, groups[i], "size", NULL);
+        if (g_strcmp0(name, task->client_name) != 0 ||
+                size != task->file_size ||
+                vdagent_file_xfers_group_in_use(xfers, groups[i])) {
+            g_free(name);
+            continue;
+        }
+        g_free(name);
+
+        path = g_key_file_get_string(xfers->journal, groups[i], "path", NULL);
+        crc32c = g_key_file_get_string(xfers->journal, groups[i], "crc32c",
+                                       NULL);
+        bytes_written = g_key_file_get_uint64(xfers->journal, groups[i],
+                                              "bytes-written", NULL);
+        fd = path ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+        if (fd == -1 || fstat(fd, &st) || st.st_size != size ||
+                bytes_written > size || !crc32c ||
+                lseek(fd, bytes_written, SEEK_SET) == -1) {
+            /* The partial file is gone or has been tampered with */
+            if (fd != -1)
+                close(fd);
+            g_free(path);
+            g_free(crc32c);
+            g_key_file_remove_group(xfers->journal, groups[i], NULL);
+            vdagent_file_xfers_journal_save(xfers);
+            continue;
+        }
+
+        g_free(task->file_name);
+        task->file_name = path;
+        task->file_fd = fd;
+        task->read_bytes = bytes_written;
+        task->journal_bytes = bytes_written;
+        task->crc32c = strtoul(crc32c, NULL, 16);
+        task->journal_group = g_strdup(groups[i]);
+        g_free(crc32c);
+        g_strfreev(groups);
+        return 1;
+    }
+    g_strfreev(groups);
+    return 0;
+}
+
+static void vdagent_file_xfers_close_dir_fd(gpointer data)
+{
+    close(GPOINTER_TO_INT(data));
+}
+
 struct vdagent_file_xfers *vdagent_file_xfers_create(
     struct udscs_connection *vdagentd, const char *save_dir,
     int open_save_dir, int debug)
@@ -88,8 +309,14 @@ struct vdagent_file_xfers *vdagent_file_xfers_create(
                                          NULL, vdagent_file_xfer_task_free);
     xfers->vdagentd = vdagentd;
     xfers->save_dir = g_strdup(save_dir);
+    xfers->save_dir_fd = -1;
+    xfers->dir_fds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           vdagent_file_xfers_close_dir_fd);
+    xfers->sets = g_hash_table_new(g_direct_hash, g_direct_equal);
+    xfers->unsynced = 0;
     xfers->open_save_dir = open_save_dir;
     xfers->debug = debug;
+    vdagent_file_xfers_journal_load(xfers);
 
     return xfers;
 }
@@ -98,7 +325,16 @@ void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers)
 {
     g_return_if_fail(xfers != NULL);
 
+    /* Losing vdagentd, or file-xfers getting disabled, suspends the xfers
+       like a client disconnect does, so that they can be resumed */
+    vdagent_file_xfers_client_disconnected(xfers);
     g_hash_table_destroy(xfers->xfers);
+    g_hash_table_destroy(xfers->dir_fds);
+    g_hash_table_destroy(xfers->sets);
+    if (xfers->save_dir_fd != -1)
+        close(xfers->save_dir_fd);
+    g_key_file_free(xfers->journal);
+    g_free(xfers->journal_path);
     g_free(xfers->save_dir);
     g_free(xfers);
 }
@@ -124,6 +360,7 @@ static AgentFileXferTask *vdagent_parse_start_msg(
     GKeyFile *keyfile = NULL;
     AgentFileXferTask *task = NULL;
     GError *error = NULL;
+    char *crc32c, *end;
 
     keyfile = g_key_file_new();
     if (g_key_file_load_from_data(keyfile,
@@ -143,6 +380,7 @@ static AgentFileXferTask *vdagent_parse_start_msg(
                error->message);
         goto error;
     }
+    task->client_name = g_strdup(task->file_name);
     task->file_size = g_key_file_get_uint64(
         keyfile, "vdagent-file-xfer", "size", &error);
     if (error) {
@@ -155,6 +393,25 @@ static AgentFileXferTask *vdagent_parse_start_msg(
         keyfile, "vdagent-file-xfer", "file-xfer-nr", NULL);
     task->file_xfer_total = g_key_file_get_integer(
         keyfile, "vdagent-file-xfer", "file-xfer-total", NULL);
+    /* Clients which know the CRC32C of the file can let us verify it */
+    crc32c = g_key_file_get_string(
+        keyfile, "vdagent-file-xfer", "crc32c", NULL);
+    if (crc32c) {
+        errno = 0;
+        task->expected_crc32c = strtoul(crc32c, &end, 16);
+        if (errno || end == crc32c || *end || strlen(crc32c) > 8) {
+            syslog(LOG_ERR, "file-xfer: invalid crc32c: %s", crc32c);
+            g_free(crc32c);
+            goto error;
+        }
+        task->check_crc32c = 1;
+        g_free(crc32c);
+    }
+    /* Clients which can resume xfers, get the offset to resume from in the
+       CAN_SEND_DATA status, see struct vdagentd_file_xfer_resume, if they
+       announced VDAGENTD_FILE_XFER_RESUME_CAP */
+    task->resumable = g_key_file_get_boolean(
+        keyfile, "vdagent-file-xfer", "resume", NULL);
 
     g_key_file_free(keyfile);
     return task;
@@ -168,82 +425,246 @@ error:
     return NULL;
 }
 
-void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
-    VDAgentFileXferStartMessage *msg)
+/* Return an fd for dir (relative to save_dir), creating it if necessary.
+   The returned fd is owned by xfers, the caller must not close it. */
+static int vdagent_file_xfers_get_dir_fd(struct vdagent_file_xfers *xfers,
+    const char *dir)
 {
-    AgentFileXferTask *task;
-    char *dir = NULL, *path = NULL, *file_path = NULL;
-    struct stat st;
-    int i;
+    gpointer value;
+    char *parent, *base;
+    int parent_fd, fd = -1;
+
+    if (xfers->save_dir_fd == -1) {
+        if (g_mkdir_with_parents(xfers->save_dir, S_IRWXU) == -1) {
+            syslog(LOG_ERR, "file-xfer: Failed to create dir %s",
+                   xfers->save_dir);
+            return -1;
+        }
+        xfers->save_dir_fd = open(xfers->save_dir,
+                                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (xfers->save_dir_fd == -1) {
+            syslog(LOG_ERR, "file-xfer: failed to open dir %s: %s",
+                   xfers->save_dir, strerror(errno));
+            return -1;
+        }
+    }
 
-    g_return_if_fail(xfers != NULL);
+    if (strcmp(dir, ".") == 0 || strcmp(dir, "/") == 0)
+        return xfers->save_dir_fd;
 
-    if (g_hash_table_lookup(xfers->xfers, GUINT_TO_POINTER(msg->id))) {
-        syslog(LOG_ERR, "file-xfer: error id %u already exists, ignoring!",
-               msg->id);
-        return;
+    if (g_hash_table_lookup_extended(xfers->dir_fds, dir, NULL, &value))
+        return GPOINTER_TO_INT(value);
+
+    /* Walk up recursively, so that the parents get cached too */
+    parent = g_path_get_dirname(dir);
+    base = g_path_get_basename(dir);
+    parent_fd = vdagent_file_xfers_get_dir_fd(xfers, parent);
+    if (parent_fd == -1)
+        goto exit;
+
+    if (mkdirat(parent_fd, base, S_IRWXU) == -1 && errno != EEXIST) {
+        syslog(LOG_ERR, "file-xfer: Failed to create dir %s/%s: %s",
+               xfers->save_dir, dir, strerror(errno));
+        goto exit;
+    }
+    fd = openat(parent_fd, base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "file-xfer: failed to open dir %s/%s: %s",
+               xfers->save_dir, dir, strerror(errno));
+        goto exit;
     }
 
-    task = vdagent_parse_start_msg(msg);
-    if (task == NULL) {
-        goto error;
+    if (g_hash_table_size(xfers->dir_fds) >= MAX_CACHED_DIR_FDS) {
+        /* Tasks never hold on to a dir fd, so we can simply start over */
+        g_hash_table_remove_all(xfers->dir_fds);
     }
+    g_hash_table_insert(xfers->dir_fds, g_strdup(dir), GINT_TO_POINTER(fd));
 
-    task->debug = xfers->debug;
+exit:
+    g_free(parent);
+    g_free(base);
+    return fd;
+}
 
-    file_path = g_build_filename(xfers->save_dir, task->file_name, NULL);
+/* Batch the durability of a multi-file xfer into a single syncfs() rather
+   then forcing each (small) file to disk separately */
+static void vdagent_file_xfers_sync(struct vdagent_file_xfers *xfers)
+{
+    if (xfers->unsynced && syncfs(xfers->save_dir_fd) == -1)
+        syslog(LOG_WARNING, "file-xfer: syncfs %s: %s", xfers->save_dir,
+               strerror(errno));
+    xfers->unsynced = 0;
+}
 
-    dir = g_path_get_dirname(file_path);
-    if (g_mkdir_with_parents(dir, S_IRWXU) == -1) {
-        syslog(LOG_ERR, "file-xfer: Failed to create dir %s", dir);
-        goto error;
+/* Called when the last running xfer is done with, this ends the (multi-file)
+   xfers it was part of, completed or abandoned */
+static void vdagent_file_xfers_end_of_set(struct vdagent_file_xfers *xfers)
+{
+    g_hash_table_remove_all(xfers->sets);
+    if (xfers->save_dir_fd == -1)
+        return; /* Resumed xfer(s) only, already synced */
+
+    vdagent_file_xfers_sync(xfers);
+
+    /* Don't hold on to the dirs between xfers, the user may move them */
+    g_hash_table_remove_all(xfers->dir_fds);
+    close(xfers->save_dir_fd);
+    xfers->save_dir_fd = -1;
+}
+
+/* Count task, which is done with (successfully or not), towards its
+   multi-file xfer. The protocol has no id for those, files of concurrent
+   ones with the same file count get counted together, which can only move
+   their syncfs() around.
+   Return value: 1 if the xfer task was part of is complete */
+static int vdagent_file_xfers_count_done(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    gpointer key = GINT_TO_POINTER(task->file_xfer_total);
+    int done;
+
+    if (task->file_xfer_total <= 1)
+        return 1;
+
+    done = GPOINTER_TO_INT(g_hash_table_lookup(xfers->sets, key)) + 1;
+    if (done < task->file_xfer_total) {
+        g_hash_table_insert(xfers->sets, key, GINT_TO_POINTER(done));
+        return 0;
     }
+    g_hash_table_remove(xfers->sets, key);
+    return 1;
+}
 
-    path = g_strdup(file_path);
-    for (i = 0; i < 64 && (stat(path, &st) == 0 || errno != ENOENT); i++) {
-        g_free(path);
-        path = g_strdup_printf("%s (%d)", file_path, i + 1);
+/* Remove task, which is done with */
+static void vdagent_file_xfers_task_done(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task, int success)
+{
+    int set_complete = vdagent_file_xfers_count_done(xfers, task);
+    int last = g_hash_table_size(xfers->xfers) == 1;
+
+    g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(task->id));
+    if (last)
+        vdagent_file_xfers_end_of_set(xfers);
+    else if (set_complete && xfers->save_dir_fd != -1)
+        vdagent_file_xfers_sync(xfers);
+
+    if (set_complete && last && success && xfers->open_save_dir) {
+        char buf[PATH_MAX];
+        snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
+        if (system(buf) == -1)
+            syslog(LOG_WARNING, "file-xfer: failed to open %s",
+                   xfers->save_dir);
+    }
+}
+
+/* Create the file for a new task, returns 0 on success, -1 on error */
+static int vdagent_file_xfers_create_file(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    char *dir, *base, *name = NULL;
+    int i, dir_fd, ret = -1;
+
+    dir = g_path_get_dirname(task->file_name);
+    base = g_path_get_basename(task->file_name);
+
+    dir_fd = vdagent_file_xfers_get_dir_fd(xfers, dir);
+    if (dir_fd == -1)
+        goto exit;
+
+    /* Let O_EXCL detect name collisions, rather then stat()-ing each
+       candidate name first */
+    name = g_strdup(base);
+    for (i = 0; i < 64; i++) {
+        task->file_fd = openat(dir_fd, name,
+                               O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+        if (task->file_fd != -1 || errno != EEXIST)
+            break;
+        g_free(name);
+        name = g_strdup_printf("%s (%d)", base, i + 1);
     }
     g_free(task->file_name);
-    task->file_name = path;
+    task->file_name = g_build_filename(xfers->save_dir, dir, name, NULL);
     if (i == 64) {
-        syslog(LOG_ERR, "file-xfer: more then 63 copies of %s exist?",
-               file_path);
-        goto error;
+        syslog(LOG_ERR, "file-xfer: more then 63 copies of %s/%s/%s exist?",
+               xfers->save_dir, dir, base);
+        goto exit;
     }
-
-    task->file_fd = open(path, O_CREAT | O_WRONLY, 0644);
     if (task->file_fd == -1) {
         syslog(LOG_ERR, "file-xfer: failed to create file %s: %s",
-               path, strerror(errno));
-        goto error;
+               task->file_name, strerror(errno));
+        goto exit;
     }
 
     if (ftruncate(task->file_fd, task->file_size) < 0) {
         syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
-               task->file_size, path, strerror(errno));
+               task->file_size, task->file_name, strerror(errno));
+        goto exit;
+    }
+    ret = 0;
+
+exit:
+    g_free(name);
+    g_free(base);
+    g_free(dir);
+    return ret;
+}
+
+void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
+    VDAgentFileXferStartMessage *msg, int can_resume)
+{
+    AgentFileXferTask *task;
+    struct vdagentd_file_xfer_resume resume;
+
+    g_return_if_fail(xfers != NULL);
+
+    if (g_hash_table_lookup(xfers->xfers, GUINT_TO_POINTER(msg->id))) {
+        syslog(LOG_ERR, "file-xfer: error id %u already exists, ignoring!",
+               msg->id);
+        return;
+    }
+
+    task = vdagent_parse_start_msg(msg);
+    if (task == NULL) {
+        goto error;
+    }
+
+    task->xfers = xfers;
+    task->debug = xfers->debug;
+    /* Other clients would take the resume data for garbage */
+    task->resumable = task->resumable && can_resume;
+
+    if (task->resumable && vdagent_file_xfers_journal_resume(xfers, task)) {
+        syslog(LOG_INFO, "file-xfer: resuming %s at %"PRIu64" bytes",
+               task->file_name, task->read_bytes);
+    } else if (vdagent_file_xfers_create_file(xfers, task) == -1) {
         goto error;
     }
 
     g_hash_table_insert(xfers->xfers, GUINT_TO_POINTER(msg->id), task);
+    metrics_inc(METRICS_FILE_XFER_STARTED);
 
     if (xfers->debug)
         syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes",
-               task->id, path, task->file_size);
+               task->id, task->file_name, task->file_size);
 
-    udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
-    g_free(file_path);
-    g_free(dir);
+    if (task->resumable) {
+        resume.offset = task->read_bytes;
+        resume.crc32c = task->crc32c;
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                    msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA,
+                    (uint8_t *)&resume, sizeof(resume));
+    } else {
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                    msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+    }
     return ;
 
 error:
+    metrics_inc(METRICS_FILE_XFER_FAILED);
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                 msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
     if (task)
         vdagent_file_xfer_task_free(task);
-    g_free(file_path);
-    g_free(dir);
 }
 
 void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
@@ -264,7 +685,8 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
         break;
     default:
         /* Cancel or Error, remove this task */
-        g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+        metrics_inc(METRICS_FILE_XFER_FAILED);
+        vdagent_file_xfers_task_done(xfers, task, 0);
     }
 }
 
@@ -282,25 +704,38 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
 
     len = write(task->file_fd, msg->data, msg->size);
     if (len == msg->size) {
+        /* Checksum the data while it is still hot in the cache, rather then
+           reading the file back once it is complete */
+        task->crc32c = crc32c_update(task->crc32c, msg->data, msg->size);
         task->read_bytes += msg->size;
+        metrics_add(METRICS_FILE_XFER_BYTES, msg->size);
+        if (task->resumable && task->read_bytes < task->file_size &&
+                task->read_bytes - task->journal_bytes >= JOURNAL_INTERVAL)
+            vdagent_file_xfers_journal_update(xfers, task);
         if (task->read_bytes >= task->file_size) {
-            if (task->read_bytes == task->file_size) {
-                if (xfers->debug)
-                    syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
-                           task->id, task->file_name);
+            if (task->read_bytes != task->file_size) {
+                syslog(LOG_ERR, "file-xfer: error received too much data");
+                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+            } else if (task->check_crc32c &&
+                       task->crc32c != task->expected_crc32c) {
+                syslog(LOG_ERR, "file-xfer: task %u %s crc32c mismatch, "
+                       "got %08x expected %08x", task->id, task->file_name,
+                       task->crc32c, task->expected_crc32c);
+                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+            } else {
+                syslog(LOG_INFO, "file-xfer: task %u %s has completed, "
+                       "crc32c %08x", task->id, task->file_name, task->crc32c);
+                /* Files which are part of a multi-file xfer get synced
+                   together once it is complete, see
+                   vdagent_file_xfers_task_done() */
+                if (task->file_xfer_total > 1 && xfers->save_dir_fd != -1)
+                    xfers->unsynced++;
+                else if (fdatasync(task->file_fd))
+                    syslog(LOG_WARNING, "file-xfer: fdatasync %s: %s",
+                           task->file_name, strerror(errno));
                 close(task->file_fd);
                 task->file_fd = -1;
-                if (xfers->open_save_dir &&
-                        task->file_xfer_nr == task->file_xfer_total &&
-                        g_hash_table_size(xfers->xfers) == 1) {
-                    char buf[PATH_MAX];
-                    snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
-                    status = system(buf);
-                }
                 status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
-            } else {
-                syslog(LOG_ERR, "file-xfer: error received too much data");
-                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
             }
         }
     } else {
@@ -310,10 +745,45 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     }
 
     if (status != -1) {
+        metrics_inc(status == VD_AGENT_FILE_XFER_STATUS_SUCCESS ?
+                    METRICS_FILE_XFER_COMPLETED : METRICS_FILE_XFER_FAILED);
         udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                     msg->id, status, NULL, 0);
-        g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+        vdagent_file_xfers_task_done(xfers, task,
+                            status == VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    }
+}
+
+static gboolean vdagent_file_xfers_suspend(gpointer key, gpointer value,
+    gpointer user_data)
+{
+    struct vdagent_file_xfers *xfers = user_data;
+    AgentFileXferTask *task = value;
+
+    if (!task->resumable) {
+        metrics_inc(METRICS_FILE_XFER_FAILED);
+        return TRUE; /* Remove the task together with its partial file */
     }
+
+    vdagent_file_xfers_journal_update(xfers, task);
+    close(task->file_fd);
+    task->file_fd = -1;
+    /* Detach the task from its journal entry, so that it survives */
+    g_free(task->journal_group);
+    task->journal_group = NULL;
+
+    syslog(LOG_INFO, "file-xfer: suspending %s at %"PRIu64" bytes",
+           task->file_name, task->read_bytes);
+    return TRUE;
+}
+
+void vdagent_file_xfers_client_disconnected(struct vdagent_file_xfers *xfers)
+{
+    g_return_if_fail(xfers != NULL);
+
+    g_hash_table_foreach_remove(xfers->xfers, vdagent_file_xfers_suspend,
+                                xfers);
+    vdagent_file_xfers_end_of_set(xfers);
 }
 
 void vdagent_file_xfers_error(struct udscs_connection *vdagentd, uint32_t msg_id)
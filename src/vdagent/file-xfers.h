@@ -29,14 +29,21 @@ struct vdagent_file_xfers;
 struct vdagent_file_xfers *vdagent_file_xfers_create(
         struct udscs_connection *vdagentd, const char *save_dir,
         int open_save_dir, int debug);
+/* Suspends the running xfers, see vdagent_file_xfers_client_disconnected */
 void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfer);
 
+/* can_resume: the spice client announced VDAGENTD_FILE_XFER_RESUME_CAP */
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
-    VDAgentFileXferStartMessage *msg);
+    VDAgentFileXferStartMessage *msg, int can_resume);
 void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStatusMessage *msg);
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg);
+/* Suspend the running xfers, the partial files of xfers for which the
+   client indicated that it can resume them are kept, together with a
+   journal entry recording their progress. A new xfer of a file with the
+   same name and size will continue where the suspended one left off. */
+void vdagent_file_xfers_client_disconnected(struct vdagent_file_xfers *xfers);
 void vdagent_file_xfers_error(struct udscs_connection *vdagentd,
     uint32_t msg_id);
 
@@ -0,0 +1,366 @@
+/*  image.c clipboard image conversion, done on a worker thread
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <spice/vd_agent.h>
+
+#include "image.h"
+
+#ifdef HAVE_GDK_PIXBUF
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/* How often an image which does not fit in max_size gets scaled down to
+   about half its area, before it is sent as is */
+#define IMAGE_MAX_SCALE_STEPS 8
+
+struct vdagent_image_job {
+    uint32_t from;
+    uint32_t to;
+    int32_t max_size;
+    uint8_t *data; /* the image to convert, then the result */
+    uint32_t size;
+    vdagent_image_done_callback done;
+    void *opaque;
+    struct vdagent_image_job *next;
+};
+
+/* The worker thread takes jobs from todo and puts them on done, waking up
+   the main loop through the pipe. Only the lists and quit are shared, under
+   lock, the jobs belong to whoever has them on their list. */
+struct vdagent_image {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct vdagent_image_job *todo;
+    struct vdagent_image_job *done;
+    int quit;
+    int pipe[2];
+    int debug;
+};
+
+static const char *vdagent_image_format(uint32_t type)
+{
+    switch (type) {
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
+        return "png";
+    case VD_AGENT_CLIPBOARD_IMAGE_BMP:
+        return "bmp";
+    case VD_AGENT_CLIPBOARD_IMAGE_TIFF:
+        return "tiff";
+    case VD_AGENT_CLIPBOARD_IMAGE_JPG:
+        return "jpeg";
+    default:
+        return NULL;
+    }
+}
+
+static void vdagent_image_append(struct vdagent_image_job **list,
+                                 struct vdagent_image_job *job)
+{
+    job->next = NULL;
+    while (*list)
+        list = &(*list)->next;
+    *list = job;
+}
+
+static GdkPixbuf *vdagent_image_decode(struct vdagent_image_job *job,
+                                       GError **err)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf = NULL;
+
+    loader = gdk_pixbuf_loader_new_with_type(vdagent_image_format(job->from),
+                                             err);
+    if (!loader)
+        return NULL;
+
+    if (gdk_pixbuf_loader_write(loader, job->data, job->size, err) &&
+            gdk_pixbuf_loader_close(loader, err)) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf)
+            g_object_ref(pixbuf);
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+/* Runs on the worker thread, replaces job->data with the result */
+static void vdagent_image_run(struct vdagent_image *image,
+                              struct vdagent_image_job *job)
+{
+    const char *format = vdagent_image_format(job->to);
+    GdkPixbuf *pixbuf, *scaled;
+    GError *err = NULL;
+    gchar *buf = NULL;
+    gsize size = 0;
+    int i, width, height;
+
+    pixbuf = vdagent_image_decode(job, &err);
+    free(job->data);
+    job->data = NULL;
+    job->size = 0;
+    if (!pixbuf)
+        goto error;
+
+    for (i = 0; ; i++) {
+        if (job->to == VD_AGENT_CLIPBOARD_IMAGE_JPG) {
+            if (!gdk_pixbuf_save_to_buffer(pixbuf, &buf, &size, format, &err,
+                                           "quality", "90", NULL))
+                break;
+        } else {
+            if (!gdk_pixbuf_save_to_buffer(pixbuf, &buf, &size, format, &err,
+                                           NULL))
+                break;
+        }
+        if (job->max_size < 0 || size <= (gsize)job->max_size ||
+                i == IMAGE_MAX_SCALE_STEPS)
+            break;
+
+        width = gdk_pixbuf_get_width(pixbuf) * 7 / 10;
+        height = gdk_pixbuf_get_height(pixbuf) * 7 / 10;
+        if (width < 1 || height < 1)
+            break;
+        if (image->debug)
+            syslog(LOG_DEBUG, "image: %lu bytes is too large, scaling to "
+                   "%dx%d", (unsigned long)size, width, height);
+        scaled = gdk_pixbuf_scale_simple(pixbuf, width, height,
+                                         GDK_INTERP_BILINEAR);
+        if (!scaled)
+            break;
+        g_object_unref(pixbuf);
+        pixbuf = scaled;
+        g_free(buf);
+        buf = NULL;
+    }
+    g_object_unref(pixbuf);
+
+    if (buf) {
+        job->data = malloc(size);
+        if (job->data) {
+            memcpy(job->data, buf, size);
+            job->size = size;
+        } else {
+            syslog(LOG_ERR, "image: out of memory converting image");
+        }
+        g_free(buf);
+        return;
+    }
+
+error:
+    syslog(LOG_ERR, "image: converting %s to %s failed: %s",
+           vdagent_image_format(job->from), format,
+           err ? err->message : "unknown error");
+    g_clear_error(&err);
+}
+
+static void *vdagent_image_thread(void *arg)
+{
+    struct vdagent_image *image = arg;
+    struct vdagent_image_job *job;
+
+    pthread_mutex_lock(&image->lock);
+    while (!image->quit) {
+        if (!image->todo) {
+            pthread_cond_wait(&image->cond, &image->lock);
+            continue;
+        }
+        job = image->todo;
+        image->todo = job->next;
+        pthread_mutex_unlock(&image->lock);
+
+        vdagent_image_run(image, job);
+
+        pthread_mutex_lock(&image->lock);
+        vdagent_image_append(&image->done, job);
+        /* A full pipe already has the main loop's attention */
+        if (write(image->pipe[1], "", 1) == -1 && errno != EAGAIN)
+            syslog(LOG_ERR, "image: waking up main loop: %m");
+    }
+    pthread_mutex_unlock(&image->lock);
+    return NULL;
+}
+
+struct vdagent_image *vdagent_image_create(int debug)
+{
+    struct vdagent_image *image;
+
+#if !GLIB_CHECK_VERSION(2, 36, 0)
+    g_type_init();
+#endif
+
+    image = calloc(1, sizeof(*image));
+    if (!image) {
+        syslog(LOG_ERR, "out of memory allocating image converter");
+        return NULL;
+    }
+    image->debug = debug;
+
+    if (pipe2(image->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        syslog(LOG_ERR, "image: creating pipe: %m");
+        free(image);
+        return NULL;
+    }
+    pthread_mutex_init(&image->lock, NULL);
+    pthread_cond_init(&image->cond, NULL);
+    if (pthread_create(&image->thread, NULL, vdagent_image_thread, image)) {
+        syslog(LOG_ERR, "image: could not start worker thread, "
+               "clipboard images will not be converted");
+        pthread_cond_destroy(&image->cond);
+        pthread_mutex_destroy(&image->lock);
+        close(image->pipe[0]);
+        close(image->pipe[1]);
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+void vdagent_image_destroy(struct vdagent_image *image)
+{
+    struct vdagent_image_job *job, *next;
+
+    if (!image)
+        return;
+
+    pthread_mutex_lock(&image->lock);
+    image->quit = 1;
+    pthread_cond_signal(&image->cond);
+    pthread_mutex_unlock(&image->lock);
+    pthread_join(image->thread, NULL);
+
+    vdagent_image_do_read(image);
+    for (job = image->todo; job; job = next) {
+        next = job->next;
+        free(job->data);
+        job->done(job->opaque, NULL, 0);
+        free(job);
+    }
+
+    pthread_cond_destroy(&image->cond);
+    pthread_mutex_destroy(&image->lock);
+    close(image->pipe[0]);
+    close(image->pipe[1]);
+    free(image);
+}
+
+int vdagent_image_get_fd(struct vdagent_image *image)
+{
+    return image->pipe[0];
+}
+
+void vdagent_image_do_read(struct vdagent_image *image)
+{
+    struct vdagent_image_job *job, *next;
+    char buf[64];
+
+    while (read(image->pipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&image->lock);
+    job = image->done;
+    image->done = NULL;
+    pthread_mutex_unlock(&image->lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        job->done(job->opaque, job->data, job->size);
+        free(job);
+    }
+}
+
+int vdagent_image_supports(uint32_t type)
+{
+    return vdagent_image_format(type) != NULL;
+}
+
+void vdagent_image_convert(struct vdagent_image *image, uint32_t from,
+    uint32_t to, const uint8_t *data, uint32_t size, int32_t max_size,
+    vdagent_image_done_callback done, void *opaque)
+{
+    struct vdagent_image_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (job)
+        job->data = malloc(size);
+    if (!job || !job->data) {
+        syslog(LOG_ERR, "out of memory allocating image conversion job");
+        free(job);
+        done(opaque, NULL, 0);
+        return;
+    }
+    memcpy(job->data, data, size);
+    job->size = size;
+    job->from = from;
+    job->to = to;
+    job->max_size = max_size;
+    job->done = done;
+    job->opaque = opaque;
+
+    pthread_mutex_lock(&image->lock);
+    vdagent_image_append(&image->todo, job);
+    pthread_cond_signal(&image->cond);
+    pthread_mutex_unlock(&image->lock);
+}
+
+#else /* !HAVE_GDK_PIXBUF */
+
+struct vdagent_image *vdagent_image_create(int debug)
+{
+    return NULL;
+}
+
+void vdagent_image_destroy(struct vdagent_image *image)
+{
+}
+
+int vdagent_image_get_fd(struct vdagent_image *image)
+{
+    return -1;
+}
+
+void vdagent_image_do_read(struct vdagent_image *image)
+{
+}
+
+int vdagent_image_supports(uint32_t type)
+{
+    return 0;
+}
+
+void vdagent_image_convert(struct vdagent_image *image, uint32_t from,
+    uint32_t to, const uint8_t *data, uint32_t size, int32_t max_size,
+    vdagent_image_done_callback done, void *opaque)
+{
+    done(opaque, NULL, 0);
+}
+
+#endif
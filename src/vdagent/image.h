@@ -0,0 +1,53 @@
+/*  image.h clipboard image conversion, done on a worker thread
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_IMAGE_H
+#define __VDAGENT_IMAGE_H
+
+#include <stdint.h>
+
+struct vdagent_image;
+
+/* Called from vdagent_image_do_read() with the malloc-ed converted image,
+   which the callback takes ownership of. data is NULL when the conversion
+   failed or the job got dropped by vdagent_image_destroy(). */
+typedef void (*vdagent_image_done_callback)(void *opaque, uint8_t *data,
+                                            uint32_t size);
+
+/* Return value: NULL when images can not be converted (built without
+   gdk-pixbuf, or the worker thread could not be started). */
+struct vdagent_image *vdagent_image_create(int debug);
+void vdagent_image_destroy(struct vdagent_image *image);
+
+/* The fd becomes readable when jobs have finished, call
+   vdagent_image_do_read() then to run their callbacks. */
+int vdagent_image_get_fd(struct vdagent_image *image);
+void vdagent_image_do_read(struct vdagent_image *image);
+
+/* Return value: 1 if images of VD_AGENT_CLIPBOARD_IMAGE_* type can be
+   converted from and to, 0 otherwise. */
+int vdagent_image_supports(uint32_t type);
+
+/* Convert an image of type from to type to, scaling it down as needed for
+   the result to fit in max_size bytes (-1 for no limit). data gets copied,
+   done is called once the conversion has finished. */
+void vdagent_image_convert(struct vdagent_image *image, uint32_t from,
+    uint32_t to, const uint8_t *data, uint32_t size, int32_t max_size,
+    vdagent_image_done_callback done, void *opaque);
+
+#endif
@@ -0,0 +1,327 @@
+/*  lineend.c CRLF <-> LF line ending conversion
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "lineend.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define LINEEND_HAVE_SSE2
+# define LINEEND_HAVE_AVX2
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define LINEEND_HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+/* The vector versions classify 64 bytes at a time into a bitmask of CRs and
+   one of LFs. Blocks without any line endings to convert, which is most of
+   them for normal text, get copied (or skipped when in place) as a whole,
+   the others are copied in pieces between the bits. */
+#define LINEEND_BLOCK 64
+
+typedef void (*lineend_masks_fn)(const uint8_t *p, uint64_t *cr, uint64_t *lf);
+
+struct lineend_impl {
+    size_t (*crlf_to_lf)(uint8_t *buf, size_t len);
+    size_t (*lf_to_crlf_extra)(const uint8_t *src, size_t len, int cr);
+    size_t (*lf_to_crlf)(uint8_t *dst, const uint8_t *src, size_t len,
+                         int *cr);
+};
+
+/* Generic implementation, also used for the tails of the vector versions.
+   dst may be equal to src, the output is never longer than the input */
+static size_t crlf_to_lf_sw(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint8_t *d = dst;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '\r' && i + 1 < len && src[i + 1] == '\n')
+            continue;
+        *d++ = src[i];
+    }
+    return d - dst;
+}
+
+static size_t lf_to_crlf_extra_sw(const uint8_t *src, size_t len, int cr)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '\n' && !cr)
+            n++;
+        cr = src[i] == '\r';
+    }
+    return n;
+}
+
+static size_t lf_to_crlf_sw(uint8_t *dst, const uint8_t *src, size_t len,
+                            int *cr)
+{
+    uint8_t *d = dst;
+    int c = *cr;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '\n' && !c)
+            *d++ = '\r';
+        c = src[i] == '\r';
+        *d++ = src[i];
+    }
+    *cr = c;
+    return d - dst;
+}
+
+#if !defined(LINEEND_HAVE_SSE2) && !defined(LINEEND_HAVE_NEON)
+static size_t lineend_crlf_to_lf_sw(uint8_t *buf, size_t len)
+{
+    return crlf_to_lf_sw(buf, buf, len);
+}
+
+static const struct lineend_impl lineend_sw = {
+    lineend_crlf_to_lf_sw,
+    lf_to_crlf_extra_sw,
+    lf_to_crlf_sw,
+};
+#endif
+
+#if defined(LINEEND_HAVE_SSE2) || defined(LINEEND_HAVE_NEON)
+/* These get inlined into the per instruction set wrappers below, so that
+   masks becomes a direct call which can be inlined too */
+static inline __attribute__((always_inline))
+size_t crlf_to_lf_simd(uint8_t *buf, size_t len, lineend_masks_fn masks)
+{
+    const uint8_t *s = buf;
+    uint8_t *d = buf;
+    uint64_t cr, lf, drop;
+    unsigned int i, pos;
+
+    for (; len >= LINEEND_BLOCK; len -= LINEEND_BLOCK, s += LINEEND_BLOCK) {
+        masks(s, &cr, &lf);
+        drop = cr & (lf >> 1);
+        if ((cr >> 63) && len > LINEEND_BLOCK && s[LINEEND_BLOCK] == '\n')
+            drop |= UINT64_C(1) << 63;
+        if (!drop) {
+            /* Nothing to move until the first CR LF has been dropped */
+            if (d != s)
+                memmove(d, s, LINEEND_BLOCK);
+            d += LINEEND_BLOCK;
+            continue;
+        }
+        for (pos = 0; drop; drop &= drop - 1) {
+            i = __builtin_ctzll(drop);
+            memmove(d, s + pos, i - pos);
+            d += i - pos;
+            pos = i + 1;
+        }
+        memmove(d, s + pos, LINEEND_BLOCK - pos);
+        d += LINEEND_BLOCK - pos;
+    }
+    d += crlf_to_lf_sw(d, s, len);
+    return d - buf;
+}
+
+static inline __attribute__((always_inline))
+size_t lf_to_crlf_extra_simd(const uint8_t *s, size_t len, int c,
+                             lineend_masks_fn masks)
+{
+    uint64_t cr, lf;
+    size_t n = 0;
+
+    for (; len >= LINEEND_BLOCK; len -= LINEEND_BLOCK, s += LINEEND_BLOCK) {
+        masks(s, &cr, &lf);
+        n += __builtin_popcountll(lf & ~(cr << 1 | c));
+        c = cr >> 63;
+    }
+    return n + lf_to_crlf_extra_sw(s, len, c);
+}
+
+static inline __attribute__((always_inline))
+size_t lf_to_crlf_simd(uint8_t *dst, const uint8_t *s, size_t len, int *cr_ret,
+                       lineend_masks_fn masks)
+{
+    uint8_t *d = dst;
+    uint64_t cr, lf, insert;
+    unsigned int i, pos;
+    int c = *cr_ret;
+
+    for (; len >= LINEEND_BLOCK; len -= LINEEND_BLOCK, s += LINEEND_BLOCK) {
+        masks(s, &cr, &lf);
+        insert = lf & ~(cr << 1 | c);
+        c = cr >> 63;
+        if (!insert) {
+            memcpy(d, s, LINEEND_BLOCK);
+            d += LINEEND_BLOCK;
+            continue;
+        }
+        /* The LF itself starts the next piece */
+        for (pos = 0; insert; insert &= insert - 1) {
+            i = __builtin_ctzll(insert);
+            memcpy(d, s + pos, i - pos);
+            d += i - pos;
+            *d++ = '\r';
+            pos = i;
+        }
+        memcpy(d, s + pos, LINEEND_BLOCK - pos);
+        d += LINEEND_BLOCK - pos;
+    }
+    d += lf_to_crlf_sw(d, s, len, &c);
+    *cr_ret = c;
+    return d - dst;
+}
+
+#define LINEEND_DEFINE_IMPL(name, attr)                                      \
+attr static size_t crlf_to_lf_##name(uint8_t *buf, size_t len)               \
+{                                                                            \
+    return crlf_to_lf_simd(buf, len, lineend_masks_##name);                  \
+}                                                                            \
+attr static size_t lf_to_crlf_extra_##name(const uint8_t *src, size_t len,   \
+                                           int cr)                           \
+{                                                                            \
+    return lf_to_crlf_extra_simd(src, len, cr, lineend_masks_##name);        \
+}                                                                            \
+attr static size_t lf_to_crlf_##name(uint8_t *dst, const uint8_t *src,       \
+                                     size_t len, int *cr)                    \
+{                                                                            \
+    return lf_to_crlf_simd(dst, src, len, cr, lineend_masks_##name);         \
+}                                                                            \
+static const struct lineend_impl lineend_##name = {                          \
+    crlf_to_lf_##name,                                                       \
+    lf_to_crlf_extra_##name,                                                 \
+    lf_to_crlf_##name,                                                       \
+}
+#endif
+
+#ifdef LINEEND_HAVE_SSE2
+static void lineend_masks_sse2(const uint8_t *p, uint64_t *cr, uint64_t *lf)
+{
+    const __m128i vcr = _mm_set1_epi8('\r');
+    const __m128i vlf = _mm_set1_epi8('\n');
+    uint64_t c = 0, l = 0;
+    __m128i v;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        c |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vcr))
+             << (16 * i);
+        l |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vlf))
+             << (16 * i);
+    }
+    *cr = c;
+    *lf = l;
+}
+
+LINEEND_DEFINE_IMPL(sse2, );
+#endif
+
+#ifdef LINEEND_HAVE_AVX2
+__attribute__((target("avx2,popcnt")))
+static void lineend_masks_avx2(const uint8_t *p, uint64_t *cr, uint64_t *lf)
+{
+    const __m256i vcr = _mm256_set1_epi8('\r');
+    const __m256i vlf = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+    *cr = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vcr)) |
+          (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vcr))
+          << 32;
+    *lf = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vlf)) |
+          (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vlf))
+          << 32;
+}
+
+LINEEND_DEFINE_IMPL(avx2, __attribute__((target("avx2,popcnt"))));
+#endif
+
+#ifdef LINEEND_HAVE_NEON
+/* NEON has no movemask, weigh the bytes of each compare result with their
+   bit and add them up pairwise until 64 bits remain */
+static uint64_t lineend_neon_bits(uint8x16_t a, uint8x16_t b,
+                                  uint8x16_t c, uint8x16_t d)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    const uint8x16_t w = vld1q_u8(weights);
+    uint8x16_t s;
+
+    s = vpaddq_u8(vpaddq_u8(vandq_u8(a, w), vandq_u8(b, w)),
+                  vpaddq_u8(vandq_u8(c, w), vandq_u8(d, w)));
+    s = vpaddq_u8(s, s);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s), 0);
+}
+
+static void lineend_masks_neon(const uint8_t *p, uint64_t *cr, uint64_t *lf)
+{
+    const uint8x16_t vcr = vdupq_n_u8('\r');
+    const uint8x16_t vlf = vdupq_n_u8('\n');
+    uint8x16_t a = vld1q_u8(p), b = vld1q_u8(p + 16);
+    uint8x16_t c = vld1q_u8(p + 32), d = vld1q_u8(p + 48);
+
+    *cr = lineend_neon_bits(vceqq_u8(a, vcr), vceqq_u8(b, vcr),
+                            vceqq_u8(c, vcr), vceqq_u8(d, vcr));
+    *lf = lineend_neon_bits(vceqq_u8(a, vlf), vceqq_u8(b, vlf),
+                            vceqq_u8(c, vlf), vceqq_u8(d, vlf));
+}
+
+LINEEND_DEFINE_IMPL(neon, );
+#endif
+
+static const struct lineend_impl *lineend_impl;
+
+static const struct lineend_impl *lineend_get_impl(void)
+{
+    if (!lineend_impl) {
+#if defined(LINEEND_HAVE_AVX2)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("popcnt"))
+            lineend_impl = &lineend_avx2;
+        else
+            lineend_impl = &lineend_sse2;
+#elif defined(LINEEND_HAVE_NEON)
+        lineend_impl = &lineend_neon;
+#else
+        lineend_impl = &lineend_sw;
+#endif
+    }
+    return lineend_impl;
+}
+
+size_t lineend_crlf_to_lf(uint8_t *buf, size_t len)
+{
+    return lineend_get_impl()->crlf_to_lf(buf, len);
+}
+
+size_t lineend_lf_to_crlf_extra(const uint8_t *src, size_t len, int cr)
+{
+    return lineend_get_impl()->lf_to_crlf_extra(src, len, cr);
+}
+
+size_t lineend_lf_to_crlf(uint8_t *dst, const uint8_t *src, size_t len,
+                          int *cr)
+{
+    return lineend_get_impl()->lf_to_crlf(dst, src, len, cr);
+}
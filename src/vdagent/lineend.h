@@ -0,0 +1,41 @@
+/*  lineend.h CRLF <-> LF line ending conversion
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_LINEEND_H
+#define __VDAGENT_LINEEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Replace every CR LF pair in buf with a single LF, in place, and return
+   the new length. Lone CRs are left alone. */
+size_t lineend_crlf_to_lf(uint8_t *buf, size_t len);
+
+/* The LF -> CR LF direction can be done in chunks: *cr tracks whether the
+   previous chunk ended with a CR, start with *cr = 0. Only lone LFs get a
+   CR inserted, so text which already uses CR LF is passed on unchanged.
+
+   lineend_lf_to_crlf_extra() returns how many bytes converting src would
+   add, without changing *cr. lineend_lf_to_crlf() converts src into dst,
+   which must have room for len + lineend_lf_to_crlf_extra() bytes, and
+   returns the number of bytes written. */
+size_t lineend_lf_to_crlf_extra(const uint8_t *src, size_t len, int cr);
+size_t lineend_lf_to_crlf(uint8_t *dst, const uint8_t *src, size_t len,
+                          int *cr);
+
+#endif
@@ -0,0 +1,121 @@
+/*  reconnect.c wait for vdagentd's socket to (re)appear
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "reconnect.h"
+
+/* The backoff doubles from the minimum with each failure, up to what the
+   agent used to poll at */
+#define RECONNECT_MIN_MS 10
+#define RECONNECT_MAX_MS 1000
+/* When waiting for the socket to get created, in case inotify misses it */
+#define RECONNECT_SAFETY_MS 10000
+
+static int vdagent_reconnect_backoff_ms(unsigned int failures)
+{
+    int ms = RECONNECT_MIN_MS;
+
+    while (failures-- > 1 && ms < RECONNECT_MAX_MS)
+        ms *= 2;
+    if (ms > RECONNECT_MAX_MS)
+        ms = RECONNECT_MAX_MS;
+
+    /* Spread out the agents of all sessions, which retry at the same time */
+    return g_random_int_range(ms / 2, ms + 1);
+}
+
+/* Closing an inotify fd waits for an RCU grace period, which takes
+   milliseconds, so the watch is kept for the life of the agent */
+static int inotify_fd = -1;
+static int watching;
+
+/* Return value: 1 if the socket's name is among the events, or the watch
+   got lost (the directory went away, or events got dropped) */
+static int vdagent_reconnect_read_events(const char *base)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    int found = 0;
+    ssize_t n, i;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)(buf + i);
+            if (event->mask & IN_IGNORED)
+                watching = 0;
+            if ((event->mask & (IN_IGNORED | IN_Q_OVERFLOW)) ||
+                    (event->len && !strcmp(event->name, base)))
+                found = 1;
+        }
+    }
+    return found;
+}
+
+void vdagent_reconnect_wait(const char *socketname, unsigned int failures)
+{
+    gchar *dir = g_path_get_dirname(socketname);
+    gchar *base = g_path_get_basename(socketname);
+    struct pollfd p;
+    struct stat st;
+    gint64 end;
+    int timeout;
+
+    if (inotify_fd == -1)
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    /* IN_ATTRIB for vdagentd making the socket accessible */
+    if (inotify_fd != -1 && !watching)
+        watching = inotify_add_watch(inotify_fd, dir,
+                                     IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                                     IN_MOVED_FROM | IN_ATTRIB) != -1;
+    /* Events from before now are of no interest, stat tells about those */
+    if (watching)
+        vdagent_reconnect_read_events(base);
+
+    if (!watching || stat(socketname, &st) == 0)
+        timeout = vdagent_reconnect_backoff_ms(failures);
+    else
+        timeout = RECONNECT_SAFETY_MS;
+    end = g_get_monotonic_time() + timeout * 1000;
+
+    p.fd = inotify_fd;
+    p.events = POLLIN;
+    for (;;) {
+        timeout = (end - g_get_monotonic_time()) / 1000;
+        if (timeout <= 0)
+            break;
+        /* Without a watch this just sleeps */
+        if (poll(&p, watching, timeout) <= 0)
+            break; /* timed out, or interrupted by a signal */
+        if (vdagent_reconnect_read_events(base))
+            break;
+    }
+
+    g_free(base);
+    g_free(dir);
+}
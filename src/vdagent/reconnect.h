@@ -0,0 +1,32 @@
+/*  reconnect.h wait for vdagentd's socket to (re)appear
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_RECONNECT_H
+#define __VDAGENT_RECONNECT_H
+
+/* Wait before connecting to socketname again, after failures failed
+   attempts (or attempts which got the wrong daemon version).
+
+   When the socket does not exist this returns as soon as it gets created,
+   watched with inotify. When it does exist (the daemon is starting up,
+   shutting down or gone without removing it), or can not be watched, this
+   waits for a jittered backoff, which grows with failures, or until the
+   socket gets replaced. It also returns when interrupted by a signal. */
+void vdagent_reconnect_wait(const char *socketname, unsigned int failures);
+
+#endif
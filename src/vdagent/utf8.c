@@ -0,0 +1,372 @@
+/*  utf8.c UTF-8 validation and ISO Latin-1 conversion
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "utf8.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define UTF8_HAVE_SSE2
+# define UTF8_HAVE_AVX2
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define UTF8_HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+/* Like lineend.c the vector versions work on blocks of 64 bytes, getting a
+   bitmask of the bytes >= 0x80 for each. Blocks of ASCII, which is what
+   most clipboard text is made of, are skipped or copied as a whole, the
+   others are handled byte wise up to the end of the block. */
+#define UTF8_BLOCK 64
+
+typedef uint64_t (*utf8_mask_fn)(const uint8_t *p);
+
+struct utf8_impl {
+    int (*validate)(const uint8_t *buf, size_t len);
+    size_t (*to_latin1)(uint8_t *dst, const uint8_t *src, size_t len);
+    size_t (*from_latin1_extra)(const uint8_t *src, size_t len);
+    size_t (*from_latin1)(uint8_t *dst, const uint8_t *src, size_t len);
+};
+
+/* Return value: the length of the valid UTF-8 sequence at p, 0 if there
+   is none */
+static size_t utf8_seq_len(const uint8_t *p, size_t len)
+{
+    uint8_t c = p[0];
+
+    if (c < 0x80)
+        return 1;
+    if (c < 0xc2) /* continuation byte or overlong 2 byte form */
+        return 0;
+    if (c < 0xe0)
+        return (len >= 2 && (p[1] & 0xc0) == 0x80) ? 2 : 0;
+    if (c < 0xf0) {
+        if (len < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80)
+            return 0;
+        if (c == 0xe0 && p[1] < 0xa0) /* overlong */
+            return 0;
+        if (c == 0xed && p[1] > 0x9f) /* surrogate */
+            return 0;
+        return 3;
+    }
+    if (c < 0xf5) {
+        if (len < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 ||
+                (p[3] & 0xc0) != 0x80)
+            return 0;
+        if (c == 0xf0 && p[1] < 0x90) /* overlong */
+            return 0;
+        if (c == 0xf4 && p[1] > 0x8f) /* above U+10FFFF */
+            return 0;
+        return 4;
+    }
+    return 0;
+}
+
+/* The byte wise loops below take an end, up to which they must get, and a
+   limit, which they may not read beyond; the vector versions stop at the
+   end of a block, but a sequence may continue in the next one. Return
+   value: how far they got, or -1 for invalid UTF-8. */
+static ptrdiff_t validate_sw(const uint8_t *buf, size_t pos, size_t end,
+                             size_t limit)
+{
+    size_t n;
+
+    while (pos < end) {
+        n = utf8_seq_len(buf + pos, limit - pos);
+        if (!n)
+            return -1;
+        pos += n;
+    }
+    return pos;
+}
+
+static size_t to_latin1_sw(uint8_t **dst, const uint8_t *src, size_t pos,
+                           size_t end, size_t limit)
+{
+    uint8_t *d = *dst, c;
+    size_t n;
+
+    while (pos < end) {
+        c = src[pos];
+        if (c < 0x80) {
+            *d++ = c;
+            pos++;
+        } else if ((c == 0xc2 || c == 0xc3) && pos + 1 < limit) {
+            *d++ = (c & 0x03) << 6 | (src[pos + 1] & 0x3f);
+            pos += 2;
+        } else {
+            n = utf8_seq_len(src + pos, limit - pos);
+            *d++ = '?';
+            pos += n ? n : 1;
+        }
+    }
+    *dst = d;
+    return pos;
+}
+
+static size_t from_latin1_extra_sw(const uint8_t *src, size_t len)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++)
+        n += src[i] >> 7;
+    return n;
+}
+
+static size_t from_latin1_sw(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint8_t *d = dst;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] < 0x80) {
+            *d++ = src[i];
+        } else {
+            *d++ = 0xc0 | src[i] >> 6;
+            *d++ = 0x80 | (src[i] & 0x3f);
+        }
+    }
+    return d - dst;
+}
+
+#if !defined(UTF8_HAVE_SSE2) && !defined(UTF8_HAVE_NEON)
+static int utf8_validate_sw(const uint8_t *buf, size_t len)
+{
+    return validate_sw(buf, 0, len, len) != -1;
+}
+
+static size_t utf8_to_latin1_sw(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint8_t *d = dst;
+
+    to_latin1_sw(&d, src, 0, len, len);
+    return d - dst;
+}
+
+static const struct utf8_impl utf8_sw = {
+    utf8_validate_sw,
+    utf8_to_latin1_sw,
+    from_latin1_extra_sw,
+    from_latin1_sw,
+};
+#endif
+
+#if defined(UTF8_HAVE_SSE2) || defined(UTF8_HAVE_NEON)
+/* These get inlined into the per instruction set wrappers below, so that
+   mask becomes a direct call which can be inlined too */
+static inline __attribute__((always_inline))
+int validate_simd(const uint8_t *buf, size_t len, utf8_mask_fn mask)
+{
+    ptrdiff_t pos = 0;
+    uint64_t m;
+
+    while ((size_t)pos + UTF8_BLOCK <= len) {
+        m = mask(buf + pos);
+        if (!m) {
+            pos += UTF8_BLOCK;
+            continue;
+        }
+        pos = validate_sw(buf, pos + __builtin_ctzll(m), pos + UTF8_BLOCK,
+                          len);
+        if (pos == -1)
+            return 0;
+    }
+    return validate_sw(buf, pos, len, len) != -1;
+}
+
+static inline __attribute__((always_inline))
+size_t to_latin1_simd(uint8_t *dst, const uint8_t *src, size_t len,
+                      utf8_mask_fn mask)
+{
+    uint8_t *d = dst;
+    size_t pos = 0, n;
+    uint64_t m;
+
+    while (pos + UTF8_BLOCK <= len) {
+        m = mask(src + pos);
+        if (!m) {
+            /* Nothing to move until the first multi byte character */
+            if (d != src + pos)
+                memmove(d, src + pos, UTF8_BLOCK);
+            d += UTF8_BLOCK;
+            pos += UTF8_BLOCK;
+            continue;
+        }
+        n = __builtin_ctzll(m);
+        if (d != src + pos)
+            memmove(d, src + pos, n);
+        d += n;
+        pos = to_latin1_sw(&d, src, pos + n, pos + UTF8_BLOCK, len);
+    }
+    to_latin1_sw(&d, src, pos, len, len);
+    return d - dst;
+}
+
+static inline __attribute__((always_inline))
+size_t from_latin1_extra_simd(const uint8_t *src, size_t len,
+                              utf8_mask_fn mask)
+{
+    size_t n = 0;
+
+    for (; len >= UTF8_BLOCK; len -= UTF8_BLOCK, src += UTF8_BLOCK)
+        n += __builtin_popcountll(mask(src));
+    return n + from_latin1_extra_sw(src, len);
+}
+
+static inline __attribute__((always_inline))
+size_t from_latin1_simd(uint8_t *dst, const uint8_t *src, size_t len,
+                        utf8_mask_fn mask)
+{
+    uint8_t *d = dst;
+
+    for (; len >= UTF8_BLOCK; len -= UTF8_BLOCK, src += UTF8_BLOCK) {
+        if (!mask(src)) {
+            memcpy(d, src, UTF8_BLOCK);
+            d += UTF8_BLOCK;
+        } else {
+            d += from_latin1_sw(d, src, UTF8_BLOCK);
+        }
+    }
+    d += from_latin1_sw(d, src, len);
+    return d - dst;
+}
+
+#define UTF8_DEFINE_IMPL(name, attr)                                         \
+attr static int validate_##name(const uint8_t *buf, size_t len)              \
+{                                                                            \
+    return validate_simd(buf, len, utf8_mask_##name);                        \
+}                                                                            \
+attr static size_t to_latin1_##name(uint8_t *dst, const uint8_t *src,        \
+                                    size_t len)                              \
+{                                                                            \
+    return to_latin1_simd(dst, src, len, utf8_mask_##name);                  \
+}                                                                            \
+attr static size_t from_latin1_extra_##name(const uint8_t *src, size_t len)  \
+{                                                                            \
+    return from_latin1_extra_simd(src, len, utf8_mask_##name);               \
+}                                                                            \
+attr static size_t from_latin1_##name(uint8_t *dst, const uint8_t *src,      \
+                                      size_t len)                            \
+{                                                                            \
+    return from_latin1_simd(dst, src, len, utf8_mask_##name);                \
+}                                                                            \
+static const struct utf8_impl utf8_##name = {                                \
+    validate_##name,                                                         \
+    to_latin1_##name,                                                        \
+    from_latin1_extra_##name,                                                \
+    from_latin1_##name,                                                      \
+}
+#endif
+
+#ifdef UTF8_HAVE_SSE2
+static uint64_t utf8_mask_sse2(const uint8_t *p)
+{
+    uint64_t m = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                 _mm_loadu_si128((const __m128i *)(p + 16 * i))) << (16 * i);
+    return m;
+}
+
+UTF8_DEFINE_IMPL(sse2, );
+#endif
+
+#ifdef UTF8_HAVE_AVX2
+__attribute__((target("avx2,popcnt")))
+static uint64_t utf8_mask_avx2(const uint8_t *p)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+    return (uint32_t)_mm256_movemask_epi8(lo) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
+
+UTF8_DEFINE_IMPL(avx2, __attribute__((target("avx2,popcnt"))));
+#endif
+
+#ifdef UTF8_HAVE_NEON
+/* See lineend_neon_bits() */
+static uint64_t utf8_mask_neon(const uint8_t *p)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    const uint8x16_t w = vld1q_u8(weights);
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    uint8x16_t a = vandq_u8(vcgeq_u8(vld1q_u8(p), high), w);
+    uint8x16_t b = vandq_u8(vcgeq_u8(vld1q_u8(p + 16), high), w);
+    uint8x16_t c = vandq_u8(vcgeq_u8(vld1q_u8(p + 32), high), w);
+    uint8x16_t d = vandq_u8(vcgeq_u8(vld1q_u8(p + 48), high), w);
+    uint8x16_t s;
+
+    s = vpaddq_u8(vpaddq_u8(a, b), vpaddq_u8(c, d));
+    s = vpaddq_u8(s, s);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s), 0);
+}
+
+UTF8_DEFINE_IMPL(neon, );
+#endif
+
+static const struct utf8_impl *utf8_impl;
+
+static const struct utf8_impl *utf8_get_impl(void)
+{
+    if (!utf8_impl) {
+#if defined(UTF8_HAVE_AVX2)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("popcnt"))
+            utf8_impl = &utf8_avx2;
+        else
+            utf8_impl = &utf8_sse2;
+#elif defined(UTF8_HAVE_NEON)
+        utf8_impl = &utf8_neon;
+#else
+        utf8_impl = &utf8_sw;
+#endif
+    }
+    return utf8_impl;
+}
+
+int utf8_validate(const uint8_t *buf, size_t len)
+{
+    return utf8_get_impl()->validate(buf, len);
+}
+
+size_t utf8_to_latin1(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    return utf8_get_impl()->to_latin1(dst, src, len);
+}
+
+size_t utf8_from_latin1_extra(const uint8_t *src, size_t len)
+{
+    return utf8_get_impl()->from_latin1_extra(src, len);
+}
+
+size_t utf8_from_latin1(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    return utf8_get_impl()->from_latin1(dst, src, len);
+}
@@ -0,0 +1,41 @@
+/*  utf8.h UTF-8 validation and ISO Latin-1 conversion
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_UTF8_H
+#define __VDAGENT_UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Return value: 1 if buf holds valid UTF-8 (RFC 3629: no overlong forms,
+   surrogates or code points above U+10FFFF), 0 otherwise. */
+int utf8_validate(const uint8_t *buf, size_t len);
+
+/* Convert valid UTF-8 to ISO Latin-1, characters above U+00FF become '?'.
+   dst may be equal to src, it needs room for len bytes.
+   Return value: the number of bytes written. */
+size_t utf8_to_latin1(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* utf8_from_latin1_extra() returns how many bytes converting ISO Latin-1
+   src to UTF-8 adds. utf8_from_latin1() does the conversion, dst must have
+   room for len + utf8_from_latin1_extra() bytes.
+   Return value: the number of bytes written. */
+size_t utf8_from_latin1_extra(const uint8_t *src, size_t len);
+size_t utf8_from_latin1(uint8_t *dst, const uint8_t *src, size_t len);
+
+#endif
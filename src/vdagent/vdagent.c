@@ -28,6 +28,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
@@ -40,9 +41,12 @@
 #include "udscs.h"
 #include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
+#include "metrics.h"
+#include "trace.h"
 #include "audio.h"
 #include "x11.h"
 #include "file-xfers.h"
+#include "reconnect.h"
 
 static const char *portdev = "/dev/virtio-ports/com.redhat.spice.0";
 static const char *vdagentd_socket = VDAGENTD_SOCKET;
@@ -54,6 +58,9 @@ static struct vdagent_file_xfers *vdagent_file_xfers = NULL;
 static struct udscs_connection *client = NULL;
 static int quit = 0;
 static int version_mismatch = 0;
+/* Connection attempts failed since the last successful one */
+static unsigned int connect_failures = 0;
+static volatile sig_atomic_t trace_requested = 0;
 
 static void daemon_read_complete(struct udscs_connection **connp,
     struct udscs_message_header *header, uint8_t *data)
@@ -63,7 +70,8 @@ static void daemon_read_complete(struct udscs_connection **connp,
         vdagent_x11_set_monitor_config(x11, (VDAgentMonitorsConfig *)data, 0);
         break;
     case VDAGENTD_CLIPBOARD_REQUEST:
-        vdagent_x11_clipboard_request(x11, header->arg1, header->arg2);
+        vdagent_x11_clipboard_request(x11, header->arg1, header->arg2,
+                                      VDAGENTD_CLIPBOARD_ID(header->arg1));
         break;
     case VDAGENTD_CLIPBOARD_GRAB:
         vdagent_x11_clipboard_grab(x11, header->arg1, (uint32_t *)data,
@@ -71,6 +79,7 @@ static void daemon_read_complete(struct udscs_connection **connp,
         break;
     case VDAGENTD_CLIPBOARD_DATA:
         vdagent_x11_clipboard_data(x11, header->arg1, header->arg2,
+                                   VDAGENTD_CLIPBOARD_ID(header->arg1),
                                    data, header->size);
         break;
     case VDAGENTD_CLIPBOARD_RELEASE:
@@ -82,12 +91,15 @@ static void daemon_read_complete(struct udscs_connection **connp,
                    data, VERSION);
             udscs_destroy_connection(connp);
             version_mismatch = 1;
+        } else {
+            connect_failures = 0;
         }
         break;
     case VDAGENTD_FILE_XFER_START:
         if (vdagent_file_xfers != NULL) {
             vdagent_file_xfers_start(vdagent_file_xfers,
-                                     (VDAgentFileXferStartMessage *)data);
+                                     (VDAgentFileXferStartMessage *)data,
+                                     header->arg1);
         } else {
             vdagent_file_xfers_error(*connp,
                                      ((VDAgentFileXferStartMessage *)data)->id);
@@ -130,12 +142,23 @@ static void daemon_read_complete(struct udscs_connection **connp,
         }
         break;
     case VDAGENTD_CLIENT_DISCONNECTED:
-        vdagent_x11_client_disconnected(x11);
-        if (vdagent_file_xfers != NULL) {
-            vdagent_file_xfers_destroy(vdagent_file_xfers);
-            vdagent_file_xfers = vdagent_file_xfers_create(client, fx_dir,
-                                                           fx_open_dir, debug);
-        }
+        /* After the port dropped the daemon keeps the clipboard state for
+           the client coming back, but the xfer data in flight is lost */
+        if (!header->arg1)
+            vdagent_x11_client_disconnected(x11);
+        if (vdagent_file_xfers != NULL)
+            vdagent_file_xfers_client_disconnected(vdagent_file_xfers);
+        break;
+    case VDAGENTD_METRICS:
+        udscs_write(*connp, VDAGENTD_METRICS, 0, 0,
+                    (const uint8_t *)metrics_get(),
+                    sizeof(struct metrics_snapshot));
+        break;
+    case VDAGENTD_CLIENT_LINEEND:
+        vdagent_x11_set_client_lineend(x11, header->arg1);
+        break;
+    case VDAGENTD_MAX_CLIPBOARD:
+        vdagent_x11_set_max_clipboard(x11, header->arg1);
         break;
     default:
         syslog(LOG_ERR, "Unknown message from vdagentd type: %d, ignoring",
@@ -152,11 +175,24 @@ static int client_setup(int reconnect)
         if (client || !reconnect || quit) {
             break;
         }
-        sleep(1);
+        vdagent_reconnect_wait(vdagentd_socket, ++connect_failures);
     }
     return client == NULL;
 }
 
+/* A package upgrade replaces our binary, the running one is deleted then */
+static int binary_replaced(void)
+{
+    char path[PATH_MAX];
+    ssize_t n;
+
+    n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n == -1)
+        return 1; /* can not tell, restart to be sure */
+    path[n] = '\0';
+    return g_str_has_suffix(path, " (deleted)");
+}
+
 static void usage(FILE *fp)
 {
     fprintf(fp,
@@ -164,7 +200,8 @@ static void usage(FILE *fp)
       "Spice guest agent X11 session agent, version %s.\n\n"
       "Options:\n"
       "  -h                                print this text\n"
-      "  -d                                log debug messages\n"
+      "  -d                                log debug messages (use twice for\n"
+      "                                    extra info)\n"
       "  -s <port>                         set virtio serial port\n"
       "  -S <filename>                     set udcs socket\n"
       "  -x                                don't daemonize\n"
@@ -178,6 +215,24 @@ static void quit_handler(int sig)
     quit = 1;
 }
 
+static void trace_handler(int sig)
+{
+    trace_requested = 1;
+}
+
+static void write_trace(void)
+{
+    gchar *filename;
+
+    filename = g_build_filename(g_get_user_runtime_dir(),
+                                "spice-vdagent.trace", NULL);
+    if (trace_dump(filename, "spice-vdagent") == 0)
+        syslog(LOG_INFO, "trace written to %s", filename);
+    else
+        syslog(LOG_ERR, "writing trace to %s: %m", filename);
+    g_free(filename);
+}
+
 /* When we daemonize, it is useful to have the main process
    wait to make sure the X connection worked.  We wait up
    to 10 seconds to get an 'all clear' from the child
@@ -236,7 +291,8 @@ static int file_test(const char *path)
 int main(int argc, char *argv[])
 {
     fd_set readfds, writefds;
-    int c, n, nfds, x11_fd;
+    struct timeval tv, *timeout;
+    int c, n, nfds, x11_fd, image_fd;
     int do_daemonize = 1;
     int parent_socket = 0;
     int x11_sync = 0;
@@ -284,6 +340,8 @@ int main(int argc, char *argv[])
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
+    act.sa_handler = trace_handler;
+    sigaction(SIGUSR1, &act, NULL);
 
     openlog("spice-vdagent", do_daemonize ? LOG_PID : (LOG_PID | LOG_PERROR),
             LOG_USER);
@@ -298,9 +356,14 @@ int main(int argc, char *argv[])
 
 reconnect:
     if (version_mismatch) {
-        syslog(LOG_INFO, "Version mismatch, restarting");
-        sleep(1);
-        execvp(argv[0], argv);
+        version_mismatch = 0;
+        if (binary_replaced()) {
+            syslog(LOG_INFO, "Version mismatch, restarting");
+            execvp(argv[0], argv);
+        }
+        /* Else vdagentd is the one to get restarted, wait for that */
+        syslog(LOG_INFO, "Version mismatch, waiting for vdagentd to restart");
+        vdagent_reconnect_wait(vdagentd_socket, ++connect_failures);
     }
 
     if (client_setup(do_daemonize)) {
@@ -342,6 +405,11 @@ reconnect:
     }
 
     while (client && !quit) {
+        if (trace_requested) {
+            trace_requested = 0;
+            write_trace();
+        }
+
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
@@ -350,8 +418,22 @@ reconnect:
         FD_SET(x11_fd, &readfds);
         if (x11_fd >= nfds)
             nfds = x11_fd + 1;
+        image_fd = vdagent_x11_get_image_fd(x11);
+        if (image_fd != -1) {
+            FD_SET(image_fd, &readfds);
+            if (image_fd >= nfds)
+                nfds = image_fd + 1;
+        }
+
+        /* Events left from the last batch do not make the fd readable */
+        timeout = NULL;
+        if (vdagent_x11_has_queued_events(x11)) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            timeout = &tv;
+        }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        n = select(nfds, &readfds, &writefds, NULL, timeout);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -359,8 +441,10 @@ reconnect:
             break;
         }
 
-        if (FD_ISSET(x11_fd, &readfds))
+        if (FD_ISSET(x11_fd, &readfds) || timeout)
             vdagent_x11_do_read(x11);
+        if (image_fd != -1 && FD_ISSET(image_fd, &readfds))
+            vdagent_x11_do_image_read(x11);
         udscs_client_handle_fds(&client, &readfds, &writefds);
     }
 
@@ -13,9 +13,10 @@
     syslog(LOG_ERR, "%s: " format, \
             vdagent_x11_sel_to_str(selection), ##__VA_ARGS__)
 
+/* Only with extra debugging, clipboard events get traced instead (trace.h) */
 #define VSELPRINTF(format, ...) \
     do { \
-        if (x11->debug) { \
+        if (x11->debug > 1) { \
             syslog(LOG_DEBUG, "%s: " format, \
                     vdagent_x11_sel_to_str(selection), ##__VA_ARGS__); \
         } \
@@ -34,6 +35,7 @@ enum { owner_none, owner_guest, owner_client };
 struct vdagent_x11_selection_request {
     XEvent event;
     uint8_t selection;
+    uint32_t id; /* See VDAGENTD_CLIPBOARD_ARG1 */
     struct vdagent_x11_selection_request *next;
 };
 
@@ -44,9 +46,24 @@ struct vdagent_x11_selection_request {
 struct vdagent_x11_conversion_request {
     Atom target;
     uint8_t selection;
+    uint32_t id; /* See VDAGENTD_CLIPBOARD_ARG1 */
+    uint32_t type; /* asked for by the client, images of an other type than
+                      target's get converted */
+    int verify; /* not from the client, checks whether the data of type
+                   the client got earlier has changed */
     struct vdagent_x11_conversion_request *next;
 };
 
+/* An image being converted on the worker thread (see image.h), for the
+   conversion request (to_client) or selection request at the head of its
+   queue. The request stays there until the conversion is done, unless the
+   selection changes owner, which cancels the job. */
+struct vdagent_x11_image_job {
+    struct vdagent_x11 *x11;
+    int to_client;
+    int cancelled;
+};
+
 struct clipboard_format_tmpl {
     uint32_t type;
     const char *atom_names[16];
@@ -108,12 +125,54 @@ struct vdagent_x11 {
     uint8_t *clipboard_data;
     uint32_t clipboard_data_size;
     uint32_t clipboard_data_space;
+    /* Whether the incr text being received gets CR LFs for the client, and
+       whether the last chunk ended with a CR */
+    int clipboard_data_crlf;
+    int clipboard_data_cr;
     /* Data for selection_req which is currently being processed */
     struct vdagent_x11_selection_request *selection_req;
     uint8_t *selection_req_data;
     uint32_t selection_req_data_pos;
     uint32_t selection_req_data_size;
+    int selection_req_data_cached; /* points into one of the caches */
     Atom selection_req_atom;
+    /* Text received from the client for each selection, and its ISO
+       Latin-1 form once a STRING target has been requested, so that
+       further requests get answered without asking the client again */
+    struct {
+        uint8_t *utf8;
+        uint32_t utf8_size;
+        uint8_t *latin1;
+        uint32_t latin1_size;
+    } clipboard_text[256];
+    /* Clipboard image conversion, NULL when not available */
+    struct vdagent_image *image;
+    struct vdagent_x11_image_job *conversion_image_job;
+    struct vdagent_x11_image_job *selection_image_job;
+    int max_clipboard; /* -1 for no limit */
+    /* The number of types the client grabbed with, the clipboard types
+       after these are images converted from the client's */
+    int clipboard_client_type_count[256];
+    /* The last converted image of each selection */
+    struct {
+        uint32_t type;
+        uint8_t *data;
+        uint32_t size;
+    } clipboard_image[256];
+    /* What the client knows of each guest owned selection: whether it has
+       our grab, and the size and CRC32C of the data of each type it got
+       since. A new owner offering the same types and data does not get
+       grabbed again, see vdagent_x11_handle_targets_notify(). */
+    int clipboard_client_grabbed[256];
+    struct {
+        uint32_t type;
+        uint32_t size;
+        uint32_t crc;
+    } clipboard_sent[256][clipboard_format_count];
+    int clipboard_sent_count[256];
+    int clipboard_verify_pending[256]; /* verify conversion requests */
+    uint32_t next_clipboard_id;
+    int client_lineend; /* VDAGENTD_LINEEND_* */
     /* resolution change state */
     struct {
         XRRScreenResources *res;
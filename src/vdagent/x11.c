@@ -24,9 +24,11 @@
    the socket triggered by other libX11 calls from this file, the select for
    read in the main loop, won't see these and our event loop won't get called!
 
-   Thus we must make sure that all queued events have been consumed, whenever
-   we return to the main loop. IOW all (externally callable) functions in this
-   file must end with calling XPending and consuming all queued events.
+   Thus all (externally callable) functions in this file must end with
+   calling XPending and consuming the queued events. Events get consumed in
+   bounded batches though (see vdagent_x11_do_read), so that a flood of them
+   does not starve vdagentd's messages, the main loop does not block while
+   vdagent_x11_has_queued_events() says some are left.
 
    Calling XPending when-ever we return to the mainloop also ensures any
    pending writes are flushed. */
@@ -42,6 +44,12 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 #include "vdagentd-proto.h"
+#include "crc32c.h"
+#include "image.h"
+#include "lineend.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utf8.h"
 #include "x11.h"
 #include "x11-priv.h"
 
@@ -58,6 +66,15 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
                                                       XEvent *del_event);
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
                 Atom prop, struct vdagent_x11_selection_request *request);
+static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
+    uint8_t selection, Atom target);
+static void vdagent_x11_send_text(struct vdagent_x11 *x11);
+static void vdagent_x11_send_selection_data(struct vdagent_x11 *x11,
+    uint32_t type, uint8_t *data, uint32_t size, int cached);
+static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11);
+static void vdagent_x11_convert_image(struct vdagent_x11 *x11,
+    uint32_t from, uint32_t to, const uint8_t *data, uint32_t size,
+    int to_client);
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
                                             uint8_t selection, int new_owner);
 
@@ -188,6 +205,7 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
 
     x11->vdagentd = vdagentd;
     x11->debug = debug;
+    x11->max_clipboard = -1;
 
     x11->display = XOpenDisplay(NULL);
     if (!x11->display) {
@@ -275,6 +293,8 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     }
     vdagent_x11_send_daemon_guest_xorg_res(x11, 1);
 
+    x11->image = vdagent_image_create(debug);
+
     /* Get net_wm_name, since we are started at the same time as the wm,
        sometimes we need to wait a bit for it to show up. */
     i = 10;
@@ -306,6 +326,7 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
         vdagent_x11_set_clipboard_owner(x11, sel, owner_none);
     }
+    vdagent_image_destroy(x11->image);
 
     XCloseDisplay(x11->display);
     g_free(x11->net_wm_name);
@@ -313,6 +334,19 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
     free(x11);
 }
 
+int vdagent_x11_get_image_fd(struct vdagent_x11 *x11)
+{
+    return x11->image ? vdagent_image_get_fd(x11->image) : -1;
+}
+
+void vdagent_x11_do_image_read(struct vdagent_x11 *x11)
+{
+    vdagent_image_do_read(x11->image);
+
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
+}
+
 int vdagent_x11_get_fd(struct vdagent_x11 *x11)
 {
     return x11->fd;
@@ -334,12 +368,60 @@ static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11)
     free(conversion_req);
 }
 
+static void vdagent_x11_free_selection_req_data(struct vdagent_x11 *x11)
+{
+    if (!x11->selection_req_data_cached) {
+        metrics_add(METRICS_CLIPBOARD_INCR_SEND_BYTES,
+                    -(int64_t)x11->selection_req_data_size);
+        free(x11->selection_req_data);
+    }
+    x11->selection_req_data = NULL;
+    x11->selection_req_data_pos = 0;
+    x11->selection_req_data_size = 0;
+    x11->selection_req_data_cached = 0;
+    x11->selection_req_atom = None;
+}
+
+static void vdagent_x11_clear_text_cache(struct vdagent_x11 *x11,
+                                         uint8_t selection)
+{
+    metrics_add(METRICS_CLIPBOARD_TEXT_CACHE_BYTES,
+                -(int64_t)(x11->clipboard_text[selection].utf8_size +
+                           x11->clipboard_text[selection].latin1_size));
+    free(x11->clipboard_text[selection].utf8);
+    free(x11->clipboard_text[selection].latin1);
+    memset(&x11->clipboard_text[selection], 0,
+           sizeof(x11->clipboard_text[selection]));
+}
+
+static void vdagent_x11_clear_image_cache(struct vdagent_x11 *x11,
+                                          uint8_t selection)
+{
+    metrics_add(METRICS_CLIPBOARD_IMAGE_CACHE_BYTES,
+                -(int64_t)x11->clipboard_image[selection].size);
+    free(x11->clipboard_image[selection].data);
+    memset(&x11->clipboard_image[selection], 0,
+           sizeof(x11->clipboard_image[selection]));
+}
+
+static void vdagent_x11_cache_image(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, uint8_t *data, uint32_t size)
+{
+    vdagent_x11_clear_image_cache(x11, selection);
+    x11->clipboard_image[selection].type = type;
+    x11->clipboard_image[selection].data = data;
+    x11->clipboard_image[selection].size = size;
+    metrics_add(METRICS_CLIPBOARD_IMAGE_CACHE_BYTES, size);
+}
+
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
     uint8_t selection, int new_owner)
 {
     struct vdagent_x11_selection_request *prev_sel, *curr_sel, *next_sel;
     struct vdagent_x11_conversion_request *prev_conv, *curr_conv, *next_conv;
-    int once;
+    int once, restart_selection = 0, restart_conversion = 0;
+
+    trace_event(TRACE_X11_OWNER_CHANGE, selection, new_owner, 0, 0, 0);
 
     /* Clear pending requests and clipboard data */
     once = 1;
@@ -357,11 +439,13 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
             vdagent_x11_send_selection_notify(x11, None, curr_sel);
             if (curr_sel == x11->selection_req) {
                 x11->selection_req = next_sel;
-                free(x11->selection_req_data);
-                x11->selection_req_data = NULL;
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = 0;
-                x11->selection_req_atom = None;
+                vdagent_x11_free_selection_req_data(x11);
+                if (x11->selection_image_job) {
+                    /* Nothing else keeps the next request from starting */
+                    x11->selection_image_job->cancelled = 1;
+                    x11->selection_image_job = NULL;
+                    restart_selection = 1;
+                }
             } else {
                 prev_sel->next = next_sel;
             }
@@ -383,13 +467,19 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
                           "ownership change, clearing");
                 once = 0;
             }
-            if (x11->vdagentd)
-                udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+            if (x11->vdagentd && !curr_conv->verify)
+                udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA,
+                            VDAGENTD_CLIPBOARD_ARG1(selection, curr_conv->id),
                             VD_AGENT_CLIPBOARD_NONE, NULL, 0);
             if (curr_conv == x11->conversion_req) {
                 x11->conversion_req = next_conv;
                 x11->clipboard_data_size = 0;
                 x11->expect_property_notify = 0;
+                if (x11->conversion_image_job) {
+                    x11->conversion_image_job->cancelled = 1;
+                    x11->conversion_image_job = NULL;
+                    restart_conversion = 1;
+                }
             } else {
                 prev_conv->next = next_conv;
             }
@@ -409,6 +499,18 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
         x11->clipboard_type_count[selection] = 0;
     }
     x11->clipboard_owner[selection] = new_owner;
+    x11->clipboard_verify_pending[selection] = 0;
+    if (new_owner != owner_guest) {
+        x11->clipboard_client_grabbed[selection] = 0;
+        x11->clipboard_sent_count[selection] = 0;
+    }
+    vdagent_x11_clear_text_cache(x11, selection);
+    vdagent_x11_clear_image_cache(x11, selection);
+
+    if (restart_conversion && x11->conversion_req)
+        vdagent_x11_handle_conversion_request(x11);
+    if (restart_selection && x11->selection_req)
+        vdagent_x11_handle_selection_request(x11);
 }
 
 static int vdagent_x11_get_clipboard_atom(struct vdagent_x11 *x11, uint8_t selection, Atom* clipboard)
@@ -489,8 +591,14 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         if (ev.xfev.owner == x11->selection_window)
             return;
 
-        /* If the clipboard owner is changed we no longer own it */
-        vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
+        /* If the clipboard owner is changed we no longer own it. A new
+           guest owner leaves the client with the old one's grab until its
+           targets are known, it may well offer the same as before. */
+        if (ev.xfev.owner != None &&
+                x11->clipboard_owner[selection] == owner_guest)
+            vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
+        else
+            vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
 
         if (ev.xfev.owner == None)
             return;
@@ -565,6 +673,8 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
 
         new_req->event = event;
         new_req->selection = selection;
+        new_req->id = VDAGENTD_CLIPBOARD_ID_AGENT |
+                      (x11->next_clipboard_id++ & 0x7fffff);
         new_req->next = NULL;
 
         if (!x11->selection_req) {
@@ -587,16 +697,35 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
                (int)event.type, (int)event.xany.window);
 }
 
+/* At most this many events get handled per call, and no more once the time
+   budget is used up, e.g. PropertyNotify storms during INCR transfers and
+   ConfigureNotify bursts come in more events than that */
+#define X11_BATCH_EVENTS 64
+#define X11_BATCH_US 5000
+
 void vdagent_x11_do_read(struct vdagent_x11 *x11)
 {
     XEvent event;
+    uint64_t start = metrics_now_us();
+    int n = 0;
 
     while (XPending(x11->display)) {
+        if (n == X11_BATCH_EVENTS ||
+                metrics_now_us() - start >= X11_BATCH_US) {
+            metrics_inc(METRICS_X11_BATCHES_LIMITED);
+            break;
+        }
         XNextEvent(x11->display, &event);
         vdagent_x11_handle_event(x11, event);
+        n++;
     }
 }
 
+int vdagent_x11_has_queued_events(struct vdagent_x11 *x11)
+{
+    return XEventsQueued(x11->display, QueuedAlready) > 0;
+}
+
 static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
 {
     if (a == None)
@@ -648,6 +777,8 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
             }
 
             if (x11->clipboard_data_space < prop_min_size) {
+                metrics_add(METRICS_CLIPBOARD_INCR_RECEIVE_BYTES,
+                            -(int64_t)x11->clipboard_data_space);
                 free(x11->clipboard_data);
                 x11->clipboard_data = malloc(prop_min_size);
                 if (!x11->clipboard_data) {
@@ -656,8 +787,17 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
                     goto exit;
                 }
                 x11->clipboard_data_space = prop_min_size;
+                metrics_add(METRICS_CLIPBOARD_INCR_RECEIVE_BYTES,
+                            prop_min_size);
             }
             x11->expect_property_notify = 1;
+            /* Text for the client gets its line endings converted while
+               it is being received */
+            x11->clipboard_data_crlf =
+                x11->client_lineend == VDAGENTD_LINEEND_CRLF &&
+                vdagent_x11_target_to_type(x11, selection, type) ==
+                    VD_AGENT_CLIPBOARD_UTF8_TEXT;
+            x11->clipboard_data_cr = 0;
             XSelectInput(x11->display, x11->selection_window,
                          PropertyChangeMask);
             XDeleteProperty(x11->display, x11->selection_window, prop);
@@ -693,21 +833,37 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
 
     if (incr) {
         if (len) {
-            if (x11->clipboard_data_size + len > x11->clipboard_data_space) {
+            unsigned long size = len;
+
+            if (x11->clipboard_data_crlf)
+                size += lineend_lf_to_crlf_extra(data, len,
+                                                 x11->clipboard_data_cr);
+            if (x11->clipboard_data_size + size > x11->clipboard_data_space) {
                 void *old_clipboard_data = x11->clipboard_data;
 
-                x11->clipboard_data_space = x11->clipboard_data_size + len;
+                metrics_add(METRICS_CLIPBOARD_INCR_RECEIVE_BYTES,
+                            x11->clipboard_data_size + size -
+                            x11->clipboard_data_space);
+                x11->clipboard_data_space = x11->clipboard_data_size + size;
                 x11->clipboard_data = realloc(x11->clipboard_data,
                                               x11->clipboard_data_space);
                 if (!x11->clipboard_data) {
                     SELPRINTF("out of memory allocating clipboard buffer");
+                    metrics_add(METRICS_CLIPBOARD_INCR_RECEIVE_BYTES,
+                                -(int64_t)x11->clipboard_data_space);
                     x11->clipboard_data_space = 0;
                     free(old_clipboard_data);
                     goto exit;
                 }
             }
-            memcpy(x11->clipboard_data + x11->clipboard_data_size, data, len);
-            x11->clipboard_data_size += len;
+            if (x11->clipboard_data_crlf)
+                lineend_lf_to_crlf(x11->clipboard_data +
+                                   x11->clipboard_data_size, data, len,
+                                   &x11->clipboard_data_cr);
+            else
+                memcpy(x11->clipboard_data + x11->clipboard_data_size,
+                       data, len);
+            x11->clipboard_data_size += size;
             VSELPRINTF("Appended %ld bytes to buffer", len);
             XFree(data);
             return 0; /* Wait for more data */
@@ -742,6 +898,8 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
     if (incr) {
         /* If the clipboard has grown large return the memory to the system */
         if (x11->clipboard_data_space > 512 * 1024) {
+            metrics_add(METRICS_CLIPBOARD_INCR_RECEIVE_BYTES,
+                        -(int64_t)x11->clipboard_data_space);
             free(x11->clipboard_data);
             x11->clipboard_data = NULL;
             x11->clipboard_data_space = 0;
@@ -786,20 +944,153 @@ static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11)
 {
     Atom clip = None;
 
+    /* Skip the checks left over from a grab which has been decided on */
+    while (x11->conversion_req && x11->conversion_req->verify &&
+           !x11->clipboard_verify_pending[x11->conversion_req->selection]) {
+        vdagent_x11_next_conversion_request(x11);
+    }
+
     if (!x11->conversion_req) {
         return;
     }
 
     vdagent_x11_get_clipboard_atom(x11, x11->conversion_req->selection, &clip);
+    trace_clipboard(x11->conversion_req->id, TRACE_CLIPBOARD_CONVERSION_START,
+                    x11->conversion_req->selection, 0, 0);
     XConvertSelection(x11->display, clip, x11->conversion_req->target,
                       clip, x11->selection_window, CurrentTime);
 }
 
+static void vdagent_x11_queue_conversion_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_conversion_request *new_req)
+{
+    struct vdagent_x11_conversion_request *req;
+
+    new_req->next = NULL;
+
+    if (!x11->conversion_req) {
+        x11->conversion_req = new_req;
+        vdagent_x11_handle_conversion_request(x11);
+        return;
+    }
+
+    /* maybe we should limit the conversion_request stack depth ? */
+    req = x11->conversion_req;
+    while (req->next)
+        req = req->next;
+
+    req->next = new_req;
+}
+
+static void vdagent_x11_send_grab(struct vdagent_x11 *x11, uint8_t selection)
+{
+    metrics_inc(METRICS_CLIPBOARD_GRABS);
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
+                (uint8_t *)x11->clipboard_agent_types[selection],
+                x11->clipboard_type_count[selection] * sizeof(uint32_t));
+    x11->clipboard_client_grabbed[selection] = 1;
+    x11->clipboard_sent_count[selection] = 0;
+    x11->clipboard_verify_pending[selection] = 0;
+}
+
+/* Remember what data of type the client got, for telling whether a new
+   owner has the same */
+static void vdagent_x11_remember_sent(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, const uint8_t *data, uint32_t size)
+{
+    int i, *count = &x11->clipboard_sent_count[selection];
+
+    if (!x11->clipboard_client_grabbed[selection])
+        return;
+
+    for (i = 0; i < *count; i++) {
+        if (x11->clipboard_sent[selection][i].type == type)
+            break;
+    }
+    if (i == clipboard_format_count)
+        return;
+    if (i == *count)
+        (*count)++;
+    x11->clipboard_sent[selection][i].type = type;
+    x11->clipboard_sent[selection][i].size = size;
+    x11->clipboard_sent[selection][i].crc = crc32c_update(0, data, size);
+}
+
+/* Handle the data read back for a verify conversion request, the first
+   difference with what the client got decides on a new grab */
+static void vdagent_x11_verify_done(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, const uint8_t *data, int len)
+{
+    int i;
+
+    metrics_add(METRICS_CLIPBOARD_VERIFY_BYTES, len);
+
+    for (i = 0; i < x11->clipboard_sent_count[selection]; i++) {
+        if (x11->clipboard_sent[selection][i].type == type)
+            break;
+    }
+    if (len <= 0 || i == x11->clipboard_sent_count[selection] ||
+            x11->clipboard_sent[selection][i].size != len ||
+            x11->clipboard_sent[selection][i].crc !=
+                crc32c_update(0, data, len)) {
+        VSELPRINTF("new owner has other data, grabbing");
+        vdagent_x11_send_grab(x11, selection);
+        return;
+    }
+
+    if (--x11->clipboard_verify_pending[selection] == 0) {
+        VSELPRINTF("new owner has the same data, not grabbing");
+        metrics_inc(METRICS_CLIPBOARD_GRABS_SUPPRESSED);
+    }
+}
+
+/* Convert text from a selection owner for the client: ISO Latin-1 STRING
+   data to UTF-8, and LF to CR LF if the client uses that (incr data had
+   this done while it was being received).
+   Return value: a malloc-ed buffer holding the *len bytes of converted
+   text, NULL when data can be sent as is */
+static uint8_t *vdagent_x11_text_for_client(struct vdagent_x11 *x11,
+    uint8_t selection, Atom target, const uint8_t *data, int *len, int incr)
+{
+    uint8_t *utf8 = NULL, *crlf;
+    size_t extra;
+    int cr = 0;
+
+    if (target == XA_STRING) {
+        extra = utf8_from_latin1_extra(data, *len);
+        if (extra) {
+            utf8 = malloc(*len + extra);
+            if (!utf8) {
+                SELPRINTF("out of memory converting clipboard text to UTF-8");
+                return NULL;
+            }
+            *len = utf8_from_latin1(utf8, data, *len);
+            data = utf8;
+        }
+    }
+
+    if (!incr && x11->client_lineend == VDAGENTD_LINEEND_CRLF) {
+        extra = lineend_lf_to_crlf_extra(data, *len, 0);
+        if (extra) {
+            crlf = malloc(*len + extra);
+            if (!crlf) {
+                SELPRINTF("out of memory converting line endings");
+                return utf8;
+            }
+            *len = lineend_lf_to_crlf(crlf, data, *len, &cr);
+            free(utf8);
+            return crlf;
+        }
+    }
+
+    return utf8;
+}
+
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
                                                 XEvent *event, int incr)
 {
     int len = 0;
-    unsigned char *data = NULL;
+    unsigned char *data = NULL, *text = NULL;
     uint32_t type;
     uint8_t selection = -1;
     Atom clip = None;
@@ -851,8 +1142,44 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
+    if (x11->conversion_req->verify) {
+        if (x11->clipboard_verify_pending[selection])
+            vdagent_x11_verify_done(x11, selection, x11->conversion_req->type,
+                                    data, type == VD_AGENT_CLIPBOARD_NONE ?
+                                    -1 : len);
+        vdagent_x11_get_selection_free(x11, data, incr);
+        vdagent_x11_next_conversion_request(x11);
+        vdagent_x11_handle_conversion_request(x11);
+        return;
+    }
+
+    if (type != VD_AGENT_CLIPBOARD_NONE)
+        vdagent_x11_remember_sent(x11, selection, type, data, len);
+
+    /* Images of an other type than the client asked for, or too large for
+       it, get converted first */
+    if (type != VD_AGENT_CLIPBOARD_NONE && x11->image &&
+            vdagent_image_supports(type) &&
+            (type != x11->conversion_req->type ||
+             (x11->max_clipboard >= 0 && len > x11->max_clipboard))) {
+        vdagent_x11_convert_image(x11, type, x11->conversion_req->type,
+                                  data, len, 1);
+        vdagent_x11_get_selection_free(x11, data, incr);
+        return;
+    }
+
+    if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT)
+        text = vdagent_x11_text_for_client(x11, selection,
+                                           x11->conversion_req->target,
+                                           data, &len, incr);
+
+    metrics_add(METRICS_CLIPBOARD_BYTES, len);
+    trace_clipboard(x11->conversion_req->id, TRACE_CLIPBOARD_CONVERSION_DONE,
+                    selection, type, len);
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA,
+                VDAGENTD_CLIPBOARD_ARG1(selection, x11->conversion_req->id),
+                type, text ? text : data, len);
+    free(text);
     vdagent_x11_get_selection_free(x11, data, incr);
 
     vdagent_x11_next_conversion_request(x11);
@@ -871,6 +1198,60 @@ static Atom atom_lists_overlap(Atom *atoms1, Atom *atoms2, int l1, int l2)
     return 0;
 }
 
+/* When the selection has an image which can be converted, offer the other
+   image types as well, made from the first such image */
+static void vdagent_x11_add_image_types(struct vdagent_x11 *x11,
+                                        uint8_t selection)
+{
+    uint32_t *types = x11->clipboard_agent_types[selection];
+    int *type_count = &x11->clipboard_type_count[selection];
+    int i, j, source = -1;
+
+    if (!x11->image)
+        return;
+
+    for (i = 0; i < *type_count && source == -1; i++)
+        if (vdagent_image_supports(types[i]))
+            source = i;
+    if (source == -1)
+        return;
+
+    for (i = 0; i < clipboard_format_count; i++) {
+        if (!vdagent_image_supports(x11->clipboard_formats[i].type))
+            continue;
+        for (j = 0; j < *type_count; j++)
+            if (types[j] == x11->clipboard_formats[i].type)
+                break;
+        if (j < *type_count)
+            continue;
+        if (*type_count == sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t))
+            break;
+
+        types[*type_count] = x11->clipboard_formats[i].type;
+        x11->clipboard_x11_targets[selection][*type_count] =
+            x11->clipboard_x11_targets[selection][source];
+        (*type_count)++;
+    }
+}
+
+/* Return value: the type to ask the client for, to answer a request for
+   type: type itself when the client has it, else the image the converted
+   types get made from */
+static uint32_t vdagent_x11_client_source_type(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type)
+{
+    uint32_t *types = x11->clipboard_agent_types[selection];
+    int i, count = x11->clipboard_client_type_count[selection];
+
+    for (i = 0; i < count; i++)
+        if (types[i] == type)
+            return type;
+    for (i = 0; i < count; i++)
+        if (vdagent_image_supports(types[i]))
+            return types[i];
+    return type;
+}
+
 static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
     uint8_t selection, const char *action, Atom *atoms, int c)
 {
@@ -880,13 +1261,47 @@ static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
         VSELPRINTF("%s", vdagent_x11_get_atom_name(x11, atoms[i]));
 }
 
+/* The new owner of a selection the client has our grab of offers the same
+   types, read back the data the client got to see whether it is the same
+   too, before grabbing again */
+static void vdagent_x11_verify_grab(struct vdagent_x11 *x11,
+                                    uint8_t selection)
+{
+    struct vdagent_x11_conversion_request *new_req;
+    int i;
+
+    for (i = 0; i < x11->clipboard_sent_count[selection]; i++) {
+        new_req = malloc(sizeof(*new_req));
+        if (!new_req) {
+            SELPRINTF("out of memory checking clipboard data, grabbing");
+            vdagent_x11_send_grab(x11, selection);
+            return;
+        }
+        new_req->type = x11->clipboard_sent[selection][i].type;
+        new_req->target = vdagent_x11_type_to_target(x11, selection,
+                                                     new_req->type);
+        new_req->selection = selection;
+        new_req->id = 0;
+        new_req->verify = 1;
+        x11->clipboard_verify_pending[selection]++;
+        vdagent_x11_queue_conversion_request(x11, new_req);
+    }
+
+    if (!x11->clipboard_sent_count[selection]) {
+        /* The client has not seen any data, only the types */
+        VSELPRINTF("new owner has the same types, not grabbing");
+        metrics_inc(METRICS_CLIPBOARD_GRABS_SUPPRESSED);
+    }
+}
+
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event)
 {
-    int i, len;
+    int i, len, old_type_count = 0;
     Atom atom, *atoms = NULL;
     uint8_t selection;
     int *type_count;
+    uint32_t old_types[256];
 
     if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
         return;
@@ -909,14 +1324,23 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
     len = vdagent_x11_get_selection(x11, event, selection,
                                     XA_ATOM, x11->targets_atom, 32,
                                     (unsigned char **)&atoms, 0);
-    if (len == 0 || len == -1) /* waiting for more data or error? */
+    if (len == 0 || len == -1) { /* waiting for more data or error? */
+        /* Do not leave the client with the grab of an earlier owner */
+        if (len == -1 && x11->clipboard_owner[selection] == owner_guest)
+            vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
         return;
+    }
 
     /* bytes -> atoms */
     len /= sizeof(Atom);
     vdagent_x11_print_targets(x11, selection, "received", atoms, len);
 
     type_count = &x11->clipboard_type_count[selection];
+    if (x11->clipboard_client_grabbed[selection]) {
+        old_type_count = *type_count;
+        memcpy(old_types, x11->clipboard_agent_types[selection],
+               old_type_count * sizeof(uint32_t));
+    }
     *type_count = 0;
     for (i = 0; i < clipboard_format_count; i++) {
         atom = atom_lists_overlap(x11->clipboard_formats[i].atoms, atoms,
@@ -934,11 +1358,19 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
         }
     }
 
+    vdagent_x11_add_image_types(x11, selection);
+
     if (*type_count) {
-        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
-                    (uint8_t *)x11->clipboard_agent_types[selection],
-                    *type_count * sizeof(uint32_t));
         vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
+        if (x11->clipboard_client_grabbed[selection] &&
+                *type_count == old_type_count &&
+                !memcmp(x11->clipboard_agent_types[selection], old_types,
+                        old_type_count * sizeof(uint32_t)))
+            vdagent_x11_verify_grab(x11, selection);
+        else
+            vdagent_x11_send_grab(x11, selection);
+    } else if (x11->clipboard_owner[selection] == owner_guest) {
+        vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
     }
 
     vdagent_x11_get_selection_free(x11, (unsigned char *)atoms, 0);
@@ -1066,8 +1498,27 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
         return;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection, type,
-                NULL, 0);
+    metrics_inc(METRICS_CLIPBOARD_REQUESTS);
+    trace_clipboard(x11->selection_req->id, TRACE_CLIPBOARD_X11_REQUEST,
+                    selection, type, 0);
+    if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT &&
+            x11->clipboard_text[selection].utf8) {
+        VSELPRINTF("answering text request from the cache");
+        vdagent_x11_send_text(x11);
+        return;
+    }
+    if (x11->clipboard_image[selection].data &&
+            x11->clipboard_image[selection].type == type) {
+        VSELPRINTF("answering image request from the cache");
+        vdagent_x11_send_selection_data(x11, type,
+                                        x11->clipboard_image[selection].data,
+                                        x11->clipboard_image[selection].size,
+                                        1);
+        return;
+    }
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST,
+                VDAGENTD_CLIPBOARD_ARG1(selection, x11->selection_req->id),
+                vdagent_x11_client_source_type(x11, selection, type), NULL, 0);
 }
 
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
@@ -1115,21 +1566,22 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
        incr transfer is done. Hence we do not check if we've send all data
        but instead check we've send the final 0 sized XChangeProperty. */
     if (len == 0) {
-        free(x11->selection_req_data);
-        x11->selection_req_data = NULL;
-        x11->selection_req_data_pos = 0;
-        x11->selection_req_data_size = 0;
-        x11->selection_req_atom = None;
+        trace_clipboard(x11->selection_req->id, TRACE_CLIPBOARD_X11_DATA_DONE,
+                        x11->selection_req->selection, 0,
+                        x11->selection_req_data_size);
+        vdagent_x11_free_selection_req_data(x11);
         vdagent_x11_next_selection_request(x11);
         vdagent_x11_handle_selection_request(x11);
     }
 }
 
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
-        uint8_t selection, uint32_t type)
+        uint8_t selection, uint32_t type, uint32_t id)
 {
     Atom target, clip;
-    struct vdagent_x11_conversion_request *req, *new_req;
+    struct vdagent_x11_conversion_request *new_req;
+
+    trace_clipboard(id, TRACE_CLIPBOARD_AGENT_REQUEST, selection, type, 0);
 
     /* We don't use clip here, but we call get_clipboard_atom to verify
        selection is valid */
@@ -1147,6 +1599,20 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         goto none;
     }
 
+    if (x11->clipboard_image[selection].data &&
+            x11->clipboard_image[selection].type == type) {
+        VSELPRINTF("answering image request from the cache");
+        metrics_add(METRICS_CLIPBOARD_BYTES,
+                    x11->clipboard_image[selection].size);
+        trace_clipboard(id, TRACE_CLIPBOARD_CONVERSION_DONE, selection, type,
+                        x11->clipboard_image[selection].size);
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA,
+                    VDAGENTD_CLIPBOARD_ARG1(selection, id), type,
+                    x11->clipboard_image[selection].data,
+                    x11->clipboard_image[selection].size);
+        return;
+    }
+
     new_req = malloc(sizeof(*new_req));
     if (!new_req) {
         SELPRINTF("out of memory on client clipboard request, ignoring.");
@@ -1155,27 +1621,24 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
 
     new_req->target = target;
     new_req->selection = selection;
-    new_req->next = NULL;
+    new_req->id = id;
+    new_req->type = type;
+    new_req->verify = 0;
 
     if (!x11->conversion_req) {
-        x11->conversion_req = new_req;
-        vdagent_x11_handle_conversion_request(x11);
+        vdagent_x11_queue_conversion_request(x11, new_req);
         /* Flush output buffers and consume any pending events */
         vdagent_x11_do_read(x11);
         return;
     }
 
-    /* maybe we should limit the conversion_request stack depth ? */
-    req = x11->conversion_req;
-    while (req->next)
-        req = req->next;
-
-    req->next = new_req;
+    vdagent_x11_queue_conversion_request(x11, new_req);
     return;
 
 none:
     udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA,
-                selection, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+                VDAGENTD_CLIPBOARD_ARG1(selection, id),
+                VD_AGENT_CLIPBOARD_NONE, NULL, 0);
 }
 
 void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
@@ -1195,6 +1658,8 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     memcpy(x11->clipboard_agent_types[selection], types,
            type_count * sizeof(uint32_t));
     x11->clipboard_type_count[selection] = type_count;
+    x11->clipboard_client_type_count[selection] = type_count;
+    vdagent_x11_add_image_types(x11, selection);
 
     XSetSelectionOwner(x11->display, clip,
                        x11->selection_window, CurrentTime);
@@ -1204,14 +1669,221 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     vdagent_x11_do_read(x11);
 }
 
-void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
-    uint32_t type, uint8_t *data, uint32_t size)
+/* Answer the current selection request with data. cached data stays valid
+   until the selection changes owner, so an INCR send can use it directly
+   instead of a copy. */
+static void vdagent_x11_send_selection_data(struct vdagent_x11 *x11,
+    uint32_t type, uint8_t *data, uint32_t size, int cached)
 {
+    XEvent *event = &x11->selection_req->event;
+    uint8_t selection = x11->selection_req->selection;
     Atom prop;
+
+    prop = event->xselectionrequest.property;
+    if (prop == None)
+        prop = event->xselectionrequest.target;
+
+    if (size > x11->max_prop_size) {
+        unsigned long len = size;
+        VSELPRINTF("Starting incr send of clipboard data");
+
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XSelectInput(x11->display, event->xselectionrequest.requestor,
+                     PropertyChangeMask);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        x11->incr_atom, 32, PropModeReplace,
+                        (unsigned char*)&len, 1);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            if (cached) {
+                x11->selection_req_data = data;
+            } else {
+                /* duplicate data */
+                x11->selection_req_data = malloc(size);
+                if (x11->selection_req_data != NULL) {
+                    memcpy(x11->selection_req_data, data, size);
+                    metrics_add(METRICS_CLIPBOARD_INCR_SEND_BYTES, size);
+                }
+            }
+            if (x11->selection_req_data != NULL) {
+                x11->selection_req_data_pos = 0;
+                x11->selection_req_data_size = size;
+                x11->selection_req_data_cached = cached;
+                x11->selection_req_atom = prop;
+                vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
+            } else {
+                SELPRINTF("out of memory allocating selection buffer");
+            }
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+        }
+    } else {
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        event->xselectionrequest.target, 8, PropModeReplace,
+                        data, size);
+        trace_clipboard(x11->selection_req->id, TRACE_CLIPBOARD_X11_DATA_DONE,
+                        selection, type, size);
+        if (vdagent_x11_restore_error_handler(x11) == 0)
+            vdagent_x11_send_selection_notify(x11, prop, NULL);
+        else
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+    }
+}
+
+/* Keep a copy of (validated) client text for further requests.
+   Return value: 1 on success, 0 on out of memory */
+static int vdagent_x11_cache_text(struct vdagent_x11 *x11, uint8_t selection,
+    const uint8_t *data, uint32_t size)
+{
+    vdagent_x11_clear_text_cache(x11, selection);
+    if (!size)
+        return 0;
+
+    x11->clipboard_text[selection].utf8 = malloc(size);
+    if (!x11->clipboard_text[selection].utf8) {
+        SELPRINTF("out of memory caching clipboard text");
+        return 0;
+    }
+    memcpy(x11->clipboard_text[selection].utf8, data, size);
+    x11->clipboard_text[selection].utf8_size = size;
+    metrics_add(METRICS_CLIPBOARD_TEXT_CACHE_BYTES, size);
+    return 1;
+}
+
+/* Answer the current selection request, for one of the text targets, from
+   the cached client text. ISO Latin-1 is converted to on the first STRING
+   request. */
+static void vdagent_x11_send_text(struct vdagent_x11 *x11)
+{
+    uint8_t selection = x11->selection_req->selection;
+    Atom target = x11->selection_req->event.xselectionrequest.target;
+    uint8_t *latin1;
+
+    if (target != XA_STRING) {
+        vdagent_x11_send_selection_data(x11, VD_AGENT_CLIPBOARD_UTF8_TEXT,
+                                        x11->clipboard_text[selection].utf8,
+                                        x11->clipboard_text[selection].utf8_size,
+                                        1);
+        return;
+    }
+
+    if (!x11->clipboard_text[selection].latin1) {
+        latin1 = malloc(x11->clipboard_text[selection].utf8_size);
+        if (!latin1) {
+            SELPRINTF("out of memory converting clipboard text to Latin-1");
+            vdagent_x11_send_selection_notify(x11, None, NULL);
+            return;
+        }
+        x11->clipboard_text[selection].latin1 = latin1;
+        x11->clipboard_text[selection].latin1_size =
+            utf8_to_latin1(latin1, x11->clipboard_text[selection].utf8,
+                           x11->clipboard_text[selection].utf8_size);
+        metrics_add(METRICS_CLIPBOARD_TEXT_CACHE_BYTES,
+                    x11->clipboard_text[selection].latin1_size);
+    }
+    vdagent_x11_send_selection_data(x11, VD_AGENT_CLIPBOARD_UTF8_TEXT,
+                                    x11->clipboard_text[selection].latin1,
+                                    x11->clipboard_text[selection].latin1_size,
+                                    1);
+}
+
+/* Send the converted image for the conversion request at the head of the
+   queue to the client, and go on with the next request */
+static void vdagent_x11_image_to_client_done(struct vdagent_x11 *x11,
+    uint8_t *data, uint32_t size)
+{
+    uint8_t selection = x11->conversion_req->selection;
+    uint32_t type = x11->conversion_req->type;
+
+    if (data)
+        vdagent_x11_cache_image(x11, selection, type, data, size);
+    else
+        type = VD_AGENT_CLIPBOARD_NONE;
+
+    metrics_add(METRICS_CLIPBOARD_BYTES, size);
+    trace_clipboard(x11->conversion_req->id, TRACE_CLIPBOARD_CONVERSION_DONE,
+                    selection, type, size);
+    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA,
+                VDAGENTD_CLIPBOARD_ARG1(selection, x11->conversion_req->id),
+                type, data, size);
+
+    vdagent_x11_next_conversion_request(x11);
+    vdagent_x11_handle_conversion_request(x11);
+}
+
+/* Answer the selection request at the head of the queue with the
+   converted image */
+static void vdagent_x11_image_to_guest_done(struct vdagent_x11 *x11,
+    uint8_t *data, uint32_t size)
+{
+    uint8_t selection = x11->selection_req->selection;
+    uint32_t type = vdagent_x11_target_to_type(x11, selection,
+                        x11->selection_req->event.xselectionrequest.target);
+
+    if (!data) {
+        vdagent_x11_send_selection_notify(x11, None, NULL);
+        return;
+    }
+    vdagent_x11_cache_image(x11, selection, type, data, size);
+    vdagent_x11_send_selection_data(x11, type, data, size, 1);
+}
+
+static void vdagent_x11_image_done(void *opaque, uint8_t *data, uint32_t size)
+{
+    struct vdagent_x11_image_job *job = opaque;
+    struct vdagent_x11 *x11 = job->x11;
+
+    if (job->cancelled) {
+        free(data);
+    } else if (job->to_client) {
+        x11->conversion_image_job = NULL;
+        vdagent_x11_image_to_client_done(x11, data, size);
+    } else {
+        x11->selection_image_job = NULL;
+        vdagent_x11_image_to_guest_done(x11, data, size);
+    }
+    free(job);
+}
+
+/* Convert an image for the conversion request (to_client) or selection
+   request at the head of its queue, on the worker thread */
+static void vdagent_x11_convert_image(struct vdagent_x11 *x11,
+    uint32_t from, uint32_t to, const uint8_t *data, uint32_t size,
+    int to_client)
+{
+    struct vdagent_x11_image_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        syslog(LOG_ERR, "out of memory allocating image job");
+        if (to_client)
+            vdagent_x11_image_to_client_done(x11, NULL, 0);
+        else
+            vdagent_x11_image_to_guest_done(x11, NULL, 0);
+        return;
+    }
+    job->x11 = x11;
+    job->to_client = to_client;
+    if (to_client)
+        x11->conversion_image_job = job;
+    else
+        x11->selection_image_job = job;
+
+    vdagent_image_convert(x11->image, from, to, data, size,
+                          to_client ? x11->max_clipboard : -1,
+                          vdagent_x11_image_done, job);
+}
+
+void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
+    uint32_t type, uint32_t id, uint8_t *data, uint32_t size)
+{
     XEvent *event;
-    uint32_t type_from_event;
+    uint32_t type_from_event, source_type;
+
+    metrics_add(METRICS_CLIPBOARD_BYTES, size);
+    trace_clipboard(id, TRACE_CLIPBOARD_X11_DATA, selection, type, size);
 
-    if (x11->selection_req_data) {
+    if (x11->selection_req_data || x11->selection_image_job) {
         if (type || size) {
             SELPRINTF("received clipboard data while still sending"
                       " data from previous request, ignoring");
@@ -1231,15 +1903,18 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     type_from_event = vdagent_x11_target_to_type(x11,
                                              x11->selection_req->selection,
                                              event->xselectionrequest.target);
-    if (type_from_event != type ||
+    source_type = vdagent_x11_client_source_type(x11,
+                                             x11->selection_req->selection,
+                                             type_from_event);
+    if (source_type != type ||
             selection != x11->selection_req->selection) {
         if (selection != x11->selection_req->selection) {
             SELPRINTF("expecting data for selection %d got %d",
                       (int)x11->selection_req->selection, (int)selection);
         }
-        if (type_from_event != type) {
+        if (source_type != type) {
             SELPRINTF("expecting type %u clipboard data got %u",
-                      type_from_event, type);
+                      source_type, type);
         }
         vdagent_x11_send_selection_notify(x11, None, NULL);
 
@@ -1248,44 +1923,22 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
         return;
     }
 
-    prop = event->xselectionrequest.property;
-    if (prop == None)
-        prop = event->xselectionrequest.target;
-
-    if (size > x11->max_prop_size) {
-        unsigned long len = size;
-        VSELPRINTF("Starting incr send of clipboard data");
-
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XSelectInput(x11->display, event->xselectionrequest.requestor,
-                     PropertyChangeMask);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        x11->incr_atom, 32, PropModeReplace,
-                        (unsigned char*)&len, 1);
-        if (vdagent_x11_restore_error_handler(x11) == 0) {
-            /* duplicate data */
-            x11->selection_req_data = malloc(size);
-            if (x11->selection_req_data != NULL) {
-                memcpy(x11->selection_req_data, data, size);
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = size;
-                x11->selection_req_atom = prop;
-                vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
-            } else {
-                SELPRINTF("out of memory allocating selection buffer");
-            }
+    if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+        if (x11->client_lineend == VDAGENTD_LINEEND_CRLF)
+            size = lineend_crlf_to_lf(data, size);
+        if (!utf8_validate(data, size)) {
+            SELPRINTF("received invalid UTF-8 text from the client, "
+                      "refusing");
+            vdagent_x11_send_selection_notify(x11, None, NULL);
+        } else if (vdagent_x11_cache_text(x11, selection, data, size)) {
+            vdagent_x11_send_text(x11);
         } else {
-            SELPRINTF("clipboard data sent failed, requestor window gone");
+            vdagent_x11_send_selection_data(x11, type, data, size, 0);
         }
+    } else if (type_from_event != type) {
+        vdagent_x11_convert_image(x11, type, type_from_event, data, size, 0);
     } else {
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        event->xselectionrequest.target, 8, PropModeReplace,
-                        data, size);
-        if (vdagent_x11_restore_error_handler(x11) == 0)
-            vdagent_x11_send_selection_notify(x11, prop, NULL);
-        else
-            SELPRINTF("clipboard data sent failed, requestor window gone");
+        vdagent_x11_send_selection_data(x11, type, data, size, 0);
     }
 
     /* Flush output buffers and consume any pending events */
@@ -1322,6 +1975,17 @@ void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection)
     vdagent_x11_do_read(x11);
 }
 
+/* The client, if any, has none of our grabs */
+static void vdagent_x11_forget_client_grabs(struct vdagent_x11 *x11)
+{
+    int sel;
+
+    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        x11->clipboard_client_grabbed[sel] = 0;
+        x11->clipboard_sent_count[sel] = 0;
+    }
+}
+
 void vdagent_x11_client_disconnected(struct vdagent_x11 *x11)
 {
     int sel;
@@ -1330,6 +1994,27 @@ void vdagent_x11_client_disconnected(struct vdagent_x11 *x11)
         if (x11->clipboard_owner[sel] == owner_client)
             vdagent_x11_clipboard_release(x11, sel);
     }
+    vdagent_x11_forget_client_grabs(x11);
+    x11->client_lineend = VDAGENTD_LINEEND_LF;
+    x11->max_clipboard = -1;
+}
+
+void vdagent_x11_set_client_lineend(struct vdagent_x11 *x11, int lineend)
+{
+    if (x11->debug)
+        syslog(LOG_DEBUG, "client uses %s line endings",
+               lineend == VDAGENTD_LINEEND_CRLF ? "CR LF" : "LF");
+    x11->client_lineend = lineend;
+    /* This comes when a client connects, and when our session becomes the
+       active one, the daemon has dropped any grabs it got before */
+    vdagent_x11_forget_client_grabs(x11);
+}
+
+void vdagent_x11_set_max_clipboard(struct vdagent_x11 *x11, int max)
+{
+    if (x11->debug)
+        syslog(LOG_DEBUG, "max clipboard: %d", max);
+    x11->max_clipboard = max;
 }
 
 /* Function used to determine the default location to save file-xfers,
@@ -33,7 +33,15 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
 void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected);
 
 int  vdagent_x11_get_fd(struct vdagent_x11 *x11);
+/* Handle a batch of X events, more may be left queued */
 void vdagent_x11_do_read(struct vdagent_x11 *x11);
+/* Return value: 1 if libX11 has queued events already, which do not make
+ * the fd readable.
+ */
+int  vdagent_x11_has_queued_events(struct vdagent_x11 *x11);
+/* Clipboard images get converted on a worker thread, -1 if not */
+int  vdagent_x11_get_image_fd(struct vdagent_x11 *x11);
+void vdagent_x11_do_image_read(struct vdagent_x11 *x11);
 
 void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     VDAgentMonitorsConfig *mon_config, int fallback);
@@ -41,12 +49,14 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
 void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t *types, uint32_t type_count);
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
-    uint8_t selection, uint32_t type);
+    uint8_t selection, uint32_t type, uint32_t id);
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
-    uint32_t type, uint8_t *data, uint32_t size);
+    uint32_t type, uint32_t id, uint8_t *data, uint32_t size);
 void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection);
 
 void vdagent_x11_client_disconnected(struct vdagent_x11 *x11);
+void vdagent_x11_set_client_lineend(struct vdagent_x11 *x11, int lineend);
+void vdagent_x11_set_max_clipboard(struct vdagent_x11 *x11, int max);
 
 int vdagent_x11_has_icons_on_desktop(struct vdagent_x11 *x11);
 
@@ -36,6 +36,9 @@ static const char * const vdagentd_messages[] = {
         "file xfer data",
         "file xfer disable",
         "client disconnected",
+        "metrics",
+        "client lineend",
+        "max clipboard",
 };
 
 #endif
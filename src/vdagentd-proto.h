@@ -23,7 +23,10 @@
 #ifndef __VDAGENTD_PROTO_H
 #define __VDAGENTD_PROTO_H
 
+#include <stdint.h>
+
 #define VDAGENTD_SOCKET "/var/run/spice-vdagentd/spice-vdagent-sock"
+#define VDAGENTD_METRICS_SOCKET "/var/run/spice-vdagentd/spice-vdagentd-metrics"
 
 enum {
     VDAGENTD_GUEST_XORG_RESOLUTION, /* client -> daemon, arg1: overall width,
@@ -32,19 +35,55 @@ enum {
     VDAGENTD_MONITORS_CONFIG, /* daemon -> client, VDAgentMonitorsConfig
                                  followed by num_monitors VDAgentMonConfig-s */
     VDAGENTD_CLIPBOARD_GRAB,    /* arg1: sel, data: array of supported types */
-    VDAGENTD_CLIPBOARD_REQUEST, /* arg1: selection, arg 2 = type */
-    VDAGENTD_CLIPBOARD_DATA,    /* arg1: sel, arg 2: type, data: data */
+    VDAGENTD_CLIPBOARD_REQUEST, /* arg1: selection + id, arg 2 = type */
+    VDAGENTD_CLIPBOARD_DATA,    /* arg1: sel + id, arg 2: type, data: data */
     VDAGENTD_CLIPBOARD_RELEASE, /* arg1: selection */
     VDAGENTD_VERSION,           /* daemon -> client, data: version string */
     VDAGENTD_AUDIO_VOLUME_SYNC,
-    VDAGENTD_FILE_XFER_START,
-    VDAGENTD_FILE_XFER_STATUS,
+    VDAGENTD_FILE_XFER_START,   /* daemon -> client, arg1: 1 if the spice
+                                   client announced
+                                   VDAGENTD_FILE_XFER_RESUME_CAP */
+    VDAGENTD_FILE_XFER_STATUS,  /* arg1: id, arg2: result, data: optional
+                                   struct vdagentd_file_xfer_resume */
     VDAGENTD_FILE_XFER_DATA,
     VDAGENTD_FILE_XFER_DISABLE,
-    VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
+    VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client, arg1: 1 if only the
+                                      virtio port dropped and the client may
+                                      come back, with its state */
+    VDAGENTD_METRICS,           /* daemon -> client: request, client -> daemon:
+                                   data: struct metrics_snapshot */
+    VDAGENTD_CLIENT_LINEEND,    /* daemon -> client, arg1: the line ending
+                                   the spice client uses for its text, one
+                                   of VDAGENTD_LINEEND_* */
+    VDAGENTD_MAX_CLIPBOARD,     /* daemon -> client, arg1: the largest
+                                   clipboard data the spice client accepts,
+                                   -1 for no limit */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
+/* Clipboard request and data messages carry a request id in the upper 24
+   bits of arg1, so that a request can be followed across the processes in
+   the trace (see trace.h). Older versions only look at the lower 8 bits.
+   Ids allocated by the agent have VDAGENTD_CLIPBOARD_ID_AGENT set, 0 means
+   no id. */
+#define VDAGENTD_CLIPBOARD_ARG1(sel, id) \
+    ((uint8_t)(sel) | (((uint32_t)(id) & 0xffffff) << 8))
+#define VDAGENTD_CLIPBOARD_ID(arg1) ((uint32_t)(arg1) >> 8)
+#define VDAGENTD_CLIPBOARD_ID_AGENT 0x800000
+
+/* Stream ids for tagging queued messages, so that messages which have become
+   stale can be dropped, see udscs_write_stream() */
+#define VDAGENTD_STREAM_FILE_XFER(id) ((UINT64_C(1) << 32) | (uint32_t)(id))
+#define VDAGENTD_STREAM_CLIPBOARD(sel) ((UINT64_C(2) << 32) | (uint8_t)(sel))
+
+/* The line ending of text in clipboard data exchanged with the client, the
+   agent converts from / to LF. Clients announce this with the same
+   VD_AGENT_CAP_GUEST_LINEEND_* caps which agents use for the guest. */
+enum {
+    VDAGENTD_LINEEND_LF,
+    VDAGENTD_LINEEND_CRLF,
+};
+
 struct vdagentd_guest_xorg_resolution {
     int width;
     int height;
@@ -52,4 +91,22 @@ struct vdagentd_guest_xorg_resolution {
     int y;
 };
 
+/* Resuming xfers is an extension of the agent protocol, which spice-protocol
+   has no equivalent of (yet), its capability bit is taken from the top of
+   the range, away from spice-protocol's. Only spice clients announcing
+   VDAGENTD_FILE_XFER_RESUME_CAP may set "resume=true" in the xfer start
+   message, the daemon tells the agent so in VDAGENTD_FILE_XFER_START.
+
+   Appended to the VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA status of
+   resumable xfers. The client must continue sending data from offset,
+   after checking that the first offset bytes of the file have the given
+   crc32c (else it must cancel the xfer and start over). offset is 0 when
+   nothing could be resumed. */
+#define VDAGENTD_FILE_XFER_RESUME_CAP 30
+
+struct vdagentd_file_xfer_resume {
+    uint64_t offset;
+    uint32_t crc32c;
+} __attribute__((packed));
+
 #endif
@@ -0,0 +1,342 @@
+/*  compress.c vdagentd virtio payload compression
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "compress.h"
+
+const struct vdagentd_compress_header *vdagentd_compress_get_header(
+    const uint8_t *data, uint32_t size)
+{
+    const struct vdagentd_compress_header *header;
+
+    if (size < sizeof(*header)) {
+        syslog(LOG_ERR, "compressed message too small: %u", size);
+        return NULL;
+    }
+    header = (const struct vdagentd_compress_header *)data;
+    if (header->codec != VDAGENTD_COMPRESS_CODEC_ZSTD) {
+        syslog(LOG_ERR, "unknown compression codec %u", header->codec);
+        return NULL;
+    }
+    return header;
+}
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+/* Level 1 keeps up with the virtio port on a single core, while still
+   getting most of the gain on text and uncompressed images */
+#define COMPRESS_LEVEL 1
+/* Smaller messages hardly shrink and are not worth the header */
+#define COMPRESS_MIN_SIZE 512
+/* The largest message a client can make us allocate through decompression,
+   callers impose tighter limits where they know them */
+#define COMPRESS_MAX_SIZE (64 * 1024 * 1024)
+/* Concurrent streams, each holds up to 2^VDAGENTD_COMPRESS_WINDOW_LOG bytes
+   of history */
+#define COMPRESS_MAX_STREAMS 16
+
+struct vdagentd_compress_stream {
+    uint32_t id;
+    ZSTD_DCtx *dctx;
+    struct vdagentd_compress_stream *next;
+};
+
+struct vdagentd_compress {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    struct vdagentd_compress_stream *streams;
+    int stream_count;
+    int debug;
+};
+
+struct vdagentd_compress *vdagentd_compress_create(int debug)
+{
+    struct vdagentd_compress *compress;
+
+    compress = calloc(1, sizeof(*compress));
+    if (!compress) {
+        syslog(LOG_ERR, "out of memory allocating compression state");
+        return NULL;
+    }
+    compress->debug = debug;
+    compress->cctx = ZSTD_createCCtx();
+    compress->dctx = ZSTD_createDCtx();
+    if (!compress->cctx || !compress->dctx) {
+        syslog(LOG_ERR, "out of memory allocating compression contexts");
+        vdagentd_compress_destroy(compress);
+        return NULL;
+    }
+    ZSTD_CCtx_setParameter(compress->cctx, ZSTD_c_compressionLevel,
+                           COMPRESS_LEVEL);
+    return compress;
+}
+
+void vdagentd_compress_destroy(struct vdagentd_compress *compress)
+{
+    if (!compress)
+        return;
+
+    vdagentd_compress_reset(compress);
+    ZSTD_freeCCtx(compress->cctx);
+    ZSTD_freeDCtx(compress->dctx);
+    free(compress);
+}
+
+uint8_t *vdagentd_compress_message(struct vdagentd_compress *compress,
+    uint32_t type, const struct vdagentd_compress_iov *iov, int count,
+    uint32_t *size)
+{
+    struct vdagentd_compress_header *header;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t total = 0, ret;
+    uint8_t *buf;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total += iov[i].size;
+    if (total < COMPRESS_MIN_SIZE)
+        return NULL;
+
+    /* Only worth it if it gets smaller, so output which does not fit in
+       what the message takes as is means giving up */
+    buf = malloc(total);
+    if (!buf)
+        return NULL;
+    out.dst = buf + sizeof(*header);
+    out.size = total - sizeof(*header);
+    out.pos = 0;
+
+    ZSTD_CCtx_reset(compress->cctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_setPledgedSrcSize(compress->cctx, total);
+    for (i = 0; i < count; i++) {
+        in.src = iov[i].data;
+        in.size = iov[i].size;
+        in.pos = 0;
+        while (in.pos < in.size) {
+            ret = ZSTD_compressStream2(compress->cctx, &out, &in,
+                                       ZSTD_e_continue);
+            if (ZSTD_isError(ret) || out.pos == out.size)
+                goto fail;
+        }
+    }
+    in.src = NULL;
+    in.size = in.pos = 0;
+    do {
+        ret = ZSTD_compressStream2(compress->cctx, &out, &in, ZSTD_e_end);
+        if (ZSTD_isError(ret) || (ret && out.pos == out.size))
+            goto fail;
+    } while (ret);
+
+    header = (struct vdagentd_compress_header *)buf;
+    header->type = type;
+    header->size = total;
+    header->codec = VDAGENTD_COMPRESS_CODEC_ZSTD;
+    header->flags = 0;
+    header->stream = 0;
+    *size = sizeof(*header) + out.pos;
+    if (compress->debug > 1)
+        syslog(LOG_DEBUG, "compressed message type %u from %lu to %u bytes",
+               type, (unsigned long)total, *size);
+    return buf;
+
+fail:
+    free(buf);
+    return NULL;
+}
+
+static struct vdagentd_compress_stream *vdagentd_compress_get_stream(
+    struct vdagentd_compress *compress, uint32_t id)
+{
+    struct vdagentd_compress_stream *stream;
+
+    for (stream = compress->streams; stream; stream = stream->next) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    if (compress->stream_count == COMPRESS_MAX_STREAMS) {
+        syslog(LOG_ERR, "too many compressed streams");
+        return NULL;
+    }
+    stream = calloc(1, sizeof(*stream));
+    if (stream)
+        stream->dctx = ZSTD_createDCtx();
+    if (!stream || !stream->dctx) {
+        syslog(LOG_ERR, "out of memory allocating compressed stream");
+        free(stream);
+        return NULL;
+    }
+    ZSTD_DCtx_setParameter(stream->dctx, ZSTD_d_windowLogMax,
+                           VDAGENTD_COMPRESS_WINDOW_LOG);
+    stream->id = id;
+    stream->next = compress->streams;
+    compress->streams = stream;
+    compress->stream_count++;
+    return stream;
+}
+
+uint8_t *vdagentd_compress_decompress(struct vdagentd_compress *compress,
+    const uint8_t *data, uint32_t size, uint32_t *type, uint32_t *out_size)
+{
+    const struct vdagentd_compress_header *header;
+    struct vdagentd_compress_stream *stream;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t ret, progress;
+    uint8_t *buf;
+
+    header = vdagentd_compress_get_header(data, size);
+    if (!header)
+        return NULL;
+    if (header->size > COMPRESS_MAX_SIZE) {
+        syslog(LOG_ERR, "compressed message too large: %u", header->size);
+        return NULL;
+    }
+
+    /* Also for 0 bytes, NULL means failure */
+    buf = malloc(header->size ? header->size : 1);
+    if (!buf) {
+        syslog(LOG_ERR, "out of memory decompressing %u bytes", header->size);
+        return NULL;
+    }
+    in.src = data + sizeof(*header);
+    in.size = size - sizeof(*header);
+    in.pos = 0;
+    out.dst = buf;
+    out.size = header->size;
+    out.pos = 0;
+
+    if (!(header->flags & VDAGENTD_COMPRESS_FLAG_STREAM)) {
+        ret = ZSTD_decompressDCtx(compress->dctx, out.dst, out.size,
+                                  in.src, in.size);
+        if (ZSTD_isError(ret) || ret != header->size) {
+            syslog(LOG_ERR, "decompressing message type %u failed: %s",
+                   header->type, ZSTD_isError(ret) ? ZSTD_getErrorName(ret)
+                                                   : "size mismatch");
+            goto fail;
+        }
+    } else {
+        stream = vdagentd_compress_get_stream(compress, header->stream);
+        if (!stream)
+            goto fail;
+        do {
+            progress = in.pos + out.pos;
+            ret = ZSTD_decompressStream(stream->dctx, &out, &in);
+            if (ZSTD_isError(ret)) {
+                syslog(LOG_ERR, "decompressing stream %u failed: %s",
+                       header->stream, ZSTD_getErrorName(ret));
+                vdagentd_compress_end_stream(compress, header->stream);
+                goto fail;
+            }
+        } while ((in.pos < in.size || out.pos < out.size) &&
+                 in.pos + out.pos != progress);
+        if (in.pos != in.size || out.pos != out.size) {
+            syslog(LOG_ERR, "decompressing stream %u failed: size mismatch",
+                   header->stream);
+            vdagentd_compress_end_stream(compress, header->stream);
+            goto fail;
+        }
+    }
+
+    *type = header->type;
+    *out_size = header->size;
+    return buf;
+
+fail:
+    free(buf);
+    return NULL;
+}
+
+void vdagentd_compress_end_stream(struct vdagentd_compress *compress,
+    uint32_t id)
+{
+    struct vdagentd_compress_stream **streamp, *stream;
+
+    for (streamp = &compress->streams; *streamp;
+         streamp = &(*streamp)->next) {
+        stream = *streamp;
+        if (stream->id == id) {
+            *streamp = stream->next;
+            ZSTD_freeDCtx(stream->dctx);
+            free(stream);
+            compress->stream_count--;
+            return;
+        }
+    }
+}
+
+void vdagentd_compress_reset(struct vdagentd_compress *compress)
+{
+    while (compress->streams)
+        vdagentd_compress_end_stream(compress, compress->streams->id);
+}
+
+int vdagentd_compress_get_stream_count(struct vdagentd_compress *compress)
+{
+    return compress->stream_count;
+}
+
+#else /* !HAVE_ZSTD */
+
+struct vdagentd_compress *vdagentd_compress_create(int debug)
+{
+    return NULL;
+}
+
+void vdagentd_compress_destroy(struct vdagentd_compress *compress)
+{
+}
+
+uint8_t *vdagentd_compress_message(struct vdagentd_compress *compress,
+    uint32_t type, const struct vdagentd_compress_iov *iov, int count,
+    uint32_t *size)
+{
+    return NULL;
+}
+
+uint8_t *vdagentd_compress_decompress(struct vdagentd_compress *compress,
+    const uint8_t *data, uint32_t size, uint32_t *type, uint32_t *out_size)
+{
+    return NULL;
+}
+
+void vdagentd_compress_end_stream(struct vdagentd_compress *compress,
+    uint32_t stream)
+{
+}
+
+void vdagentd_compress_reset(struct vdagentd_compress *compress)
+{
+}
+
+int vdagentd_compress_get_stream_count(struct vdagentd_compress *compress)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*  compress.h vdagentd virtio payload compression header
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_COMPRESS_H
+#define __VDAGENTD_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spice/vd_agent.h>
+
+/* Compressed payloads are a private extension of the agent protocol, which
+ * spice-protocol has no equivalent of (yet). The capability bit and message
+ * type are not allocated by spice-protocol, they are taken from the top of
+ * their ranges, away from the ones it allocates. So vdagentd only uses the
+ * extension when started with -z, by admins who know that their clients
+ * implement it (and give the capability bit no other meaning).
+ *
+ * A client announcing the VDAGENTD_COMPRESS_CAP capability accepts
+ * VDAGENTD_COMPRESS_MESSAGE messages and may send them, for
+ * VD_AGENT_CLIPBOARD and VD_AGENT_FILE_XFER_DATA messages only.
+ *
+ * A VDAGENTD_COMPRESS_MESSAGE holds a struct vdagentd_compress_header
+ * followed by the compressed data of the carried message. Without
+ * VDAGENTD_COMPRESS_FLAG_STREAM this is a single zstd frame. With it, it
+ * continues the zstd stream of the earlier messages with the same stream,
+ * flushed (ZSTD_e_flush) at the end of each message, so that files
+ * compress as a whole instead of chunk by chunk. The stream of a file
+ * xfer must use the xfer's id, it ends with the xfer. Stream windows are
+ * limited to 2^VDAGENTD_COMPRESS_WINDOW_LOG bytes. Clipboard data can get
+ * dropped from the queue when it becomes stale, so it never uses streams.
+ *
+ * A carried VD_AGENT_FILE_XFER_DATA message holds at most
+ * VDAGENTD_COMPRESS_MAX_XFER_DATA bytes of file data, a carried
+ * VD_AGENT_CLIPBOARD message at most the VD_AGENT_MAX_CLIPBOARD announced
+ * by the client, so that a few bytes of compressed data can not make the
+ * receiver allocate much more than the uncompressed message would.
+ */
+#define VDAGENTD_COMPRESS_CAP 31
+#define VDAGENTD_COMPRESS_MESSAGE 0x10000
+#define VDAGENTD_COMPRESS_FLAG_STREAM 1
+#define VDAGENTD_COMPRESS_WINDOW_LOG 23
+#define VDAGENTD_COMPRESS_MAX_XFER_DATA (64 * VD_AGENT_MAX_DATA_SIZE)
+
+enum {
+    VDAGENTD_COMPRESS_CODEC_ZSTD = 1,
+};
+
+struct vdagentd_compress_header {
+    uint32_t type;   /* of the carried message */
+    uint32_t size;   /* of the carried message's data, decompressed */
+    uint32_t codec;  /* VDAGENTD_COMPRESS_CODEC_* */
+    uint32_t flags;  /* VDAGENTD_COMPRESS_FLAG_* */
+    uint32_t stream; /* with VDAGENTD_COMPRESS_FLAG_STREAM */
+};
+
+/* The compression state of a client connection: the decompression
+ * contexts of its streams.
+ */
+struct vdagentd_compress;
+
+/* Return value: NULL when built without zstd support (or on out of
+ * memory), don't announce VDAGENTD_COMPRESS_CAP then.
+ */
+struct vdagentd_compress *vdagentd_compress_create(int debug);
+void vdagentd_compress_destroy(struct vdagentd_compress *compress);
+
+/* Compress a message of type, made up of the count pieces of data in
+ * iov, to the data of a VDAGENTD_COMPRESS_MESSAGE.
+ * Return value: malloc-ed data of *size bytes, NULL when the message is
+ * better sent as is: not compressible enough, too small, or on error.
+ */
+struct vdagentd_compress_iov {
+    const void *data;
+    size_t size;
+};
+
+uint8_t *vdagentd_compress_message(struct vdagentd_compress *compress,
+    uint32_t type, const struct vdagentd_compress_iov *iov, int count,
+    uint32_t *size);
+
+/* Return value: the header of the data of a VDAGENTD_COMPRESS_MESSAGE, to
+ * check the carried message before decompressing it, NULL if the data is
+ * not valid (logged).
+ */
+const struct vdagentd_compress_header *vdagentd_compress_get_header(
+    const uint8_t *data, uint32_t size);
+
+/* Decompress the data of a VDAGENTD_COMPRESS_MESSAGE.
+ * Return value: the malloc-ed data of the carried message, which is of
+ * *type and *size bytes, NULL on error (logged).
+ */
+uint8_t *vdagentd_compress_decompress(struct vdagentd_compress *compress,
+    const uint8_t *data, uint32_t size, uint32_t *type, uint32_t *out_size);
+
+/* Drop the context of stream, when its file xfer ends */
+void vdagentd_compress_end_stream(struct vdagentd_compress *compress,
+    uint32_t stream);
+
+/* Drop all stream contexts, when the client disconnects */
+void vdagentd_compress_reset(struct vdagentd_compress *compress);
+
+/* Return value: the number of streams with a decompression context, which
+ * can not be handed over to a new process.
+ */
+int vdagentd_compress_get_stream_count(struct vdagentd_compress *compress);
+
+#endif
@@ -38,8 +38,22 @@ struct session_info {
     gchar *match_session_signals;
     gboolean session_is_locked;
     gboolean session_idle_hint;
+    /* All ConsoleKit method calls made from the main loop are asynchronous,
+       these are the serials of the outstanding calls (0 if none) */
+    dbus_uint32_t active_session_serial;
+    dbus_uint32_t session_type_serial;
+    GHashTable *pid_serials;   /* serial -> pid */
+    /* Session type of the active session, prefetched when it changes */
+    gboolean session_type_known;
+    gboolean session_is_user;
+    /* pid -> session cache, a NULL session means the lookup is pending */
+    GHashTable *pid_sessions;
+    gboolean updates;
 };
 
+/* Flush the pid -> session cache when it grows beyond this */
+#define MAX_CACHED_PIDS 64
+
 #define INTERFACE_CONSOLE_KIT "org.freedesktop.ConsoleKit"
 #define OBJ_PATH_CONSOLE_KIT  "/org/freedesktop/ConsoleKit"
 
@@ -59,15 +73,17 @@ struct session_info {
 
 static char *console_kit_get_first_seat(struct session_info *info);
 static char *console_kit_check_active_session_change(struct session_info *info);
+static void console_kit_request_session_type(struct session_info *info);
 
+/* Note passing a NULL error to dbus_bus_[add|remove]_match makes them
+   asynchronous, errors are then reported as an error reply, which
+   si_dbus_read_signals() logs */
 static void si_dbus_match_remove(struct session_info *info)
 {
-    DBusError error;
     if (info->match_seat_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_seat_signals,
-                              &error);
+                              NULL);
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) seat match removed: %s",
                    info->match_seat_signals);
@@ -76,10 +92,9 @@ static void si_dbus_match_remove(struct session_info *info)
     }
 
     if (info->match_session_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_session_signals,
-                              &error);
+                              NULL);
 
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) session match removed: %s",
@@ -91,8 +106,6 @@ static void si_dbus_match_remove(struct session_info *info)
 
 static void si_dbus_match_rule_update(struct session_info *info)
 {
-    DBusError error;
-
     if (info->connection == NULL)
         return;
 
@@ -109,17 +122,9 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) seat match: %s",
                    info->match_seat_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_seat_signals,
-                           &error);
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-                   error.message);
-            dbus_error_free(&error);
-            g_free(info->match_seat_signals);
-            info->match_seat_signals = NULL;
-        }
+                           NULL);
     }
 
     /* Session signals */
@@ -132,16 +137,102 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) session match: %s",
                    info->match_session_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_session_signals,
-                           &error);
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
+                           NULL);
+    }
+    dbus_connection_flush(info->connection);
+}
+
+/* Send message without waiting for the reply, which gets handled by
+   si_dbus_read_signals(). Takes ownership of message.
+   Returns the serial of the message, or 0 on error */
+static dbus_uint32_t si_dbus_send_async(struct session_info *info,
+                                        DBusMessage *message)
+{
+    dbus_uint32_t serial = 0;
+
+    if (!dbus_connection_send(info->connection, message, &serial)) {
+        syslog(LOG_ERR, "(console-kit) Unable to send %s",
+               dbus_message_get_member(message));
+        serial = 0;
+    }
+    dbus_connection_flush(info->connection);
+    dbus_message_unref(message);
+    return serial;
+}
+
+/* Set the active session, session may be NULL */
+static void si_set_active_session(struct session_info *info,
+                                  const char *session)
+{
+    free(info->active_session);
+    info->active_session = session ? strdup(session) : NULL;
+    si_dbus_match_rule_update(info);
+    console_kit_request_session_type(info);
+}
+
+/* Handle the reply to one of our asynchronous method calls */
+static void si_dbus_handle_reply(struct session_info *info,
+                                 DBusMessage *message)
+{
+    dbus_uint32_t serial = dbus_message_get_reply_serial(message);
+    gpointer pid;
+    DBusError error;
+    char *value = NULL;
+
+    dbus_error_init(&error);
+    if (dbus_set_error_from_message(&error, message)) {
+        syslog(LOG_ERR, "(console-kit) %s", error.message);
+        dbus_error_free(&error);
+        message = NULL;
+    }
+
+    if (serial == info->active_session_serial) {
+        info->active_session_serial = 0;
+        if (message && dbus_message_get_args(message, &error,
+                                             DBUS_TYPE_OBJECT_PATH, &value,
+                                             DBUS_TYPE_INVALID)) {
+            si_set_active_session(info, value);
+            info->updates = TRUE;
+        } else if (message) {
+            syslog(LOG_ERR, "error getting ssid from reply: %s",
+                   error.message);
+            dbus_error_free(&error);
+        }
+    } else if (serial == info->session_type_serial) {
+        info->session_type_serial = 0;
+        if (message && dbus_message_get_args(message, &error,
+                                             DBUS_TYPE_STRING, &value,
+                                             DBUS_TYPE_INVALID)) {
+            /* Empty session_type means user */
+            if (info->verbose)
+                syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", value);
+            info->session_is_user = (g_strcmp0(value, "LoginWindow") != 0);
+            info->session_type_known = TRUE;
+        } else if (message) {
+            syslog(LOG_ERR,
+                   "(console-kit) fail to get session-type from reply: %s",
                    error.message);
             dbus_error_free(&error);
-            g_free(info->match_session_signals);
-            info->match_session_signals = NULL;
+        }
+    } else if (g_hash_table_lookup_extended(info->pid_serials,
+                                            GUINT_TO_POINTER(serial),
+                                            NULL, &pid)) {
+        g_hash_table_remove(info->pid_serials, GUINT_TO_POINTER(serial));
+        if (message && dbus_message_get_args(message, &error,
+                                             DBUS_TYPE_OBJECT_PATH, &value,
+                                             DBUS_TYPE_INVALID)) {
+            g_hash_table_insert(info->pid_sessions, pid, g_strdup(value));
+            info->updates = TRUE;
+        } else {
+            if (message) {
+                syslog(LOG_ERR, "error get ssid from reply: %s",
+                       error.message);
+                dbus_error_free(&error);
+            }
+            /* Allow a retry */
+            g_hash_table_remove(info->pid_sessions, pid);
         }
     }
 }
@@ -155,15 +246,20 @@ si_dbus_read_signals(struct session_info *info)
     message = dbus_connection_pop_message(info->connection);
     while (message != NULL) {
         const char *member;
+        int msg_type = dbus_message_get_type(message);
 
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SEAT_SIGNAL_ACTIVE_SESSION_CHANGED) == 0) {
+        if (msg_type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                msg_type == DBUS_MESSAGE_TYPE_ERROR) {
+            si_dbus_handle_reply(info, message);
+        } else if (g_strcmp0(member, SEAT_SIGNAL_ACTIVE_SESSION_CHANGED) == 0) {
             DBusMessageIter iter;
             gint type;
             gchar *session;
 
-            free(info->active_session);
-            info->active_session = NULL;
+            si_set_active_session(info, NULL);
+            /* Supersedes any outstanding GetActiveSession call */
+            info->active_session_serial = 0;
 
             dbus_message_iter_init(message, &iter);
             type = dbus_message_iter_get_arg_type(&iter);
@@ -173,8 +269,7 @@ si_dbus_read_signals(struct session_info *info)
             if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
                 dbus_message_iter_get_basic(&iter, &session);
                 if (session != NULL && session[0] != '\0') {
-                    info->active_session = g_strdup(session);
-                    si_dbus_match_rule_update(info);
+                    si_set_active_session(info, session);
                 } else {
                     syslog(LOG_WARNING, "(console-kit) received invalid session. "
                            "No active-session at the moment");
@@ -229,6 +324,9 @@ struct session_info *session_info_create(int verbose)
     info->verbose = verbose;
     info->session_is_locked = FALSE;
     info->session_idle_hint = FALSE;
+    info->pid_serials = g_hash_table_new(g_direct_hash, g_direct_equal);
+    info->pid_sessions = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                               NULL, g_free);
 
     dbus_error_init(&error);
     info->connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
@@ -239,6 +337,8 @@ struct session_info *session_info_create(int verbose)
              dbus_error_free(&error);
         } else
              syslog(LOG_ERR, "Unable to connect to system bus");
+        g_hash_table_destroy(info->pid_serials);
+        g_hash_table_destroy(info->pid_sessions);
         free(info);
         return NULL;
     }
@@ -265,6 +365,8 @@ void session_info_destroy(struct session_info *info)
 
     si_dbus_match_remove(info);
     dbus_connection_close(info->connection);
+    g_hash_table_destroy(info->pid_serials);
+    g_hash_table_destroy(info->pid_sessions);
     free(info->seat);
     free(info->active_session);
     free(info);
@@ -275,6 +377,16 @@ int session_info_get_fd(struct session_info *info)
     return info->fd;
 }
 
+/* Our D-Bus connection is the one of session_info_get_fd() */
+int session_info_get_dbus_fd(struct session_info *info)
+{
+    return -1;
+}
+
+void session_info_read_dbus(struct session_info *info)
+{
+}
+
 static char *console_kit_get_first_seat(struct session_info *info)
 {
     DBusError error;
@@ -342,15 +454,12 @@ exit:
 
 const char *session_info_get_active_session(struct session_info *info)
 {
-    DBusError error;
     DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
-    char *session = NULL;
 
     if (!info)
         return NULL;
 
-    if (info->active_session)
+    if (info->active_session || info->active_session_serial)
         return console_kit_check_active_session_change(info);
 
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
@@ -359,120 +468,73 @@ const char *session_info_get_active_session(struct session_info *info)
                                            "GetActiveSession");
     if (message == NULL) {
         syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetActiveSession failed: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetActiveSession failed");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    if (!dbus_message_get_args(reply,
-                               &error,
-                               DBUS_TYPE_OBJECT_PATH, &session,
-                               DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "error getting ssid from reply");
-        session = NULL;
-        goto exit;
-    }
-
-    info->active_session = strdup(session);
-    si_dbus_match_rule_update(info);
-
-exit:
-    if (reply != NULL) {
-            dbus_message_unref(reply);
+        return NULL;
     }
 
-    if (message != NULL) {
-            dbus_message_unref(message);
-    }
+    /* The reply gets processed by a later call, once it has arrived */
+    info->active_session_serial = si_dbus_send_async(info, message);
 
     /* In case the session was changed while we were running */
     return console_kit_check_active_session_change(info);
 }
 
+/* Returns the session of pid if known, else sends an asynchronous
+   GetSessionForUnixProcess request and returns NULL. When the reply arrives
+   session_info_has_updates() returns TRUE, after which the caller should
+   try again. */
 char *session_info_session_for_pid(struct session_info *info, uint32_t pid)
 {
-    DBusError error;
     DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
     DBusMessageIter args;
-    char *ssid = NULL;
+    dbus_uint32_t serial;
+    gpointer session;
 
     if (!info)
         return NULL;
 
+    si_dbus_read_signals(info);
+
+    if (g_hash_table_lookup_extended(info->pid_sessions,
+                                     GUINT_TO_POINTER(pid), NULL, &session))
+        return session ? strdup(session) : NULL;
+
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
                                            OBJ_PATH_CONSOLE_KIT_MANAGER,
                                            INTERFACE_CONSOLE_KIT_MANAGER,
                                            "GetSessionForUnixProcess");
     if (message == NULL) {
         syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
+        return NULL;
     }
 
     dbus_message_iter_init_append(message, &args);
     if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT32, &pid)) {
         syslog(LOG_ERR, "Unable to append dbus message args");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetSessionForUnixProcess failed: %s",
-                   error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetSessionForUnixProces failed");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    if (!dbus_message_get_args(reply,
-                               &error,
-                               DBUS_TYPE_OBJECT_PATH, &ssid,
-                               DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "error getting ssid from reply");
-        ssid = NULL;
-        goto exit;
+        dbus_message_unref(message);
+        return NULL;
     }
 
-    ssid = strdup(ssid);
+    serial = si_dbus_send_async(info, message);
+    if (serial == 0)
+        return NULL;
 
-exit:
-    if (reply != NULL) {
-            dbus_message_unref(reply);
-    }
+    if (g_hash_table_size(info->pid_sessions) >= MAX_CACHED_PIDS)
+        g_hash_table_remove_all(info->pid_sessions);
+    g_hash_table_insert(info->pid_serials, GUINT_TO_POINTER(serial),
+                        GUINT_TO_POINTER(pid));
+    g_hash_table_insert(info->pid_sessions, GUINT_TO_POINTER(pid), NULL);
+    return NULL;
+}
 
-    if (message != NULL) {
-            dbus_message_unref(message);
-    }
+gboolean session_info_has_updates(struct session_info *info)
+{
+    gboolean updates;
 
-    return ssid;
+    /* No need to read new messages here, their arrival makes our fd
+       readable, which makes vdagentd re-check the session info anyway */
+    updates = info->updates;
+    info->updates = FALSE;
+    return updates;
 }
 
 static char *console_kit_check_active_session_change(struct session_info *info)
@@ -519,6 +581,15 @@ gboolean session_info_is_user(struct session_info *info)
     g_return_val_if_fail (info->connection != NULL, TRUE);
     g_return_val_if_fail (info->active_session != NULL, TRUE);
 
+    /* The session type gets prefetched when the active session changes, so
+       this normally does not need to wait for ConsoleKit. If the reply has
+       not arrived yet we do a blocking call, rather then guessing: treating
+       a LoginWindow session as a user session would enable file-xfer to the
+       greeter */
+    si_dbus_read_signals(info);
+    if (info->session_type_known)
+        return info->session_is_user;
+
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
                                            info->active_session,
                                            INTERFACE_CONSOLE_KIT_SESSION,
@@ -565,6 +636,9 @@ gboolean session_info_is_user(struct session_info *info)
         syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", session_type);
 
     ret = (g_strcmp0 (session_type, "LoginWindow") != 0);
+    info->session_is_user = ret;
+    info->session_type_known = TRUE;
+    info->session_type_serial = 0;
 
 exit:
     if (reply != NULL) {
@@ -575,3 +649,25 @@ exit:
     }
     return ret;
 }
+
+static void console_kit_request_session_type(struct session_info *info)
+{
+    DBusMessage *message;
+
+    info->session_type_known = FALSE;
+    info->session_type_serial = 0;
+    if (info->active_session == NULL)
+        return;
+
+    message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
+                                           info->active_session,
+                                           INTERFACE_CONSOLE_KIT_SESSION,
+                                           "GetSessionType");
+    if (message == NULL) {
+        syslog(LOG_ERR,
+               "(console-kit) Unable to create dbus message for GetSessionType");
+        return;
+    }
+
+    info->session_type_serial = si_dbus_send_async(info, message);
+}
@@ -35,6 +35,15 @@ int session_info_get_fd(struct session_info *si)
     return -1;
 }
 
+int session_info_get_dbus_fd(struct session_info *si)
+{
+    return -1;
+}
+
+void session_info_read_dbus(struct session_info *si)
+{
+}
+
 const char *session_info_get_active_session(struct session_info *si)
 {
     return NULL;
@@ -45,7 +54,12 @@ char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
     return NULL;
 }
 
-gboolean session_is_locked(struct session_info *ck)
+gboolean session_info_has_updates(struct session_info *si)
+{
+    return FALSE;
+}
+
+gboolean session_info_session_is_locked(struct session_info *ck)
 {
     return FALSE;
 }
@@ -0,0 +1,291 @@
+/*  handoff.c vdagentd state handoff across a re-exec
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "handoff.h"
+
+#define HANDOFF_ALIGN(size) (((size) + 7) & ~(size_t)7)
+/* The state is small, anything larger is not ours */
+#define HANDOFF_MAX_SIZE (16 * 1024 * 1024)
+
+struct vdagentd_handoff {
+    uint8_t *buf;
+    size_t size;
+    size_t allocated;
+    int fd;
+    int error;
+};
+
+/* An anonymous file to pass the state in, cloexec until the very end, so
+   that it does not leak if the exec does not happen */
+static int handoff_create_fd(void)
+{
+    int fd;
+#ifndef HAVE_MEMFD_CREATE
+    char template[] = "/tmp/spice-vdagentd-handoff-XXXXXX";
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("spice-vdagentd-handoff", MFD_CLOEXEC);
+    if (fd == -1)
+        syslog(LOG_ERR, "memfd_create: %m");
+#else
+#ifdef O_TMPFILE
+    fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1)
+        return fd;
+#endif
+    fd = mkostemp(template, O_CLOEXEC);
+    if (fd == -1)
+        syslog(LOG_ERR, "creating handoff file: %m");
+    else
+        unlink(template);
+#endif
+    return fd;
+}
+
+static struct vdagentd_handoff *handoff_alloc(void)
+{
+    struct vdagentd_handoff *handoff;
+
+    handoff = calloc(1, sizeof(*handoff));
+    if (!handoff) {
+        syslog(LOG_ERR, "out of memory allocating handoff state");
+        return NULL;
+    }
+    handoff->fd = -1;
+    return handoff;
+}
+
+struct vdagentd_handoff *vdagentd_handoff_create(void)
+{
+    struct vdagentd_handoff *handoff = handoff_alloc();
+    struct vdagentd_handoff_header header = {
+        .magic = VDAGENTD_HANDOFF_MAGIC,
+        .major = VDAGENTD_HANDOFF_MAJOR,
+        .minor = VDAGENTD_HANDOFF_MINOR,
+    };
+
+    if (!handoff)
+        return NULL;
+    handoff->allocated = 4096;
+    handoff->buf = malloc(handoff->allocated);
+    if (!handoff->buf) {
+        syslog(LOG_ERR, "out of memory allocating handoff state");
+        free(handoff);
+        return NULL;
+    }
+    memcpy(handoff->buf, &header, sizeof(header));
+    handoff->size = sizeof(header);
+    return handoff;
+}
+
+void vdagentd_handoff_add(struct vdagentd_handoff *handoff, uint32_t type,
+    const void *data, uint32_t size)
+{
+    struct vdagentd_handoff_record record;
+    size_t needed = handoff->size + sizeof(record) + HANDOFF_ALIGN(size);
+    uint8_t *buf;
+
+    if (handoff->error)
+        return;
+
+    if (needed > handoff->allocated) {
+        buf = realloc(handoff->buf, needed * 2);
+        if (!buf) {
+            syslog(LOG_ERR, "out of memory adding handoff record %u", type);
+            handoff->error = 1;
+            return;
+        }
+        handoff->buf = buf;
+        handoff->allocated = needed * 2;
+    }
+
+    record.type = type;
+    record.size = size;
+    memcpy(handoff->buf + handoff->size, &record, sizeof(record));
+    memset(handoff->buf + handoff->size + sizeof(record), 0,
+           HANDOFF_ALIGN(size));
+    if (size)
+        memcpy(handoff->buf + handoff->size + sizeof(record), data, size);
+    handoff->size = needed;
+}
+
+int vdagentd_handoff_finish(struct vdagentd_handoff *handoff)
+{
+    size_t pos = 0;
+    ssize_t n;
+
+    if (handoff->error)
+        return -1;
+
+    handoff->fd = handoff_create_fd();
+    if (handoff->fd == -1)
+        return -1;
+    while (pos < handoff->size) {
+        n = write(handoff->fd, handoff->buf + pos, handoff->size - pos);
+        if (n == -1) {
+            syslog(LOG_ERR, "writing handoff state: %m");
+            return -1;
+        }
+        pos += n;
+    }
+    if (lseek(handoff->fd, 0, SEEK_SET) == -1 ||
+            fcntl(handoff->fd, F_SETFD, 0) == -1) {
+        syslog(LOG_ERR, "preparing handoff state: %m");
+        return -1;
+    }
+    return handoff->fd;
+}
+
+struct vdagentd_handoff *vdagentd_handoff_open(int fd)
+{
+    struct vdagentd_handoff *handoff;
+    struct vdagentd_handoff_header header;
+    struct vdagentd_handoff_record record;
+    struct stat st;
+    size_t pos;
+    ssize_t n;
+
+    handoff = handoff_alloc();
+    if (!handoff) {
+        close(fd);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        syslog(LOG_ERR, "handoff state fd %d: %m", fd);
+        goto error;
+    }
+    if (st.st_size > HANDOFF_MAX_SIZE) {
+        syslog(LOG_ERR, "handoff state too large: %ld bytes",
+               (long)st.st_size);
+        goto error;
+    }
+    handoff->allocated = handoff->size = st.st_size;
+    handoff->buf = malloc(handoff->size ? handoff->size : 1);
+    if (!handoff->buf) {
+        syslog(LOG_ERR, "out of memory reading handoff state");
+        goto error;
+    }
+    for (pos = 0; pos < handoff->size; pos += n) {
+        n = pread(fd, handoff->buf + pos, handoff->size - pos, pos);
+        if (n <= 0) {
+            syslog(LOG_ERR, "reading handoff state: %m");
+            goto error;
+        }
+    }
+    close(fd);
+
+    if (handoff->size < sizeof(header)) {
+        syslog(LOG_ERR, "handoff state is truncated");
+        vdagentd_handoff_destroy(handoff);
+        return NULL;
+    }
+    memcpy(&header, handoff->buf, sizeof(header));
+    if (header.magic != VDAGENTD_HANDOFF_MAGIC ||
+            header.major != VDAGENTD_HANDOFF_MAJOR) {
+        syslog(LOG_ERR, "handoff state has version %u.%u, this daemon "
+               "takes over from version %d only", header.major, header.minor,
+               VDAGENTD_HANDOFF_MAJOR);
+        vdagentd_handoff_destroy(handoff);
+        return NULL;
+    }
+
+    /* Check the framing once, so that vdagentd_handoff_next can trust it */
+    for (pos = sizeof(header); pos < handoff->size;
+         pos += sizeof(record) + HANDOFF_ALIGN(record.size)) {
+        if (handoff->size - pos < sizeof(record))
+            break;
+        memcpy(&record, handoff->buf + pos, sizeof(record));
+        if (HANDOFF_ALIGN(record.size) > handoff->size - pos - sizeof(record))
+            break;
+    }
+    if (pos != handoff->size) {
+        syslog(LOG_ERR, "handoff state is truncated");
+        vdagentd_handoff_destroy(handoff);
+        return NULL;
+    }
+    return handoff;
+
+error:
+    close(fd);
+    vdagentd_handoff_destroy(handoff);
+    return NULL;
+}
+
+const void *vdagentd_handoff_next(struct vdagentd_handoff *handoff,
+    uint32_t type, const void *prev, uint32_t *size)
+{
+    struct vdagentd_handoff_record record;
+    size_t pos = sizeof(struct vdagentd_handoff_header);
+
+    if (prev) {
+        pos = (const uint8_t *)prev - handoff->buf - sizeof(record);
+        memcpy(&record, handoff->buf + pos, sizeof(record));
+        pos += sizeof(record) + HANDOFF_ALIGN(record.size);
+    }
+
+    for (; pos < handoff->size;
+         pos += sizeof(record) + HANDOFF_ALIGN(record.size)) {
+        memcpy(&record, handoff->buf + pos, sizeof(record));
+        if (record.type == type) {
+            *size = record.size;
+            return handoff->buf + pos + sizeof(record);
+        }
+    }
+    return NULL;
+}
+
+const void *vdagentd_handoff_get(struct vdagentd_handoff *handoff,
+    uint32_t type, const void *prev, void *dest, uint32_t dest_size)
+{
+    const void *data;
+    uint32_t size;
+
+    data = vdagentd_handoff_next(handoff, type, prev, &size);
+    if (!data)
+        return NULL;
+    if (size > dest_size)
+        size = dest_size;
+    memcpy(dest, data, size);
+    memset((uint8_t *)dest + size, 0, dest_size - size);
+    return data;
+}
+
+void vdagentd_handoff_destroy(struct vdagentd_handoff *handoff)
+{
+    if (!handoff)
+        return;
+
+    if (handoff->fd != -1)
+        close(handoff->fd);
+    free(handoff->buf);
+    free(handoff);
+}
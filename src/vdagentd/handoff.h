@@ -0,0 +1,155 @@
+/*  handoff.h vdagentd state handoff across a re-exec header
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_HANDOFF_H
+#define __VDAGENTD_HANDOFF_H
+
+#include <stdint.h>
+
+/* When re-executing itself (on SIGUSR2, to switch to an upgraded binary
+ * without the client noticing), vdagentd writes its state to an anonymous
+ * file (a memfd where available), which the new daemon finds through
+ * VDAGENTD_HANDOFF_ENV. The fds the state refers to are inherited by the
+ * new daemon.
+ *
+ * The state starts with a struct vdagentd_handoff_header, followed by a
+ * sequence of records, each a struct vdagentd_handoff_record followed by
+ * its data, padded to a multiple of 8 bytes. Readers skip records of types
+ * they do not know, ignore data past the end of the structs they know and
+ * zero-fill the fields missing from shorter records (see
+ * vdagentd_handoff_get), so that a daemon can take over from an older (or
+ * newer) one with the same major version. New fields therefore go at the
+ * end of the structs, with 0 meaning what older daemons did. Anything else
+ * bumps VDAGENTD_HANDOFF_MAJOR, a daemon does not take over from another
+ * major version, but starts afresh.
+ */
+#define VDAGENTD_HANDOFF_ENV "SPICE_VDAGENTD_HANDOFF_FD"
+/* The fds passed in by socket activation, "<agent fd>,<virtio fd>" (-1 for
+ * none), kept out of the state so that they survive a state which can not
+ * be taken over: systemd still owns them, they must not get closed then.
+ */
+#define VDAGENTD_HANDOFF_ACTIVATED_ENV "SPICE_VDAGENTD_ACTIVATED_FDS"
+
+#define VDAGENTD_HANDOFF_MAGIC 0x66646876 /* "vhdf" */
+#define VDAGENTD_HANDOFF_MAJOR 1
+#define VDAGENTD_HANDOFF_MINOR 0
+
+struct vdagentd_handoff_header {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+};
+
+struct vdagentd_handoff_record {
+    uint32_t type;
+    uint32_t size;
+};
+
+enum {
+    VDAGENTD_HANDOFF_VERSION,         /* the old daemon's VERSION string */
+    VDAGENTD_HANDOFF_DAEMON,          /* struct vdagentd_handoff_daemon */
+    VDAGENTD_HANDOFF_CLIENT,          /* struct vdagentd_handoff_client */
+    VDAGENTD_HANDOFF_CAPABILITIES,    /* the client's capabilities */
+    VDAGENTD_HANDOFF_MONITORS_CONFIG, /* VDAgentMonitorsConfig */
+    VDAGENTD_HANDOFF_UINPUT,          /* struct vdagentd_uinput_state */
+    VDAGENTD_HANDOFF_AGENT,           /* struct vdagentd_handoff_agent */
+    VDAGENTD_HANDOFF_AGENT_SCREENS,   /* the screen_count
+                                         vdagentd_guest_xorg_resolution of
+                                         the agent record before it */
+    VDAGENTD_HANDOFF_CLIPBOARD,       /* struct vdagentd_handoff_clipboard */
+    VDAGENTD_HANDOFF_CLIPBOARD_TYPES, /* the types of the agent's grab of
+                                         the clipboard record before it */
+    VDAGENTD_HANDOFF_XFER,            /* struct vdagentd_handoff_xfer */
+};
+
+struct vdagentd_handoff_daemon {
+    int32_t server_fd;
+    int32_t virtio_fd;                /* -1 when the port is closed */
+    int32_t activated_agent_fd;       /* -1 if not socket activated */
+    int32_t activated_virtio_fd;
+    int32_t daemonized;
+    int32_t session_count;
+    int32_t grace_timer_armed;
+    int32_t reconnect_timer_armed;
+    uint32_t next_clipboard_id;
+};
+
+struct vdagentd_handoff_client {
+    int32_t connected;
+    int32_t lineend;
+    int32_t max_clipboard;
+    int32_t revalidate;
+};
+
+struct vdagentd_handoff_agent {
+    int32_t fd;
+    int32_t active;                   /* the active session's agent */
+    int32_t width;
+    int32_t height;
+    int32_t screen_count;
+};
+
+struct vdagentd_handoff_clipboard {
+    uint32_t selection;
+    int32_t agent_owns;
+    int32_t agent_request_pending;    /* waiting for the client's data */
+    uint32_t agent_request_id;
+};
+
+struct vdagentd_handoff_xfer {
+    uint32_t id;
+    int32_t agent_fd;
+};
+
+struct vdagentd_handoff;
+
+/* Writing: create the state, add the records, and finish to get the fd to
+ * pass on, rewound and inheritable.
+ * Return value of vdagentd_handoff_finish: the fd, -1 if adding any of the
+ * records failed (logged).
+ */
+struct vdagentd_handoff *vdagentd_handoff_create(void);
+void vdagentd_handoff_add(struct vdagentd_handoff *handoff, uint32_t type,
+    const void *data, uint32_t size);
+int vdagentd_handoff_finish(struct vdagentd_handoff *handoff);
+
+/* Reading: read the state from fd, which gets closed.
+ * Return value: NULL on error, or when the state has another major version
+ * (logged).
+ */
+struct vdagentd_handoff *vdagentd_handoff_open(int fd);
+
+/* Return value: the data of the first record of type after the record with
+ * data prev, or the first one if prev is NULL. NULL if there is none.
+ * *size gets the size of the data.
+ */
+const void *vdagentd_handoff_next(struct vdagentd_handoff *handoff,
+    uint32_t type, const void *prev, uint32_t *size);
+
+/* Like vdagentd_handoff_next, but copies the data to dest, of dest_size
+ * bytes. Data past dest_size is ignored, if the record is shorter the rest
+ * of dest is zeroed.
+ * Return value: the data of the record, to pass as prev, NULL if there is
+ * none (dest is left alone then).
+ */
+const void *vdagentd_handoff_get(struct vdagentd_handoff *handoff,
+    uint32_t type, const void *prev, void *dest, uint32_t dest_size);
+
+/* Also closes the state's fd, for a handoff which was not passed on */
+void vdagentd_handoff_destroy(struct vdagentd_handoff *handoff);
+
+#endif
@@ -0,0 +1,146 @@
+/*  metrics-server.c vdagentd metrics export socket
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics-server.h"
+
+struct vdagentd_metrics_server {
+    int fd;
+    char *socketname;
+    int debug;
+};
+
+struct vdagentd_metrics_server *vdagentd_metrics_server_create(
+    const char *socketname, int debug)
+{
+    struct vdagentd_metrics_server *server;
+    struct sockaddr_un address;
+
+    server = calloc(1, sizeof(*server));
+    if (!server)
+        return NULL;
+
+    server->debug = debug;
+    server->socketname = strdup(socketname);
+    server->fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (!server->socketname || server->fd == -1) {
+        syslog(LOG_ERR, "creating metrics socket: %m");
+        goto error;
+    }
+
+    /* Remove a stale socket from a previous run */
+    unlink(socketname);
+
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketname);
+    if (bind(server->fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        syslog(LOG_ERR, "bind %s: %m", socketname);
+        goto error;
+    }
+
+    if (chmod(socketname, 0600) != 0 || listen(server->fd, 5) != 0) {
+        syslog(LOG_ERR, "setting up metrics socket %s: %m", socketname);
+        unlink(socketname);
+        goto error;
+    }
+
+    return server;
+
+error:
+    if (server->fd != -1)
+        close(server->fd);
+    free(server->socketname);
+    free(server);
+    return NULL;
+}
+
+void vdagentd_metrics_server_destroy(struct vdagentd_metrics_server *server)
+{
+    if (!server)
+        return;
+
+    close(server->fd);
+    if (unlink(server->socketname) != 0)
+        syslog(LOG_ERR, "unlink %s: %m", server->socketname);
+    free(server->socketname);
+    free(server);
+}
+
+int vdagentd_metrics_server_fill_fds(struct vdagentd_metrics_server *server,
+    fd_set *readfds)
+{
+    if (!server)
+        return -1;
+
+    FD_SET(server->fd, readfds);
+    return server->fd + 1;
+}
+
+int vdagentd_metrics_server_handle_fds(struct vdagentd_metrics_server *server,
+    fd_set *readfds, const struct metrics_snapshot *agent_snapshot)
+{
+    const struct metrics_snapshot *snapshots[2];
+    static const char * const labels[2] = { "spice-vdagentd", "spice-vdagent" };
+    char *text;
+    ssize_t n;
+    size_t len;
+    int fd;
+
+    if (!server || !FD_ISSET(server->fd, readfds))
+        return 0;
+
+    fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1) {
+        if (errno != EINTR && errno != EAGAIN)
+            syslog(LOG_ERR, "accept metrics connection: %m");
+        return 0;
+    }
+
+    snapshots[0] = metrics_get();
+    snapshots[1] = agent_snapshot;
+    text = metrics_render(snapshots, labels, 2);
+    if (!text) {
+        syslog(LOG_ERR, "out of memory rendering metrics");
+        close(fd);
+        return 0;
+    }
+
+    /* The output fits in the socket buffer, never block the main loop on
+       a scraper which is slow to read */
+    len = strlen(text);
+    n = send(fd, text, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n != (ssize_t)len && server->debug)
+        syslog(LOG_DEBUG, "metrics: sent %zd of %zu bytes", n, len);
+
+    free(text);
+    close(fd);
+    return 1;
+}
@@ -0,0 +1,50 @@
+/*  metrics-server.h vdagentd metrics export socket header
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_METRICS_SERVER_H
+#define __VDAGENTD_METRICS_SERVER_H
+
+#include <sys/select.h>
+#include "metrics.h"
+
+/* A unix domain socket on which each connecting client gets the current
+ * metrics in the Prometheus text exposition format, after which the
+ * connection is closed. E.g.: "socat - UNIX-CONNECT:<socketname>".
+ * The socket is only accessible by root.
+ */
+struct vdagentd_metrics_server;
+
+struct vdagentd_metrics_server *vdagentd_metrics_server_create(
+    const char *socketname, int debug);
+
+/* Close the socket and remove it from the filesystem.
+ * Does nothing if server is NULL.
+ */
+void vdagentd_metrics_server_destroy(struct vdagentd_metrics_server *server);
+
+/* Return value: value of the highest fd + 1 or -1 if server is NULL */
+int vdagentd_metrics_server_fill_fds(struct vdagentd_metrics_server *server,
+    fd_set *readfds);
+
+/* Serve a pending connection, if any, with vdagentd's own metrics and
+ * those in agent_snapshot (which may be NULL).
+ * Return value: 1 if a connection was served, 0 otherwise.
+ */
+int vdagentd_metrics_server_handle_fds(struct vdagentd_metrics_server *server,
+    fd_set *readfds, const struct metrics_snapshot *agent_snapshot);
+
+#endif
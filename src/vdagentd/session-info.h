@@ -32,10 +32,22 @@ struct session_info *session_info_create(int verbose);
 void session_info_destroy(struct session_info *ck);
 
 int session_info_get_fd(struct session_info *ck);
-
+/* The fd of a D-Bus connection on which signals and replies arrive, which
+   do not make session_info_get_fd() readable, or -1. Call
+   session_info_read_dbus() when it is readable. */
+int session_info_get_dbus_fd(struct session_info *si);
+void session_info_read_dbus(struct session_info *si);
+
+/* These never block on a D-Bus round trip. With console-kit they return the
+   cached state, when that is not available yet they start an asynchronous
+   query and return NULL, session_info_has_updates() tells when to call them
+   again. With systemd-login they query sd-login, which does not use D-Bus. */
 const char *session_info_get_active_session(struct session_info *ck);
 /* Note result must be free()-ed by caller */
 char *session_info_session_for_pid(struct session_info *ck, uint32_t pid);
+/* Returns TRUE (once) when results of asynchronous queries have arrived
+   since the last call */
+gboolean session_info_has_updates(struct session_info *si);
 
 gboolean session_info_session_is_locked(struct session_info *si);
 gboolean session_info_is_user(struct session_info *si);
@@ -34,6 +34,9 @@ struct session_info {
     struct {
         DBusConnection *system_connection;
         char *match_session_signals;
+        char *match_properties_changed;
+        /* Serial of the outstanding async LockedHint Get call, or 0 */
+        dbus_uint32_t locked_hint_serial;
     } dbus;
     gboolean session_is_locked;
     gboolean session_locked_hint;
@@ -51,6 +54,8 @@ struct session_info {
 
 #define SESSION_PROP_LOCKED_HINT    "LockedHint"
 
+#define PROPERTIES_SIGNAL_CHANGED   "PropertiesChanged"
+
 /* dbus related */
 static DBusConnection *si_dbus_get_system_bus(void)
 {
@@ -72,30 +77,36 @@ static DBusConnection *si_dbus_get_system_bus(void)
     return connection;
 }
 
+/* Note passing a NULL error to dbus_bus_[add|remove]_match makes them
+   asynchronous, errors are then reported as an error reply, which
+   si_dbus_read_signals() logs */
 static void si_dbus_match_remove(struct session_info *si)
 {
-    DBusError error;
-    if (si->dbus.match_session_signals == NULL)
-        return;
-
-    dbus_error_init(&error);
-    dbus_bus_remove_match(si->dbus.system_connection,
-                          si->dbus.match_session_signals,
-                          &error);
+    if (si->dbus.match_session_signals != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_session_signals,
+                              NULL);
+        g_free(si->dbus.match_session_signals);
+        si->dbus.match_session_signals = NULL;
+    }
 
-    g_free(si->dbus.match_session_signals);
-    si->dbus.match_session_signals = NULL;
+    if (si->dbus.match_properties_changed != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_properties_changed,
+                              NULL);
+        g_free(si->dbus.match_properties_changed);
+        si->dbus.match_properties_changed = NULL;
+    }
 }
 
 static void si_dbus_match_rule_update(struct session_info *si)
 {
-    DBusError error;
-
-    if (si->dbus.system_connection == NULL ||
-            si->session == NULL)
+    if (si->dbus.system_connection == NULL)
         return;
 
     si_dbus_match_remove(si);
+    if (si->session == NULL)
+        return;
 
     si->dbus.match_session_signals =
         g_strdup_printf ("type='signal',interface='%s',path='"
@@ -105,32 +116,38 @@ static void si_dbus_match_rule_update(struct session_info *si)
     if (si->verbose)
         syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
 
-    dbus_error_init(&error);
     dbus_bus_add_match(si->dbus.system_connection,
                        si->dbus.match_session_signals,
-                       &error);
-    if (dbus_error_is_set(&error)) {
-        syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-               error.message);
-        dbus_error_free(&error);
-        g_free(si->dbus.match_session_signals);
-        si->dbus.match_session_signals = NULL;
-    }
+                       NULL);
+
+    si->dbus.match_properties_changed =
+        g_strdup_printf ("type='signal',interface='%s',member='%s',path='"
+                         LOGIND_SESSION_OBJ_TEMPLATE"'",
+                         DBUS_PROPERTIES_INTERFACE,
+                         PROPERTIES_SIGNAL_CHANGED,
+                         si->session);
+    if (si->verbose)
+        syslog(LOG_DEBUG, "logind match: %s",
+               si->dbus.match_properties_changed);
+
+    dbus_bus_add_match(si->dbus.system_connection,
+                       si->dbus.match_properties_changed,
+                       NULL);
+    dbus_connection_flush(si->dbus.system_connection);
 }
 
+/* Send a request for the LockedHint property of the session, without
+   waiting for the reply, si_dbus_read_signals() processes the reply */
 static void
-si_dbus_read_properties(struct session_info *si)
+si_dbus_request_locked_hint(struct session_info *si)
 {
-    dbus_bool_t locked_hint, ret;
-    DBusMessageIter iter, iter_variant;
-    gint type;
-    DBusError error;
+    dbus_bool_t ret;
     DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
     gchar *session_object;
     const gchar *interface, *property;
 
-    if (si->session == NULL)
+    si->dbus.locked_hint_serial = 0;
+    if (si->dbus.system_connection == NULL || si->session == NULL)
         return;
 
     session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE, si->session);
@@ -155,44 +172,83 @@ si_dbus_read_properties(struct session_info *si)
         goto exit;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(si->dbus.system_connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s", error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
-        }
+    if (!dbus_connection_send(si->dbus.system_connection, message,
+                              &si->dbus.locked_hint_serial)) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
+        si->dbus.locked_hint_serial = 0;
         goto exit;
     }
+    dbus_connection_flush(si->dbus.system_connection);
 
-    dbus_message_iter_init(reply, &iter);
-    type = dbus_message_iter_get_arg_type(&iter);
+exit:
+    if (message != NULL) {
+        dbus_message_unref(message);
+    }
+}
+
+/* iter must point to the variant holding the LockedHint value */
+static void
+si_dbus_parse_locked_hint(struct session_info *si, DBusMessageIter *iter)
+{
+    DBusMessageIter iter_variant;
+    dbus_bool_t locked_hint;
+    gint type;
+
+    type = dbus_message_iter_get_arg_type(iter);
     if (type != DBUS_TYPE_VARIANT) {
         syslog(LOG_ERR, "expected a variant, got a '%c' instead", type);
-        goto exit;
+        return;
     }
 
-    dbus_message_iter_recurse(&iter, &iter_variant);
+    dbus_message_iter_recurse(iter, &iter_variant);
     type = dbus_message_iter_get_arg_type(&iter_variant);
     if (type != DBUS_TYPE_BOOLEAN) {
         syslog(LOG_ERR, "expected a boolean, got a '%c' instead", type);
-        goto exit;
+        return;
     }
     dbus_message_iter_get_basic(&iter_variant, &locked_hint);
 
     si->session_locked_hint = (locked_hint) ? TRUE : FALSE;
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
+}
+
+/* Handle a PropertiesChanged signal for the session */
+static void
+si_dbus_properties_changed(struct session_info *si, DBusMessage *message)
+{
+    DBusMessageIter iter, iter_array, iter_dict;
+    const gchar *interface, *property;
+
+    if (!dbus_message_iter_init(message, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return;
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (g_strcmp0(interface, LOGIND_SESSION_INTERFACE) != 0 ||
+            !dbus_message_iter_next(&iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+
+    /* Changed properties, a{sv} */
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) ==
+               DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&iter_array, &iter_dict);
+        dbus_message_iter_get_basic(&iter_dict, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0 &&
+                dbus_message_iter_next(&iter_dict))
+            si_dbus_parse_locked_hint(si, &iter_dict);
+        dbus_message_iter_next(&iter_array);
     }
 
-    if (message != NULL) {
-        dbus_message_unref(message);
+    /* Invalidated properties, as, fetch these anew */
+    if (!dbus_message_iter_next(&iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter_array, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0)
+            si_dbus_request_locked_hint(si);
+        dbus_message_iter_next(&iter_array);
     }
 }
 
@@ -201,16 +257,47 @@ si_dbus_read_signals(struct session_info *si)
 {
     DBusMessage *message = NULL;
 
+    if (si->dbus.system_connection == NULL)
+        return;
+
     dbus_connection_read_write(si->dbus.system_connection, 0);
     message = dbus_connection_pop_message(si->dbus.system_connection);
     while (message != NULL) {
         const char *member;
+        int type = dbus_message_get_type(message);
+        gchar *session_object = NULL;
+
+        if (si->session)
+            session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE,
+                                             si->session);
 
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
+        if ((type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                type == DBUS_MESSAGE_TYPE_ERROR) &&
+                dbus_message_get_reply_serial(message) ==
+                    si->dbus.locked_hint_serial &&
+                si->dbus.locked_hint_serial != 0) {
+            DBusMessageIter iter;
+
+            si->dbus.locked_hint_serial = 0;
+            if (type == DBUS_MESSAGE_TYPE_ERROR)
+                syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s",
+                       dbus_message_get_error_name(message));
+            else if (dbus_message_iter_init(message, &iter))
+                si_dbus_parse_locked_hint(si, &iter);
+        } else if (type == DBUS_MESSAGE_TYPE_ERROR) {
+            syslog(LOG_WARNING, "(systemd-login) dbus error: %s",
+                   dbus_message_get_error_name(message));
+        } else if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+            /* Reply to a stale LockedHint request */
+        } else if (!dbus_message_has_path(message, session_object)) {
+            /* Signal for the previous active session */
+        } else if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
             si->session_is_locked = TRUE;
         } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
             si->session_is_locked = FALSE;
+        } else if (g_strcmp0(member, PROPERTIES_SIGNAL_CHANGED) == 0) {
+            si_dbus_properties_changed(si, message);
         } else {
             if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
                 syslog(LOG_WARNING, "(systemd-login) received non signal message");
@@ -219,6 +306,7 @@ si_dbus_read_signals(struct session_info *si)
             }
         }
 
+        g_free(session_object);
         dbus_message_unref(message);
         dbus_connection_read_write(si->dbus.system_connection, 0);
         message = dbus_connection_pop_message(si->dbus.system_connection);
@@ -254,7 +342,8 @@ void session_info_destroy(struct session_info *si)
         return;
 
     si_dbus_match_remove(si);
-    dbus_connection_close(si->dbus.system_connection);
+    if (si->dbus.system_connection)
+        dbus_connection_close(si->dbus.system_connection);
     sd_login_monitor_unref(si->mon);
     free(si->session);
     free(si);
@@ -265,6 +354,24 @@ int session_info_get_fd(struct session_info *si)
     return sd_login_monitor_get_fd(si->mon);
 }
 
+/* The lock state arrives on the D-Bus connection, see
+   si_dbus_read_signals() */
+int session_info_get_dbus_fd(struct session_info *si)
+{
+    int fd;
+
+    if (si->dbus.system_connection == NULL ||
+            !dbus_connection_get_unix_fd(si->dbus.system_connection, &fd))
+        return -1;
+
+    return fd;
+}
+
+void session_info_read_dbus(struct session_info *si)
+{
+    si_dbus_read_signals(si);
+}
+
 const char *session_info_get_active_session(struct session_info *si)
 {
     int r;
@@ -282,9 +389,17 @@ const char *session_info_get_active_session(struct session_info *si)
         syslog(LOG_INFO, "Active session: %s", si->session);
 
     sd_login_monitor_flush(si->mon);
+
+    /* (Re)start tracking the lock state when the active session changes,
+       from here on it gets updated through dbus signals */
+    if (g_strcmp0(old_session, si->session) != 0) {
+        si->session_is_locked = FALSE;
+        si->session_locked_hint = FALSE;
+        si_dbus_match_rule_update(si);
+        si_dbus_request_locked_hint(si);
+    }
     free(old_session);
 
-    si_dbus_match_rule_update(si);
     return si->session;
 }
 
@@ -303,16 +418,28 @@ char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
     return session;
 }
 
+gboolean session_info_has_updates(struct session_info *si)
+{
+    /* Only the lock state is queried asynchronously, and that does not
+       require any action from the caller */
+    return FALSE;
+}
+
 gboolean session_info_session_is_locked(struct session_info *si)
 {
     gboolean locked;
 
     g_return_val_if_fail (si != NULL, FALSE);
 
+    /* Only process the signals and replies which have already arrived, the
+       result of an outstanding LockedHint request is not waited for, this
+       gets called from the main loop, which must never block */
     si_dbus_read_signals(si);
-    si_dbus_read_properties(si);
 
-    locked = (si->session_is_locked || si->session_locked_hint);
+    /* Until the LockedHint request is answered the lock state is unknown,
+       guessing wrong would enable file-xfer to a locked session */
+    locked = (si->session_is_locked || si->session_locked_hint ||
+              si->dbus.locked_hint_serial != 0);
     if (si->verbose) {
         syslog(LOG_DEBUG, "(systemd-login) session is locked: %s",
                locked ? "yes" : "no");
@@ -32,6 +32,8 @@
 #include <linux/uinput.h>
 #include <spice/vd_agent.h>
 #include "uinput.h"
+#include "metrics.h"
+#include "trace.h"
 
 struct vdagentd_uinput {
     const char *devname;
@@ -67,6 +69,41 @@ struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     return uinput;
 }
 
+struct vdagentd_uinput *vdagentd_uinput_create_from_state(const char *devname,
+    const struct vdagentd_uinput_state *state,
+    struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
+    int debug, int fake)
+{
+    struct vdagentd_uinput *uinput;
+
+    uinput = calloc(1, sizeof(*uinput));
+    if (!uinput) {
+        close(state->fd);
+        return NULL;
+    }
+
+    uinput->devname      = devname;
+    uinput->fd           = state->fd;
+    uinput->debug        = debug;
+    uinput->fake         = fake;
+    uinput->width        = state->width;
+    uinput->height       = state->height;
+    uinput->last         = state->last;
+    uinput->screen_info  = screen_info;
+    uinput->screen_count = screen_count;
+
+    return uinput;
+}
+
+void vdagentd_uinput_get_state(struct vdagentd_uinput *uinput,
+    struct vdagentd_uinput_state *state)
+{
+    state->fd     = uinput->fd;
+    state->width  = uinput->width;
+    state->height = uinput->height;
+    state->last   = uinput->last;
+}
+
 void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
 {
     struct vdagentd_uinput *uinput = *uinputp;
@@ -173,6 +210,8 @@ static void uinput_send_event(struct vdagentd_uinput **uinputp,
     };
     int rc;
 
+    metrics_inc(METRICS_UINPUT_EVENTS);
+    trace_event(TRACE_UINPUT_EVENT, type, code, value, 0, 0);
     rc = write(uinput->fd, &event, sizeof(event));
     if (rc != sizeof(event)) {
         syslog(LOG_ERR, "write %s: %m", uinput->devname);
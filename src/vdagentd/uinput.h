@@ -23,6 +23,7 @@
 #define __VDAGENTD_UINPUT_H
 
 #include <stdio.h>
+#include <spice/vd_agent.h>
 #include "vdagentd-proto.h"
 
 struct vdagentd_uinput;
@@ -40,4 +41,21 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         struct vdagentd_guest_xorg_resolution *screen_info,
         int screen_count);
 
+/* What it takes to continue using a created uinput device in a new
+   process, without the tablet disappearing and reappearing */
+struct vdagentd_uinput_state {
+    int32_t fd;
+    int32_t width;
+    int32_t height;
+    VDAgentMouseState last;
+};
+
+void vdagentd_uinput_get_state(struct vdagentd_uinput *uinput,
+        struct vdagentd_uinput_state *state);
+/* Takes ownership of state->fd */
+struct vdagentd_uinput *vdagentd_uinput_create_from_state(const char *devname,
+        const struct vdagentd_uinput_state *state,
+        struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
+        int debug, int fake);
+
 #endif
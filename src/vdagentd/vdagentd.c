@@ -26,13 +26,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <limits.h>
 #include <syslog.h>
+#include <dirent.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
 
@@ -42,9 +46,17 @@
 #include "uinput.h"
 #include "xorg-conf.h"
 #include "virtio-port.h"
+#include "xfer-sched.h"
+#include "budget.h"
+#include "compress.h"
+#include "handoff.h"
+#include "metrics-server.h"
 #include "session-info.h"
+#include "metrics.h"
+#include "trace.h"
 
 struct agent_data {
+    uint32_t pid;
     char *session;
     int width;
     int height;
@@ -56,26 +68,65 @@ struct agent_data {
 static const char *pidfilename = "/var/run/spice-vdagentd/spice-vdagentd.pid";
 static const char *portdev = "/dev/virtio-ports/com.redhat.spice.0";
 static const char *vdagentd_socket = VDAGENTD_SOCKET;
+static const char *metrics_socket = VDAGENTD_METRICS_SOCKET;
+static const char *trace_file = "/var/run/spice-vdagentd/spice-vdagentd.trace";
 static const char *uinput_device = "/dev/uinput";
 static int debug = 0;
 static int uinput_fake = 0;
 static int only_once = 0;
+static int want_session_info = 1;
+static int initialized = 0;
+/* Passed in by systemd socket activation, -1 when not */
+static int activated_agent_fd = -1;
+static int activated_virtio_fd = -1;
 static struct udscs_server *server = NULL;
 static struct vdagent_virtio_port *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
+static struct vdagentd_xfer_sched *xfer_sched = NULL;
+static uint64_t xfer_rate_limit = 0;
+/* For all message buffers together, see budget.h, in KiB */
+static uint64_t budget_limit = 512 * 1024;
+/* NULL unless enabled with -z, and built with compression support */
+static struct vdagentd_compress *compress = NULL;
+static int want_compress = 0;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
+static struct vdagentd_metrics_server *metrics_server = NULL;
+/* The last metrics snapshot received from the active session agent */
+static struct metrics_snapshot *agent_metrics = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
 static uint32_t *capabilities = NULL;
 static int capabilities_size = 0;
+/* VDAGENTD_LINEEND_* of the client's clipboard text, the agents get told */
+static uint32_t client_lineend = VDAGENTD_LINEEND_LF;
 static const char *active_session = NULL;
 static unsigned int session_count = 0;
 static struct udscs_connection *active_session_conn = NULL;
 static int agent_owns_clipboard[256] = { 0, };
+/* The types of the agent's grabs, to announce them again to a client which
+   comes back after the virtio port dropped */
+static uint8_t *agent_grab_types[256] = { NULL, };
+static uint32_t agent_grab_size[256] = { 0, };
+/* Start times of pending clipboard requests, for the latency metrics */
+static uint64_t client_clipboard_request_us[256] = { 0, };
+static uint64_t agent_clipboard_request_us[256] = { 0, };
+/* Ids of pending agent clipboard requests, for tracing, see trace.h */
+static uint32_t agent_clipboard_request_id[256] = { 0, };
+static uint32_t next_clipboard_id = 0;
 static int quit = 0;
+static volatile sig_atomic_t trace_requested = 0;
+static volatile sig_atomic_t reexec_requested = 0;
+static int reexec_pending = 0;
+static gint64 reexec_deadline = 0;
+static char **saved_argv = NULL;
+static char self_path[PATH_MAX] = "";
+static int daemonized = 0;
 static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
+/* Set when the virtio port dropped with a client connected, until the client
+   announces its capabilities again */
+static int client_revalidate = 0;
 
 /* utility functions */
 /* vdagentd <-> spice-client communication handling */
@@ -102,6 +153,9 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_GUEST_LINEEND_LF);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MAX_CLIPBOARD);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_AUDIO_VOLUME_SYNC);
+    VD_AGENT_SET_CAPABILITY(caps->caps, VDAGENTD_FILE_XFER_RESUME_CAP);
+    if (compress)
+        VD_AGENT_SET_CAPABILITY(caps->caps, VDAGENTD_COMPRESS_CAP);
 
     vdagent_virtio_port_write(vport, VDP_CLIENT_PORT,
                               VD_AGENT_ANNOUNCE_CAPABILITIES, 0,
@@ -111,9 +165,19 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
 
 static void do_client_disconnect(void)
 {
+    client_revalidate = 0;
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
                                NULL, 0);
+        /* The agents suspend or cancel their xfers, a new client may
+           reuse the ids */
+        g_hash_table_remove_all(active_xfers);
+        vdagentd_xfer_sched_remove_all(xfer_sched, NULL);
+        if (compress)
+            vdagentd_compress_reset(compress);
+        /* The agents go back to LF on a client disconnect */
+        client_lineend = VDAGENTD_LINEEND_LF;
+        max_clipboard = -1;
         client_connected = 0;
     }
 }
@@ -170,11 +234,23 @@ static void do_client_volume_sync(struct vdagent_virtio_port *vport, int port_nr
                 (uint8_t *)avs, message_header->size);
 }
 
+static void announce_agent_grabs(void);
+
 static void do_client_capabilities(struct vdagent_virtio_port *vport,
     VDAgentMessage *message_header,
     VDAgentAnnounceCapabilities *caps)
 {
     int new_size = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size);
+    int resumed = 0;
+    uint32_t lineend;
+
+    /* The same capabilities after the virtio port dropped mean that the
+       client, which keeps its state across that, is back. (Or a new one just
+       like it, which gets the clipboard and line ending it asks for anyway.) */
+    if (client_revalidate)
+        resumed = capabilities && capabilities_size == new_size &&
+                  !memcmp(capabilities, caps->caps,
+                          new_size * sizeof(uint32_t));
 
     if (capabilities_size != new_size) {
         capabilities_size = new_size;
@@ -187,20 +263,99 @@ static void do_client_capabilities(struct vdagent_virtio_port *vport,
         }
     }
     memcpy(capabilities, caps->caps, capabilities_size * sizeof(uint32_t));
-    if (caps->request) {
+    if (!resumed && (caps->request || client_revalidate)) {
         /* Report the previous client has disconneced. */
         do_client_disconnect();
         if (debug)
             syslog(LOG_DEBUG, "New client connected");
         client_connected = 1;
+    }
+    if (caps->request)
         send_capabilities(vport, 0);
+    if (resumed) {
+        syslog(LOG_INFO, "spice client is back, keeping its state");
+        metrics_inc(METRICS_VIRTIO_CLIENT_RESUMES);
+        client_revalidate = 0;
+        announce_agent_grabs();
+    }
+
+    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_GUEST_LINEEND_CRLF))
+        lineend = VDAGENTD_LINEEND_CRLF;
+    else
+        lineend = VDAGENTD_LINEEND_LF;
+    if (lineend != client_lineend) {
+        client_lineend = lineend;
+        udscs_server_write_all(server, VDAGENTD_CLIENT_LINEEND, lineend, 0,
+                               NULL, 0);
     }
 }
 
+static void clipboard_request_done(uint64_t *start_us)
+{
+    if (!*start_us)
+        return;
+
+    metrics_observe(METRICS_CLIPBOARD_LATENCY, metrics_now_us() - *start_us);
+    *start_us = 0;
+}
+
+/* The client does not send ids, the requests from the client get an id here.
+   The ids of the agent have VDAGENTD_CLIPBOARD_ID_AGENT set. */
+static uint32_t new_clipboard_id(void)
+{
+    next_clipboard_id =
+        (next_clipboard_id + 1) & (VDAGENTD_CLIPBOARD_ID_AGENT - 1);
+    if (!next_clipboard_id)
+        next_clipboard_id = 1;
+    return next_clipboard_id;
+}
+
+/* Answer a request of the agent whose data got purged, under its own id */
+static void answer_purged_clipboard_data(struct udscs_connection *conn,
+    struct udscs_message_header *header, void *priv)
+{
+    udscs_write(conn, VDAGENTD_CLIPBOARD_DATA, header->arg1,
+                VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+}
+
+/* Drop the not yet sent data of the previous owner of the selection, it is
+   stale now. The agent still gets an answer for its requests though. */
+static void purge_agent_clipboard_data(uint8_t selection)
+{
+    udscs_purge_stream(active_session_conn,
+                       VDAGENTD_STREAM_CLIPBOARD(selection),
+                       answer_purged_clipboard_data, NULL);
+}
+
+/* Answer the agent's pending request for the selection, the data will not
+   come */
+static void fail_agent_clipboard_request(uint8_t selection)
+{
+    if (agent_clipboard_request_us[selection] && active_session_conn)
+        udscs_write(active_session_conn, VDAGENTD_CLIPBOARD_DATA,
+                    VDAGENTD_CLIPBOARD_ARG1(selection,
+                        agent_clipboard_request_id[selection]),
+                    VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+    agent_clipboard_request_us[selection] = 0;
+    agent_clipboard_request_id[selection] = 0;
+}
+
+static void set_agent_grab(uint8_t selection, const uint8_t *types,
+    uint32_t size)
+{
+    free(agent_grab_types[selection]);
+    agent_grab_types[selection] = size ? malloc(size) : NULL;
+    agent_grab_size[selection] = agent_grab_types[selection] ? size : 0;
+    if (agent_grab_types[selection])
+        memcpy(agent_grab_types[selection], types, size);
+}
+
 static void do_client_clipboard(struct vdagent_virtio_port *vport,
     VDAgentMessage *message_header, uint8_t *data)
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
+    uint32_t id = 0;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
 
     if (!active_session_conn) {
@@ -221,6 +376,9 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
     case VD_AGENT_CLIPBOARD_GRAB:
         msg_type = VDAGENTD_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 0;
+        set_agent_grab(selection, NULL, 0);
+        purge_agent_clipboard_data(selection);
+        metrics_inc(METRICS_CLIPBOARD_GRABS);
         break;
     case VD_AGENT_CLIPBOARD_REQUEST: {
         VDAgentClipboardRequest *req = (VDAgentClipboardRequest *)data;
@@ -228,6 +386,11 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
         data_type = req->type;
         data = NULL;
         size = 0;
+        metrics_inc(METRICS_CLIPBOARD_REQUESTS);
+        client_clipboard_request_us[selection] = metrics_now_us();
+        id = new_clipboard_id();
+        trace_clipboard(id, TRACE_CLIPBOARD_CLIENT_REQUEST, selection,
+                        data_type, 0);
         break;
     }
     case VD_AGENT_CLIPBOARD: {
@@ -236,17 +399,27 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
         data_type = clipboard->type;
         size = size - sizeof(VDAgentClipboard);
         data = clipboard->data;
+        metrics_add(METRICS_CLIPBOARD_BYTES, size);
+        clipboard_request_done(&agent_clipboard_request_us[selection]);
+        id = agent_clipboard_request_id[selection];
+        agent_clipboard_request_id[selection] = 0;
+        trace_clipboard(id, TRACE_CLIPBOARD_CLIENT_DATA, selection,
+                        data_type, size);
         break;
     }
     case VD_AGENT_CLIPBOARD_RELEASE:
         msg_type = VDAGENTD_CLIPBOARD_RELEASE;
         data = NULL;
         size = 0;
+        purge_agent_clipboard_data(selection);
         break;
     }
 
-    udscs_write(active_session_conn, msg_type, selection, data_type,
-                data, size);
+    udscs_write_stream(active_session_conn,
+                       msg_type == VDAGENTD_CLIPBOARD_DATA ?
+                           VDAGENTD_STREAM_CLIPBOARD(selection) : 0,
+                       msg_type, VDAGENTD_CLIPBOARD_ARG1(selection, id),
+                       data_type, data, size);
 }
 
 /* To be used by vdagentd for failures in file-xfer such as when file-xfer was
@@ -265,6 +438,26 @@ static void send_file_xfer_status(struct vdagent_virtio_port *vport,
                                   (uint8_t *)&status, sizeof(status));
 }
 
+/* Clients can give an xfer a larger share of the bandwidth, by setting
+   "weight" in the xfer start message, see vdagentd_xfer_sched_set_weight() */
+static unsigned int file_xfer_weight(VDAgentFileXferStartMessage *s,
+                                     uint32_t size)
+{
+    GKeyFile *keyfile;
+    int weight = 1;
+
+    if (size <= sizeof(*s))
+        return weight;
+
+    keyfile = g_key_file_new();
+    if (g_key_file_load_from_data(keyfile, (const gchar *)s->data,
+                                  size - sizeof(*s), G_KEY_FILE_NONE, NULL))
+        weight = g_key_file_get_integer(keyfile, "vdagent-file-xfer",
+                                        "weight", NULL);
+    g_key_file_free(keyfile);
+    return MAX(weight, 1);
+}
+
 static void do_client_file_xfer(struct vdagent_virtio_port *vport,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
@@ -289,14 +482,22 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
                s->id, VD_AGENT_FILE_XFER_STATUS_ERROR);
             return;
         }
-        udscs_write(active_session_conn, VDAGENTD_FILE_XFER_START, 0, 0,
-                    data, message_header->size);
+        vdagentd_xfer_sched_set_weight(xfer_sched, s->id,
+            file_xfer_weight(s, message_header->size));
+        udscs_write(active_session_conn, VDAGENTD_FILE_XFER_START,
+                    VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                            VDAGENTD_FILE_XFER_RESUME_CAP),
+                    0, data, message_header->size);
         return;
     }
     case VD_AGENT_FILE_XFER_STATUS: {
         VDAgentFileXferStatusMessage *s = (VDAgentFileXferStatusMessage *)data;
         msg_type = VDAGENTD_FILE_XFER_STATUS;
         id = s->id;
+        /* The client cancelled the xfer, drop the data we still have */
+        vdagentd_xfer_sched_remove(xfer_sched, id);
+        if (compress)
+            vdagentd_compress_end_stream(compress, id);
         break;
     }
     case VD_AGENT_FILE_XFER_DATA: {
@@ -313,9 +514,141 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
             syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", id);
         return;
     }
+    if (msg_type == VDAGENTD_FILE_XFER_DATA) {
+        if (vdagentd_xfer_sched_queue(xfer_sched, conn, id, data,
+                                      message_header->size) == -1)
+            syslog(LOG_ERR, "Out of memory queueing file-xfer %u data", id);
+        return;
+    }
     udscs_write(conn, msg_type, 0, 0, data, message_header->size);
 }
 
+static int virtio_port_read_complete(
+        struct vdagent_virtio_port *vport,
+        int port_nr,
+        VDAgentMessage *message_header,
+        uint8_t *data);
+
+/* The data of file-xfer id got dropped, the file would end up corrupted */
+static void fail_client_xfer(uint32_t id)
+{
+    VDAgentFileXferStatusMessage status = {
+        .id = id,
+        .result = VD_AGENT_FILE_XFER_STATUS_ERROR,
+    };
+    struct udscs_connection *conn;
+
+    conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
+    if (!conn)
+        return;
+    udscs_write(conn, VDAGENTD_FILE_XFER_STATUS, 0, 0,
+                (uint8_t *)&status, sizeof(status));
+    g_hash_table_remove(active_xfers, GUINT_TO_POINTER(id));
+    vdagentd_xfer_sched_remove(xfer_sched, id);
+    if (compress)
+        vdagentd_compress_end_stream(compress, id);
+    send_file_xfer_status(virtio_port, "file-xfer %u data exceeds the memory "
+                          "budget, failing it", id,
+                          VD_AGENT_FILE_XFER_STATUS_ERROR);
+}
+
+/* A message of the client got dropped by the memory budget, fail what waits
+   for it, as far as that can be told from the first size bytes of its data.
+   The data of compressed messages can not be looked into, the stream of a
+   compressed file-xfer tells its id, but a compressed clipboard message
+   fails all pending requests. */
+static void virtio_port_dropped(struct vdagent_virtio_port *vport,
+    int port_nr, VDAgentMessage *message_header, const uint8_t *data,
+    uint32_t size)
+{
+    const struct vdagentd_compress_header *header;
+    uint32_t id;
+    int sel;
+
+    switch (message_header->type) {
+    case VD_AGENT_FILE_XFER_DATA:
+        if (size >= sizeof(id)) {
+            memcpy(&id, data, sizeof(id));
+            fail_client_xfer(id);
+        }
+        break;
+    case VD_AGENT_CLIPBOARD:
+        if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                     VD_AGENT_CAP_CLIPBOARD_SELECTION))
+            fail_agent_clipboard_request(
+                VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+        else if (size >= 1 &&
+                 data[0] <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY)
+            fail_agent_clipboard_request(data[0]);
+        break;
+    case VDAGENTD_COMPRESS_MESSAGE:
+        if (size < sizeof(*header))
+            break;
+        header = (const struct vdagentd_compress_header *)data;
+        if (header->type == VD_AGENT_FILE_XFER_DATA &&
+                (header->flags & VDAGENTD_COMPRESS_FLAG_STREAM))
+            fail_client_xfer(header->stream);
+        else if (header->type == VD_AGENT_CLIPBOARD)
+            for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++)
+                fail_agent_clipboard_request(sel);
+        break;
+    }
+}
+
+/* Handle the message carried by a VDAGENTD_COMPRESS_MESSAGE as if it had
+   been received as is */
+static void do_client_compressed(struct vdagent_virtio_port *vport,
+    int port_nr, VDAgentMessage *message_header, uint8_t *data)
+{
+    const struct vdagentd_compress_header *compress_header;
+    VDAgentMessage header = *message_header;
+    uint64_t max_size;
+    uint8_t *buf;
+
+    compress_header = vdagentd_compress_get_header(data, message_header->size);
+    if (!compress_header)
+        return;
+    if (compress_header->type == VD_AGENT_CLIPBOARD) {
+        max_size = max_clipboard != -1 ?
+                   sizeof(VDAgentClipboard) + (uint64_t)max_clipboard :
+                   UINT32_MAX;
+    } else if (compress_header->type == VD_AGENT_FILE_XFER_DATA) {
+        max_size = sizeof(VDAgentFileXferDataMessage) +
+                   VDAGENTD_COMPRESS_MAX_XFER_DATA;
+    } else {
+        syslog(LOG_ERR, "compressed message of type %u, ignoring",
+               compress_header->type);
+        return;
+    }
+    if (compress_header->size > max_size) {
+        syslog(LOG_ERR, "compressed message of type %u too large: %u",
+               compress_header->type, compress_header->size);
+        return;
+    }
+    /* Like a message which completes one being reassembled, this one has
+       been read already and can not wait for the usage to drop */
+    if (!budget_fits(BUDGET_VIRTIO_READ, compress_header->size)) {
+        syslog(LOG_WARNING, "dropping compressed message type %u of %u "
+               "bytes, it exceeds the memory budget", compress_header->type,
+               compress_header->size);
+        virtio_port_dropped(vport, port_nr, message_header, data,
+                            message_header->size);
+        return;
+    }
+
+    buf = vdagentd_compress_decompress(compress, data, message_header->size,
+                                       &header.type, &header.size);
+    if (!buf)
+        return;
+    budget_charge(BUDGET_VIRTIO_READ, header.size);
+    metrics_add(METRICS_COMPRESS_RECEIVED_BYTES, message_header->size);
+    metrics_add(METRICS_COMPRESS_RECEIVED_ORIGINAL_BYTES, header.size);
+
+    virtio_port_read_complete(vport, port_nr, &header, buf);
+    free(buf);
+    budget_release(BUDGET_VIRTIO_READ, header.size);
+}
+
 static int virtio_port_read_complete(
         struct vdagent_virtio_port *vport,
         int port_nr,
@@ -401,6 +734,10 @@ static int virtio_port_read_complete(
         VDAgentMaxClipboard *msg = (VDAgentMaxClipboard *)data;
         syslog(LOG_DEBUG, "Set max clipboard: %d", msg->max);
         max_clipboard = msg->max;
+        /* The agent scales images down to fit */
+        if (active_session_conn)
+            udscs_write(active_session_conn, VDAGENTD_MAX_CLIPBOARD,
+                        max_clipboard, 0, NULL, 0);
         break;
     case VD_AGENT_AUDIO_VOLUME_SYNC:
         if (message_header->size < sizeof(VDAgentAudioVolumeSync))
@@ -409,6 +746,12 @@ static int virtio_port_read_complete(
         do_client_volume_sync(vport, port_nr, message_header,
                 (VDAgentAudioVolumeSync *)data);
         break;
+    case VDAGENTD_COMPRESS_MESSAGE:
+        if (compress) {
+            do_client_compressed(vport, port_nr, message_header, data);
+            break;
+        }
+        /* fall through, we did not announce the capability */
     default:
         syslog(LOG_WARNING, "unknown message type %d, ignoring",
                message_header->type);
@@ -422,11 +765,66 @@ size_error:
     return 0;
 }
 
+/* Clipboard data of these types is (mostly) already compressed */
+static int clipboard_type_compresses(uint32_t data_type)
+{
+    return data_type != VD_AGENT_CLIPBOARD_IMAGE_PNG &&
+           data_type != VD_AGENT_CLIPBOARD_IMAGE_JPG;
+}
+
+/* Write clipboard data compressed, if the client can handle that and it
+   pays off.
+   Return value: 1 if the data was written, 0 if it should be sent as is */
+static int virtio_write_clipboard_compressed(uint8_t selection,
+    uint32_t data_type, const uint8_t *data, uint32_t data_size)
+{
+    struct vdagentd_compress_iov iov[3];
+    uint8_t sel[4] = { selection, 0, 0, 0 };
+    uint8_t *buf;
+    uint32_t size;
+    int count = 0;
+
+    if (!compress || !clipboard_type_compresses(data_type) ||
+            !VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                     VDAGENTD_COMPRESS_CAP))
+        return 0;
+
+    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+        iov[count].data = sel;
+        iov[count++].size = 4;
+    }
+    iov[count].data = &data_type;
+    iov[count++].size = 4;
+    iov[count].data = data;
+    iov[count++].size = data_size;
+
+    buf = vdagentd_compress_message(compress, VD_AGENT_CLIPBOARD, iov, count,
+                                    &size);
+    if (!buf)
+        return 0;
+
+    metrics_add(METRICS_COMPRESS_SENT_BYTES, size);
+    metrics_add(METRICS_COMPRESS_SENT_ORIGINAL_BYTES,
+                data_size + (count - 1) * 4);
+    vdagent_virtio_port_write_stream_start(virtio_port,
+        VDAGENTD_STREAM_CLIPBOARD(selection), VDP_CLIENT_PORT,
+        VDAGENTD_COMPRESS_MESSAGE, 0, size);
+    vdagent_virtio_port_write_append(virtio_port, buf, size);
+    free(buf);
+    return 1;
+}
+
 static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
     uint32_t data_type, const uint8_t *data, uint32_t data_size)
 {
     uint32_t size = data_size;
 
+    if (msg_type == VD_AGENT_CLIPBOARD &&
+            virtio_write_clipboard_compressed(selection, data_type, data,
+                                              data_size))
+        return;
+
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         size += 4;
@@ -435,8 +833,11 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
         size += 4;
     }
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+    /* Tag data, so that it can be dropped when it becomes stale */
+    vdagent_virtio_port_write_stream_start(virtio_port,
+        msg_type == VD_AGENT_CLIPBOARD ? VDAGENTD_STREAM_CLIPBOARD(selection)
+                                       : 0,
+        VDP_CLIENT_PORT, msg_type, 0, size);
 
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
@@ -450,11 +851,36 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
     vdagent_virtio_port_write_append(virtio_port, data, data_size);
 }
 
+static void announce_agent_grabs(void)
+{
+    int sel;
+
+    for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        if (agent_owns_clipboard[sel] && agent_grab_size[sel])
+            virtio_write_clipboard(sel, VD_AGENT_CLIPBOARD_GRAB, -1,
+                                   agent_grab_types[sel], agent_grab_size[sel]);
+    }
+}
+
+/* Drop the not yet sent data of the previous owner of the selection, it is
+   stale now. The client still gets an answer for its requests though. */
+static void purge_client_clipboard_data(uint8_t selection)
+{
+    int n;
+
+    n = vdagent_virtio_port_purge_stream(virtio_port,
+                                         VDAGENTD_STREAM_CLIPBOARD(selection));
+    while (n--)
+        virtio_write_clipboard(selection, VD_AGENT_CLIPBOARD,
+                               VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+}
+
 /* vdagentd <-> vdagent communication handling */
 static int do_agent_clipboard(struct udscs_connection *conn,
         struct udscs_message_header *header, const uint8_t *data)
 {
     uint8_t selection = header->arg1;
+    uint32_t id = VDAGENTD_CLIPBOARD_ID(header->arg1);
     uint32_t msg_type = 0, data_type = -1, size = header->size;
 
     if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
@@ -470,6 +896,16 @@ static int do_agent_clipboard(struct udscs_connection *conn,
     }
 
     if (!virtio_port) {
+        /* Announced to the client once it is back */
+        if (client_revalidate &&
+                (header->type == VDAGENTD_CLIPBOARD_GRAB ||
+                 header->type == VDAGENTD_CLIPBOARD_RELEASE)) {
+            agent_owns_clipboard[selection] =
+                header->type == VDAGENTD_CLIPBOARD_GRAB;
+            set_agent_grab(selection, data, agent_owns_clipboard[selection] ?
+                                            size : 0);
+            return 0;
+        }
         syslog(LOG_ERR, "Clipboard req from agent but no client connection");
         goto error;
     }
@@ -484,15 +920,27 @@ static int do_agent_clipboard(struct udscs_connection *conn,
     case VDAGENTD_CLIPBOARD_GRAB:
         msg_type = VD_AGENT_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 1;
+        set_agent_grab(selection, data, size);
+        purge_client_clipboard_data(selection);
+        metrics_inc(METRICS_CLIPBOARD_GRABS);
         break;
     case VDAGENTD_CLIPBOARD_REQUEST:
         msg_type = VD_AGENT_CLIPBOARD_REQUEST;
         data_type = header->arg2;
         size = 0;
+        metrics_inc(METRICS_CLIPBOARD_REQUESTS);
+        agent_clipboard_request_us[selection] = metrics_now_us();
+        agent_clipboard_request_id[selection] = id;
+        trace_clipboard(id, TRACE_CLIPBOARD_DAEMON_REQUEST, selection,
+                        data_type, 0);
         break;
     case VDAGENTD_CLIPBOARD_DATA:
         msg_type = VD_AGENT_CLIPBOARD;
         data_type = header->arg2;
+        metrics_add(METRICS_CLIPBOARD_BYTES, size);
+        clipboard_request_done(&client_clipboard_request_us[selection]);
+        trace_clipboard(id, TRACE_CLIPBOARD_AGENT_DATA, selection,
+                        data_type, size);
         if (max_clipboard != -1 && size > max_clipboard) {
             syslog(LOG_WARNING, "clipboard is too large (%d > %d), discarding",
                    size, max_clipboard);
@@ -504,6 +952,8 @@ static int do_agent_clipboard(struct udscs_connection *conn,
         msg_type = VD_AGENT_CLIPBOARD_RELEASE;
         size = 0;
         agent_owns_clipboard[selection] = 0;
+        set_agent_grab(selection, NULL, 0);
+        purge_client_clipboard_data(selection);
         break;
     default:
         syslog(LOG_WARNING, "unexpected clipboard message type");
@@ -524,23 +974,164 @@ error:
     if (header->type == VDAGENTD_CLIPBOARD_REQUEST) {
         /* Let the agent know no answer is coming */
         udscs_write(conn, VDAGENTD_CLIPBOARD_DATA,
-                    selection, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+                    VDAGENTD_CLIPBOARD_ARG1(selection, id),
+                    VD_AGENT_CLIPBOARD_NONE, NULL, 0);
     }
     return 0;
 }
 
+/* A session switch (fast user switching, or the greeter handing over to the
+   user's session) leaves the active session without an agent for a moment.
+   Closing the virtio port then would take the client out of client mouse
+   mode and back once the new agent is there, with a new capability
+   handshake, so the port and uinput device are kept for the new agent for
+   this long */
+#define SESSION_SWITCH_GRACE_MS 5000
+
+static int grace_timer_fd = -1;
+static int grace_timer_armed = 0;
+
+/* When the virtio port drops it gets reopened right away, and if that fails
+   again from the main loop, with a backoff doubling from the minimum */
+#define RECONNECT_MIN_MS 10
+#define RECONNECT_MAX_MS 1000
+
+static int reconnect_timer_fd = -1;
+static int reconnect_timer_armed = 0;
+static unsigned int reconnect_failures = 0;
+
+/* Arm fd to expire once after ms, or disarm it for 0 */
+static int set_timer(int fd, int ms)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    return timerfd_settime(fd, 0, &its, NULL);
+}
+
+static void set_grace_timer(int ms)
+{
+    if (set_timer(grace_timer_fd, ms) == -1)
+        syslog(LOG_ERR, "setting session switch timer: %m");
+    grace_timer_armed = ms != 0;
+}
+
+static void set_reconnect_timer(int ms)
+{
+    if (set_timer(reconnect_timer_fd, ms) == -1)
+        syslog(LOG_ERR, "setting virtio reconnect timer: %m");
+    reconnect_timer_armed = ms != 0;
+}
+
+/* A port passed in by socket activation stays open in systemd, so it can not
+   be opened again by name, re-use the fd instead */
+static struct vdagent_virtio_port *open_virtio_port(void)
+{
+    int fd;
+
+    if (activated_virtio_fd == -1)
+        return vdagent_virtio_port_create(portdev, virtio_port_read_complete,
+                                          virtio_port_dropped, NULL);
+
+    fd = fcntl(activated_virtio_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "dup virtio port fd: %m");
+        return NULL;
+    }
+    return vdagent_virtio_port_create_for_fd(fd, virtio_port_read_complete,
+                                             virtio_port_dropped, NULL);
+}
+
+/* Reopen the virtio port after it dropped, retrying later on failure */
+static void reconnect_virtio_port(void)
+{
+    int ms = RECONNECT_MIN_MS;
+    unsigned int i;
+
+    virtio_port = open_virtio_port();
+    if (virtio_port) {
+        if (reconnect_failures)
+            syslog(LOG_INFO, "reopened vdagent virtio channel after %u "
+                   "failed attempts", reconnect_failures);
+        reconnect_failures = 0;
+        return;
+    }
+
+    if (reconnect_timer_fd == -1) {
+        syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
+        retval = 1;
+        quit = 1;
+        return;
+    }
+    if (!reconnect_failures)
+        syslog(LOG_ERR, "error reopening vdagent virtio channel, retrying");
+    for (i = 0; i < reconnect_failures && ms < RECONNECT_MAX_MS; i++)
+        ms *= 2;
+    if (ms > RECONNECT_MAX_MS)
+        ms = RECONNECT_MAX_MS;
+    reconnect_failures++;
+    set_reconnect_timer(ms);
+}
+
+/* The messages in flight went down with the virtio port. The agent gets an
+   answer to its clipboard requests and suspends its xfers, the rest of the
+   state negotiated with the client is kept, until the client announces its
+   capabilities again, see do_client_capabilities() */
+static void virtio_port_lost(void)
+{
+    int sel;
+
+    metrics_inc(METRICS_VIRTIO_RECONNECTS);
+    for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        fail_agent_clipboard_request(sel);
+        client_clipboard_request_us[sel] = 0;
+    }
+
+    if (!client_connected)
+        return;
+    udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 1, 0,
+                           NULL, 0);
+    g_hash_table_remove_all(active_xfers);
+    vdagentd_xfer_sched_remove_all(xfer_sched, NULL);
+    if (compress)
+        vdagentd_compress_reset(compress);
+    client_revalidate = 1;
+}
+
+static void close_virtio_port_and_uinput(void)
+{
+#ifndef WITH_STATIC_UINPUT
+    vdagentd_uinput_destroy(&uinput);
+#endif
+    if (reconnect_timer_armed)
+        set_reconnect_timer(0);
+    reconnect_failures = 0;
+    if (virtio_port) {
+        vdagent_virtio_port_flush(&virtio_port);
+        vdagent_virtio_port_destroy(&virtio_port);
+        syslog(LOG_INFO, "closed vdagent virtio channel");
+    }
+}
+
 /* When we open the vdagent virtio channel, the server automatically goes into
    client mouse mode, so we can only have the channel open when we know the
    active session resolution. This function checks that we have an agent in the
    active session, and that it has told us its resolution. If these conditions
    are met it sets the uinput tablet device's resolution and opens the virtio
    channel (if it is not already open). If these conditions are not met, it
-   closes both. */
+   closes both, after SESSION_SWITCH_GRACE_MS if the channel is open. */
 static void check_xorg_resolution(void)
 {
     struct agent_data *agent_data = udscs_get_user_data(active_session_conn);
 
     if (agent_data && agent_data->screen_info) {
+        if (grace_timer_armed) {
+            set_grace_timer(0);
+            syslog(LOG_INFO, "new session agent took over the virtio channel");
+        }
+
         if (!uinput)
             uinput = vdagentd_uinput_create(uinput_device,
                                             agent_data->width,
@@ -562,11 +1153,10 @@ static void check_xorg_resolution(void)
             return;
         }
 
-        if (!virtio_port) {
+        /* After the port dropped it gets reopened by the reconnect timer */
+        if (!virtio_port && !reconnect_timer_armed) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
+            virtio_port = open_virtio_port();
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 retval = 1;
@@ -575,15 +1165,15 @@ static void check_xorg_resolution(void)
             }
             send_capabilities(virtio_port, 1);
         }
-    } else {
-#ifndef WITH_STATIC_UINPUT
-        vdagentd_uinput_destroy(&uinput);
-#endif
-        if (virtio_port) {
-            vdagent_virtio_port_flush(&virtio_port);
-            vdagent_virtio_port_destroy(&virtio_port);
-            syslog(LOG_INFO, "closed vdagent virtio channel");
+    } else if (virtio_port && grace_timer_fd != -1) {
+        if (!grace_timer_armed) {
+            syslog(LOG_INFO, "no agent in the active session, keeping the "
+                   "vdagent virtio channel open for %d s",
+                   SESSION_SWITCH_GRACE_MS / 1000);
+            set_grace_timer(SESSION_SWITCH_GRACE_MS);
         }
+    } else {
+        close_virtio_port_and_uinput();
     }
 }
 
@@ -593,6 +1183,11 @@ static int connection_matches_active_session(struct udscs_connection **connp,
     struct udscs_connection **conn_ret = (struct udscs_connection **)priv;
     struct agent_data *agent_data = udscs_get_user_data(*connp);
 
+    /* The session lookup may have been pending when the agent connected */
+    if (!agent_data->session)
+        agent_data->session = session_info_session_for_pid(session_info,
+                                                           agent_data->pid);
+
     /* Check if this connection matches the currently active session */
     if (!agent_data->session || !active_session)
         return 0;
@@ -613,6 +1208,7 @@ static void release_clipboards(void)
                                       VD_AGENT_CLIPBOARD_RELEASE, 0, &sel, 1);
         }
         agent_owns_clipboard[sel] = 0;
+        set_agent_grab(sel, NULL, 0);
     }
 }
 
@@ -645,6 +1241,12 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
     if (debug)
         syslog(LOG_DEBUG, "%p is now the active session", new_conn);
 
+    /* The metrics of the previous agent are no longer of interest */
+    free(agent_metrics);
+    agent_metrics = NULL;
+    if (active_session_conn && metrics_server)
+        udscs_write(active_session_conn, VDAGENTD_METRICS, 0, 0, NULL, 0);
+
     if (active_session_conn && !session_info_is_user(session_info)) {
         if (debug)
             syslog(LOG_DEBUG, "New session agent does not belong to user: "
@@ -658,6 +1260,13 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
                     (uint8_t *)mon_config, sizeof(VDAgentMonitorsConfig) +
                     mon_config->num_of_monitors * sizeof(VDAgentMonConfig));
 
+    if (active_session_conn) {
+        udscs_write(active_session_conn, VDAGENTD_CLIENT_LINEEND,
+                    client_lineend, 0, NULL, 0);
+        udscs_write(active_session_conn, VDAGENTD_MAX_CLIPBOARD,
+                    max_clipboard, 0, NULL, 0);
+    }
+
     release_clipboards();
 
     check_xorg_resolution();
@@ -666,6 +1275,9 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
 static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
 {
     if (value == conn) {
+        vdagentd_xfer_sched_remove(xfer_sched, GPOINTER_TO_UINT(key));
+        if (compress)
+            vdagentd_compress_end_stream(compress, GPOINTER_TO_UINT(key));
         send_file_xfer_status(virtio_port,
                               "Agent disc; cancelling file-xfer %u",
                               GPOINTER_TO_UINT(key),
@@ -675,10 +1287,44 @@ static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
         return 0;
 }
 
+/* Setting up the session info and a static uinput device takes a while, and
+   is of no use before there is an agent, so it is left until then: this
+   keeps the daemon off the boot critical path. */
+static int initialize(void)
+{
+    if (initialized)
+        return 1;
+    initialized = 1;
+
+#ifdef WITH_STATIC_UINPUT
+    /* Unless taken over from the previous daemon, see restore_state() */
+    if (!uinput)
+        uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
+                                        debug > 1, uinput_fake);
+    if (!uinput) {
+        syslog(LOG_CRIT, "Fatal uinput error");
+        retval = 1;
+        quit = 1;
+        return 0;
+    }
+#endif
+
+    if (want_session_info)
+        session_info = session_info_create(debug);
+    if (!session_info)
+        syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
+    return 1;
+}
+
 static void agent_connect(struct udscs_connection *conn)
 {
     struct agent_data *agent_data;
 
+    if (!initialize()) {
+        udscs_destroy_connection(&conn);
+        return;
+    }
+
     agent_data = calloc(1, sizeof(*agent_data));
     if (!agent_data) {
         syslog(LOG_ERR, "Out of memory allocating agent data, disconnecting");
@@ -687,8 +1333,9 @@ static void agent_connect(struct udscs_connection *conn)
     }
 
     if (session_info) {
-        uint32_t pid = udscs_get_peer_cred(conn).pid;
-        agent_data->session = session_info_session_for_pid(session_info, pid);
+        agent_data->pid = udscs_get_peer_cred(conn).pid;
+        agent_data->session = session_info_session_for_pid(session_info,
+                                                           agent_data->pid);
     }
 
     udscs_set_user_data(conn, (void *)agent_data);
@@ -701,6 +1348,10 @@ static void agent_disconnect(struct udscs_connection *conn)
 {
     struct agent_data *agent_data = udscs_get_user_data(conn);
 
+    /* Disconnected from agent_connect() */
+    if (!agent_data)
+        return;
+
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
 
     free(agent_data->session);
@@ -762,19 +1413,46 @@ static void agent_read_complete(struct udscs_connection **connp,
         }
         break;
     case VDAGENTD_FILE_XFER_STATUS:{
-        VDAgentFileXferStatusMessage status;
-        status.id = header->arg1;
-        status.result = header->arg2;
+        VDAgentFileXferStatusMessage *status;
+        size_t size = sizeof(*status) + header->size;
+
+        /* The status may be followed by status specific data, which only
+           clients knowing about it get */
+        if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                     VDAGENTD_FILE_XFER_RESUME_CAP))
+            size = sizeof(*status);
+        status = g_malloc(size);
+        status->id = header->arg1;
+        status->result = header->arg2;
+        if (size > sizeof(*status))
+            memcpy((uint8_t *)status + sizeof(*status), data, header->size);
         vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
                                   VD_AGENT_FILE_XFER_STATUS, 0,
-                                  (uint8_t *)&status, sizeof(status));
-        if (status.result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
-            g_hash_table_insert(active_xfers, GUINT_TO_POINTER(status.id),
+                                  (uint8_t *)status, size);
+        if (status->result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+            g_hash_table_insert(active_xfers, GUINT_TO_POINTER(status->id),
                                 *connp);
-        else
-            g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status.id));
+        else {
+            g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status->id));
+            vdagentd_xfer_sched_remove(xfer_sched, status->id);
+            if (compress)
+                vdagentd_compress_end_stream(compress, status->id);
+        }
+        g_free(status);
         break;
     }
+    case VDAGENTD_METRICS:
+        if (*connp != active_session_conn)
+            break;
+        if (!metrics_snapshot_valid(data, header->size)) {
+            syslog(LOG_WARNING, "invalid metrics snapshot from agent, ignoring");
+            break;
+        }
+        if (!agent_metrics)
+            agent_metrics = malloc(sizeof(*agent_metrics));
+        if (agent_metrics)
+            memcpy(agent_metrics, data, sizeof(*agent_metrics));
+        break;
 
     default:
         syslog(LOG_ERR, "unknown message from vdagent: %u, ignoring",
@@ -782,6 +1460,392 @@ static void agent_read_complete(struct udscs_connection **connp,
     }
 }
 
+/* live re-exec */
+
+/* Re-executing waits this long at most for the in flight messages */
+#define REEXEC_QUIESCE_MS 10000
+
+/* Let fd be inherited by the re-executed daemon */
+static int inherit_fd(int fd)
+{
+    if (fd != -1 && fcntl(fd, F_SETFD, 0) == -1)
+        syslog(LOG_WARNING, "clearing close-on-exec of fd %d: %m", fd);
+    return fd;
+}
+
+static int save_agent(struct udscs_connection **connp, void *priv)
+{
+    struct vdagentd_handoff *handoff = priv;
+    struct agent_data *agent_data = udscs_get_user_data(*connp);
+    struct vdagentd_handoff_agent agent;
+
+    if (!agent_data)
+        return 0;
+
+    memset(&agent, 0, sizeof(agent));
+    agent.fd = inherit_fd(udscs_get_fd(*connp));
+    agent.active = *connp == active_session_conn;
+    agent.width = agent_data->width;
+    agent.height = agent_data->height;
+    agent.screen_count = agent_data->screen_count;
+    vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_AGENT,
+                         &agent, sizeof(agent));
+    vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_AGENT_SCREENS,
+                         agent_data->screen_info, agent_data->screen_count *
+                         sizeof(*agent_data->screen_info));
+    return 1;
+}
+
+static void save_xfer(gpointer key, gpointer value, gpointer priv)
+{
+    struct vdagentd_handoff_xfer xfer;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.id = GPOINTER_TO_UINT(key);
+    xfer.agent_fd = udscs_get_fd(value);
+    vdagentd_handoff_add(priv, VDAGENTD_HANDOFF_XFER, &xfer, sizeof(xfer));
+}
+
+/* Write the state for the re-executed daemon, and make the fds it refers
+   to inheritable */
+static struct vdagentd_handoff *save_state(void)
+{
+    struct vdagentd_handoff *handoff;
+    struct vdagentd_handoff_daemon daemon;
+    struct vdagentd_handoff_client client;
+    struct vdagentd_handoff_clipboard clipboard;
+    struct vdagentd_uinput_state uinput_state;
+    int sel;
+
+    handoff = vdagentd_handoff_create();
+    if (!handoff)
+        return NULL;
+
+    vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_VERSION, VERSION,
+                         strlen(VERSION) + 1);
+
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.server_fd = inherit_fd(udscs_server_get_fd(server));
+    daemon.virtio_fd = virtio_port ?
+        inherit_fd(vdagent_virtio_port_get_fd(virtio_port)) : -1;
+    daemon.activated_agent_fd = activated_agent_fd;
+    daemon.activated_virtio_fd = inherit_fd(activated_virtio_fd);
+    daemon.daemonized = daemonized;
+    daemon.session_count = session_count;
+    daemon.grace_timer_armed = grace_timer_armed;
+    daemon.reconnect_timer_armed = reconnect_timer_armed;
+    daemon.next_clipboard_id = next_clipboard_id;
+    vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_DAEMON,
+                         &daemon, sizeof(daemon));
+
+    memset(&client, 0, sizeof(client));
+    client.connected = client_connected;
+    client.lineend = client_lineend;
+    client.max_clipboard = max_clipboard;
+    client.revalidate = client_revalidate;
+    vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_CLIENT,
+                         &client, sizeof(client));
+    if (capabilities)
+        vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_CAPABILITIES,
+                             capabilities,
+                             capabilities_size * sizeof(uint32_t));
+    if (mon_config)
+        vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_MONITORS_CONFIG,
+                             mon_config, sizeof(VDAgentMonitorsConfig) +
+                             mon_config->num_of_monitors *
+                             sizeof(VDAgentMonConfig));
+
+    if (uinput) {
+        memset(&uinput_state, 0, sizeof(uinput_state));
+        vdagentd_uinput_get_state(uinput, &uinput_state);
+        inherit_fd(uinput_state.fd);
+        vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_UINPUT,
+                             &uinput_state, sizeof(uinput_state));
+    }
+
+    udscs_server_for_all_clients(server, save_agent, handoff);
+
+    for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        if (!agent_owns_clipboard[sel] && !agent_clipboard_request_us[sel])
+            continue;
+        memset(&clipboard, 0, sizeof(clipboard));
+        clipboard.selection = sel;
+        clipboard.agent_owns = agent_owns_clipboard[sel];
+        clipboard.agent_request_pending = agent_clipboard_request_us[sel] != 0;
+        clipboard.agent_request_id = agent_clipboard_request_id[sel];
+        vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_CLIPBOARD,
+                             &clipboard, sizeof(clipboard));
+        vdagentd_handoff_add(handoff, VDAGENTD_HANDOFF_CLIPBOARD_TYPES,
+                             agent_grab_types[sel], agent_grab_size[sel]);
+    }
+
+    g_hash_table_foreach(active_xfers, save_xfer, handoff);
+
+    return handoff;
+}
+
+struct xfer_conn_lookup {
+    const struct vdagentd_handoff_xfer *xfer;
+    struct udscs_connection *conn;
+};
+
+static int find_connection_by_fd(struct udscs_connection **connp,
+    void *priv)
+{
+    struct xfer_conn_lookup *lookup = priv;
+
+    if (udscs_get_fd(*connp) != lookup->xfer->agent_fd)
+        return 0;
+    lookup->conn = *connp;
+    return 1;
+}
+
+static void restore_agents(struct vdagentd_handoff *handoff)
+{
+    const void *record = NULL;
+    const void *screens;
+    struct vdagentd_handoff_agent agent;
+    struct vdagentd_guest_xorg_resolution *res;
+    struct udscs_connection *conn;
+    struct agent_data *agent_data;
+    uint32_t size;
+
+    while ((record = vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_AGENT,
+                                          record, &agent, sizeof(agent)))) {
+        screens = vdagentd_handoff_next(handoff,
+                                        VDAGENTD_HANDOFF_AGENT_SCREENS,
+                                        record, &size);
+        if (!screens || agent.screen_count < 0 ||
+                size / sizeof(*res) < agent.screen_count) {
+            syslog(LOG_ERR, "invalid handoff agent record, disconnecting");
+            close(agent.fd);
+            continue;
+        }
+        conn = udscs_server_adopt_connection(server, agent.fd);
+        if (!conn)
+            continue;
+
+        agent_data = calloc(1, sizeof(*agent_data));
+        res = malloc(agent.screen_count * sizeof(*res) + 1);
+        if (!agent_data || !res) {
+            syslog(LOG_ERR, "out of memory restoring agent, disconnecting");
+            free(agent_data);
+            free(res);
+            udscs_destroy_connection(&conn);
+            continue;
+        }
+        memcpy(res, screens, agent.screen_count * sizeof(*res));
+        agent_data->pid = udscs_get_peer_cred(conn).pid;
+        if (session_info)
+            agent_data->session = session_info_session_for_pid(session_info,
+                                                        agent_data->pid);
+        agent_data->width = agent.width;
+        agent_data->height = agent.height;
+        agent_data->screen_info = res;
+        agent_data->screen_count = agent.screen_count;
+        udscs_set_user_data(conn, agent_data);
+        if (agent.active)
+            active_session_conn = conn;
+
+        /* Like on connect, an agent which is older than the new daemon
+           restarts */
+        udscs_write(conn, VDAGENTD_VERSION, 0, 0,
+                    (uint8_t *)VERSION, strlen(VERSION) + 1);
+    }
+}
+
+/* Take over from the daemon which re-executed us */
+static void restore_state(struct vdagentd_handoff *handoff,
+    const struct vdagentd_handoff_daemon *daemon)
+{
+    struct vdagentd_handoff_client client;
+    struct vdagentd_handoff_clipboard clipboard;
+    struct vdagentd_uinput_state uinput_state;
+    const char *version;
+    const void *record;
+    struct agent_data *agent_data;
+    struct vdagentd_handoff_xfer xfer;
+    struct xfer_conn_lookup lookup = { .xfer = &xfer };
+    const void *data;
+    uint32_t size;
+
+    version = vdagentd_handoff_next(handoff, VDAGENTD_HANDOFF_VERSION, NULL,
+                                    &size);
+    syslog(LOG_INFO, "taking over from spice-vdagentd %.*s",
+           version ? (int)size : 1, version ? version : "?");
+
+    if (vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_CLIENT, NULL,
+                             &client, sizeof(client))) {
+        client_connected = client.connected;
+        client_lineend = client.lineend;
+        max_clipboard = client.max_clipboard;
+        client_revalidate = client.revalidate;
+    }
+    data = vdagentd_handoff_next(handoff, VDAGENTD_HANDOFF_CAPABILITIES, NULL,
+                                 &size);
+    if (data && size && (capabilities = malloc(size))) {
+        memcpy(capabilities, data, size);
+        capabilities_size = size / sizeof(uint32_t);
+    }
+    data = vdagentd_handoff_next(handoff, VDAGENTD_HANDOFF_MONITORS_CONFIG,
+                                 NULL, &size);
+    if (data && size >= sizeof(VDAgentMonitorsConfig) &&
+            (mon_config = malloc(size)))
+        memcpy(mon_config, data, size);
+    next_clipboard_id = daemon->next_clipboard_id;
+
+    /* The tablet's screen info is the active agent's, set below */
+    if (vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_UINPUT, NULL,
+                             &uinput_state, sizeof(uinput_state)))
+        uinput = vdagentd_uinput_create_from_state(uinput_device,
+                                                   &uinput_state, NULL, 0,
+                                                   debug > 1, uinput_fake);
+
+    if (vdagentd_handoff_next(handoff, VDAGENTD_HANDOFF_AGENT, NULL, &size)) {
+        initialize();
+        if (session_info)
+            active_session = session_info_get_active_session(session_info);
+        restore_agents(handoff);
+    }
+    session_count = daemon->session_count;
+    agent_data = udscs_get_user_data(active_session_conn);
+    if (agent_data && uinput)
+        vdagentd_uinput_update_size(&uinput, agent_data->width,
+                                    agent_data->height,
+                                    agent_data->screen_info,
+                                    agent_data->screen_count);
+
+    if (daemon->virtio_fd != -1) {
+        virtio_port = vdagent_virtio_port_create_for_fd(daemon->virtio_fd,
+                                                    virtio_port_read_complete,
+                                                    virtio_port_dropped,
+                                                    NULL);
+        if (!virtio_port) {
+            syslog(LOG_ERR, "taking over the virtio channel failed");
+            virtio_port_lost();
+            reconnect_virtio_port();
+        }
+    }
+
+    record = NULL;
+    while ((record = vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_CLIPBOARD,
+                                          record, &clipboard,
+                                          sizeof(clipboard)))) {
+        if (clipboard.selection > VD_AGENT_CLIPBOARD_SELECTION_SECONDARY)
+            continue;
+        agent_owns_clipboard[clipboard.selection] = clipboard.agent_owns;
+        data = vdagentd_handoff_next(handoff, VDAGENTD_HANDOFF_CLIPBOARD_TYPES,
+                                     record, &size);
+        if (data)
+            set_agent_grab(clipboard.selection, data, size);
+        if (clipboard.agent_request_pending) {
+            agent_clipboard_request_us[clipboard.selection] =
+                metrics_now_us();
+            agent_clipboard_request_id[clipboard.selection] =
+                clipboard.agent_request_id;
+        }
+    }
+
+    record = NULL;
+    while ((record = vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_XFER,
+                                          record, &xfer, sizeof(xfer)))) {
+        lookup.conn = NULL;
+        udscs_server_for_all_clients(server, find_connection_by_fd, &lookup);
+        if (lookup.conn)
+            g_hash_table_insert(active_xfers, GUINT_TO_POINTER(xfer.id),
+                                lookup.conn);
+    }
+
+    if (daemon->grace_timer_armed && grace_timer_fd != -1)
+        set_grace_timer(SESSION_SWITCH_GRACE_MS);
+    if (daemon->reconnect_timer_armed && !virtio_port &&
+            reconnect_timer_fd != -1)
+        set_reconnect_timer(RECONNECT_MIN_MS);
+}
+
+static void abort_reexec(const char *reason)
+{
+    syslog(LOG_ERR, "not re-executing %s: %s", self_path, reason);
+    reexec_pending = 0;
+    udscs_server_quiesce(server, 0);
+    if (virtio_port)
+        vdagent_virtio_port_quiesce(virtio_port, 0);
+}
+
+static void start_reexec(void)
+{
+    if (reexec_pending)
+        return;
+    if (!self_path[0]) {
+        syslog(LOG_ERR, "not re-executing: the path of the daemon is unknown");
+        return;
+    }
+
+    syslog(LOG_INFO, "re-executing %s once pending messages are handled",
+           self_path);
+    reexec_pending = 1;
+    reexec_deadline = g_get_monotonic_time() + REEXEC_QUIESCE_MS * 1000;
+    udscs_server_quiesce(server, 1);
+}
+
+static void do_reexec(void)
+{
+    struct vdagentd_handoff *handoff;
+    char fd_str[16], activated_str[32];
+    int fd;
+
+    handoff = save_state();
+    fd = handoff ? vdagentd_handoff_finish(handoff) : -1;
+    if (fd == -1) {
+        vdagentd_handoff_destroy(handoff);
+        abort_reexec("saving the state failed");
+        return;
+    }
+
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    setenv(VDAGENTD_HANDOFF_ENV, fd_str, 1);
+    snprintf(activated_str, sizeof(activated_str), "%d,%d",
+             activated_agent_fd, activated_virtio_fd);
+    setenv(VDAGENTD_HANDOFF_ACTIVATED_ENV, activated_str, 1);
+    syslog(LOG_INFO, "re-executing %s", self_path);
+    execv(self_path, saved_argv);
+
+    syslog(LOG_ERR, "exec %s: %m", self_path);
+    unsetenv(VDAGENTD_HANDOFF_ENV);
+    unsetenv(VDAGENTD_HANDOFF_ACTIVATED_ENV);
+    vdagentd_handoff_destroy(handoff);
+    abort_reexec("exec failed");
+}
+
+/* Re-execute once no message is in flight. Reading stops at message
+   boundaries, so that the new daemon gets the rest from the sockets.
+   Return value: the main loop's timeout, given its timeout ms */
+static int continue_reexec(int ms)
+{
+    int streams = compress ? vdagentd_compress_get_stream_count(compress) : 0;
+    gint64 left = reexec_deadline - g_get_monotonic_time();
+
+    /* The context of a compressed xfer can not be handed over, so those
+       have to finish first */
+    if (virtio_port)
+        vdagent_virtio_port_quiesce(virtio_port, !streams);
+
+    if (udscs_server_is_quiescent(server) &&
+            (!virtio_port || vdagent_virtio_port_is_quiescent(virtio_port)) &&
+            vdagentd_xfer_sched_is_idle(xfer_sched) && !streams) {
+        do_reexec();
+        return ms;
+    }
+    if (left <= 0) {
+        abort_reexec(streams ? "compressed file transfers in progress" :
+                               "pending messages were not handled in time");
+        return ms;
+    }
+    if (ms < 0 || left / 1000 + 1 < ms)
+        ms = left / 1000 + 1;
+    return ms;
+}
+
 /* main */
 
 static void usage(FILE *fp)
@@ -798,13 +1862,21 @@ static void usage(FILE *fp)
             "  -f             treat uinput device as fake; no ioctls\n"
             "  -x             don't daemonize\n"
             "  -o             only handle one virtio serial session\n"
+            "  -r <KiB/s>     limit the file xfer data rate to the agents\n"
+            "  -b <KiB>       memory budget for message buffers [%"PRIu64"]\n"
+            "  -B <pool>=<KiB> cap the message buffers of pool (virtio-read,\n"
+            "                 virtio-write, udscs-read or udscs-write)\n"
+            "  -M <filename>  set metrics Unix domain socket [%s]\n"
+            "  -z             compress virtio data for clients supporting the\n"
+            "                 (private) compression protocol extension\n"
 #ifdef HAVE_CONSOLE_KIT
             "  -X             disable console kit integration\n"
 #endif
 #ifdef HAVE_LIBSYSTEMD_LOGIN
             "  -X             disable systemd-logind integration\n"
 #endif
-            ,VERSION, portdev, vdagentd_socket, uinput_device);
+            ,VERSION, portdev, vdagentd_socket, uinput_device,
+            budget_limit, metrics_socket);
 }
 
 static void daemonize(void)
@@ -833,14 +1905,85 @@ static void daemonize(void)
     }
 }
 
+/* As in sd-daemon.h, the protocol is simple enough to not need libsystemd */
+#define SD_LISTEN_FDS_START 3
+
+/* Pick up the fds passed in by systemd socket activation, see
+   sd_listen_fds(3): the agent socket, and optionally the virtio port.
+   Return value: 1 if started by socket activation */
+static int get_activated_fds(void)
+{
+    const char *env;
+    struct stat st;
+    int fd, n;
+
+    env = getenv("LISTEN_PID");
+    if (!env || strtol(env, NULL, 10) != getpid())
+        return 0;
+    env = getenv("LISTEN_FDS");
+    n = env ? atoi(env) : 0;
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd++) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (fstat(fd, &st) == -1)
+            st.st_mode = 0;
+        if (S_ISSOCK(st.st_mode) && activated_agent_fd == -1) {
+            activated_agent_fd = fd;
+        } else if (S_ISCHR(st.st_mode) && activated_virtio_fd == -1) {
+            activated_virtio_fd = fd;
+        } else {
+            syslog(LOG_WARNING, "ignoring unexpected activation fd %d", fd);
+            close(fd);
+        }
+    }
+    return n > 0;
+}
+
+/* How often messages deferred by the memory budget get retried */
+#define BUDGET_RETRY_MS 10
+
 static void main_loop(void)
 {
     fd_set readfds, writefds;
-    int n, nfds;
+    struct timeval tv, *timeout;
+    int n, nfds, ms;
     int ck_fd = 0;
+    int dbus_fd = -1;
     int once = 0;
 
     while (!quit) {
+        if (trace_requested) {
+            trace_requested = 0;
+            if (trace_dump(trace_file, "spice-vdagentd") == 0)
+                syslog(LOG_INFO, "trace written to %s", trace_file);
+            else
+                syslog(LOG_ERR, "writing trace to %s: %m", trace_file);
+        }
+
+        if (reexec_requested) {
+            reexec_requested = 0;
+            start_reexec();
+        }
+
+        /* Hand queued file xfer data to the agents as their sockets drain */
+        ms = vdagentd_xfer_sched_run(xfer_sched);
+        /* Messages deferred by the memory budget get retried soon, what
+           makes room for them need not wake us up */
+        if (budget_take_deferred() && (ms < 0 || ms > BUDGET_RETRY_MS))
+            ms = BUDGET_RETRY_MS;
+        if (reexec_pending)
+            ms = continue_reexec(ms);
+        if (ms >= 0) {
+            tv.tv_sec = ms / 1000;
+            tv.tv_usec = (ms % 1000) * 1000;
+            timeout = &tv;
+        } else {
+            timeout = NULL;
+        }
+
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
@@ -849,14 +1992,37 @@ static void main_loop(void)
         if (n >= nfds)
             nfds = n + 1;
 
+        n = vdagentd_metrics_server_fill_fds(metrics_server, &readfds);
+        if (n > nfds)
+            nfds = n;
+
         if (session_info) {
             ck_fd = session_info_get_fd(session_info);
             FD_SET(ck_fd, &readfds);
             if (ck_fd >= nfds)
                 nfds = ck_fd + 1;
+
+            dbus_fd = session_info_get_dbus_fd(session_info);
+            if (dbus_fd != -1) {
+                FD_SET(dbus_fd, &readfds);
+                if (dbus_fd >= nfds)
+                    nfds = dbus_fd + 1;
+            }
         }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        if (grace_timer_armed) {
+            FD_SET(grace_timer_fd, &readfds);
+            if (grace_timer_fd >= nfds)
+                nfds = grace_timer_fd + 1;
+        }
+
+        if (reconnect_timer_armed) {
+            FD_SET(reconnect_timer_fd, &readfds);
+            if (reconnect_timer_fd >= nfds)
+                nfds = reconnect_timer_fd + 1;
+        }
+
+        n = select(nfds, &readfds, &writefds, NULL, timeout);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -867,33 +2033,55 @@ static void main_loop(void)
 
         udscs_server_handle_fds(server, &readfds, &writefds);
 
+        if (grace_timer_armed && FD_ISSET(grace_timer_fd, &readfds)) {
+            uint64_t expirations;
+
+            if (read(grace_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                grace_timer_armed = 0;
+                syslog(LOG_INFO, "no new session agent showed up");
+                close_virtio_port_and_uinput();
+            }
+        }
+
+        if (reconnect_timer_armed && FD_ISSET(reconnect_timer_fd, &readfds)) {
+            uint64_t expirations;
+
+            if (read(reconnect_timer_fd, &expirations,
+                     sizeof(expirations)) > 0) {
+                reconnect_timer_armed = 0;
+                reconnect_virtio_port();
+            }
+        }
+
+        /* Serve the agent's last snapshot, and ask it for a fresh one for
+           the next scrape, so that we never wait for the agent */
+        if (vdagentd_metrics_server_handle_fds(metrics_server, &readfds,
+                                               agent_metrics) &&
+                active_session_conn)
+            udscs_write(active_session_conn, VDAGENTD_METRICS, 0, 0, NULL, 0);
+
         if (virtio_port) {
             once = 1;
             vdagent_virtio_port_handle_fds(&virtio_port, &readfds, &writefds);
             if (!virtio_port) {
-                int old_client_connected = client_connected;
                 syslog(LOG_CRIT,
                        "AIIEEE lost spice client connection, reconnecting");
-                virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     NULL);
-                if (!virtio_port) {
-                    syslog(LOG_CRIT,
-                           "Fatal error opening vdagent virtio channel");
-                    retval = 1;
-                    break;
-                }
-                do_client_disconnect();
-                client_connected = old_client_connected;
+                virtio_port_lost();
+                reconnect_virtio_port();
             }
         }
-        else if (only_once && once)
+        else if (only_once && once && !reconnect_timer_armed)
         {
             syslog(LOG_INFO, "Exiting after one client session.");
             break;
         }
 
-        if (session_info && FD_ISSET(ck_fd, &readfds)) {
+        /* Keep the lock state up to date */
+        if (session_info && dbus_fd != -1 && FD_ISSET(dbus_fd, &readfds))
+            session_info_read_dbus(session_info);
+
+        if (session_info && (FD_ISSET(ck_fd, &readfds) ||
+                             session_info_has_updates(session_info))) {
             active_session = session_info_get_active_session(session_info);
             update_active_session_connection(NULL);
         }
@@ -905,15 +2093,92 @@ static void quit_handler(int sig)
     quit = 1;
 }
 
+static void trace_handler(int sig)
+{
+    trace_requested = 1;
+}
+
+static void reexec_handler(int sig)
+{
+    reexec_requested = 1;
+}
+
+/* The state left by the daemon which re-executed us, see do_reexec() */
+static struct vdagentd_handoff *open_handoff(void)
+{
+    const char *env = getenv(VDAGENTD_HANDOFF_ENV);
+    int fd;
+
+    if (!env)
+        return NULL;
+    fd = atoi(env);
+    unsetenv(VDAGENTD_HANDOFF_ENV);
+
+    return vdagentd_handoff_open(fd);
+}
+
+/* The fds the daemon which re-executed us got from socket activation */
+static void get_handed_over_activated_fds(void)
+{
+    const char *env = getenv(VDAGENTD_HANDOFF_ACTIVATED_ENV);
+
+    if (env && sscanf(env, "%d,%d", &activated_agent_fd,
+                      &activated_virtio_fd) != 2) {
+        activated_agent_fd = -1;
+        activated_virtio_fd = -1;
+    }
+    unsetenv(VDAGENTD_HANDOFF_ACTIVATED_ENV);
+    /* They were made inheritable for the exec */
+    if (activated_agent_fd != -1)
+        fcntl(activated_agent_fd, F_SETFD, FD_CLOEXEC);
+    if (activated_virtio_fd != -1)
+        fcntl(activated_virtio_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* The state of the previous daemon can not be taken over, close the fds it
+   left us, so that the agents and the client see it go away and reconnect,
+   and start afresh. The fds of socket activation are systemd's, those, and
+   the socket path, are kept. */
+static void drop_handoff(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int fd;
+
+    syslog(LOG_ERR, "not taking over from the previous daemon, restarting");
+    closelog();
+    dir = opendir("/proc/self/fd");
+    if (dir) {
+        while ((entry = readdir(dir))) {
+            fd = atoi(entry->d_name);
+            if (fd > STDERR_FILENO && fd != dirfd(dir) &&
+                    fd != activated_agent_fd && fd != activated_virtio_fd)
+                close(fd);
+        }
+        closedir(dir);
+    }
+    openlog("spice-vdagentd", LOG_PERROR, LOG_USER);
+    if (activated_agent_fd == -1)
+        unlink(vdagentd_socket);
+}
+
 int main(int argc, char *argv[])
 {
     int c;
     int do_daemonize = 1;
-    int want_session_info = 1;
+    int activated;
     struct sigaction act;
+    struct vdagentd_handoff *handoff = NULL;
+    struct vdagentd_handoff_daemon daemon_state;
+    const struct vdagentd_handoff_daemon *daemon = NULL;
+    ssize_t n;
+
+    saved_argv = argv;
+    n = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    self_path[n > 0 ? n : 0] = '\0';
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dhxXfos:u:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dhxXforzs:u:S:M:b:B:")))
             break;
         switch (c) {
         case 'd':
@@ -934,6 +2199,32 @@ int main(int argc, char *argv[])
         case 'o':
             only_once = 1;
             break;
+        case 'M':
+            metrics_socket = optarg;
+            break;
+        case 'z':
+            want_compress = 1;
+            break;
+        case 'r':
+            xfer_rate_limit = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'b':
+            budget_limit = strtoull(optarg, NULL, 10);
+            break;
+        case 'B': {
+            /* argv is used again when re-executing, so it stays intact */
+            const char *eq = strchr(optarg, '=');
+            gchar *name = eq ? g_strndup(optarg, eq - optarg) : NULL;
+            int pool = name ? budget_pool_from_name(name) : -1;
+
+            g_free(name);
+            if (pool == -1) {
+                fprintf(stderr, "invalid -B argument, see -h\n");
+                return 1;
+            }
+            budget_set_limit(pool, strtoull(eq + 1, NULL, 10) * 1024);
+            break;
+        }
         case 'x':
             do_daemonize = 0;
             break;
@@ -950,6 +2241,9 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Also the guard against a client sending absurd message sizes */
+    budget_set_global_limit(budget_limit * 1024);
+
     memset(&act, 0, sizeof(act));
     act.sa_flags = SA_RESTART;
     act.sa_handler = quit_handler;
@@ -957,14 +2251,56 @@ int main(int argc, char *argv[])
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
+    act.sa_handler = trace_handler;
+    sigaction(SIGUSR1, &act, NULL);
+    act.sa_handler = reexec_handler;
+    sigaction(SIGUSR2, &act, NULL);
+
+    /* systemd started us, and does the forking and socket creation */
+    activated = get_activated_fds();
+    /* Or we re-executed ourselves, and are set up already */
+    if (activated || getenv(VDAGENTD_HANDOFF_ENV))
+        do_daemonize = 0;
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
+    if (getenv(VDAGENTD_HANDOFF_ENV)) {
+        get_handed_over_activated_fds();
+        handoff = open_handoff();
+        if (handoff && vdagentd_handoff_get(handoff, VDAGENTD_HANDOFF_DAEMON,
+                                            NULL, &daemon_state,
+                                            sizeof(daemon_state)))
+            daemon = &daemon_state;
+        if (!daemon) {
+            vdagentd_handoff_destroy(handoff);
+            handoff = NULL;
+            drop_handoff();
+        }
+    }
+    if (daemon) {
+        activated_agent_fd = daemon->activated_agent_fd;
+        activated_virtio_fd = daemon->activated_virtio_fd;
+        daemonized = daemon->daemonized;
+    }
+
     /* Setup communication with vdagent process(es) */
-    server = udscs_create_server(vdagentd_socket, agent_connect,
-                                 agent_read_complete, agent_disconnect,
-                                 vdagentd_messages, VDAGENTD_NO_MESSAGES,
-                                 debug);
+    if (daemon)
+        server = udscs_create_server_for_fd(daemon->server_fd, agent_connect,
+                                            agent_read_complete,
+                                            agent_disconnect,
+                                            vdagentd_messages,
+                                            VDAGENTD_NO_MESSAGES, debug);
+    else if (activated_agent_fd != -1)
+        server = udscs_create_server_for_fd(activated_agent_fd, agent_connect,
+                                            agent_read_complete,
+                                            agent_disconnect,
+                                            vdagentd_messages,
+                                            VDAGENTD_NO_MESSAGES, debug);
+    else
+        server = udscs_create_server(vdagentd_socket, agent_connect,
+                                     agent_read_complete, agent_disconnect,
+                                     vdagentd_messages, VDAGENTD_NO_MESSAGES,
+                                     debug);
     if (!server) {
         if (errno == EADDRINUSE) {
             syslog(LOG_CRIT, "Fatal the server socket %s exists already. Delete it?",
@@ -973,33 +2309,44 @@ int main(int argc, char *argv[])
             syslog(LOG_CRIT, "Fatal could not create the server socket %s: %m",
                    vdagentd_socket);
         }
+        vdagentd_handoff_destroy(handoff);
         return 1;
     }
-    if (chmod(vdagentd_socket, 0666)) {
+    if (!daemon && activated_agent_fd == -1 && chmod(vdagentd_socket, 0666)) {
         syslog(LOG_CRIT, "Fatal could not change permissions on %s: %m",
                vdagentd_socket);
         udscs_destroy_server(server);
         return 1;
     }
 
-    if (do_daemonize)
+    if (do_daemonize) {
         daemonize();
-
-#ifdef WITH_STATIC_UINPUT
-    uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
-                                    debug > 1, uinput_fake);
-    if (!uinput) {
-        udscs_destroy_server(server);
-        return 1;
+        daemonized = 1;
     }
-#endif
 
-    if (want_session_info)
-        session_info = session_info_create(debug);
-    if (!session_info)
-        syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
+    metrics_server = vdagentd_metrics_server_create(metrics_socket, debug);
+    if (!metrics_server)
+        syslog(LOG_WARNING, "no metrics socket, metrics will not be exported");
+
+    grace_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+    if (grace_timer_fd == -1)
+        syslog(LOG_WARNING, "creating session switch timer: %m, the "
+               "virtio channel closes right away on session switches");
+    reconnect_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reconnect_timer_fd == -1)
+        syslog(LOG_WARNING, "creating virtio reconnect timer: %m, failing "
+               "to reopen the virtio channel is fatal");
 
     active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    xfer_sched = vdagentd_xfer_sched_create(xfer_rate_limit, debug);
+    if (want_compress)
+        compress = vdagentd_compress_create(debug);
+    if (handoff) {
+        restore_state(handoff, daemon);
+        vdagentd_handoff_destroy(handoff);
+    }
     main_loop();
 
     release_clipboards();
@@ -1008,12 +2355,23 @@ int main(int argc, char *argv[])
     vdagent_virtio_port_flush(&virtio_port);
     vdagent_virtio_port_destroy(&virtio_port);
     session_info_destroy(session_info);
+    vdagentd_xfer_sched_destroy(xfer_sched);
+    vdagentd_compress_destroy(compress);
+    vdagentd_metrics_server_destroy(metrics_server);
+    free(agent_metrics);
     udscs_destroy_server(server);
-    if (unlink(vdagentd_socket) != 0)
+    /* An activated socket belongs to systemd, which keeps listening on it */
+    if (activated_agent_fd == -1 && unlink(vdagentd_socket) != 0)
         syslog(LOG_ERR, "unlink %s: %s", vdagentd_socket, strerror(errno));
+    if (activated_virtio_fd != -1)
+        close(activated_virtio_fd);
+    if (grace_timer_fd != -1)
+        close(grace_timer_fd);
+    if (reconnect_timer_fd != -1)
+        close(reconnect_timer_fd);
     syslog(LOG_INFO, "vdagentd quiting, returning status %d", retval);
 
-    if (do_daemonize)
+    if (daemonized)
         unlink(pidfilename);
 
     return retval;
@@ -27,9 +27,13 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include "virtio-port.h"
+#include "budget.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 struct vdagent_virtio_port_buf {
@@ -37,8 +41,20 @@ struct vdagent_virtio_port_buf {
     size_t pos;
     size_t size;
     size_t write_pos;
+    uint64_t stream;
 
     struct vdagent_virtio_port_buf *next;
+    struct vdagent_virtio_port_buf *prev;
+    struct vdagent_virtio_port_buf *stream_next;
+};
+
+/* The buffers queued for a single stream, in queue order */
+struct vdagent_virtio_port_stream {
+    uint64_t id;
+    struct vdagent_virtio_port_buf *head;
+    struct vdagent_virtio_port_buf *tail;
+
+    struct vdagent_virtio_port_stream *next;
 };
 
 /* Data to keep track of the assembling of vdagent messages per chunk port,
@@ -46,6 +62,7 @@ struct vdagent_virtio_port_buf {
 struct vdagent_virtio_port_chunk_port_data {
     int message_header_read;
     int message_data_pos;
+    int discard;          /* refused by the memory budget, skip the data */
     VDAgentMessage message_header;
     uint8_t *message_data;
 };
@@ -54,6 +71,7 @@ struct vdagent_virtio_port {
     int fd;
     int opening;
     int is_uds;
+    int quiesce;
 
     /* Chunk read stuff, single buffer, separate header and data buffer */
     int chunk_header_read;
@@ -67,57 +85,90 @@ struct vdagent_virtio_port {
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
     struct vdagent_virtio_port_buf *write_buf;
+    struct vdagent_virtio_port_buf *write_buf_tail;
+    /* Buffers which are part of a stream are also linked per stream, so
+       that they can be purged without walking the entire write_buf list */
+    struct vdagent_virtio_port_stream *streams;
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
+    vdagent_virtio_port_drop_callback drop_callback;
     vdagent_virtio_port_disconnect_callback disconnect_callback;
 };
 
 static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp);
 static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp);
 
-struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
+static void vdagent_virtio_port_free_message_data(
+    struct vdagent_virtio_port_chunk_port_data *port)
+{
+    if (port->message_data)
+        budget_release(BUDGET_VIRTIO_READ, port->message_header.size);
+    free(port->message_data);
+    port->message_data = NULL;
+}
+
+struct vdagent_virtio_port *vdagent_virtio_port_create_for_fd(int fd,
     vdagent_virtio_port_read_callback read_callback,
+    vdagent_virtio_port_drop_callback drop_callback,
     vdagent_virtio_port_disconnect_callback disconnect_callback)
 {
     struct vdagent_virtio_port *vport;
-    struct sockaddr_un address;
-    int c;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        syslog(LOG_ERR, "fstat virtio port fd %d: %m", fd);
+        close(fd);
+        return NULL;
+    }
 
     vport = calloc(1, sizeof(*vport));
-    if (!vport)
-        return 0;
+    if (!vport) {
+        close(fd);
+        return NULL;
+    }
+
+    vport->fd = fd;
+    vport->is_uds = S_ISSOCK(st.st_mode);
+    vport->opening = 1;
+
+    vport->read_callback = read_callback;
+    vport->drop_callback = drop_callback;
+    vport->disconnect_callback = disconnect_callback;
+
+    return vport;
+}
+
+struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
+    vdagent_virtio_port_read_callback read_callback,
+    vdagent_virtio_port_drop_callback drop_callback,
+    vdagent_virtio_port_disconnect_callback disconnect_callback)
+{
+    struct sockaddr_un address;
+    int c, fd;
 
-    vport->fd = open(portname, O_RDWR);
-    if (vport->fd == -1) {
-        vport->fd = socket(PF_UNIX, SOCK_STREAM, 0);
-        if (vport->fd == -1) {
+    fd = open(portname, O_RDWR);
+    if (fd == -1) {
+        fd = socket(PF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
             goto error;
         }
         address.sun_family = AF_UNIX;
         snprintf(address.sun_path, sizeof(address.sun_path), "%s", portname);
-        c = connect(vport->fd, (struct sockaddr *)&address, sizeof(address));
-        if (c == 0) {
-            vport->is_uds = 1;
-        } else {
+        c = connect(fd, (struct sockaddr *)&address, sizeof(address));
+        if (c != 0) {
             goto error;
         }
-    } else {
-        vport->is_uds = 0;
     }
-    vport->opening = 1;
-
-    vport->read_callback = read_callback;
-    vport->disconnect_callback = disconnect_callback;
 
-    return vport;
+    return vdagent_virtio_port_create_for_fd(fd, read_callback, drop_callback,
+                                             disconnect_callback);
 
 error:
     syslog(LOG_ERR, "open %s: %m", portname);
-    if (vport->fd != -1) {
-        close(vport->fd);
+    if (fd != -1) {
+        close(fd);
     }
-    free(vport);
     return NULL;
 }
 
@@ -136,13 +187,20 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
     wbuf = vport->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
+        budget_release(BUDGET_VIRTIO_WRITE, wbuf->size - wbuf->pos);
         free(wbuf->buf);
         free(wbuf);
         wbuf = next_wbuf;
     }
 
+    while (vport->streams) {
+        struct vdagent_virtio_port_stream *next_stream = vport->streams->next;
+        free(vport->streams);
+        vport->streams = next_stream;
+    }
+
     for (i = 0; i < VDP_END_PORT; i++) {
-        free(vport->port_data[i].message_data);
+        vdagent_virtio_port_free_message_data(&vport->port_data[i]);
     }
 
     close(vport->fd);
@@ -150,13 +208,29 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
     *vportp = NULL;
 }
 
+/* Return value: 1 if no chunk or message is partially read */
+static int vdagent_virtio_port_between_messages(
+    struct vdagent_virtio_port *vport)
+{
+    int i;
+
+    if (vport->chunk_header_read)
+        return 0;
+    for (i = 0; i < VDP_END_PORT; i++) {
+        if (vport->port_data[i].message_header_read)
+            return 0;
+    }
+    return 1;
+}
+
 int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
         fd_set *readfds, fd_set *writefds)
 {
     if (!vport)
         return -1;
 
-    FD_SET(vport->fd, readfds);
+    if (!vport->quiesce || !vdagent_virtio_port_between_messages(vport))
+        FD_SET(vport->fd, readfds);
     if (vport->write_buf)
         FD_SET(vport->fd, writefds);
 
@@ -176,44 +250,64 @@ void vdagent_virtio_port_handle_fds(struct vdagent_virtio_port **vportp,
         vdagent_virtio_port_do_write(vportp);
 }
 
-static struct vdagent_virtio_port_buf* vdagent_virtio_port_get_last_wbuf(
-    struct vdagent_virtio_port *vport)
+static struct vdagent_virtio_port_stream **vdagent_virtio_port_find_stream(
+    struct vdagent_virtio_port *vport, uint64_t id)
 {
-    struct vdagent_virtio_port_buf *wbuf;
-
-    wbuf = vport->write_buf;
-    if (!wbuf)
-        return NULL;
+    struct vdagent_virtio_port_stream **streamp = &vport->streams;
 
-    while (wbuf->next)
-        wbuf = wbuf->next;
+    while (*streamp && (*streamp)->id != id)
+        streamp = &(*streamp)->next;
 
-    return wbuf;
+    return streamp;
 }
 
-int vdagent_virtio_port_write_start(
+int vdagent_virtio_port_write_stream_start(
         struct vdagent_virtio_port *vport,
+        uint64_t stream,
         uint32_t port_nr,
         uint32_t message_type,
         uint32_t message_opaque,
         uint32_t data_size)
 {
-    struct vdagent_virtio_port_buf *wbuf, *new_wbuf;
+    struct vdagent_virtio_port_buf *new_wbuf;
+    struct vdagent_virtio_port_stream **streamp = NULL;
     VDIChunkHeader chunk_header;
     VDAgentMessage message_header;
 
+    if (stream) {
+        streamp = vdagent_virtio_port_find_stream(vport, stream);
+        if (!*streamp) {
+            *streamp = calloc(1, sizeof(**streamp));
+            if (!*streamp)
+                return -1;
+            (*streamp)->id = stream;
+        }
+    }
+
+    /* Control messages always get queued, dropping one would leave the
+       client waiting for it, the budget only refuses bulk data */
+    if (data_size >= BUDGET_BULK_SIZE &&
+            !budget_fits(BUDGET_VIRTIO_WRITE, sizeof(chunk_header) +
+                         sizeof(message_header) + data_size)) {
+        syslog(LOG_ERR, "virtio message of %u bytes exceeds the memory budget",
+               data_size);
+        goto error;
+    }
+
     new_wbuf = malloc(sizeof(*new_wbuf));
     if (!new_wbuf)
-        return -1;
+        goto error;
 
     new_wbuf->pos = 0;
     new_wbuf->write_pos = 0;
     new_wbuf->size = sizeof(chunk_header) + sizeof(message_header) + data_size;
+    new_wbuf->stream = stream;
     new_wbuf->next = NULL;
+    new_wbuf->stream_next = NULL;
     new_wbuf->buf = malloc(new_wbuf->size);
     if (!new_wbuf->buf) {
         free(new_wbuf);
-        return -1;
+        goto error;
     }
 
     chunk_header.port = port_nr;
@@ -230,15 +324,48 @@ int vdagent_virtio_port_write_start(
            sizeof(message_header));
     new_wbuf->write_pos += sizeof(message_header);
 
-    if (!vport->write_buf) {
+    metrics_inc(METRICS_VIRTIO_MESSAGES_SENT);
+    trace_event(TRACE_VIRTIO_WRITE, port_nr, message_type, message_opaque,
+                data_size, 0);
+    budget_charge(BUDGET_VIRTIO_WRITE, new_wbuf->size);
+    metrics_observe(METRICS_VIRTIO_MESSAGE_SIZE, new_wbuf->size);
+
+    new_wbuf->prev = vport->write_buf_tail;
+    if (vport->write_buf_tail)
+        vport->write_buf_tail->next = new_wbuf;
+    else
         vport->write_buf = new_wbuf;
-        return 0;
+    vport->write_buf_tail = new_wbuf;
+
+    if (streamp) {
+        if ((*streamp)->tail)
+            (*streamp)->tail->stream_next = new_wbuf;
+        else
+            (*streamp)->head = new_wbuf;
+        (*streamp)->tail = new_wbuf;
     }
 
-    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
-    wbuf->next = new_wbuf;
-
     return 0;
+
+error:
+    if (streamp && !(*streamp)->head) {
+        struct vdagent_virtio_port_stream *empty = *streamp;
+        *streamp = empty->next;
+        free(empty);
+    }
+    return -1;
+}
+
+int vdagent_virtio_port_write_start(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size)
+{
+    return vdagent_virtio_port_write_stream_start(vport, 0, port_nr,
+                                                  message_type,
+                                                  message_opaque, data_size);
 }
 
 int vdagent_virtio_port_write_append(struct vdagent_virtio_port *vport,
@@ -246,7 +373,7 @@ int vdagent_virtio_port_write_append(struct vdagent_virtio_port *vport,
 {
     struct vdagent_virtio_port_buf *wbuf;
 
-    wbuf = vdagent_virtio_port_get_last_wbuf(vport);
+    wbuf = vport->write_buf_tail;
     if (!wbuf) {
         syslog(LOG_ERR, "can't append without a buffer");
         return -1;
@@ -278,22 +405,128 @@ int vdagent_virtio_port_write(
     return 0;
 }
 
+/* Remove wbuf from the write_buf list, and from its stream if it is
+   the first buffer of it. */
+static void vdagent_virtio_port_unlink_wbuf(struct vdagent_virtio_port *vport,
+    struct vdagent_virtio_port_buf *wbuf)
+{
+    struct vdagent_virtio_port_stream **streamp, *stream;
+
+    if (wbuf->prev)
+        wbuf->prev->next = wbuf->next;
+    else
+        vport->write_buf = wbuf->next;
+    if (wbuf->next)
+        wbuf->next->prev = wbuf->prev;
+    else
+        vport->write_buf_tail = wbuf->prev;
+
+    if (!wbuf->stream)
+        return;
+
+    streamp = vdagent_virtio_port_find_stream(vport, wbuf->stream);
+    stream = *streamp;
+    if (!stream || stream->head != wbuf)
+        return;
+
+    stream->head = wbuf->stream_next;
+    if (!stream->head) {
+        *streamp = stream->next;
+        free(stream);
+    }
+}
+
+int vdagent_virtio_port_purge_stream(struct vdagent_virtio_port *vport,
+    uint64_t stream)
+{
+    struct vdagent_virtio_port_stream **streamp, *s;
+    struct vdagent_virtio_port_buf *wbuf, *next_wbuf;
+    int purged = 0;
+
+    if (!vport || !stream)
+        return 0;
+
+    streamp = vdagent_virtio_port_find_stream(vport, stream);
+    s = *streamp;
+    if (!s)
+        return 0;
+    *streamp = s->next;
+
+    for (wbuf = s->head; wbuf; wbuf = next_wbuf) {
+        next_wbuf = wbuf->stream_next;
+        wbuf->stream = 0;
+        /* Dropping a partially written message would corrupt the stream,
+           and the last buffer may still be getting appended to */
+        if (wbuf->pos || wbuf->write_pos != wbuf->size)
+            continue;
+
+        vdagent_virtio_port_unlink_wbuf(vport, wbuf);
+        budget_release(BUDGET_VIRTIO_WRITE, wbuf->size);
+        free(wbuf->buf);
+        free(wbuf);
+        purged++;
+    }
+    free(s);
+    metrics_add(METRICS_VIRTIO_MESSAGES_PURGED, purged);
+    trace_event(TRACE_VIRTIO_PURGE, stream >> 32, stream, purged, 0, 0);
+
+    return purged;
+}
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp)
 {
     while (*vportp && (*vportp)->write_buf)
         vdagent_virtio_port_do_write(vportp);
 }
 
+int vdagent_virtio_port_get_fd(struct vdagent_virtio_port *vport)
+{
+    return vport->fd;
+}
+
+void vdagent_virtio_port_quiesce(struct vdagent_virtio_port *vport,
+    int quiesce)
+{
+    vport->quiesce = quiesce;
+}
+
+int vdagent_virtio_port_is_quiescent(struct vdagent_virtio_port *vport)
+{
+    return vport->quiesce && !vport->write_buf &&
+           vdagent_virtio_port_between_messages(vport);
+}
+
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port)
 {
     if (port >= VDP_END_PORT) {
         syslog(LOG_ERR, "vdagent_virtio_port_reset port out of range");
         return;
     }
-    free(vport->port_data[port].message_data);
+    vdagent_virtio_port_free_message_data(&vport->port_data[port]);
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
+/* Decide whether the message whose header just got read can be reassembled,
+   data holds the first size bytes of its data.
+   Waiting for the budget would stop reading the port, and with it the
+   control messages behind this one (such as mouse events), so a bulk
+   message which has to wait gets dropped as well. */
+static void vdagent_virtio_port_admit(struct vdagent_virtio_port *vport,
+    struct vdagent_virtio_port_chunk_port_data *port, const uint8_t *data,
+    uint32_t size)
+{
+    if (budget_admit_now(BUDGET_VIRTIO_READ, port->message_header.size))
+        return;
+
+    syslog(LOG_WARNING, "dropping virtio message type %u of %u bytes, "
+           "it exceeds the memory budget", port->message_header.type,
+           port->message_header.size);
+    port->discard = 1;
+    if (vport->drop_callback)
+        vport->drop_callback(vport, vport->chunk_header.port,
+                             &port->message_header, data, size);
+}
+
 static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
 {
     int avail, read, pos = 0;
@@ -310,13 +543,18 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
                vport->chunk_data, read);
         port->message_header_read += read;
         if (port->message_header_read == sizeof(port->message_header) &&
-                port->message_header.size) {
+                port->message_header.size)
+            vdagent_virtio_port_admit(vport, port, vport->chunk_data + read,
+                                      vport->chunk_header.size - read);
+        if (port->message_header_read == sizeof(port->message_header) &&
+                port->message_header.size && !port->discard) {
             port->message_data = malloc(port->message_header.size);
             if (!port->message_data) {
                 syslog(LOG_ERR, "out of memory, disconnecting virtio");
                 vdagent_virtio_port_destroy(vportp);
                 return;
             }
+            budget_charge(BUDGET_VIRTIO_READ, port->message_header.size);
         }
         pos = read;
     }
@@ -335,12 +573,23 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
             read = avail;
 
         if (read) {
-            memcpy(port->message_data + port->message_data_pos,
-                   vport->chunk_data + pos, read);
+            if (!port->discard)
+                memcpy(port->message_data + port->message_data_pos,
+                       vport->chunk_data + pos, read);
             port->message_data_pos += read;
         }
 
-        if (port->message_data_pos == port->message_header.size) {
+        if (port->message_data_pos == port->message_header.size &&
+                port->discard) {
+            port->message_header_read = 0;
+            port->message_data_pos = 0;
+            port->discard = 0;
+        } else if (port->message_data_pos == port->message_header.size) {
+            metrics_inc(METRICS_VIRTIO_MESSAGES_RECEIVED);
+            trace_event(TRACE_VIRTIO_READ, vport->chunk_header.port,
+                        port->message_header.type,
+                        port->message_header.opaque,
+                        port->message_header.size, 0);
             if (vport->read_callback) {
                 int r = vport->read_callback(vport, vport->chunk_header.port,
                                  &port->message_header, port->message_data);
@@ -351,8 +600,7 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
             }
             port->message_header_read = 0;
             port->message_data_pos = 0;
-            free(port->message_data);
-            port->message_data = NULL;
+            vdagent_virtio_port_free_message_data(port);
         }
     }
 }
@@ -386,6 +634,7 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
         if (errno == EINTR)
             return;
         syslog(LOG_ERR, "reading from vdagent virtio port: %m");
+        metrics_inc(METRICS_VIRTIO_ERRORS);
     }
     if (n == 0 && vport->opening) {
         /* When we open the virtio serial port, the following happens:
@@ -416,6 +665,7 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
         return;
     }
     vport->opening = 0;
+    metrics_add(METRICS_VIRTIO_BYTES_RECEIVED, n);
 
     if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
         vport->chunk_header_read += n;
@@ -477,6 +727,7 @@ static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp)
         if (errno == EINTR)
             return;
         syslog(LOG_ERR, "writing to vdagent virtio port: %m");
+        metrics_inc(METRICS_VIRTIO_ERRORS);
         vdagent_virtio_port_destroy(vportp);
         return;
     }
@@ -484,8 +735,10 @@ static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp)
         vport->opening = 0;
 
     wbuf->pos += n;
+    metrics_add(METRICS_VIRTIO_BYTES_SENT, n);
+    budget_release(BUDGET_VIRTIO_WRITE, n);
     if (wbuf->pos == wbuf->size) {
-        vport->write_buf = wbuf->next;
+        vdagent_virtio_port_unlink_wbuf(vport, wbuf);
         free(wbuf->buf);
         free(wbuf);
     }
@@ -40,6 +40,17 @@ typedef int (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
+/* Callbacks with this type will be called when a message gets dropped, as
+   it does not fit in the memory budget. data holds the first size bytes of
+   the message's data (those in its first chunk), so that the callback can
+   fail whatever waits for the message. */
+typedef void (*vdagent_virtio_port_drop_callback)(
+    struct vdagent_virtio_port *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    const uint8_t *data,
+    uint32_t size);
+
 /* Callbacks with this type will be called when the port is disconnected.
    Note:
    1) vdagent_virtio_port will destroy the port in question itself after
@@ -54,6 +65,15 @@ typedef void (*vdagent_virtio_port_disconnect_callback)(
 /* Create a vdagent virtio port object for port portname */
 struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
+    vdagent_virtio_port_drop_callback drop_callback,
+    vdagent_virtio_port_disconnect_callback disconnect_callback);
+
+/* Create a vdagent virtio port object for an already opened port (or unix
+   socket), such as one passed in by systemd socket activation. The port
+   takes ownership of fd. */
+struct vdagent_virtio_port *vdagent_virtio_port_create_for_fd(int fd,
+    vdagent_virtio_port_read_callback read_callback,
+    vdagent_virtio_port_drop_callback drop_callback,
     vdagent_virtio_port_disconnect_callback disconnect_callback);
 
 /* The contents of portp will be made NULL */
@@ -85,6 +105,18 @@ int vdagent_virtio_port_write_start(
         uint32_t message_opaque,
         uint32_t data_size);
 
+/* Like vdagent_virtio_port_write_start, but tag the message as being part
+   of stream, so that it can be dropped with
+   vdagent_virtio_port_purge_stream() as long as it has not been sent.
+   Stream 0 is reserved for untagged messages. */
+int vdagent_virtio_port_write_stream_start(
+        struct vdagent_virtio_port *vport,
+        uint64_t stream,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size);
+
 int vdagent_virtio_port_write_append(
         struct vdagent_virtio_port *vport,
         const uint8_t *data,
@@ -98,7 +130,29 @@ int vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
+/* Drop all queued messages of stream, except for a message of which sending
+   has already started, in time linear to the amount of messages queued for
+   the stream.
+
+   Returns the number of dropped messages */
+int vdagent_virtio_port_purge_stream(struct vdagent_virtio_port *vport,
+        uint64_t stream);
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp);
+
+/* Return value: the port's fd, for handing it over to a new process (which
+   takes it over with vdagent_virtio_port_create_for_fd) */
+int vdagent_virtio_port_get_fd(struct vdagent_virtio_port *vport);
+
+/* Stop reading from the port once no message is partially read, or resume
+   reading if quiesce is 0. What arrives meanwhile stays in the port. */
+void vdagent_virtio_port_quiesce(struct vdagent_virtio_port *vport,
+    int quiesce);
+
+/* Return value: 1 if the port is quiesced, no message is partially read and
+   all queued messages have been written */
+int vdagent_virtio_port_is_quiescent(struct vdagent_virtio_port *vport);
+
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port);
 
 #endif
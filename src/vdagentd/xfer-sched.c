@@ -0,0 +1,325 @@
+/*  xfer-sched.c vdagentd file xfer data scheduler
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <glib.h>
+
+#include "vdagentd-proto.h"
+#include "budget.h"
+#include "metrics.h"
+#include "xfer-sched.h"
+
+/* The amount of data each xfer may send per round, per unit of weight */
+#define XFER_SCHED_QUANTUM (64 * 1024)
+/* Only hand data to a connection when less then this is queued on it */
+#define XFER_SCHED_LOW_WATER (128 * 1024)
+/* Retry handing data to a connection after this many ms when that failed
+   (out of memory, or the memory budget refused it) */
+#define XFER_SCHED_RETRY_MS 10
+
+struct xfer_sched_msg {
+    struct xfer_sched_msg *next;
+    gint64 queued;
+    uint32_t size;
+    uint8_t data[0];
+};
+
+struct xfer_sched_xfer {
+    uint32_t id;
+    struct udscs_connection *conn;
+    struct xfer_sched_msg *head;
+    struct xfer_sched_msg *tail;
+    uint64_t deficit;
+    unsigned int weight;
+    int in_turn;
+    int active;
+    /* Statistics */
+    gint64 start;
+    uint64_t bytes;
+    uint64_t msgs;
+    uint64_t dropped;
+    gint64 delay_total;
+    gint64 delay_max;
+};
+
+struct vdagentd_xfer_sched {
+    GHashTable *xfers;
+    /* Weights of xfers which have no data queued yet, see xfer->weight */
+    GHashTable *weights;
+    /* Round robin queue of xfers with queued data */
+    GQueue active;
+    uint64_t rate_limit;
+    gint64 tokens;
+    gint64 last_refill;
+    int debug;
+};
+
+static void xfer_sched_xfer_free(gpointer data)
+{
+    struct xfer_sched_xfer *xfer = data;
+    struct xfer_sched_msg *msg;
+    gint64 elapsed;
+
+    while ((msg = xfer->head)) {
+        xfer->head = msg->next;
+        xfer->dropped++;
+        budget_release(BUDGET_XFER_QUEUE, msg->size);
+        free(msg);
+    }
+    /* And also the data which has not been sent from the udscs queue */
+    xfer->dropped += udscs_purge_stream(xfer->conn,
+                                        VDAGENTD_STREAM_FILE_XFER(xfer->id),
+                                        NULL, NULL);
+
+    if (xfer->bytes) {
+        elapsed = g_get_monotonic_time() - xfer->start;
+        syslog(LOG_INFO, "file-xfer %u: %"PRIu64" bytes in %.2f s "
+               "(%.1f KiB/s), queue delay avg %.1f ms max %.1f ms, "
+               "%"PRIu64" msgs dropped", xfer->id, xfer->bytes,
+               elapsed / 1e6, elapsed ? xfer->bytes * 1e6 / elapsed / 1024 : 0,
+               xfer->delay_total / 1e3 / xfer->msgs, xfer->delay_max / 1e3,
+               xfer->dropped);
+    }
+
+    g_free(xfer);
+}
+
+struct vdagentd_xfer_sched *vdagentd_xfer_sched_create(uint64_t rate_limit,
+    int debug)
+{
+    struct vdagentd_xfer_sched *sched;
+
+    sched = g_new0(struct vdagentd_xfer_sched, 1);
+    sched->xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, xfer_sched_xfer_free);
+    sched->weights = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&sched->active);
+    sched->rate_limit = rate_limit;
+    sched->last_refill = g_get_monotonic_time();
+    sched->debug = debug;
+
+    return sched;
+}
+
+void vdagentd_xfer_sched_destroy(struct vdagentd_xfer_sched *sched)
+{
+    if (!sched)
+        return;
+
+    g_queue_clear(&sched->active);
+    g_hash_table_destroy(sched->xfers);
+    g_hash_table_destroy(sched->weights);
+    g_free(sched);
+}
+
+void vdagentd_xfer_sched_set_weight(struct vdagentd_xfer_sched *sched,
+    uint32_t id, unsigned int weight)
+{
+    struct xfer_sched_xfer *xfer;
+
+    weight = CLAMP(weight, 1, VDAGENTD_XFER_SCHED_MAX_WEIGHT);
+    xfer = g_hash_table_lookup(sched->xfers, GUINT_TO_POINTER(id));
+    if (xfer)
+        xfer->weight = weight;
+    else if (weight > 1)
+        g_hash_table_insert(sched->weights, GUINT_TO_POINTER(id),
+                            GUINT_TO_POINTER(weight));
+    else
+        g_hash_table_remove(sched->weights, GUINT_TO_POINTER(id));
+}
+
+int vdagentd_xfer_sched_queue(struct vdagentd_xfer_sched *sched,
+    struct udscs_connection *conn, uint32_t id,
+    const uint8_t *data, uint32_t size)
+{
+    struct xfer_sched_xfer *xfer;
+    struct xfer_sched_msg *msg;
+
+    msg = malloc(sizeof(*msg) + size);
+    if (!msg)
+        return -1;
+
+    msg->next = NULL;
+    msg->queued = g_get_monotonic_time();
+    msg->size = size;
+    memcpy(msg->data, data, size);
+    budget_charge(BUDGET_XFER_QUEUE, size);
+
+    xfer = g_hash_table_lookup(sched->xfers, GUINT_TO_POINTER(id));
+    if (!xfer) {
+        xfer = g_new0(struct xfer_sched_xfer, 1);
+        xfer->id = id;
+        xfer->weight = MAX(GPOINTER_TO_UINT(g_hash_table_lookup(
+                               sched->weights, GUINT_TO_POINTER(id))), 1);
+        g_hash_table_remove(sched->weights, GUINT_TO_POINTER(id));
+        xfer->start = msg->queued;
+        g_hash_table_insert(sched->xfers, GUINT_TO_POINTER(id), xfer);
+    }
+    xfer->conn = conn;
+
+    if (xfer->tail)
+        xfer->tail->next = msg;
+    else
+        xfer->head = msg;
+    xfer->tail = msg;
+
+    if (!xfer->active) {
+        g_queue_push_tail(&sched->active, xfer);
+        xfer->active = 1;
+    }
+
+    return 0;
+}
+
+void vdagentd_xfer_sched_remove(struct vdagentd_xfer_sched *sched,
+    uint32_t id)
+{
+    struct xfer_sched_xfer *xfer;
+
+    g_hash_table_remove(sched->weights, GUINT_TO_POINTER(id));
+    xfer = g_hash_table_lookup(sched->xfers, GUINT_TO_POINTER(id));
+    if (!xfer)
+        return;
+
+    if (xfer->active)
+        g_queue_remove(&sched->active, xfer);
+    g_hash_table_remove(sched->xfers, GUINT_TO_POINTER(id));
+}
+
+void vdagentd_xfer_sched_remove_all(struct vdagentd_xfer_sched *sched,
+    struct udscs_connection *conn)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    /* Those are not tied to a connection yet */
+    if (!conn)
+        g_hash_table_remove_all(sched->weights);
+
+    g_hash_table_iter_init(&iter, sched->xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct xfer_sched_xfer *xfer = value;
+
+        if (conn && xfer->conn != conn)
+            continue;
+        if (xfer->active)
+            g_queue_remove(&sched->active, xfer);
+        g_hash_table_iter_remove(&iter);
+    }
+}
+
+static void xfer_sched_refill(struct vdagentd_xfer_sched *sched, gint64 now)
+{
+    gint64 burst = MAX(sched->rate_limit / 4, XFER_SCHED_QUANTUM);
+
+    sched->tokens += (now - sched->last_refill) * sched->rate_limit / 1000000;
+    if (sched->tokens > burst)
+        sched->tokens = burst;
+    sched->last_refill = now;
+}
+
+int vdagentd_xfer_sched_run(struct vdagentd_xfer_sched *sched)
+{
+    struct xfer_sched_xfer *xfer;
+    struct xfer_sched_msg *msg;
+    gint64 delay, now = g_get_monotonic_time();
+    guint blocked = 0;
+    int sent, ret = -1;
+
+    if (sched->rate_limit)
+        xfer_sched_refill(sched, now);
+
+    /* Until every xfer left in the queue is blocked */
+    while ((xfer = g_queue_peek_head(&sched->active)) &&
+           blocked < g_queue_get_length(&sched->active)) {
+        if (!xfer->in_turn) {
+            xfer->deficit += (uint64_t)XFER_SCHED_QUANTUM * xfer->weight;
+            xfer->in_turn = 1;
+        }
+
+        sent = 0;
+        while ((msg = xfer->head) && msg->size <= xfer->deficit) {
+            /* Skip an xfer whose connection has enough queued to keep it
+               busy, keeping the rest of its turn for when it comes round
+               again; we get called again once it has been drained */
+            if (udscs_get_queued_bytes(xfer->conn) >= XFER_SCHED_LOW_WATER)
+                break;
+
+            if (sched->rate_limit && sched->tokens <= 0)
+                return 1 + -sched->tokens * 1000 / sched->rate_limit;
+
+            if (udscs_write_stream(xfer->conn,
+                                   VDAGENTD_STREAM_FILE_XFER(xfer->id),
+                                   VDAGENTD_FILE_XFER_DATA, 0, 0,
+                                   msg->data, msg->size) == -1) {
+                ret = XFER_SCHED_RETRY_MS;
+                break;
+            }
+
+            xfer->head = msg->next;
+            if (!xfer->head)
+                xfer->tail = NULL;
+            xfer->deficit -= msg->size;
+            sched->tokens -= msg->size;
+
+            delay = now - msg->queued;
+            metrics_observe(METRICS_FILE_XFER_QUEUE_DELAY, delay);
+            metrics_add(METRICS_FILE_XFER_BYTES, msg->size);
+            budget_release(BUDGET_XFER_QUEUE, msg->size);
+            xfer->delay_total += delay;
+            if (delay > xfer->delay_max)
+                xfer->delay_max = delay;
+            xfer->bytes += msg->size;
+            xfer->msgs++;
+            free(msg);
+            sent = 1;
+        }
+
+        g_queue_pop_head(&sched->active);
+        if (msg && msg->size <= xfer->deficit) {
+            /* Blocked, move on to the next xfer */
+            g_queue_push_tail(&sched->active, xfer);
+            blocked = sent ? 1 : blocked + 1;
+            continue;
+        }
+
+        /* End of this xfer's turn, move on to the next one */
+        blocked = 0;
+        xfer->in_turn = 0;
+        if (xfer->head) {
+            g_queue_push_tail(&sched->active, xfer);
+        } else {
+            xfer->deficit = 0;
+            xfer->active = 0;
+        }
+    }
+
+    return ret;
+}
+
+int vdagentd_xfer_sched_is_idle(struct vdagentd_xfer_sched *sched)
+{
+    return g_queue_is_empty(&sched->active);
+}
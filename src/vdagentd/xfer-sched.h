@@ -0,0 +1,85 @@
+/*  xfer-sched.h vdagentd file xfer data scheduler header
+
+    Copyright 2016 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_XFER_SCHED_H
+#define __VDAGENTD_XFER_SCHED_H
+
+#include <stdint.h>
+#include "udscs.h"
+
+/* File xfer data from the client does not get written to the agent directly,
+ * instead it is queued per xfer, and handed to the agent's udscs connection
+ * in a weighted fair (deficit round robin) order, only when the connection's
+ * write queue has (almost) drained. This way concurrent xfers get a share
+ * of the bandwidth proportional to their weight (equal unless the client
+ * sets one), and all other (interactive) messages, which do get
+ * written to the connection directly, never end up behind more then a
+ * small amount of file xfer data.
+ */
+struct vdagentd_xfer_sched;
+
+/* Create a scheduler, if rate_limit is not 0 the total file xfer data
+ * throughput gets limited to rate_limit bytes / second.
+ */
+struct vdagentd_xfer_sched *vdagentd_xfer_sched_create(uint64_t rate_limit,
+    int debug);
+void vdagentd_xfer_sched_destroy(struct vdagentd_xfer_sched *sched);
+
+#define VDAGENTD_XFER_SCHED_MAX_WEIGHT 16
+
+/* Give xfer id weight (1 - VDAGENTD_XFER_SCHED_MAX_WEIGHT, default 1) times
+ * the share of the bandwidth of an xfer with the default weight. Applies to
+ * data queued from here on, it is forgotten with vdagentd_xfer_sched_remove.
+ */
+void vdagentd_xfer_sched_set_weight(struct vdagentd_xfer_sched *sched,
+    uint32_t id, unsigned int weight);
+
+/* Queue a VDAGENTD_FILE_XFER_DATA message with data for xfer id, for
+ * delivery through conn.
+ * Return value: 0 on success -1 on error (only happens when malloc fails).
+ */
+int vdagentd_xfer_sched_queue(struct vdagentd_xfer_sched *sched,
+    struct udscs_connection *conn, uint32_t id,
+    const uint8_t *data, uint32_t size);
+
+/* Drop any data still queued for xfer id, including the data already
+ * handed to the udscs connection but not sent yet, and report its
+ * statistics. To be called whenever the xfer gets removed from vdagentd's
+ * active_xfers.
+ */
+void vdagentd_xfer_sched_remove(struct vdagentd_xfer_sched *sched,
+    uint32_t id);
+
+/* Like vdagentd_xfer_sched_remove, for all xfers (going to conn if conn is
+ * not NULL).
+ */
+void vdagentd_xfer_sched_remove_all(struct vdagentd_xfer_sched *sched,
+    struct udscs_connection *conn);
+
+/* Move queued data to the udscs connections, to be called on each main
+ * loop iteration.
+ * Return value: the amount of ms after which this must be called again
+ * at the latest, or -1 if there is no such deadline.
+ */
+int vdagentd_xfer_sched_run(struct vdagentd_xfer_sched *sched);
+
+/* Return value: 1 if no data is queued in the scheduler (data handed to
+ * the udscs connections already is not looked at).
+ */
+int vdagentd_xfer_sched_is_idle(struct vdagentd_xfer_sched *sched);
+
+#endif